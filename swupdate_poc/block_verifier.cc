@@ -0,0 +1,57 @@
+#include "block_verifier.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+static const EVP_MD* blockDigestMd(const std::string& algorithm) {
+  if (algorithm == Sha256Algorithm::kName) {
+    return Sha256Algorithm::md();
+  }
+  if (algorithm == Sha512Algorithm::kName) {
+    return Sha512Algorithm::md();
+  }
+  throw std::runtime_error("Unsupported block hash algorithm: " + algorithm);
+}
+
+BlockVerifier::BlockVerifier(const std::string& algorithm, uint64_t block_size, std::vector<std::string> block_digests,
+                             uint64_t stream_length)
+    : block_size_{block_size},
+      block_digests_{std::move(block_digests)},
+      stream_length_{stream_length},
+      digest_{blockDigestMd(algorithm)} {
+  if (block_size_ == 0 || block_digests_.size() != (stream_length_ + block_size_ - 1) / block_size_) {
+    throw std::runtime_error("Block hash manifest does not match the image length");
+  }
+}
+
+bool BlockVerifier::update(const char* data, size_t len) {
+  while (len > 0) {
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(len, block_size_ - block_filled_));
+    digest_.update(data, n);
+    data += n;
+    len -= n;
+    block_filled_ += n;
+    offset_ += n;
+
+    if (block_filled_ == block_size_ || offset_ == stream_length_) {
+      if (block_ >= block_digests_.size() || digest_.hexDigest() != block_digests_[block_]) {
+        return false;
+      }
+      digest_.reset();
+      block_filled_ = 0;
+      ++block_;
+    }
+  }
+  return true;
+}
+
+bool BlockVerifier::resumeAt(uint64_t offset) {
+  if (offset % block_size_ != 0 || offset > stream_length_) {
+    return false;
+  }
+  digest_.reset();
+  block_ = static_cast<size_t>(offset / block_size_);
+  block_filled_ = 0;
+  offset_ = offset;
+  return true;
+}
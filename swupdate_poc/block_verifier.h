@@ -0,0 +1,41 @@
+#ifndef SWUPDATE_POC_BLOCK_VERIFIER_H_
+#define SWUPDATE_POC_BLOCK_VERIFIER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "digest.h"
+
+// Checks the stream against a per-block hash manifest as it goes by, so a
+// corrupt or tampered image is caught at the first bad block instead of after
+// the whole download. The manifest lists one digest per block_size bytes; the
+// last block may be shorter.
+class BlockVerifier {
+ public:
+  // Throws std::runtime_error if the manifest does not cover stream_length in
+  // blocks of block_size, or the algorithm is not supported.
+  BlockVerifier(const std::string& algorithm, uint64_t block_size, std::vector<std::string> block_digests,
+                uint64_t stream_length);
+
+  // Feeds the next part of the stream. Returns false as soon as a completed
+  // block does not match the manifest; the verifier must not be fed after that.
+  bool update(const char* data, size_t len);
+  // Continues verification at offset, which must be a block boundary, after
+  // the blocks before it were verified by an earlier run.
+  bool resumeAt(uint64_t offset);
+  // Index of the block that failed, valid once update() returned false.
+  size_t failedBlock() const { return block_; }
+  uint64_t blockSize() const { return block_size_; }
+
+ private:
+  const uint64_t block_size_;
+  const std::vector<std::string> block_digests_;
+  const uint64_t stream_length_;
+  EvpDigest digest_;
+  size_t block_{0};
+  uint64_t block_filled_{0};
+  uint64_t offset_{0};
+};
+
+#endif  // SWUPDATE_POC_BLOCK_VERIFIER_H_
@@ -0,0 +1,283 @@
+#include "chunk_store.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <sstream>
+#include <stdexcept>
+
+#include "digest.h"
+
+// The rolling hash looks at this many bytes; anything before it in the chunk
+// cannot influence a boundary.
+static constexpr size_t kGearWindow = 64;
+// Chunks are read into memory whole.
+static constexpr size_t kMaxChunkSize = 16 * 1024 * 1024;
+
+// Random but fixed per-byte values of the gear hash. Both the index generator
+// and the client get them from here, so they always agree.
+static const std::array<uint64_t, 256>& gearTable() {
+  static const std::array<uint64_t, 256> table = [] {
+    std::array<uint64_t, 256> values{};
+    uint64_t x = 0x2545f4914f6cdd1dULL;
+    for (auto& value : values) {
+      // splitmix64
+      x += 0x9e3779b97f4a7c15ULL;
+      uint64_t z = x;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      value = z ^ (z >> 31);
+    }
+    return values;
+  }();
+  return table;
+}
+
+static unsigned int log2Exact(size_t value) {
+  unsigned int bits = 0;
+  while ((size_t{1} << bits) < value) {
+    ++bits;
+  }
+  return bits;
+}
+
+static void checkParams(const ChunkerParams& params) {
+  if (params.avg_size == 0 || (params.avg_size & (params.avg_size - 1)) != 0 || params.min_size < kGearWindow ||
+      params.min_size >= params.avg_size || params.avg_size >= params.max_size || params.max_size > kMaxChunkSize) {
+    throw std::runtime_error("Invalid chunker sizes");
+  }
+}
+
+// The boundary test uses the top bits of the hash, which depend on the whole
+// window; the low bits only see the last few bytes.
+static uint64_t boundaryMask(const ChunkerParams& params) {
+  checkParams(params);
+  return static_cast<uint64_t>(params.avg_size - 1) << (64 - log2Exact(params.avg_size));
+}
+
+Chunker::Chunker(const ChunkerParams& params) : params_{params}, mask_{boundaryMask(params)} {}
+
+size_t Chunker::feed(const char* data, size_t len, bool* boundary) {
+  const auto& gear = gearTable();
+  const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+  size_t i = 0;
+  // No boundary can fall before min_size, so skip straight to the bytes that
+  // feed the hash at that point.
+  if (size_ + kGearWindow < params_.min_size) {
+    i = std::min(len, params_.min_size - kGearWindow - size_);
+    size_ += i;
+  }
+  for (; i < len; ++i) {
+    hash_ = (hash_ << 1) + gear[bytes[i]];
+    ++size_;
+    if ((size_ >= params_.min_size && (hash_ & mask_) == 0) || size_ >= params_.max_size) {
+      hash_ = 0;
+      size_ = 0;
+      *boundary = true;
+      return i + 1;
+    }
+  }
+  *boundary = false;
+  return len;
+}
+
+namespace {
+// Turns a stream into ChunkRefs.
+class ChunkCollector {
+ public:
+  ChunkCollector(const ChunkerParams& params, std::vector<ChunkRef>* chunks)
+      : chunker_{params}, digest_{EVP_sha256()}, chunks_{chunks} {}
+
+  void update(const char* data, size_t len) {
+    while (len > 0) {
+      bool boundary = false;
+      size_t n = chunker_.feed(data, len, &boundary);
+      digest_.update(data, n);
+      length_ += n;
+      if (boundary) {
+        emit();
+      }
+      data += n;
+      len -= n;
+    }
+  }
+  void finish() {
+    if (length_ > 0) {
+      emit();
+    }
+  }
+
+ private:
+  void emit() {
+    chunks_->push_back({offset_, length_, digest_.hexDigest()});
+    digest_.reset();
+    offset_ += length_;
+    length_ = 0;
+  }
+
+  Chunker chunker_;
+  EvpDigest digest_;
+  std::vector<ChunkRef>* chunks_;
+  uint64_t offset_{0};
+  uint64_t length_{0};
+};
+}  // namespace
+
+std::vector<ChunkRef> chunkBuffer(const char* data, size_t len, const ChunkerParams& params) {
+  std::vector<ChunkRef> chunks;
+  ChunkCollector collector(params, &chunks);
+  collector.update(data, len);
+  collector.finish();
+  return chunks;
+}
+
+bool chunkFile(const std::string& path, const ChunkerParams& params, std::vector<ChunkRef>* chunks) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  chunks->clear();
+  ChunkCollector collector(params, chunks);
+  std::vector<char> buffer(1024 * 1024);
+  ssize_t n = 0;
+  while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+    collector.update(buffer.data(), static_cast<size_t>(n));
+  }
+  close(fd);
+  collector.finish();
+  return n == 0;
+}
+
+Json::Value chunkIndexToJson(const ChunkIndex& index) {
+  Json::Value json;
+  json["chunker"]["min"] = Json::UInt64(index.params.min_size);
+  json["chunker"]["avg"] = Json::UInt64(index.params.avg_size);
+  json["chunker"]["max"] = Json::UInt64(index.params.max_size);
+  json["length"] = Json::UInt64(index.length);
+  json["chunks"] = Json::Value(Json::arrayValue);
+  for (const auto& chunk : index.chunks) {
+    Json::Value entry;
+    entry["length"] = Json::UInt64(chunk.length);
+    entry["sha256"] = chunk.sha256;
+    json["chunks"].append(entry);
+  }
+  return json;
+}
+
+ChunkIndex parseChunkIndex(const std::string& text) {
+  Json::CharReaderBuilder readerBuilder;
+  Json::Value json;
+  std::string errs;
+  std::istringstream stream(text);
+  if (!Json::parseFromStream(readerBuilder, stream, &json, &errs) || !json.isObject() || !json["chunks"].isArray()) {
+    throw std::runtime_error("Malformed chunk index: " + errs);
+  }
+  ChunkIndex index;
+  index.params.min_size = json["chunker"]["min"].asUInt64();
+  index.params.avg_size = json["chunker"]["avg"].asUInt64();
+  index.params.max_size = json["chunker"]["max"].asUInt64();
+  checkParams(index.params);
+  index.length = json["length"].asUInt64();
+  uint64_t offset = 0;
+  for (const auto& entry : json["chunks"]) {
+    ChunkRef chunk{offset, entry["length"].asUInt64(), entry["sha256"].asString()};
+    std::string raw;
+    // No chunk is longer than max_size, and readers size their buffers on it.
+    if (chunk.length == 0 || chunk.length > index.params.max_size || !fromHex(chunk.sha256, &raw) ||
+        raw.size() != 32) {
+      throw std::runtime_error("Malformed chunk index entry at " + std::to_string(offset));
+    }
+    offset += chunk.length;
+    index.chunks.push_back(std::move(chunk));
+  }
+  if (offset != index.length) {
+    throw std::runtime_error("Chunk index covers " + std::to_string(offset) + " bytes, image has " +
+                             std::to_string(index.length));
+  }
+  return index;
+}
+
+ChunkStore::~ChunkStore() {
+  for (int fd : fds_) {
+    close(fd);
+  }
+}
+
+bool ChunkStore::addSeed(const std::string& path) {
+  std::vector<ChunkRef> chunks;
+  if (!chunkFile(path, params_, &chunks)) {
+    return false;
+  }
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  fds_.push_back(fd);
+  for (const auto& chunk : chunks) {
+    chunks_.emplace(chunk.sha256, Location{fd, chunk.offset});
+  }
+  return true;
+}
+
+bool ChunkStore::read(const ChunkRef& chunk, char* data) const {
+  auto it = chunks_.find(chunk.sha256);
+  if (it == chunks_.end()) {
+    return false;
+  }
+  uint64_t done = 0;
+  while (done < chunk.length) {
+    ssize_t n = pread(it->second.fd, data + done, chunk.length - done, static_cast<off_t>(it->second.offset + done));
+    if (n <= 0) {
+      return false;
+    }
+    done += static_cast<uint64_t>(n);
+  }
+  EvpDigest digest(EVP_sha256());
+  digest.update(data, chunk.length);
+  return digest.hexDigest() == chunk.sha256;
+}
+
+std::vector<DeltaSpan> planDelta(const ChunkIndex& index, const ChunkStore& store, uint64_t from, uint64_t min_gap) {
+  // Chunks from the one holding from onwards, and whether each is local.
+  size_t first = 0;
+  while (first < index.chunks.size() && index.chunks[first].offset + index.chunks[first].length <= from) {
+    ++first;
+  }
+  std::vector<bool> local;
+  for (size_t i = first; i < index.chunks.size(); ++i) {
+    local.push_back(store.contains(index.chunks[i].sha256));
+  }
+
+  // Download short local runs along with the downloads around them.
+  for (size_t i = 0; i < local.size();) {
+    size_t end = i;
+    uint64_t run = 0;
+    while (end < local.size() && local[end]) {
+      run += index.chunks[first + end].length;
+      ++end;
+    }
+    if (end > i && i > 0 && end < local.size() && run < min_gap) {
+      std::fill(local.begin() + static_cast<std::ptrdiff_t>(i), local.begin() + static_cast<std::ptrdiff_t>(end),
+                false);
+    }
+    i = end > i ? end : i + 1;
+  }
+
+  std::vector<DeltaSpan> spans;
+  for (size_t i = 0; i < local.size(); ++i) {
+    const ChunkRef& chunk = index.chunks[first + i];
+    const uint64_t begin = std::max(chunk.offset, from);
+    const uint64_t length = chunk.offset + chunk.length - begin;
+    if (local[i]) {
+      spans.push_back({begin, length, &chunk});
+    } else if (!spans.empty() && spans.back().local == nullptr) {
+      spans.back().length += length;
+    } else {
+      spans.push_back({begin, length, nullptr});
+    }
+  }
+  return spans;
+}
@@ -0,0 +1,111 @@
+#ifndef SWUPDATE_POC_CHUNK_STORE_H_
+#define SWUPDATE_POC_CHUNK_STORE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "json/json.h"
+
+// Content-defined chunking, as in casync or zchunk: chunk boundaries are
+// picked by a rolling hash over the last 64 bytes rather than at fixed
+// offsets, so an insertion or deletion only changes the chunks around it and
+// the rest of an image still cuts into the same chunks as its previous
+// version. The sizes must be the same on both ends, so they are part of the
+// chunk index; avg_size has to be a power of two.
+struct ChunkerParams {
+  size_t min_size{16 * 1024};
+  size_t avg_size{64 * 1024};
+  size_t max_size{256 * 1024};
+};
+
+// Finds chunk boundaries in a stream with a gear hash.
+class Chunker {
+ public:
+  explicit Chunker(const ChunkerParams& params);
+
+  // Returns how many bytes of data, at most len, belong to the current chunk
+  // and sets *boundary if the chunk ends after them.
+  size_t feed(const char* data, size_t len, bool* boundary);
+
+ private:
+  const ChunkerParams params_;
+  const uint64_t mask_;
+  uint64_t hash_{0};
+  size_t size_{0};
+};
+
+// One chunk of an image and its sha256, as lowercase hex.
+struct ChunkRef {
+  uint64_t offset{0};
+  uint64_t length{0};
+  std::string sha256;
+};
+
+std::vector<ChunkRef> chunkBuffer(const char* data, size_t len, const ChunkerParams& params);
+// Chunks a file or block device front to back. Returns false if it cannot be read.
+bool chunkFile(const std::string& path, const ChunkerParams& params, std::vector<ChunkRef>* chunks);
+
+// Chunk list of a target image, published next to it and referenced from the
+// target metadata:
+//   "swupdate": {"chunkIndex": {"url": "https://...", "sha256": "<hex of the index>"}}
+// The index itself is
+//   {"chunker": {"min": 16384, "avg": 65536, "max": 262144}, "length": <image length>,
+//    "chunks": [{"length": 70431, "sha256": "<hex>"}, ...]}
+// with the chunks in image order.
+struct ChunkIndex {
+  ChunkerParams params;
+  uint64_t length{0};
+  std::vector<ChunkRef> chunks;
+};
+
+Json::Value chunkIndexToJson(const ChunkIndex& index);
+// Throws std::runtime_error if text is not a well-formed index.
+ChunkIndex parseChunkIndex(const std::string& text);
+
+// Chunks available locally: seed files such as the running rootfs partition
+// or earlier images in the image cache are chunked the way the index was, and
+// every chunk whose digest the index lists can be read from the seed instead
+// of being downloaded.
+class ChunkStore {
+ public:
+  explicit ChunkStore(const ChunkerParams& params) : params_{params} {}
+  ~ChunkStore();
+  ChunkStore(const ChunkStore&) = delete;
+  ChunkStore& operator=(const ChunkStore&) = delete;
+
+  // Chunks the seed at path. Returns false if it cannot be read.
+  bool addSeed(const std::string& path);
+  bool contains(const std::string& sha256) const { return chunks_.count(sha256) != 0; }
+  // Reads the chunk with chunk.sha256 into data, which must hold chunk.length
+  // bytes, and checks it. Returns false if the seed changed since it was added.
+  bool read(const ChunkRef& chunk, char* data) const;
+
+ private:
+  struct Location {
+    int fd;
+    uint64_t offset;
+  };
+
+  const ChunkerParams params_;
+  std::vector<int> fds_;
+  std::unordered_map<std::string, Location> chunks_;
+};
+
+// Part of the image to produce in stream order: either one chunk read from
+// the store, or a range of bytes to download.
+struct DeltaSpan {
+  uint64_t offset{0};
+  uint64_t length{0};
+  const ChunkRef* local{nullptr};  // null for a download
+};
+
+// Plans how to produce bytes [from, index.length) of the image: chunks the
+// store has are read locally, the rest is coalesced into as few downloads as
+// possible. A local run shorter than min_gap between two downloads is
+// downloaded as well; one request less is worth more than a few KiB.
+std::vector<DeltaSpan> planDelta(const ChunkIndex& index, const ChunkStore& store, uint64_t from, uint64_t min_gap);
+
+#endif  // SWUPDATE_POC_CHUNK_STORE_H_
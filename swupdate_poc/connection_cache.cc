@@ -0,0 +1,625 @@
+#include "connection_cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#include <openssl/evp.h>
+
+#include "json/json.h"
+
+// Idle handles kept, each with the connections of its last transfers.
+static constexpr size_t kMaxIdleHandles = 8;
+// Servers whose TLS sessions are kept.
+static constexpr size_t kMaxSessions = 64;
+// A stalled server fails the transfer instead of hanging the update.
+static constexpr long kConnectTimeoutSeconds = 60;
+static constexpr long kLowSpeedTimeSeconds = 60;
+// Longest wait for the network between two rounds of a transfer, as with
+// curl_easy_perform().
+static constexpr std::chrono::milliseconds kPollTimeout{1000};
+
+struct ConnectionCache::Handle {
+  ~Handle() {
+    curl_multi_cleanup(multi);
+    curl_easy_cleanup(easy);
+  }
+
+  CURL* easy;
+  // Scheme, host and port of the last transfer.
+  std::string origin;
+  // Runs the handle's transfers and keeps its open connections.
+  CURLM* multi;
+  // Its transfer waits for the rate limiter, see ThrottledWrite.
+  std::atomic<bool> throttled{false};
+};
+
+// curl's own new-session callback, which ours passes sessions on to. curl
+// installs the same one on every SSL_CTX.
+static std::atomic<int (*)(SSL*, SSL_SESSION*)> curl_new_session_handler{nullptr};
+
+// Where the SSL_CTX of a connection keeps its ConnectionCache.
+static int sslContextIndex() {
+  static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+static ConnectionCache* cacheOf(const SSL* ssl) {
+  return static_cast<ConnectionCache*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sslContextIndex()));
+}
+
+static std::string serverName(const SSL* ssl) {
+  const char* name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  return name != nullptr ? name : "";
+}
+
+static std::string originOf(const std::string& url) {
+  const size_t scheme = url.find("://");
+  const size_t start = scheme == std::string::npos ? 0 : scheme + 3;
+  std::string origin = url.substr(0, url.find_first_of("/?#", start));
+  std::transform(origin.begin(), origin.end(), origin.begin(), ::tolower);
+  return origin;
+}
+
+static std::string toBase64(const std::string& data) {
+  std::string text(4 * ((data.size() + 2) / 3) + 1, '\0');
+  const int len = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&text[0]),
+                                  reinterpret_cast<const unsigned char*>(data.data()), static_cast<int>(data.size()));
+  text.resize(static_cast<size_t>(std::max(len, 0)));
+  return text;
+}
+
+static bool fromBase64(const std::string& text, std::string* data) {
+  if (text.empty() || text.size() % 4 != 0) {
+    return false;
+  }
+  data->assign(text.size() / 4 * 3, '\0');
+  const int len = EVP_DecodeBlock(reinterpret_cast<unsigned char*>(&(*data)[0]),
+                                  reinterpret_cast<const unsigned char*>(text.data()), static_cast<int>(text.size()));
+  if (len < 0) {
+    return false;
+  }
+  // EVP_DecodeBlock() counts the padding as data.
+  const size_t padding = static_cast<size_t>(std::count(text.end() - 2, text.end(), '='));
+  data->resize(static_cast<size_t>(len) - padding);
+  return true;
+}
+
+std::shared_ptr<ConnectionCache> ConnectionCache::create(const std::string& session_file) {
+  return std::shared_ptr<ConnectionCache>(new ConnectionCache(session_file));
+}
+
+ConnectionCache::ConnectionCache(std::string session_file)
+    : session_file_{std::move(session_file)}, share_{curl_share_init()} {
+  if (share_ == nullptr) {
+    throw std::runtime_error("Could not set up the connection cache");
+  }
+  curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, LockHandler);
+  curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, UnlockHandler);
+  curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  loadSessions();
+}
+
+ConnectionCache::~ConnectionCache() {
+  // Every handle is back in the pool by now, as each holds a reference.
+  for (Handle* handle : idle_) {
+    delete handle;
+  }
+  curl_share_cleanup(share_);
+  saveSessions();
+}
+
+CurlHandler ConnectionCache::acquire(const std::string& url) {
+  const std::string origin = originOf(url);
+  Handle* handle = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(pool_mutex_);
+    // Any idle handle saves setting one up, one to the same server also the
+    // handshakes.
+    auto it = std::find_if(idle_.rbegin(), idle_.rend(), [&origin](Handle* idle) { return idle->origin == origin; });
+    if (it == idle_.rend() && !idle_.empty()) {
+      it = idle_.rbegin();
+    }
+    if (it != idle_.rend()) {
+      handle = *it;
+      idle_.erase(std::next(it).base());
+    }
+  }
+  if (handle == nullptr) {
+    CURL* easy = curl_easy_init();
+    CURLM* multi = curl_multi_init();
+    if (easy == nullptr || multi == nullptr) {
+      curl_easy_cleanup(easy);
+      curl_multi_cleanup(multi);
+      throw std::runtime_error("Could not set up a transfer");
+    }
+    handle = new Handle{easy, "", multi};
+  }
+  handle->origin = origin;
+  handle->throttled = false;
+
+  // Resetting keeps the handle's open connections and the share.
+  CURL* easy = handle->easy;
+  curl_easy_reset(easy);
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, handle);
+  curl_easy_setopt(easy, CURLOPT_SHARE, share_);
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, kConnectTimeoutSeconds);
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, kLowSpeedTimeSeconds);
+  // Fails with TLS backends other than OpenSSL, which just keeps the
+  // sessions in memory.
+  curl_easy_setopt(easy, CURLOPT_SSL_CTX_FUNCTION, SslContextHandler);
+  curl_easy_setopt(easy, CURLOPT_SSL_CTX_DATA, this);
+
+  std::shared_ptr<ConnectionCache> self = shared_from_this();
+  return CurlHandler(easy, [self, handle](CURL*) { self->release(handle); });
+}
+
+void ConnectionCache::wakeup(CURL* easy) {
+  Handle* handle = nullptr;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, reinterpret_cast<char**>(&handle));
+  curl_multi_wakeup(handle->multi);
+}
+
+bool ConnectionCache::throttled(CURL* easy) {
+  Handle* handle = nullptr;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, reinterpret_cast<char**>(&handle));
+  return handle->throttled;
+}
+
+void ConnectionCache::setThrottled(CURL* easy, bool throttled) {
+  Handle* handle = nullptr;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, reinterpret_cast<char**>(&handle));
+  handle->throttled = throttled;
+}
+
+void ConnectionCache::release(Handle* handle) {
+  Handle* evicted = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(pool_mutex_);
+    if (idle_.size() >= kMaxIdleHandles) {
+      evicted = idle_.front();
+      idle_.erase(idle_.begin());
+    }
+    idle_.push_back(handle);
+  }
+  delete evicted;
+}
+
+CURLcode ConnectionCache::perform(CURL* easy, const std::function<std::chrono::milliseconds()>& tick) {
+  Handle* handle = nullptr;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, reinterpret_cast<char**>(&handle));
+  CURLM* multi = handle->multi;
+  CURLMcode code = curl_multi_add_handle(multi, easy);
+  int running = 1;
+  while (code == CURLM_OK && running != 0) {
+    code = curl_multi_perform(multi, &running);
+    if (code == CURLM_OK && running != 0) {
+      const std::chrono::milliseconds timeout = tick ? tick() : kPollTimeout;
+      code = curl_multi_poll(multi, nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+    }
+  }
+  CURLcode result = code == CURLM_OUT_OF_MEMORY ? CURLE_OUT_OF_MEMORY : CURLE_BAD_FUNCTION_ARGUMENT;
+  if (code == CURLM_OK) {
+    int left = 0;
+    while (CURLMsg* message = curl_multi_info_read(multi, &left)) {
+      if (message->msg == CURLMSG_DONE && message->easy_handle == easy) {
+        result = message->data.result;
+      }
+    }
+  }
+  curl_multi_remove_handle(multi, easy);
+  return result;
+}
+
+void ConnectionCache::recordTransfer(CURL* easy) {
+  long connects = 0;
+  long status = 0;
+  curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+  connections_ += static_cast<uint64_t>(connects);
+  if (connects == 0 && status != 0) {
+    ++reused_;
+  }
+}
+
+void ConnectionCache::loadSessions() {
+  if (session_file_.empty()) {
+    return;
+  }
+  std::ifstream file(session_file_, std::ifstream::binary);
+  Json::Value json;
+  std::string errs;
+  if (!file.is_open() || !Json::parseFromStream(Json::CharReaderBuilder(), file, &json, &errs) ||
+      !json["sessions"].isObject()) {
+    return;
+  }
+  const Json::Value& sessions = json["sessions"];
+  for (const auto& server : sessions.getMemberNames()) {
+    std::string der;
+    if (fromBase64(sessions[server].asString(), &der)) {
+      sessions_[server] = der;
+    }
+  }
+}
+
+bool ConnectionCache::saveSessions() {
+  Json::Value json(Json::objectValue);
+  {
+    std::lock_guard<std::mutex> guard(sessions_mutex_);
+    if (session_file_.empty() || !sessions_changed_) {
+      return true;
+    }
+    json["sessions"] = Json::Value(Json::objectValue);
+    for (const auto& session : sessions_) {
+      json["sessions"][session.first] = toBase64(session.second);
+    }
+    sessions_changed_ = false;
+  }
+  const std::string data = Json::writeString(Json::StreamWriterBuilder(), json);
+
+  const std::string tmp_path = session_file_ + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0) {
+      break;
+    }
+    written += static_cast<size_t>(n);
+  }
+  bool ok = written == data.size();
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), session_file_.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+SSL_SESSION* ConnectionCache::findSession(const std::string& server) {
+  std::lock_guard<std::mutex> guard(sessions_mutex_);
+  auto it = sessions_.find(server);
+  if (it == sessions_.end()) {
+    return nullptr;
+  }
+  const auto* der = reinterpret_cast<const unsigned char*>(it->second.data());
+  SSL_SESSION* session = d2i_SSL_SESSION(nullptr, &der, static_cast<long>(it->second.size()));
+  if (session != nullptr && (SSL_SESSION_is_resumable(session) == 0 ||
+                             SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < std::time(nullptr))) {
+    SSL_SESSION_free(session);
+    session = nullptr;
+  }
+  if (session == nullptr) {
+    sessions_.erase(it);
+    sessions_changed_ = true;
+  }
+  return session;
+}
+
+void ConnectionCache::storeSession(const std::string& server, SSL_SESSION* session) {
+  const int len = i2d_SSL_SESSION(session, nullptr);
+  if (server.empty() || len <= 0 || SSL_SESSION_is_resumable(session) == 0) {
+    return;
+  }
+  std::string der(static_cast<size_t>(len), '\0');
+  auto* out = reinterpret_cast<unsigned char*>(&der[0]);
+  i2d_SSL_SESSION(session, &out);
+
+  std::lock_guard<std::mutex> guard(sessions_mutex_);
+  if (sessions_.size() >= kMaxSessions && sessions_.count(server) == 0) {
+    sessions_.erase(sessions_.begin());
+  }
+  sessions_[server] = std::move(der);
+  sessions_changed_ = true;
+}
+
+// Called by curl on every SSL_CTX it sets up for a connection, before the
+// handshake.
+CURLcode ConnectionCache::SslContextHandler(CURL* easy, void* ssl_ctx, void* userp) {
+  (void)easy;
+  auto* ctx = static_cast<SSL_CTX*>(ssl_ctx);
+  SSL_CTX_set_ex_data(ctx, sslContextIndex(), userp);
+  auto* curl_handler = SSL_CTX_sess_get_new_cb(ctx);
+  if (curl_handler != NewSessionHandler) {
+    curl_new_session_handler = curl_handler;
+  }
+  // Sessions are only handed to the new-session callback with the client
+  // session cache on, which curl turns off when told not to cache sessions.
+  SSL_CTX_set_session_cache_mode(ctx, SSL_CTX_get_session_cache_mode(ctx) | SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, NewSessionHandler);
+  SSL_CTX_set_info_callback(ctx, InfoHandler);
+  return CURLE_OK;
+}
+
+// Called with every session, or TLS 1.3 ticket, the server issues.
+int ConnectionCache::NewSessionHandler(SSL* ssl, SSL_SESSION* session) {
+  ConnectionCache* cache = cacheOf(ssl);
+  if (cache != nullptr) {
+    cache->storeSession(serverName(ssl), session);
+  }
+  auto* curl_handler = curl_new_session_handler.load();
+  return curl_handler != nullptr ? curl_handler(ssl, session) : 0;
+}
+
+// Offers the saved session at the start of a handshake, unless curl already
+// has one of its own for the server. This is the last point before the
+// ClientHello is put together, and curl has set the server name by then.
+void ConnectionCache::InfoHandler(const SSL* ssl, int where, int ret) {
+  (void)ret;
+  ConnectionCache* cache = cacheOf(ssl);
+  if (cache == nullptr) {
+    return;
+  }
+  auto* mutable_ssl = const_cast<SSL*>(ssl);
+  if ((where & SSL_CB_HANDSHAKE_START) != 0 && SSL_get_session(ssl) == nullptr) {
+    SSL_SESSION* session = cache->findSession(serverName(ssl));
+    if (session != nullptr) {
+      SSL_set_session(mutable_ssl, session);
+      SSL_SESSION_free(session);
+    }
+  } else if ((where & SSL_CB_HANDSHAKE_DONE) != 0 && SSL_session_reused(mutable_ssl) != 0) {
+    ++cache->resumed_;
+  }
+}
+
+void ConnectionCache::LockHandler(CURL* easy, curl_lock_data data, curl_lock_access access, void* userp) {
+  (void)easy;
+  (void)access;
+  static_cast<ConnectionCache*>(userp)->share_mutexes_[data].lock();
+}
+
+void ConnectionCache::UnlockHandler(CURL* easy, curl_lock_data data, void* userp) {
+  (void)easy;
+  static_cast<ConnectionCache*>(userp)->share_mutexes_[data].unlock();
+}
+
+namespace {
+
+struct ResponseBody {
+  std::string* body;
+  int64_t maxsize;
+};
+
+size_t appendBody(char* contents, size_t size, size_t nmemb, void* userp) {
+  auto* response = static_cast<ResponseBody*>(userp);
+  const size_t len = size * nmemb;
+  if (response->maxsize != HttpInterface::kNoLimit &&
+      response->body->size() + len > static_cast<uint64_t>(response->maxsize)) {
+    return 0;  // fails the transfer
+  }
+  response->body->append(contents, len);
+  return len;
+}
+
+// A download shaped by a RateLimiter. Data the bucket cannot take yet is
+// left with curl by pausing the transfer, which tick() resumes once the
+// bucket has refilled. Meanwhile the handle is marked throttled, so that a
+// paused transfer is not taken for a stalled one.
+struct ThrottledWrite {
+  RateLimiter* limiter;
+  curl_write_callback write_cb;
+  void* userp;
+  CURL* easy;
+  std::chrono::steady_clock::time_point resume_at;
+
+  std::chrono::milliseconds tick() {
+    if (resume_at != std::chrono::steady_clock::time_point{} && std::chrono::steady_clock::now() >= resume_at) {
+      resume_at = std::chrono::steady_clock::time_point{};
+      ConnectionCache::setThrottled(easy, false);
+      // Hands curl's buffered data straight back to ThrottledWriteHandler,
+      // which may pause the transfer again.
+      curl_easy_pause(easy, CURLPAUSE_CONT);
+    }
+    if (resume_at == std::chrono::steady_clock::time_point{}) {
+      return kPollTimeout;
+    }
+    // Rounded up, so that the transfer is not resumed too early.
+    const auto wait = resume_at - std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+    return std::min(std::chrono::duration_cast<std::chrono::milliseconds>(wait), kPollTimeout);
+  }
+};
+
+size_t ThrottledWriteHandler(char* contents, size_t size, size_t nmemb, void* userp) {
+  auto* write = static_cast<ThrottledWrite*>(userp);
+  const size_t len = size * nmemb;
+  const auto wait = write->limiter->acquire(len);
+  if (wait != std::chrono::steady_clock::duration::zero()) {
+    write->resume_at = std::chrono::steady_clock::now() + wait;
+    ConnectionCache::setThrottled(write->easy, true);
+    return CURL_WRITEFUNC_PAUSE;
+  }
+  const size_t written = write->write_cb(contents, size, nmemb, write->userp);
+  if (written != len) {
+    write->limiter->refund(len);  // paused or failed by the caller
+  }
+  return written;
+}
+
+HttpResponse performTransfer(ConnectionCache& cache, CURL* easy, ThrottledWrite* throttle = nullptr) {
+  HttpResponse response;
+  std::function<std::chrono::milliseconds()> tick;
+  if (throttle != nullptr) {
+    tick = [throttle] { return throttle->tick(); };
+  }
+  response.curl_code = cache.perform(easy, tick);
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response.http_status_code);
+  if (response.curl_code != CURLE_OK) {
+    response.error_message = curl_easy_strerror(response.curl_code);
+  }
+  cache.recordTransfer(easy);
+  return response;
+}
+
+}  // namespace
+
+CachedHttpClient::CachedHttpClient(std::shared_ptr<ConnectionCache> cache) : cache_{std::move(cache)} {}
+
+CurlHandler CachedHttpClient::prepare(const std::string& url) {
+  CurlHandler easy = cache_->acquire(url);
+  curl_easy_setopt(easy.get(), CURLOPT_URL, url.c_str());
+  if (!ca_.empty()) {
+    curl_blob blob{&ca_[0], ca_.size(), CURL_BLOB_NOCOPY};
+    curl_easy_setopt(easy.get(), CURLOPT_CAINFO_BLOB, &blob);
+  }
+  if (!cert_.empty()) {
+    curl_blob blob{&cert_[0], cert_.size(), CURL_BLOB_NOCOPY};
+    curl_easy_setopt(easy.get(), CURLOPT_SSLCERT_BLOB, &blob);
+    curl_easy_setopt(easy.get(), CURLOPT_SSLCERTTYPE, "PEM");
+  }
+  if (!pkey_.empty()) {
+    curl_blob blob{&pkey_[0], pkey_.size(), CURL_BLOB_NOCOPY};
+    curl_easy_setopt(easy.get(), CURLOPT_SSLKEY_BLOB, &blob);
+    curl_easy_setopt(easy.get(), CURLOPT_SSLKEYTYPE, "PEM");
+  }
+  return easy;
+}
+
+HttpResponse CachedHttpClient::get(const std::string& url, int64_t maxsize) {
+  CurlHandler easy = prepare(url);
+  std::string body;
+  ResponseBody response_body{&body, maxsize};
+  curl_easy_setopt(easy.get(), CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEFUNCTION, appendBody);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEDATA, &response_body);
+  HttpResponse response = performTransfer(*cache_, easy.get());
+  response.body = std::move(body);
+  return response;
+}
+
+HttpResponse CachedHttpClient::send(const std::string& method, const std::string& url, const std::string& content_type,
+                                    const std::string& data) {
+  CurlHandler easy = prepare(url);
+  std::unique_ptr<curl_slist, void (*)(curl_slist*)> headers(
+      curl_slist_append(nullptr, ("Content-Type: " + content_type).c_str()), curl_slist_free_all);
+  std::string body;
+  ResponseBody response_body{&body, kNoLimit};
+  curl_easy_setopt(easy.get(), CURLOPT_CUSTOMREQUEST, method.c_str());
+  curl_easy_setopt(easy.get(), CURLOPT_HTTPHEADER, headers.get());
+  curl_easy_setopt(easy.get(), CURLOPT_POSTFIELDS, data.data());
+  curl_easy_setopt(easy.get(), CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(data.size()));
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEFUNCTION, appendBody);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEDATA, &response_body);
+  HttpResponse response = performTransfer(*cache_, easy.get());
+  response.body = std::move(body);
+  return response;
+}
+
+HttpResponse CachedHttpClient::post(const std::string& url, const std::string& content_type,
+                                    const std::string& data) {
+  return send("POST", url, content_type, data);
+}
+
+HttpResponse CachedHttpClient::post(const std::string& url, const Json::Value& data) {
+  return send("POST", url, "application/json", Json::writeString(Json::StreamWriterBuilder(), data));
+}
+
+HttpResponse CachedHttpClient::put(const std::string& url, const std::string& content_type,
+                                   const std::string& data) {
+  return send("PUT", url, content_type, data);
+}
+
+HttpResponse CachedHttpClient::put(const std::string& url, const Json::Value& data) {
+  return send("PUT", url, "application/json", Json::writeString(Json::StreamWriterBuilder(), data));
+}
+
+HttpResponse CachedHttpClient::download(const std::string& url, curl_write_callback write_cb,
+                                        curl_xferinfo_callback progress_cb, void* userp, curl_off_t from) {
+  return downloadAsync(url, write_cb, progress_cb, userp, from, nullptr).get();
+}
+
+std::future<HttpResponse> CachedHttpClient::downloadAsync(const std::string& url, curl_write_callback write_cb,
+                                                          curl_xferinfo_callback progress_cb, void* userp,
+                                                          curl_off_t from, CurlHandler* easyp) {
+  CurlHandler easy = prepare(url);
+  std::unique_ptr<ThrottledWrite> throttle;
+  if (limiter_) {
+    throttle = std::unique_ptr<ThrottledWrite>(new ThrottledWrite{limiter_.get(), write_cb, userp, easy.get(), {}});
+  }
+  curl_easy_setopt(easy.get(), CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(easy.get(), CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEFUNCTION, throttle ? ThrottledWriteHandler : write_cb);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEDATA, throttle ? static_cast<void*>(throttle.get()) : userp);
+  if (progress_cb != nullptr) {
+    curl_easy_setopt(easy.get(), CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(easy.get(), CURLOPT_XFERINFOFUNCTION, progress_cb);
+    curl_easy_setopt(easy.get(), CURLOPT_XFERINFODATA, userp);
+  }
+  curl_easy_setopt(easy.get(), CURLOPT_RESUME_FROM_LARGE, from);
+  if (easyp != nullptr) {
+    *easyp = easy;
+  }
+
+  // As with HttpClient, the transfer runs on a thread of its own, which
+  // keeps the cache and the limiter alive until it is done.
+  std::promise<HttpResponse> promise;
+  std::future<HttpResponse> future = promise.get_future();
+  std::thread(
+      [](std::shared_ptr<ConnectionCache> cache, CurlHandler handle, std::shared_ptr<RateLimiter> limiter,
+         std::unique_ptr<ThrottledWrite> throttle, std::promise<HttpResponse> result) {
+        HttpResponse response = performTransfer(*cache, handle.get(), throttle.get());
+        limiter.reset();
+        // Back in the pool before the caller can start the next transfer.
+        handle.reset();
+        cache.reset();
+        result.set_value(std::move(response));
+      },
+      cache_, std::move(easy), limiter_, std::move(throttle), std::move(promise))
+      .detach();
+  return future;
+}
+
+HttpResponse CachedHttpClient::downloadRange(const std::string& url, curl_write_callback write_cb, void* userp,
+                                             curl_off_t from, curl_off_t last) {
+  CurlHandler easy = prepare(url);
+  const std::string range = std::to_string(from) + "-" + std::to_string(last);
+  ThrottledWrite throttle{limiter_.get(), write_cb, userp, easy.get(), {}};
+  curl_easy_setopt(easy.get(), CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(easy.get(), CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEFUNCTION, limiter_ ? ThrottledWriteHandler : write_cb);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEDATA, limiter_ ? static_cast<void*>(&throttle) : userp);
+  curl_easy_setopt(easy.get(), CURLOPT_RANGE, range.c_str());
+  return performTransfer(*cache_, easy.get(), limiter_ ? &throttle : nullptr);
+}
+
+std::chrono::microseconds CachedHttpClient::probe(const std::string& url, std::chrono::milliseconds timeout) {
+  CurlHandler easy = prepare(url);
+  std::string body;
+  ResponseBody response_body{&body, 1};
+  curl_easy_setopt(easy.get(), CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(easy.get(), CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(easy.get(), CURLOPT_RANGE, "0-0");
+  curl_easy_setopt(easy.get(), CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count()));
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEFUNCTION, appendBody);
+  curl_easy_setopt(easy.get(), CURLOPT_WRITEDATA, &response_body);
+  const HttpResponse response = performTransfer(*cache_, easy.get());
+  curl_off_t first_byte = -1;
+  if (!response.isOk() || curl_easy_getinfo(easy.get(), CURLINFO_STARTTRANSFER_TIME_T, &first_byte) != CURLE_OK) {
+    return std::chrono::microseconds(-1);
+  }
+  return std::chrono::microseconds(first_byte);
+}
+
+void CachedHttpClient::setCerts(const std::string& ca, CryptoSource ca_source, const std::string& cert,
+                                CryptoSource cert_source, const std::string& pkey, CryptoSource pkey_source) {
+  if (ca_source != CryptoSource::kFile || cert_source != CryptoSource::kFile || pkey_source != CryptoSource::kFile) {
+    throw std::runtime_error("Only PEM certificates and keys are supported");
+  }
+  ca_ = ca;
+  cert_ = cert;
+  pkey_ = pkey;
+}
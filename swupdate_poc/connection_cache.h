@@ -0,0 +1,154 @@
+#ifndef SWUPDATE_POC_CONNECTION_CACHE_H_
+#define SWUPDATE_POC_CONNECTION_CACHE_H_
+
+#include <curl/curl.h>
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "http/httpinterface.h"
+#include "rate_limiter.h"
+
+// Connections and TLS sessions kept across the transfers of a process, and
+// TLS sessions kept across processes.
+//
+// Transfers run on easy handles checked out of a pool. An easy handle keeps
+// its connections open after a transfer, so the next transfer to the same
+// server that gets the handle skips the TCP and TLS handshakes; acquire()
+// hands out a handle that last talked to the same origin where it can. The
+// handles share curl's DNS and TLS session caches, so a new connection to a
+// server seen before resumes the TLS session rather than doing a full
+// handshake. With a session file, the TLS sessions are also saved to disk and
+// offered on the first connection to each server of the next run. This needs
+// curl built with OpenSSL; with other TLS backends sessions stay in memory.
+// Saved sessions are kept by server name (SNI), so servers addressed by IP
+// address only resume sessions within a run.
+//
+// Shared between threads; each handle serves one transfer at a time.
+class ConnectionCache : public std::enable_shared_from_this<ConnectionCache> {
+ public:
+  // session_file holds the TLS sessions between runs; empty for none. It
+  // holds session secrets, so it is written readable by the owner only.
+  static std::shared_ptr<ConnectionCache> create(const std::string& session_file = "");
+  ~ConnectionCache();
+  ConnectionCache(const ConnectionCache&) = delete;
+  ConnectionCache& operator=(const ConnectionCache&) = delete;
+
+  // An easy handle with curl's defaults, the cache's shared state and
+  // connections still open from earlier transfers. It goes back to the pool
+  // once the last copy is dropped.
+  CurlHandler acquire(const std::string& url);
+  // Runs the transfer on easy, a handle from acquire(), like
+  // curl_easy_perform() does: through a multi handle kept with the easy
+  // handle, so its connections stay open for the next transfer. Between
+  // rounds tick gets to resume a paused transfer, and returns how long the
+  // next wait for the network may last at most.
+  CURLcode perform(CURL* easy, const std::function<std::chrono::milliseconds()>& tick);
+  // Cuts the wait for the network of the transfer running on easy, a handle
+  // from acquire(), short, so that its callbacks run now, e.g. for the
+  // progress callback to cancel it. May be called from any thread.
+  static void wakeup(CURL* easy);
+  // Whether the transfer running on easy, a handle from acquire(), is paused
+  // for a RateLimiter rather than waiting for the network. May be called
+  // from any thread.
+  static bool throttled(CURL* easy);
+  static void setThrottled(CURL* easy, bool throttled);
+  // Counts the connections the transfer just finished on easy made.
+  void recordTransfer(CURL* easy);
+
+  // Writes the TLS sessions to the session file, if they changed.
+  bool saveSessions();
+
+  // Connections opened and transfers that reused an open one.
+  uint64_t connections() const { return connections_; }
+  uint64_t reusedConnections() const { return reused_; }
+  // TLS handshakes that resumed a session.
+  uint64_t resumedSessions() const { return resumed_; }
+
+ private:
+  struct Handle;
+
+  explicit ConnectionCache(std::string session_file);
+  void release(Handle* handle);
+  void loadSessions();
+  // The saved session for server, owned by the caller, or nullptr.
+  SSL_SESSION* findSession(const std::string& server);
+  void storeSession(const std::string& server, SSL_SESSION* session);
+
+  static CURLcode SslContextHandler(CURL* easy, void* ssl_ctx, void* userp);
+  static int NewSessionHandler(SSL* ssl, SSL_SESSION* session);
+  static void InfoHandler(const SSL* ssl, int where, int ret);
+  static void LockHandler(CURL* easy, curl_lock_data data, curl_lock_access access, void* userp);
+  static void UnlockHandler(CURL* easy, curl_lock_data data, void* userp);
+
+  const std::string session_file_;
+  CURLSH* const share_;
+  std::mutex share_mutexes_[CURL_LOCK_DATA_LAST];
+
+  std::mutex pool_mutex_;
+  // Idle handles, the most recently used last.
+  std::vector<Handle*> idle_;
+
+  std::mutex sessions_mutex_;
+  // DER encoded sessions by server name.
+  std::map<std::string, std::string> sessions_;
+  bool sessions_changed_{false};
+
+  std::atomic<uint64_t> connections_{0};
+  std::atomic<uint64_t> reused_{0};
+  std::atomic<uint64_t> resumed_{0};
+};
+
+// HttpInterface on a ConnectionCache, in place of aktualizr's HttpClient,
+// which gives every download a fresh handle and so a fresh connection.
+class CachedHttpClient : public HttpInterface {
+ public:
+  explicit CachedHttpClient(std::shared_ptr<ConnectionCache> cache);
+
+  HttpResponse get(const std::string& url, int64_t maxsize) override;
+  HttpResponse post(const std::string& url, const std::string& content_type, const std::string& data) override;
+  HttpResponse post(const std::string& url, const Json::Value& data) override;
+  HttpResponse put(const std::string& url, const std::string& content_type, const std::string& data) override;
+  HttpResponse put(const std::string& url, const Json::Value& data) override;
+  HttpResponse download(const std::string& url, curl_write_callback write_cb, curl_xferinfo_callback progress_cb,
+                        void* userp, curl_off_t from) override;
+  std::future<HttpResponse> downloadAsync(const std::string& url, curl_write_callback write_cb,
+                                          curl_xferinfo_callback progress_cb, void* userp, curl_off_t from,
+                                          CurlHandler* easyp) override;
+  // Like download(), for bytes [from, last] only and on the calling thread.
+  // The connection then stays open for the next request, where cutting an
+  // open-ended download short would close it.
+  HttpResponse downloadRange(const std::string& url, curl_write_callback write_cb, void* userp, curl_off_t from,
+                             curl_off_t last);
+  // Time to the first byte of url, from a request for that byte alone which
+  // gives up after timeout; negative if the request failed. The connection
+  // stays open for the download that follows.
+  std::chrono::microseconds probe(const std::string& url, std::chrono::milliseconds timeout);
+  // Shapes every download of the client with limiter, which may be shared
+  // with other clients; nullptr for none. Other requests are not shaped.
+  void setRateLimiter(std::shared_ptr<RateLimiter> limiter) { limiter_ = std::move(limiter); }
+  // Only PEM contents (CryptoSource::kFile) are supported.
+  void setCerts(const std::string& ca, CryptoSource ca_source, const std::string& cert, CryptoSource cert_source,
+                const std::string& pkey, CryptoSource pkey_source) override;
+
+ private:
+  CurlHandler prepare(const std::string& url);
+  HttpResponse send(const std::string& method, const std::string& url, const std::string& content_type,
+                    const std::string& data);
+
+  const std::shared_ptr<ConnectionCache> cache_;
+  std::string ca_;
+  std::string cert_;
+  std::string pkey_;
+  std::shared_ptr<RateLimiter> limiter_;
+};
+
+#endif  // SWUPDATE_POC_CONNECTION_CACHE_H_
@@ -0,0 +1,527 @@
+#include "decompress_stage.h"
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Slab sizes for frames decoded in parallel. A BGZF member holds at most
+// 64 KiB, compressed and decompressed; pzstd's frames are a few MiB. Larger
+// frames are decoded by the streaming decoder instead.
+static constexpr size_t kGzipSlabSize = 64 * 1024;
+static constexpr size_t kZstdSlabSize = 4 * 1024 * 1024;
+// Bytes needed to recognise a sized frame: a gzip header up to XLEN, or a
+// pzstd skippable frame.
+static constexpr size_t kFrameHeaderSize = 12;
+// frameSize() result when the header is not complete yet.
+static constexpr size_t kNeedMore = SIZE_MAX;
+
+Compression compressionFromName(const std::string& name) {
+  if (name.empty() || name == "none") {
+    return Compression::kNone;
+  }
+  if (name == "gzip") {
+    return Compression::kGzip;
+  }
+  if (name == "zstd") {
+#ifdef HAVE_ZSTD
+    return Compression::kZstd;
+#else
+    throw std::runtime_error("This build has no zstd support");
+#endif
+  }
+  throw std::runtime_error("Unsupported compression " + name);
+}
+
+const char* compressionName(Compression compression) {
+  switch (compression) {
+    case Compression::kGzip:
+      return "gzip";
+    case Compression::kZstd:
+      return "zstd";
+    case Compression::kNone:
+    default:
+      return "none";
+  }
+}
+
+namespace {
+class GzipDecoder : public StreamDecoder {
+ public:
+  GzipDecoder() {
+    if (inflateInit2(&stream_, 16 + MAX_WBITS) != Z_OK) {
+      throw std::runtime_error("Could not set up gzip decoder");
+    }
+  }
+  ~GzipDecoder() override { inflateEnd(&stream_); }
+  GzipDecoder(const GzipDecoder&) = delete;
+  GzipDecoder& operator=(const GzipDecoder&) = delete;
+
+  bool decode(const char* in, size_t in_len, size_t* consumed, char* out, size_t out_len,
+              size_t* produced) override {
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+    stream_.avail_in = static_cast<uInt>(std::min<size_t>(in_len, UINT32_MAX));
+    stream_.next_out = reinterpret_cast<Bytef*>(out);
+    stream_.avail_out = static_cast<uInt>(std::min<size_t>(out_len, UINT32_MAX));
+    const uInt avail_in = stream_.avail_in;
+    const uInt avail_out = stream_.avail_out;
+    int rc = inflate(&stream_, Z_NO_FLUSH);
+    *consumed = avail_in - stream_.avail_in;
+    *produced = avail_out - stream_.avail_out;
+    if (rc == Z_STREAM_END) {
+      // The next member, if any, starts afresh.
+      at_frame_end_ = true;
+      return inflateReset(&stream_) == Z_OK;
+    }
+    if (*consumed != 0) {
+      at_frame_end_ = false;
+    }
+    return rc == Z_OK || rc == Z_BUF_ERROR;
+  }
+  bool atFrameEnd() const override { return at_frame_end_; }
+  void reset() override {
+    inflateReset(&stream_);
+    at_frame_end_ = true;
+  }
+
+ private:
+  z_stream stream_{};
+  bool at_frame_end_{true};
+};
+
+#ifdef HAVE_ZSTD
+class ZstdDecoder : public StreamDecoder {
+ public:
+  ZstdDecoder() : ctx_{ZSTD_createDCtx()} {
+    if (ctx_ == nullptr) {
+      throw std::runtime_error("Could not set up zstd decoder");
+    }
+  }
+  ~ZstdDecoder() override { ZSTD_freeDCtx(ctx_); }
+  ZstdDecoder(const ZstdDecoder&) = delete;
+  ZstdDecoder& operator=(const ZstdDecoder&) = delete;
+
+  bool decode(const char* in, size_t in_len, size_t* consumed, char* out, size_t out_len,
+              size_t* produced) override {
+    ZSTD_inBuffer input{in, in_len, 0};
+    ZSTD_outBuffer output{out, out_len, 0};
+    size_t rc = ZSTD_decompressStream(ctx_, &output, &input);
+    *consumed = input.pos;
+    *produced = output.pos;
+    if (ZSTD_isError(rc) != 0) {
+      return false;
+    }
+    // 0 means a frame was completely decoded and flushed.
+    if (rc == 0) {
+      at_frame_end_ = true;
+    } else if (*consumed != 0 || *produced != 0) {
+      at_frame_end_ = false;
+    }
+    return true;
+  }
+  bool atFrameEnd() const override { return at_frame_end_; }
+  void reset() override {
+    ZSTD_DCtx_reset(ctx_, ZSTD_reset_session_only);
+    at_frame_end_ = true;
+  }
+
+ private:
+  ZSTD_DCtx* ctx_;
+  bool at_frame_end_{true};
+};
+#endif
+
+uint32_t readLe32(const char* data) {
+  const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+  return static_cast<uint32_t>(bytes[0]) | static_cast<uint32_t>(bytes[1]) << 8 |
+         static_cast<uint32_t>(bytes[2]) << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+}
+uint16_t readLe16(const char* data) {
+  const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+  return static_cast<uint16_t>(bytes[0] | bytes[1] << 8);
+}
+
+// Size of the independent frame at the start of data if its header records
+// it, 0 if it does not, or kNeedMore if more of the header is needed.
+//  - BGZF: a gzip member whose FEXTRA field has a "BC" subfield holding the
+//    member size minus one.
+//  - pzstd: a skippable frame with magic 0x184D2A50 and four bytes of
+//    content, the size of the zstd frame that follows.
+size_t frameSize(Compression compression, const char* data, size_t len) {
+  if (len < kFrameHeaderSize) {
+    return kNeedMore;
+  }
+  size_t size = 0;
+  if (compression == Compression::kGzip) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    if (bytes[0] != 0x1f || bytes[1] != 0x8b || bytes[2] != 8 || (bytes[3] & 4) == 0) {
+      return 0;
+    }
+    const size_t extra_end = kFrameHeaderSize + readLe16(data + 10);
+    if (len < extra_end) {
+      return kNeedMore;
+    }
+    for (size_t pos = kFrameHeaderSize; pos + 4 <= extra_end; pos += 4 + readLe16(data + pos + 2)) {
+      if (data[pos] == 'B' && data[pos + 1] == 'C' && readLe16(data + pos + 2) == 2 && pos + 6 <= extra_end) {
+        size = static_cast<size_t>(readLe16(data + pos + 4)) + 1;
+        break;
+      }
+    }
+  } else if (compression == Compression::kZstd) {
+    if (readLe32(data) != 0x184D2A50 || readLe32(data + 4) != 4) {
+      return 0;
+    }
+    size = kFrameHeaderSize + readLe32(data + 8);
+  }
+  return size;
+}
+
+// Decompressed size of the complete frame at data, as recorded in it, or
+// SIZE_MAX if it does not say.
+//  - BGZF: ISIZE, the last four bytes of the member. A member is at most
+//    64 KiB, so the size modulo 2^32 is the size.
+//  - pzstd: the content size field of the zstd frame after the skippable one.
+size_t frameContentSize(Compression compression, const char* data, size_t size) {
+  if (compression == Compression::kGzip && size >= 4) {
+    return readLe32(data + size - 4);
+  }
+#ifdef HAVE_ZSTD
+  if (compression == Compression::kZstd && size > kFrameHeaderSize) {
+    const unsigned long long content = ZSTD_getFrameContentSize(data + kFrameHeaderSize, size - kFrameHeaderSize);
+    if (content != ZSTD_CONTENTSIZE_UNKNOWN && content != ZSTD_CONTENTSIZE_ERROR && content < SIZE_MAX) {
+      return static_cast<size_t>(content);
+    }
+  }
+#endif
+  return SIZE_MAX;
+}
+
+// Decodes one complete, independent frame into output, which must be big
+// enough for all of it.
+bool decodeFrame(StreamDecoder& decoder, const SlabPool::Slab& input, SlabPool::Slab* output) {
+  decoder.reset();
+  size_t in_pos = 0;
+  size_t out_pos = 0;
+  for (;;) {
+    size_t consumed = 0;
+    size_t produced = 0;
+    if (!decoder.decode(input.data() + in_pos, input.size() - in_pos, &consumed, output->data() + out_pos,
+                        output->capacity() - out_pos, &produced)) {
+      return false;
+    }
+    in_pos += consumed;
+    out_pos += produced;
+    if (consumed == 0 && produced == 0) {
+      break;
+    }
+  }
+  output->setSize(out_pos);
+  return in_pos == input.size() && decoder.atFrameEnd();
+}
+}  // namespace
+
+std::unique_ptr<StreamDecoder> makeStreamDecoder(Compression compression) {
+  switch (compression) {
+    case Compression::kGzip:
+      return std::unique_ptr<StreamDecoder>(new GzipDecoder());
+#ifdef HAVE_ZSTD
+    case Compression::kZstd:
+      return std::unique_ptr<StreamDecoder>(new ZstdDecoder());
+#endif
+    default:
+      throw std::runtime_error(std::string("No decoder for ") + compressionName(compression));
+  }
+}
+
+DecompressStage::DecompressStage(RingBuffer& in, size_t reader, RingBuffer& out, Compression compression,
+                                 unsigned int threads, size_t memory_budget, const std::atomic<bool>& cancel,
+                                 std::function<void(const std::string&)> on_error)
+    : in_{in},
+      reader_{reader},
+      out_{out},
+      compression_{compression},
+      threads_{std::max(threads, 1U)},
+      cancel_{cancel},
+      on_error_{std::move(on_error)} {
+  makeStreamDecoder(compression_);  // throws now rather than on the stage's thread
+  if (threads_ > 1) {
+    const size_t slab_size = compression_ == Compression::kGzip ? kGzipSlabSize : kZstdSlabSize;
+    window_ = std::min<size_t>(2 * threads_, memory_budget / slab_size / 2);
+  }
+  if (window_ > 0) {
+    pool_.reset(new SlabPool(compression_ == Compression::kGzip ? kGzipSlabSize : kZstdSlabSize, 2 * window_));
+    frames_.resize(window_);
+  }
+}
+
+DecompressStage::~DecompressStage() { wait(); }
+
+void DecompressStage::start() { thread_ = std::thread(&DecompressStage::run, this); }
+
+bool DecompressStage::wait() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  return ok_;
+}
+
+void DecompressStage::fail(const std::string& error) {
+  if (on_error_) {
+    on_error_(error);
+  }
+}
+
+void DecompressStage::run() {
+  ok_ = (window_ == 0 || runFramed()) && runStreaming();
+  out_.close();
+}
+
+// Moves input from the ring to slab until it holds want bytes, which must fit,
+// and takes no more than that. Returns false if the stream ends or the stage
+// is cancelled first.
+bool DecompressStage::fill(SlabPool::Slab* slab, size_t want) {
+  Backoff backoff;
+  while (slab->size() < want) {
+    if (cancel_) {
+      return false;
+    }
+    const char* data = nullptr;
+    size_t len = in_.peek(&data, reader_);
+    if (len == 0) {
+      if (in_.drained(reader_)) {
+        return false;
+      }
+      backoff.pause();
+      continue;
+    }
+    backoff.reset();
+    len = std::min(len, want - slab->size());
+    std::memcpy(slab->data() + slab->size(), data, len);
+    slab->setSize(slab->size() + len);
+    in_.consume(len, reader_);
+  }
+  return true;
+}
+
+bool DecompressStage::emit(const char* data, size_t len) {
+  Backoff backoff;
+  while (len > 0) {
+    if (cancel_) {
+      return false;
+    }
+    size_t n = out_.write(data, len);
+    if (n == 0) {
+      backoff.pause();
+      continue;
+    }
+    backoff.reset();
+    data += n;
+    len -= n;
+    decoded_ += n;
+  }
+  return true;
+}
+
+// The oldest frame in flight no worker has taken yet. Needs mutex_.
+DecompressStage::Frame* DecompressStage::unclaimedFrame() {
+  for (size_t i = 0; i < queued_; ++i) {
+    Frame& frame = frames_[(first_ + i) % window_];
+    if (!frame.claimed) {
+      return &frame;
+    }
+  }
+  return nullptr;
+}
+
+void DecompressStage::worker() {
+  auto decoder = makeStreamDecoder(compression_);
+  for (;;) {
+    Frame* frame = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&] { return stop_workers_ || (frame = unclaimedFrame()) != nullptr; });
+      if (stop_workers_) {
+        return;
+      }
+      frame->claimed = true;
+    }
+    bool ok = false;
+    {
+      StageTimer timer(latency_);
+      ok = decodeFrame(*decoder, frame->input, &frame->output);
+    }
+    frame->input.reset();
+    std::lock_guard<std::mutex> guard(mutex_);
+    frame->ok = ok;
+    frame->done = true;
+    cv_.notify_all();
+  }
+}
+
+// Decodes sized frames on threads_ workers for as long as the stream consists
+// of them, handing back the first frame that is not to runStreaming() through
+// leftover_. Each frame is read from the ring straight into its input slab.
+// Frames enter and leave the ring of frames in stream order; only
+// this thread moves its ends.
+bool DecompressStage::runFramed() {
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < threads_; ++i) {
+    workers.emplace_back(&DecompressStage::worker, this);
+  }
+  const size_t slab_size = pool_->slabSize();
+  bool more = true;
+  bool ok = true;
+  for (;;) {
+    Frame* front = nullptr;
+    size_t queued = 0;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (queued_ != 0 && frames_[first_ % window_].done) {
+        front = &frames_[first_ % window_];
+      }
+      queued = queued_;
+    }
+    if (front) {
+      if (!front->ok) {
+        fail(std::string("Corrupt ") + compressionName(compression_) + " frame at compressed offset " +
+             std::to_string(front->offset));
+        ok = false;
+        break;
+      }
+      const bool emitted = emit(front->output.data(), front->output.size());
+      front->output.reset();
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        front->claimed = false;
+        front->done = false;
+        ++first_;
+        --queued_;
+      }
+      if (!emitted) {
+        ok = false;
+        break;
+      }
+      continue;
+    }
+
+    if (more && queued < window_) {
+      // The slot is outside the frames in flight, so the workers leave it
+      // alone until queued_ grows. Two slabs per slot never run out.
+      Frame& frame = frames_[(first_ + queued) % window_];
+      frame.input = pool_->acquire();
+      size_t size = kNeedMore;
+      while (size == kNeedMore && frame.input.size() < slab_size &&
+             fill(&frame.input, std::max(kFrameHeaderSize, frame.input.size() + 1))) {
+        size = frameSize(compression_, frame.input.data(), frame.input.size());
+      }
+      if (size == kNeedMore || size == 0 || size > slab_size || !fill(&frame.input, size) ||
+          frameContentSize(compression_, frame.input.data(), size) > slab_size) {
+        leftover_ = std::move(frame.input);
+        more = false;  // end of stream, or a frame for runStreaming()
+        continue;
+      }
+      frame.offset = consumed_;
+      frame.output = pool_->acquire();
+      consumed_ += size;
+      std::lock_guard<std::mutex> guard(mutex_);
+      ++queued_;
+      cv_.notify_all();
+      continue;
+    }
+    if (queued == 0 || cancel_) {
+      ok = !cancel_;
+      break;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, std::chrono::milliseconds(10), [this] { return frames_[first_ % window_].done; });
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_workers_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  for (auto& frame : frames_) {
+    frame = Frame();
+  }
+  queued_ = 0;
+  return ok;
+}
+
+// Decodes the rest of the stream, starting with whatever runFramed() left in
+// leftover_, straight into the output ring.
+bool DecompressStage::runStreaming() {
+  auto decoder = makeStreamDecoder(compression_);
+  Backoff backoff;
+  size_t leftover_pos = 0;
+  for (;;) {
+    if (cancel_) {
+      return false;
+    }
+    const char* data = nullptr;
+    size_t len = 0;
+    const bool from_leftover = leftover_ && leftover_pos < leftover_.size();
+    if (from_leftover) {
+      data = leftover_.data() + leftover_pos;
+      len = leftover_.size() - leftover_pos;
+    } else {
+      len = in_.peek(&data, reader_);
+    }
+    // With no input left the decoder may still hold output back.
+    const bool input_done = len == 0 && in_.drained(reader_);
+    if (len == 0 && !input_done) {
+      backoff.pause();
+      continue;
+    }
+
+    char* out = nullptr;
+    size_t room = out_.reserve(&out);
+    if (room == 0) {
+      backoff.pause();
+      continue;
+    }
+    size_t consumed = 0;
+    size_t produced = 0;
+    bool decoded = false;
+    {
+      StageTimer timer(latency_);
+      decoded = decoder->decode(data, len, &consumed, out, room, &produced);
+    }
+    if (!decoded) {
+      fail(std::string("Corrupt ") + compressionName(compression_) + " data at compressed offset " +
+           std::to_string(consumed_));
+      return false;
+    }
+    out_.commit(produced);
+    decoded_ += produced;
+    consumed_ += consumed;
+    if (from_leftover) {
+      leftover_pos += consumed;
+      if (leftover_pos == leftover_.size()) {
+        leftover_.reset();
+      }
+    } else if (consumed != 0) {
+      in_.consume(consumed, reader_);
+    }
+    if (input_done && produced == 0) {
+      break;
+    }
+    if (consumed != 0 || produced != 0) {
+      backoff.reset();
+    } else {
+      backoff.pause();
+    }
+  }
+  if (!decoder->atFrameEnd()) {
+    fail(std::string("Truncated ") + compressionName(compression_) + " stream");
+    return false;
+  }
+  return true;
+}
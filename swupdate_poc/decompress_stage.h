@@ -0,0 +1,131 @@
+#ifndef SWUPDATE_POC_DECOMPRESS_STAGE_H_
+#define SWUPDATE_POC_DECOMPRESS_STAGE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "ring_buffer.h"
+#include "slab_pool.h"
+
+// Transport compression of an image, from the target's
+// custom.swupdate.compression ("gzip" or "zstd").
+enum class Compression { kNone, kGzip, kZstd };
+
+// Throws std::runtime_error for an unknown name, or for "zstd" in a build
+// without libzstd.
+Compression compressionFromName(const std::string& name);
+const char* compressionName(Compression compression);
+
+// Streaming decoder, fed compressed input in arbitrary pieces. Concatenated
+// gzip members and zstd frames decode as one stream.
+class StreamDecoder {
+ public:
+  virtual ~StreamDecoder() = default;
+  // Decodes from in into out, setting how much of each it used. Returns false
+  // on corrupt input.
+  virtual bool decode(const char* in, size_t in_len, size_t* consumed, char* out, size_t out_len,
+                      size_t* produced) = 0;
+  // True between frames, where the input may end.
+  virtual bool atFrameEnd() const = 0;
+  // Forgets any partly decoded frame, to start on unrelated input.
+  virtual void reset() = 0;
+};
+
+std::unique_ptr<StreamDecoder> makeStreamDecoder(Compression compression);
+
+// Pipeline stage decompressing the download ring into a second ring, from
+// which SWUpdate and the hash stage of the decompressed image read.
+//
+// Both formats have a variant made of independent frames that record their
+// compressed size: BGZF (bgzip) for gzip, and pzstd's output for zstd. Those
+// frames are decoded on several threads at once and put back in order. Each
+// frame in flight holds two slabs of a pool sized by the memory budget, one
+// for its input and one for its output, and every worker keeps its decoder,
+// so the steady state allocates nothing. A frame is copied once, from the
+// ring into its input slab, which is released once it is decoded; the output
+// slab is released once it is written to the output ring. A window of up to
+// 2 x threads frames is in flight, fewer if the budget does not stretch that
+// far. Any other stream, the rest of one once a frame without a size or too
+// big for a slab turns up, or every stream when the budget holds no slabs at
+// all, is decoded by a single streaming decoder on the stage's thread. Either
+// way the download thread and the hash stages keep their own cores.
+class DecompressStage {
+ public:
+  // Reads reader of in, writes to out and closes it at the end of the
+  // stream. on_error gets a description of corrupt or truncated input; the
+  // stage then stops, as it does once cancel is set.
+  // memory_budget bounds the slabs of frames in flight, see above.
+  DecompressStage(RingBuffer& in, size_t reader, RingBuffer& out, Compression compression, unsigned int threads,
+                  size_t memory_budget, const std::atomic<bool>& cancel,
+                  std::function<void(const std::string&)> on_error);
+  ~DecompressStage();
+  DecompressStage(const DecompressStage&) = delete;
+  DecompressStage& operator=(const DecompressStage&) = delete;
+
+  // Records the time spent decoding each frame or chunk. Must be set before
+  // start().
+  void setLatencyHistogram(LatencyHistogram* latency) { latency_ = latency; }
+
+  void start();
+  // Waits for the end of the stream. Returns false if it was corrupt.
+  bool wait();
+  uint64_t decodedBytes() const { return decoded_; }
+  // Frames decoded in parallel at a time; 0 when decoding is streaming only.
+  size_t window() const { return window_; }
+
+ private:
+  struct Frame {
+    uint64_t offset{0};  // in the compressed stream
+    SlabPool::Slab input;
+    SlabPool::Slab output;
+    bool claimed{false};
+    bool done{false};
+    bool ok{false};
+  };
+
+  void run();
+  bool runFramed();
+  bool runStreaming();
+  bool fill(SlabPool::Slab* slab, size_t want);
+  bool emit(const char* data, size_t len);
+  void worker();
+  Frame* unclaimedFrame();
+  void fail(const std::string& error);
+
+  RingBuffer& in_;
+  const size_t reader_;
+  RingBuffer& out_;
+  const Compression compression_;
+  const unsigned int threads_;
+  size_t window_{0};
+  std::unique_ptr<SlabPool> pool_;
+  const std::atomic<bool>& cancel_;
+  std::function<void(const std::string&)> on_error_;
+  // Input runFramed() took off the ring for a frame that is not for the
+  // workers, which runStreaming() decodes first.
+  SlabPool::Slab leftover_;
+  uint64_t consumed_{0};  // compressed bytes taken on, for error messages
+  std::atomic<uint64_t> decoded_{0};
+  bool ok_{true};
+  LatencyHistogram* latency_{nullptr};
+  std::thread thread_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Ring of window_ frames; frames first_ to first_ + queued_ are in flight.
+  std::vector<Frame> frames_;
+  uint64_t first_{0};
+  size_t queued_{0};
+  bool stop_workers_{false};
+};
+
+#endif  // SWUPDATE_POC_DECOMPRESS_STAGE_H_
@@ -0,0 +1,131 @@
+#include "digest.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+EvpDigest::EvpDigest(const EVP_MD* md) : md_{md}, ctx_{EVP_MD_CTX_new()} {
+  if (ctx_ == nullptr) {
+    throw std::runtime_error("EVP_MD_CTX_new failed");
+  }
+  reset();
+}
+
+EvpDigest::~EvpDigest() { EVP_MD_CTX_free(ctx_); }
+
+std::string EvpDigest::hexDigest() {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  EVP_DigestFinal_ex(ctx_, md, &len);
+  return toHex(md, len);
+}
+
+void EvpDigest::reset() {
+  if (EVP_DigestInit_ex(ctx_, md_, nullptr) != 1) {
+    throw std::runtime_error("EVP_DigestInit_ex failed");
+  }
+}
+
+DigestResults digestBuffer(const char* data, size_t len, const std::set<std::string>& algorithms) {
+  std::vector<std::unique_ptr<EvpDigest>> digests;
+  for (const auto& algorithm : algorithms) {
+    const EVP_MD* md = EVP_get_digestbyname(algorithm.c_str());
+    if (md == nullptr) {
+      throw std::runtime_error("Unsupported hash algorithm " + algorithm);
+    }
+    digests.emplace_back(new EvpDigest(md));
+  }
+  // Feed all digests the same cache-sized piece before moving on, so that a
+  // buffer larger than memory is only read from storage once.
+  static constexpr size_t kPiece = 256 * 1024;
+  for (size_t pos = 0; pos < len; pos += kPiece) {
+    for (auto& digest : digests) {
+      digest->update(data + pos, std::min(kPiece, len - pos));
+    }
+  }
+  DigestResults results;
+  auto digest = digests.begin();
+  for (const auto& algorithm : algorithms) {
+    results[algorithm] = (*digest++)->hexDigest();
+  }
+  return results;
+}
+
+std::vector<std::string> digestMismatches(const std::vector<ExpectedDigest>& expected, const DigestResults& results) {
+  std::vector<std::string> mismatches;
+  for (const auto& digest : expected) {
+    auto computed = results.find(digest.algorithm);
+    if (computed == results.end()) {
+      mismatches.push_back(digest.source + "." + digest.algorithm + " was not computed");
+    } else if (computed->second != digest.value) {
+      mismatches.push_back(digest.source + "." + digest.algorithm + " expected " + digest.value + ", got " +
+                           computed->second);
+    }
+  }
+  return mismatches;
+}
+
+std::string toHex(const unsigned char* data, size_t len) {
+  static const char kHex[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(2 * len);
+  for (size_t i = 0; i < len; ++i) {
+    hex.push_back(kHex[data[i] >> 4]);
+    hex.push_back(kHex[data[i] & 0x0f]);
+  }
+  return hex;
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool fromHex(const std::string& hex, std::string* data) {
+  if (hex.size() % 2 != 0) {
+    return false;
+  }
+  data->clear();
+  data->reserve(hex.size() / 2);
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    int high = hexValue(hex[i]);
+    int low = hexValue(hex[i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    data->push_back(static_cast<char>((high << 4) | low));
+  }
+  return true;
+}
+
+const char* shaAcceleration() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax = 0;
+  unsigned int ebx = 0;
+  unsigned int ecx = 0;
+  unsigned int edx = 0;
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0 && (ebx & (1U << 29)) != 0) {
+    return "SHA-NI";
+  }
+#elif defined(__aarch64__)
+  if ((getauxval(AT_HWCAP) & HWCAP_SHA2) != 0) {
+    return "ARMv8 crypto extensions";
+  }
+#endif
+  return "none";
+}
@@ -0,0 +1,162 @@
+#ifndef SWUPDATE_POC_DIGEST_H_
+#define SWUPDATE_POC_DIGEST_H_
+
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <openssl/evp.h>
+
+// Incremental message digest on top of OpenSSL's EVP interface. OpenSSL probes
+// the CPU once at startup and routes EVP SHA-2 through the SHA-NI or ARMv8
+// crypto extension code when available, so no build-time choice is needed.
+class EvpDigest {
+ public:
+  explicit EvpDigest(const EVP_MD* md);
+  ~EvpDigest();
+  EvpDigest(const EvpDigest&) = delete;
+  EvpDigest& operator=(const EvpDigest&) = delete;
+
+  void update(const void* data, size_t len) { EVP_DigestUpdate(ctx_, data, len); }
+  // Finalises the digest and returns it as lowercase hex, the same format as
+  // Hash::HashString(). The digest must be reset() before it is reused.
+  std::string hexDigest();
+  void reset();
+
+ private:
+  const EVP_MD* md_;
+  EVP_MD_CTX* ctx_;
+};
+
+// Low-level OpenSSL contexts, only needed by ResumableDigest.
+struct SHA256state_st;
+struct SHA512state_st;
+
+// Algorithms a target's metadata may list, named as in its "hashes" objects.
+struct Sha256Algorithm {
+  static constexpr const char* kName = "sha256";
+  static const EVP_MD* md() { return EVP_sha256(); }
+  using Context = SHA256state_st;
+};
+struct Sha512Algorithm {
+  static constexpr const char* kName = "sha512";
+  static const EVP_MD* md() { return EVP_sha512(); }
+  using Context = SHA512state_st;
+};
+
+// EvpDigest bound to an algorithm at compile time.
+template <class Algorithm>
+class EvpAlgorithmDigest : public EvpDigest {
+ public:
+  static constexpr bool kResumable = false;
+  EvpAlgorithmDigest() : EvpDigest(Algorithm::md()) {}
+};
+
+// Digest whose midstate can be saved and restored, so that hashing a stream
+// can continue in a later process without reading the prefix again.
+//
+// EVP contexts are opaque (with OpenSSL 3 providers the state is not even in
+// the process' view), so this uses OpenSSL's low-level SHA-2 contexts. They
+// run the same runtime-dispatched SHA-NI / ARMv8 block functions as EVP.
+// Instantiated for Sha256Algorithm and Sha512Algorithm.
+template <class Algorithm>
+class ResumableDigest {
+ public:
+  static constexpr bool kResumable = true;
+  ResumableDigest();
+  ~ResumableDigest();
+  ResumableDigest(const ResumableDigest&) = delete;
+  ResumableDigest& operator=(const ResumableDigest&) = delete;
+
+  void update(const void* data, size_t len);
+  std::string hexDigest();
+  void reset();
+  // Midstate as hex. Only meaningful to the same build on the same
+  // architecture, which is all a crash checkpoint needs.
+  std::string saveState() const;
+  // Returns false if state was not produced by saveState().
+  bool restoreState(const std::string& state);
+
+ private:
+  typename Algorithm::Context* ctx_;
+};
+
+extern template class ResumableDigest<Sha256Algorithm>;
+extern template class ResumableDigest<Sha512Algorithm>;
+
+// Hex digests keyed by algorithm name.
+using DigestResults = std::map<std::string, std::string>;
+// Saved midstates keyed by algorithm name.
+using DigestStates = std::map<std::string, std::string>;
+
+// Computes several digests of the same data in a single pass. The algorithm
+// set is fixed at compile time, so update() expands to one direct call per
+// algorithm with no per-chunk dispatch. Digest is EvpAlgorithmDigest, or
+// ResumableDigest when midstates have to be saved.
+template <template <class> class Digest, class... Algorithms>
+class MultiDigest {
+ public:
+  static constexpr bool kResumable = (Digest<Algorithms>::kResumable && ...);
+
+  void update(const void* data, size_t len) {
+    std::apply([data, len](auto&... digest) { (digest.update(data, len), ...); }, digests_);
+  }
+  DigestResults finish() {
+    DigestResults results;
+    finishInto(results, std::index_sequence_for<Algorithms...>{});
+    return results;
+  }
+
+  // Only available with ResumableDigest.
+  DigestStates saveState() const {
+    DigestStates states;
+    saveInto(states, std::index_sequence_for<Algorithms...>{});
+    return states;
+  }
+  bool restoreState(const DigestStates& states) { return restoreFrom(states, std::index_sequence_for<Algorithms...>{}); }
+
+ private:
+  template <size_t... I>
+  void finishInto(DigestResults& results, std::index_sequence<I...> /*unused*/) {
+    ((results[Algorithms::kName] = std::get<I>(digests_).hexDigest()), ...);
+  }
+  template <size_t... I>
+  void saveInto(DigestStates& states, std::index_sequence<I...> /*unused*/) const {
+    ((states[Algorithms::kName] = std::get<I>(digests_).saveState()), ...);
+  }
+  template <size_t... I>
+  bool restoreFrom(const DigestStates& states, std::index_sequence<I...> /*unused*/) {
+    return ((states.count(Algorithms::kName) != 0 && std::get<I>(digests_).restoreState(states.at(Algorithms::kName))) &&
+            ...);
+  }
+
+  std::tuple<Digest<Algorithms>...> digests_;
+};
+
+// A digest the target metadata expects for the stream and where it was listed.
+struct ExpectedDigest {
+  std::string source;     // e.g. "hashes" or "custom.swupdate.rawHashes"
+  std::string algorithm;  // e.g. "sha256"
+  std::string value;      // lowercase hex
+};
+
+// Digests a whole buffer in one pass with every named algorithm, e.g. an image
+// mapped into memory. Throws for an algorithm OpenSSL does not know.
+DigestResults digestBuffer(const char* data, size_t len, const std::set<std::string>& algorithms);
+
+// Describes every expected digest that the computed results do not match.
+std::vector<std::string> digestMismatches(const std::vector<ExpectedDigest>& expected, const DigestResults& results);
+
+std::string toHex(const unsigned char* data, size_t len);
+// Returns false on malformed input.
+bool fromHex(const std::string& hex, std::string* data);
+
+// Name of the SHA-2 instruction set extension available on this CPU, for
+// logging which implementation the hashing stage ends up running.
+const char* shaAcceleration();
+
+#endif  // SWUPDATE_POC_DIGEST_H_
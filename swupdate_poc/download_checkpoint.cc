@@ -0,0 +1,84 @@
+#include "download_checkpoint.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#include "json/json.h"
+
+bool loadCheckpoint(const std::string& path, DownloadCheckpoint* checkpoint) {
+  std::ifstream file(path, std::ifstream::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+  Json::CharReaderBuilder readerBuilder;
+  Json::Value json;
+  std::string errs;
+  if (!Json::parseFromStream(readerBuilder, file, &json, &errs) || !json.isObject()) {
+    return false;
+  }
+
+  checkpoint->target_name = json["target"]["name"].asString();
+  checkpoint->target_length = json["target"]["length"].asUInt64();
+  checkpoint->target_digest = json["target"]["digest"].asString();
+  checkpoint->hash.offset = json["offset"].asUInt64();
+  checkpoint->hash.states.clear();
+  const Json::Value& states = json["midstates"];
+  for (const auto& algorithm : states.getMemberNames()) {
+    checkpoint->hash.states[algorithm] = states[algorithm].asString();
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0) {
+      return false;
+    }
+    written += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool saveCheckpoint(const std::string& path, const DownloadCheckpoint& checkpoint) {
+  Json::Value json;
+  json["target"]["name"] = checkpoint.target_name;
+  json["target"]["length"] = Json::UInt64(checkpoint.target_length);
+  json["target"]["digest"] = checkpoint.target_digest;
+  json["offset"] = Json::UInt64(checkpoint.hash.offset);
+  for (const auto& state : checkpoint.hash.states) {
+    json["midstates"][state.first] = state.second;
+  }
+  Json::StreamWriterBuilder writerBuilder;
+  const std::string data = Json::writeString(writerBuilder, json);
+
+  const std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = writeAll(fd, data) && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  // Make the rename itself durable.
+  std::vector<char> dir(path.begin(), path.end());
+  dir.push_back('\0');
+  int dir_fd = open(dirname(dir.data()), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return true;
+}
+
+void removeCheckpoint(const std::string& path) { std::remove(path.c_str()); }
@@ -0,0 +1,27 @@
+#ifndef SWUPDATE_POC_DOWNLOAD_CHECKPOINT_H_
+#define SWUPDATE_POC_DOWNLOAD_CHECKPOINT_H_
+
+#include <cstdint>
+#include <string>
+
+#include "hash_stage.h"
+
+// Progress of an interrupted download: which image it was, how much of it is
+// in the staging file, and the digest midstates at that offset.
+struct DownloadCheckpoint {
+  std::string target_name;
+  uint64_t target_length{0};
+  // First of the target's "hashes", as "<algorithm>:<hex>".
+  std::string target_digest;
+  HashCheckpoint hash;
+};
+
+// Returns false if there is no readable checkpoint at path.
+bool loadCheckpoint(const std::string& path, DownloadCheckpoint* checkpoint);
+// Replaces the checkpoint at path atomically: the new one is written and
+// synced to a temporary file which is then renamed over the old one, so a
+// power cut leaves either of them intact, never a torn file.
+bool saveCheckpoint(const std::string& path, const DownloadCheckpoint& checkpoint);
+void removeCheckpoint(const std::string& path);
+
+#endif  // SWUPDATE_POC_DOWNLOAD_CHECKPOINT_H_
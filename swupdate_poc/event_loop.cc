@@ -0,0 +1,567 @@
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+// How often the loop checks on stages that do not signal it, see the class
+// comment.
+static constexpr std::chrono::milliseconds kStagePollInterval{1};
+// How often a paused loop checks whether it may go on.
+static constexpr std::chrono::milliseconds kPausePollInterval{10};
+// Time between two status polls that found nothing new, as in
+// ipc_wait_for_complete().
+static constexpr std::chrono::milliseconds kStatusPollInterval{1000};
+// A stalled server fails the transfer instead of hanging the install.
+static constexpr long kConnectTimeoutSeconds = 60;
+static constexpr long kLowSpeedTimeSeconds = 60;
+
+using Clock = std::chrono::steady_clock;
+
+EventLoopInstall::EventLoopInstall(RingBuffer& download, RingBuffer& install, size_t install_reader,
+                                   size_t high_watermark, size_t low_watermark, std::atomic<bool>& failed)
+    : download_{download},
+      install_{install},
+      install_reader_{install_reader},
+      high_watermark_{high_watermark},
+      low_watermark_{low_watermark},
+      failed_{failed},
+      epoll_fd_{epoll_create1(EPOLL_CLOEXEC)},
+      multi_{curl_multi_init(), curl_multi_cleanup} {
+  if (epoll_fd_ < 0 || !multi_) {
+    if (epoll_fd_ >= 0) {
+      close(epoll_fd_);
+    }
+    throw std::runtime_error("Could not set up the event loop");
+  }
+  curl_multi_setopt(multi_.get(), CURLMOPT_SOCKETFUNCTION, SocketHandler);
+  curl_multi_setopt(multi_.get(), CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(multi_.get(), CURLMOPT_TIMERFUNCTION, TimerHandler);
+  curl_multi_setopt(multi_.get(), CURLMOPT_TIMERDATA, this);
+}
+
+EventLoopInstall::~EventLoopInstall() {
+  if (transferring_) {
+    curl_multi_remove_handle(multi_.get(), easy_.get());
+  }
+  // The connection stays with the multi handle, and must close before the
+  // easy handle goes back to its cache.
+  multi_.reset();
+  easy_.reset();
+  for (int fd : {prefix_fd_, install_fd_, status_fd_}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  close(epoll_fd_);
+}
+
+void EventLoopInstall::setPrefix(int fd, uint64_t length) {
+  prefix_fd_ = fd;
+  prefix_left_ = length;
+}
+
+void EventLoopInstall::setDownload(const std::string& url, uint64_t from, uint64_t length, DataCallback on_data,
+                                   TickCallback on_tick) {
+  if (from >= length) {
+    return;
+  }
+  if (connections_ != nullptr) {
+    easy_ = connections_->acquire(url);
+  } else {
+    easy_ = CurlHandler(curl_easy_init(), curl_easy_cleanup);
+  }
+  if (!easy_) {
+    throw std::runtime_error("Could not set up the download");
+  }
+  CURL* easy = easy_.get();
+  curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(easy, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(from));
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, WriteHandler);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, this);
+  curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, ProgressHandler);
+  curl_easy_setopt(easy, CURLOPT_XFERINFODATA, this);
+  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, kConnectTimeoutSeconds);
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, kLowSpeedTimeSeconds);
+  expected_ = length - from;
+  on_data_ = std::move(on_data);
+  on_tick_ = std::move(on_tick);
+}
+
+RECOVERY_STATUS EventLoopInstall::run(int install_fd, getstatus on_status) {
+  install_fd_ = install_fd;
+  on_status_ = on_status;
+  fcntl(install_fd_, F_SETFL, fcntl(install_fd_, F_GETFL) | O_NONBLOCK);
+  // Errors and hangups only, until sendInstall() finds the socket full and
+  // waits for EPOLLOUT; it disarms that again once the ring is drained.
+  epoll_event event{};
+  event.data.fd = install_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, install_fd_, &event);
+
+  std::array<epoll_event, 16> events{};
+  while (!finished_) {
+    step();
+    if (finished_) {
+      break;
+    }
+    const int n = epoll_wait(epoll_fd_, events.data(), static_cast<int>(events.size()), timeoutMs());
+    if (n < 0 && errno != EINTR) {
+      fail(std::string("epoll_wait: ") + std::strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      const int fd = events[i].data.fd;
+      const uint32_t ready = events[i].events;
+      if (fd == install_fd_) {
+        // Writable: the next step() sends the rest of the ring.
+        if ((ready & (EPOLLERR | EPOLLHUP)) != 0) {
+          fail("SWUpdate closed the install connection");
+        }
+      } else if (fd == status_fd_) {
+        if (status_sent_) {
+          readStatusReply();
+        } else {
+          sendStatusRequest();
+        }
+      } else {
+        int mask = 0;
+        mask |= (ready & EPOLLIN) != 0 ? CURL_CSELECT_IN : 0;
+        mask |= (ready & EPOLLOUT) != 0 ? CURL_CSELECT_OUT : 0;
+        mask |= (ready & (EPOLLERR | EPOLLHUP)) != 0 ? CURL_CSELECT_ERR : 0;
+        int running = 0;
+        curl_multi_socket_action(multi_.get(), fd, mask, &running);
+      }
+    }
+    const auto now = Clock::now();
+    if (curl_deadline_ != Clock::time_point{} && now >= curl_deadline_) {
+      curl_deadline_ = Clock::time_point{};
+      int running = 0;
+      curl_multi_socket_action(multi_.get(), CURL_SOCKET_TIMEOUT, 0, &running);
+    }
+    if (status_deadline_ != Clock::time_point{} && now >= status_deadline_) {
+      status_deadline_ = Clock::time_point{};
+      pollStatus();
+    }
+    readMessages();
+  }
+  return result_;
+}
+
+// Moves the stream along as far as it goes without waiting.
+void EventLoopInstall::step() {
+  if (install_fd_ < 0) {
+    return;  // the stream is through, only the status poll is left
+  }
+  if (flow_control_ != nullptr && flow_control_->hasAborted()) {
+    fail("aborted");
+  }
+  if (failed_ && !aborted_) {
+    abort();
+    return;
+  }
+  held_ = flow_control_ != nullptr && !flow_control_->canContinue(false);
+  if (held_) {
+    hold();
+    return;
+  }
+  fillPrefix();
+  if (prefix_left_ == 0 && easy_ && !transferring_ && !download_done_) {
+    startDownload();
+  }
+  resumeDownload();
+  if (prefix_left_ == 0 && (!easy_ || download_done_)) {
+    download_.close();
+  }
+  sendInstall();
+  if (install_fd_ >= 0 && gateOpen() && install_.drained(install_reader_)) {
+    endStream();
+  }
+}
+
+int EventLoopInstall::timeoutMs() const {
+  const auto now = Clock::now();
+  Clock::time_point deadline;
+  auto consider = [&deadline](Clock::time_point t) {
+    if (t != Clock::time_point{} && (deadline == Clock::time_point{} || t < deadline)) {
+      deadline = t;
+    }
+  };
+  consider(curl_deadline_);
+  consider(status_deadline_);
+  consider(throttled_until_);
+  if (install_fd_ >= 0) {
+    // Whatever step() found, the stages may have made room or queued data
+    // since, so this cannot depend on the state of the rings. While SWUpdate
+    // is what holds the stream back, though, its socket turning writable
+    // wakes the loop, which then also picks up what the stages did meanwhile.
+    const bool waiting_for_swupdate = (install_events_ & EPOLLOUT) != 0;
+    const bool waiting_for_room = paused_ || prefix_left_ > 0;
+    const bool waiting_for_data = (&install_ != &download_ && !install_.drained(install_reader_)) || !gateOpen();
+    if (held_) {
+      consider(now + kPausePollInterval);
+    } else if (!waiting_for_swupdate && (waiting_for_room || waiting_for_data)) {
+      consider(now + kStagePollInterval);
+    }
+  }
+  if (deadline == Clock::time_point{}) {
+    return -1;
+  }
+  if (deadline <= now) {
+    return 0;
+  }
+  // Rounded up, so that the loop never wakes up before the deadline.
+  return static_cast<int>((deadline - now + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)) /
+                          std::chrono::milliseconds(1));
+}
+
+// Queues the prefix in place, straight from the file into the ring.
+void EventLoopInstall::fillPrefix() {
+  while (prefix_left_ > 0 && download_.size() < high_watermark_) {
+    char* data = nullptr;
+    const size_t room = static_cast<size_t>(
+        std::min<uint64_t>({download_.reserve(&data), high_watermark_ - download_.size(), prefix_left_}));
+    const ssize_t n = read(prefix_fd_, data, room);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fail("Could not read back staged image");
+      return;
+    }
+    download_.commit(static_cast<size_t>(n));
+    prefix_left_ -= static_cast<uint64_t>(n);
+  }
+  if (prefix_left_ == 0 && prefix_fd_ >= 0) {
+    close(prefix_fd_);
+    prefix_fd_ = -1;
+  }
+}
+
+void EventLoopInstall::startDownload() {
+  transferring_ = true;
+  curl_multi_add_handle(multi_.get(), easy_.get());
+}
+
+// Only the loop ever pauses or resumes the transfer, so this is the one place
+// it resumes, as soon as the stages have made room and the rate limiter's
+// bucket has refilled.
+void EventLoopInstall::resumeDownload() {
+  const bool throttled = throttled_until_ != Clock::time_point{};
+  if ((!paused_ && !throttled) || (paused_ && download_.size() > low_watermark_) ||
+      (throttled && Clock::now() < throttled_until_)) {
+    return;
+  }
+  if (paused_ && metrics_ != nullptr && paused_since_ != Clock::time_point{}) {
+    metrics_->stage(Stage::kQueueWait).record(Clock::now() - paused_since_);
+  }
+  paused_ = false;
+  throttled_until_ = Clock::time_point{};
+  curl_easy_pause(easy_.get(), CURLPAUSE_CONT);
+}
+
+// Pauses the transfer, if it is not paused already, and stops writing to
+// SWUpdate. resumeDownload() picks the transfer up again once the token lets
+// the loop go on and the ring has room.
+void EventLoopInstall::hold() {
+  if (transferring_ && !paused_) {
+    curl_easy_pause(easy_.get(), CURLPAUSE_ALL);
+    paused_ = true;
+  }
+  paused_since_ = Clock::time_point{};
+  last_callback_ = Clock::time_point{};
+  watch(install_fd_, 0);
+}
+
+void EventLoopInstall::readMessages() {
+  CURLMsg* message = nullptr;
+  int left = 0;
+  while ((message = curl_multi_info_read(multi_.get(), &left)) != nullptr) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+    const CURLcode result = message->data.result;
+    long code = 0;
+    curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+    if (connections_ != nullptr) {
+      connections_->recordTransfer(message->easy_handle);
+    }
+    curl_multi_remove_handle(multi_.get(), message->easy_handle);
+    transferring_ = false;
+    download_done_ = true;
+    if (failed_) {
+      continue;
+    }
+    if (result != CURLE_OK) {
+      fail(std::string(curl_easy_strerror(result)) + (code != 0 ? " (HTTP " + std::to_string(code) + ")" : ""));
+    } else if (received_ != expected_) {
+      fail("download ended after " + std::to_string(received_) + " of " + std::to_string(expected_) + " bytes");
+    }
+  }
+}
+
+void EventLoopInstall::sendInstall() {
+  while (gateOpen()) {
+    const char* data = nullptr;
+    const size_t len = install_.peek(&data, install_reader_);
+    if (len == 0) {
+      break;
+    }
+    ssize_t n = 0;
+    {
+      StageTimer timer(metrics_ != nullptr ? &metrics_->stage(Stage::kIpcWrite) : nullptr);
+      n = send(install_fd_, data, len, MSG_NOSIGNAL);
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      watch(install_fd_, EPOLLOUT);
+      return;
+    }
+    if (n < 0) {
+      fail(std::string("Could not write to SWUpdate: ") + std::strerror(errno));
+      return;
+    }
+    install_.consume(static_cast<size_t>(n), install_reader_);
+    if (metrics_ != nullptr) {
+      metrics_->addInstalled(static_cast<uint64_t>(n));
+    }
+  }
+  watch(install_fd_, 0);
+}
+
+// Closing the install connection ends the image for SWUpdate; before the
+// whole image is through, it makes SWUpdate abort the install.
+void EventLoopInstall::endStream() {
+  ipc_end(install_fd_);
+  install_fd_ = -1;
+  stream_end_ = Clock::now();
+  pollStatus();
+}
+
+// Stops the transfer and cuts the install stream short.
+void EventLoopInstall::abort() {
+  aborted_ = true;
+  if (transferring_) {
+    curl_multi_remove_handle(multi_.get(), easy_.get());
+    transferring_ = false;
+  }
+  download_done_ = true;
+  prefix_left_ = 0;
+  download_.close();
+  endStream();
+}
+
+void EventLoopInstall::fail(const std::string& error) {
+  if (error_.empty()) {
+    error_ = error;
+  }
+  failed_ = true;
+}
+
+void EventLoopInstall::watch(int fd, uint32_t events) {
+  if (fd == install_fd_) {
+    if (events == install_events_) {
+      return;
+    }
+    install_events_ = events;
+  }
+  epoll_event event{};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) != 0 && errno == ENOENT) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+// One status request on a connection of its own, as SWUpdate answers one
+// request per connection.
+void EventLoopInstall::pollStatus() {
+  status_fd_ = socket(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_LOCAL;
+  std::strncpy(addr.sun_path, get_ctrl_socket(), sizeof(addr.sun_path) - 1);
+  if (status_fd_ < 0 || connect(status_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    const bool busy = errno == EAGAIN;
+    if (status_fd_ >= 0) {
+      close(status_fd_);
+      status_fd_ = -1;
+    }
+    if (busy) {
+      status_deadline_ = Clock::now() + kStatusPollInterval;
+    } else {
+      finishStatusPoll(false);
+    }
+    return;
+  }
+  status_ = ipc_message{};
+  status_.magic = IPC_MAGIC;
+  status_.type = GET_STATUS;
+  status_done_ = 0;
+  status_sent_ = false;
+  sendStatusRequest();
+}
+
+void EventLoopInstall::sendStatusRequest() {
+  while (status_done_ < sizeof(status_)) {
+    const ssize_t n = send(status_fd_, reinterpret_cast<const char*>(&status_) + status_done_,
+                           sizeof(status_) - status_done_, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      watch(status_fd_, EPOLLOUT);
+      return;
+    }
+    if (n < 0) {
+      finishStatusPoll(false);
+      return;
+    }
+    status_done_ += static_cast<size_t>(n);
+  }
+  status_ = ipc_message{};
+  status_done_ = 0;
+  status_sent_ = true;
+  watch(status_fd_, EPOLLIN);
+}
+
+// Acts on a reply like ipc_wait_for_complete() does: a new state or a message
+// is passed on and the status polled again right away, anything else is
+// polled again a second later, until SWUpdate is idle again.
+void EventLoopInstall::readStatusReply() {
+  while (status_done_ < sizeof(status_)) {
+    const ssize_t n =
+        read(status_fd_, reinterpret_cast<char*>(&status_) + status_done_, sizeof(status_) - status_done_);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n <= 0) {
+      finishStatusPoll(false);
+      return;
+    }
+    status_done_ += static_cast<size_t>(n);
+  }
+  close(status_fd_);
+  status_fd_ = -1;
+  const int current = status_.data.status.current;
+  if (current != last_status_ || status_.data.status.desc[0] != '\0') {
+    if (on_status_ != nullptr) {
+      on_status_(&status_);
+    }
+    status_deadline_ = Clock::now();
+  } else {
+    status_deadline_ = Clock::now() + kStatusPollInterval;
+  }
+  last_status_ = current;
+  if (current == IDLE) {
+    finishStatusPoll(true);
+  }
+}
+
+void EventLoopInstall::finishStatusPoll(bool ok) {
+  if (status_fd_ >= 0) {
+    close(status_fd_);
+    status_fd_ = -1;
+  }
+  status_deadline_ = Clock::time_point{};
+  result_ = ok ? static_cast<RECOVERY_STATUS>(status_.data.status.last_result) : FAILURE;
+  finished_ = true;
+}
+
+int EventLoopInstall::SocketHandler(CURL* easy, curl_socket_t socket, int what, void* userp, void* socketp) {
+  (void)easy;
+  (void)socketp;
+  auto* self = static_cast<EventLoopInstall*>(userp);
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(self->epoll_fd_, EPOLL_CTL_DEL, socket, nullptr);
+    return 0;
+  }
+  uint32_t events = 0;
+  if ((what & CURL_POLL_IN) != 0) {
+    events |= EPOLLIN;
+  }
+  if ((what & CURL_POLL_OUT) != 0) {
+    events |= EPOLLOUT;
+  }
+  self->watch(socket, events);
+  return 0;
+}
+
+int EventLoopInstall::TimerHandler(CURLM* multi, long timeout_ms, void* userp) {
+  (void)multi;
+  auto* self = static_cast<EventLoopInstall*>(userp);
+  self->curl_deadline_ =
+      timeout_ms < 0 ? Clock::time_point{} : Clock::now() + std::chrono::milliseconds(timeout_ms);
+  return 0;
+}
+
+// Like DownloadHandler, except that there is no waiting for room: the loop
+// that drains the ring resumes the transfer as soon as there is some.
+size_t EventLoopInstall::WriteHandler(char* contents, size_t size, size_t nmemb, void* userp) {
+  auto* self = static_cast<EventLoopInstall*>(userp);
+  const auto called = Clock::now();
+  if (self->metrics_ != nullptr && self->last_callback_ != Clock::time_point{}) {
+    self->metrics_->stage(Stage::kNetworkWait).record(called - self->last_callback_);
+  }
+  StageTimer timer(self->metrics_ != nullptr ? &self->metrics_->stage(Stage::kCurlCallback) : nullptr);
+  const size_t len = size * nmemb;
+  if (self->failed_ || self->received_ + len > self->expected_) {
+    return len + 1;  // curl will abort if return unexpected size;
+  }
+  if (self->download_.size() + len > self->high_watermark_) {
+    self->paused_ = true;
+    self->paused_since_ = called;
+    self->last_callback_ = Clock::time_point{};
+    return CURL_WRITEFUNC_PAUSE;
+  }
+  if (self->limiter_ != nullptr) {
+    const auto wait = self->limiter_->acquire(len);
+    if (wait != Clock::duration::zero()) {
+      self->throttled_until_ = called + wait;
+      self->last_callback_ = Clock::time_point{};
+      return CURL_WRITEFUNC_PAUSE;
+    }
+  }
+  if (self->on_data_) {
+    self->on_data_(contents, len);
+  }
+  self->download_.write(contents, len);
+  self->received_ += len;
+  if (self->metrics_ != nullptr) {
+    self->metrics_->addDownloaded(len);
+  }
+  self->last_callback_ = Clock::now();
+  return len;
+}
+
+int EventLoopInstall::ProgressHandler(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                                      curl_off_t ulnow) {
+  (void)dltotal;
+  (void)dlnow;
+  (void)ultotal;
+  (void)ulnow;
+  auto* self = static_cast<EventLoopInstall*>(clientp);
+  if (self->failed_) {
+    return 1;
+  }
+  if (self->on_tick_) {
+    self->on_tick_();
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+#ifndef SWUPDATE_POC_EVENT_LOOP_H_
+#define SWUPDATE_POC_EVENT_LOOP_H_
+
+#include <curl/curl.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+extern "C" {
+#include "network_ipc.h"
+}
+
+#include "connection_cache.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "ring_buffer.h"
+#include "utilities/apiqueue.h"
+
+// Runs a streaming install on the calling thread alone: one epoll loop drives
+// the download through curl's multi interface, writes the install stream to
+// SWUpdate's install socket and polls SWUpdate for the result, none of which
+// ever blocks.
+//
+// This replaces the thread blocked in the download, SWUpdate's reader thread
+// and the wait for its result, and the handoffs between them: the download
+// is paused and resumed directly by the loop that drains the ring, instead of
+// from curl's progress callback. All state lives in the object, so several
+// installs can run side by side.
+//
+// Stages reading the rings on their own threads, such as hashing and
+// decompression, stay as they are. They do not signal the loop, so while it
+// waits on one of them, i.e. for room in the download ring or for data in an
+// install ring it does not fill itself, the loop checks back every
+// millisecond. While SWUpdate is the slowest, the loop only waits for the
+// install socket to take more, so it wakes once per write rather than on a
+// timer.
+class EventLoopInstall {
+ public:
+  // Sees every chunk of the download before it is queued, e.g. to stage it.
+  using DataCallback = std::function<void(const char* data, size_t len)>;
+  // Called every now and then while downloading, e.g. to checkpoint.
+  using TickCallback = std::function<void()>;
+
+  // The download is queued in download; install is what goes to SWUpdate,
+  // the same ring without transport compression. Queueing stops at
+  // high_watermark bytes and the transfer resumes at low_watermark. failed
+  // is shared with the stages: any of them may set it to abort the install.
+  EventLoopInstall(RingBuffer& download, RingBuffer& install, size_t install_reader, size_t high_watermark,
+                   size_t low_watermark, std::atomic<bool>& failed);
+  ~EventLoopInstall();
+  EventLoopInstall(const EventLoopInstall&) = delete;
+  EventLoopInstall& operator=(const EventLoopInstall&) = delete;
+
+  // Queues length bytes read from fd, e.g. the staged prefix of a resumed
+  // download, ahead of the download. Takes ownership of fd.
+  void setPrefix(int fd, uint64_t length);
+  // Downloads bytes [from, length) of the image at url. Without a download
+  // the stream ends after the prefix.
+  void setDownload(const std::string& url, uint64_t from, uint64_t length, DataCallback on_data,
+                   TickCallback on_tick);
+  void setMetrics(PipelineMetrics* metrics) { metrics_ = metrics; }
+  // Takes the download's easy handle from cache, for its DNS and TLS session
+  // caches. The connection itself stays with the loop's multi handle. Set it
+  // before setDownload().
+  void setConnectionCache(ConnectionCache* cache) { connections_ = cache; }
+  // Shapes the download with limiter; the loop pauses the transfer while the
+  // bucket is short and resumes it on a timer.
+  void setRateLimiter(RateLimiter* limiter) { limiter_ = limiter; }
+  // Holds the install stream back until *gate is set by a stage, e.g. once
+  // it has checked the image's sw-description. The loop polls it like the
+  // stages' rings.
+  void setInstallGate(const std::atomic<bool>* gate) { gate_ = gate; }
+  // Pauses the download and the install stream while token is paused, and
+  // cuts both short once it is aborted. The loop polls it every few
+  // milliseconds while paused.
+  void setFlowControl(const api::FlowControlToken* token) { flow_control_ = token; }
+
+  // Streams the image into install_fd, an install connection opened with
+  // ipc_inst_start_ext(), closes it and waits for SWUpdate to finish. Takes
+  // ownership of install_fd. Status messages go to on_status, as with
+  // ipc_wait_for_complete(). Returns SWUpdate's result.
+  RECOVERY_STATUS run(int install_fd, getstatus on_status);
+
+  // Why the stream was cut short; empty if it was not.
+  const std::string& error() const { return error_; }
+  // When the whole stream, or as much as was sent of a failed one, was
+  // through to SWUpdate.
+  std::chrono::steady_clock::time_point streamEnd() const { return stream_end_; }
+
+ private:
+  static int SocketHandler(CURL* easy, curl_socket_t socket, int what, void* userp, void* socketp);
+  static int TimerHandler(CURLM* multi, long timeout_ms, void* userp);
+  static size_t WriteHandler(char* contents, size_t size, size_t nmemb, void* userp);
+  static int ProgressHandler(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                             curl_off_t ulnow);
+
+  void step();
+  int timeoutMs() const;
+  void fillPrefix();
+  void startDownload();
+  void resumeDownload();
+  void readMessages();
+  void sendInstall();
+  void endStream();
+  void abort();
+  void hold();
+  bool gateOpen() const { return gate_ == nullptr || gate_->load(std::memory_order_acquire); }
+  void fail(const std::string& error);
+  void watch(int fd, uint32_t events);
+  void pollStatus();
+  void sendStatusRequest();
+  void readStatusReply();
+  void finishStatusPoll(bool ok);
+
+  RingBuffer& download_;
+  RingBuffer& install_;
+  const size_t install_reader_;
+  const size_t high_watermark_;
+  const size_t low_watermark_;
+  std::atomic<bool>& failed_;
+  PipelineMetrics* metrics_{nullptr};
+  ConnectionCache* connections_{nullptr};
+  RateLimiter* limiter_{nullptr};
+  const std::atomic<bool>* gate_{nullptr};
+  const api::FlowControlToken* flow_control_{nullptr};
+  const int epoll_fd_;
+
+  int prefix_fd_{-1};
+  uint64_t prefix_left_{0};
+
+  std::unique_ptr<CURLM, CURLMcode (*)(CURLM*)> multi_;
+  CurlHandler easy_;
+  DataCallback on_data_;
+  TickCallback on_tick_;
+  uint64_t received_{0};
+  uint64_t expected_{0};
+  bool transferring_{false};
+  bool download_done_{false};
+  bool paused_{false};
+  // Set while the token holds everything back.
+  bool held_{false};
+  // When the transfer was paused for room in the ring; unset while it is
+  // held, so that a pause does not count as waiting for the stages.
+  std::chrono::steady_clock::time_point paused_since_;
+  std::chrono::steady_clock::time_point last_callback_;
+  // Until when the transfer is paused for the rate limiter; unset if not.
+  std::chrono::steady_clock::time_point throttled_until_;
+  // When curl wants to be called back without socket activity; unset if not.
+  std::chrono::steady_clock::time_point curl_deadline_;
+
+  int install_fd_{-1};
+  uint32_t install_events_{0};
+  bool aborted_{false};
+  std::chrono::steady_clock::time_point stream_end_;
+
+  getstatus on_status_{nullptr};
+  int status_fd_{-1};
+  ipc_message status_{};
+  size_t status_done_{0};
+  bool status_sent_{false};
+  int last_status_{IDLE};
+  std::chrono::steady_clock::time_point status_deadline_;
+  bool finished_{false};
+  RECOVERY_STATUS result_{FAILURE};
+  std::string error_;
+};
+
+#endif  // SWUPDATE_POC_EVENT_LOOP_H_
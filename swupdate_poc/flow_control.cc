@@ -0,0 +1,54 @@
+#include "flow_control.h"
+
+#include <pthread.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "logging/logging.h"
+
+SignalFlowControl::SignalFlowControl(api::FlowControlToken& token) : token_{token} {
+  sigemptyset(&signals_);
+  sigaddset(&signals_, SIGUSR1);
+  sigaddset(&signals_, SIGUSR2);
+  sigaddset(&signals_, SIGINT);
+  sigaddset(&signals_, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals_, &previous_);
+  thread_ = std::thread(&SignalFlowControl::run, this);
+}
+
+SignalFlowControl::~SignalFlowControl() {
+  stopping_ = true;
+  // Wakes the thread with a signal it takes anyway; resuming is harmless.
+  pthread_kill(thread_.native_handle(), SIGUSR2);
+  thread_.join();
+  pthread_sigmask(SIG_SETMASK, &previous_, nullptr);
+}
+
+void SignalFlowControl::run() {
+  for (;;) {
+    int signal = 0;
+    if (sigwait(&signals_, &signal) != 0 || stopping_) {
+      return;
+    }
+    switch (signal) {
+      case SIGUSR1:
+        if (token_.setPause(true)) {
+          LOG_INFO << "Update paused, send SIGUSR2 to resume";
+        }
+        break;
+      case SIGUSR2:
+        if (token_.setPause(false)) {
+          LOG_INFO << "Update resumed";
+        }
+        break;
+      default:
+        if (!token_.setAbort()) {
+          LOG_WARNING << "Second " << strsignal(signal) << ", exiting at once";
+          std::_Exit(EXIT_FAILURE);
+        }
+        LOG_INFO << "Aborting update on " << strsignal(signal);
+        break;
+    }
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef SWUPDATE_POC_FLOW_CONTROL_H_
+#define SWUPDATE_POC_FLOW_CONTROL_H_
+
+#include <signal.h>
+
+#include <atomic>
+#include <thread>
+
+#include "utilities/apiqueue.h"
+
+// Lets an operator steer a running update through token with signals:
+// SIGUSR1 pauses it, SIGUSR2 resumes it, and SIGINT or SIGTERM abort it. A
+// second SIGINT or SIGTERM exits at once, without cleaning up.
+//
+// The signals are blocked and taken with sigwait() on a thread of its own, so
+// the token is only ever touched from a normal thread and not from a signal
+// handler. Threads inherit the signal mask of the thread creating them, so
+// the object must be created before any other thread of the process, or a
+// signal may reach a thread that does not block it and take the default
+// action. The previous mask of the creating thread is restored on
+// destruction.
+class SignalFlowControl {
+ public:
+  explicit SignalFlowControl(api::FlowControlToken& token);
+  ~SignalFlowControl();
+  SignalFlowControl(const SignalFlowControl&) = delete;
+  SignalFlowControl& operator=(const SignalFlowControl&) = delete;
+
+ private:
+  void run();
+
+  api::FlowControlToken& token_;
+  sigset_t signals_{};
+  sigset_t previous_{};
+  std::atomic<bool> stopping_{false};
+  std::thread thread_;
+};
+
+#endif  // SWUPDATE_POC_FLOW_CONTROL_H_
@@ -0,0 +1,74 @@
+#include "hash_stage.h"
+
+#include <stdexcept>
+
+HashStage::~HashStage() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void HashStage::setBlockVerifier(std::unique_ptr<BlockVerifier> blocks,
+                                 std::function<void(const std::string&)> on_failure) {
+  blocks_ = std::move(blocks);
+  on_block_failure_ = std::move(on_failure);
+}
+
+void HashStage::start() { thread_ = std::thread(&HashStage::run, this); }
+
+const DigestResults& HashStage::wait() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  return results_;
+}
+
+void HashStage::setCheckpointInterval(uint64_t interval) {
+  if (blocks_ && interval % blocks_->blockSize() != 0) {
+    interval += blocks_->blockSize() - interval % blocks_->blockSize();
+  }
+  checkpoint_interval_ = interval;
+}
+
+bool HashStage::takeCheckpoint(HashCheckpoint* checkpoint) {
+  std::lock_guard<std::mutex> guard(checkpoint_mutex_);
+  if (!checkpoint_pending_) {
+    return false;
+  }
+  *checkpoint = checkpoint_;
+  checkpoint_pending_ = false;
+  return true;
+}
+
+void HashStage::publishCheckpoint(HashCheckpoint checkpoint) {
+  std::lock_guard<std::mutex> guard(checkpoint_mutex_);
+  checkpoint_ = std::move(checkpoint);
+  checkpoint_pending_ = true;
+}
+
+template <template <class> class Digest>
+static std::unique_ptr<HashStage> makeStage(RingBuffer& stream, size_t reader, bool sha256, bool sha512) {
+  if (sha256 && sha512) {
+    return std::unique_ptr<HashStage>(new MultiDigestStage<Digest, Sha256Algorithm, Sha512Algorithm>(stream, reader));
+  }
+  if (sha256) {
+    return std::unique_ptr<HashStage>(new MultiDigestStage<Digest, Sha256Algorithm>(stream, reader));
+  }
+  if (sha512) {
+    return std::unique_ptr<HashStage>(new MultiDigestStage<Digest, Sha512Algorithm>(stream, reader));
+  }
+  throw std::runtime_error("No hash algorithm to compute");
+}
+
+std::unique_ptr<HashStage> makeHashStage(RingBuffer& stream, size_t reader, const std::set<std::string>& algorithms,
+                                         bool resumable) {
+  const bool sha256 = algorithms.count(Sha256Algorithm::kName) != 0;
+  const bool sha512 = algorithms.count(Sha512Algorithm::kName) != 0;
+  if (algorithms.size() != static_cast<size_t>(sha256) + static_cast<size_t>(sha512)) {
+    throw std::runtime_error("Unsupported hash algorithm");
+  }
+  if (resumable) {
+    return makeStage<ResumableDigest>(stream, reader, sha256, sha512);
+  }
+  return makeStage<EvpAlgorithmDigest>(stream, reader, sha256, sha512);
+}
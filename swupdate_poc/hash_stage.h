@@ -0,0 +1,193 @@
+#ifndef SWUPDATE_POC_HASH_STAGE_H_
+#define SWUPDATE_POC_HASH_STAGE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "block_verifier.h"
+#include "digest.h"
+#include "metrics.h"
+#include "ring_buffer.h"
+
+// Digest midstates of the stream up to offset.
+struct HashCheckpoint {
+  uint64_t offset{0};
+  DigestStates states;
+};
+
+// Pipeline stage hashing the download stream on its own thread.
+//
+// The stage is one reader of the stream ring, so it digests the very bytes
+// SWUpdate is fed, in place, while the curl callback goes straight back to the
+// socket. It stops once the producer has closed the ring and it has hashed
+// everything.
+//
+// Every algorithm the target metadata lists is computed in the same pass;
+// makeHashStage() picks the matching compile-time specialisation once, so the
+// per-chunk loop has no dispatch.
+class HashStage {
+ public:
+  virtual ~HashStage();
+  HashStage(const HashStage&) = delete;
+  HashStage& operator=(const HashStage&) = delete;
+
+  // Also checks the stream against a per-block manifest. On the first bad
+  // block the stage stops and calls on_failure with a description. Must be
+  // set before start().
+  void setBlockVerifier(std::unique_ptr<BlockVerifier> blocks, std::function<void(const std::string&)> on_failure);
+
+  // Checkpointing, for stages created with resumable digests. The stage saves
+  // its midstates every interval bytes of the stream; takeCheckpoint()
+  // collects them. With a block manifest the interval is rounded up to whole
+  // blocks, so that block verification can resume too. Must be called after
+  // setBlockVerifier().
+  void setCheckpointInterval(uint64_t interval);
+  // Records the time spent on each chunk. Must be set before start().
+  void setLatencyHistogram(LatencyHistogram* latency) { latency_ = latency; }
+  // Stops the stage as soon as *cancel is set, e.g. when the update is
+  // aborted, instead of hashing what is left in the ring. The digests are
+  // then incomplete. Must be set before start().
+  void setCancel(const std::atomic<bool>* cancel) { cancel_ = cancel; }
+  // Continues from a checkpoint of an earlier run: the digests start from its
+  // midstates and the first checkpoint.offset bytes of the stream, hashed
+  // back then, are skipped. Returns false if the midstates do not fit this
+  // stage. Must be called before start().
+  virtual bool resumeFrom(const HashCheckpoint& checkpoint) = 0;
+  // Returns true and fills checkpoint if one was taken since the last call.
+  bool takeCheckpoint(HashCheckpoint* checkpoint);
+
+  void start();
+  // Waits for the end of the stream, or for a block failure, and returns the
+  // hex digests.
+  const DigestResults& wait();
+
+ protected:
+  HashStage(RingBuffer& stream, size_t reader) : stream_{stream}, reader_{reader} {}
+
+  // Feeds the stream to fn(data, len, end), end being the stream offset after
+  // the chunk, until the ring is drained or fn returns false. Bytes before the
+  // resume offset are skipped, and chunks are split at checkpoint boundaries.
+  template <class Fn>
+  void drain(Fn&& fn) {
+    Backoff backoff;
+    uint64_t position = 0;
+    for (;;) {
+      if (cancel_ != nullptr && cancel_->load(std::memory_order_relaxed)) {
+        return;
+      }
+      const char* data = nullptr;
+      size_t len = stream_.peek(&data, reader_);
+      if (len == 0) {
+        if (stream_.drained(reader_)) {
+          return;
+        }
+        backoff.pause();
+        continue;
+      }
+      backoff.reset();
+      if (position < resume_offset_) {
+        len = static_cast<size_t>(std::min<uint64_t>(len, resume_offset_ - position));
+      } else {
+        if (checkpoint_interval_ != 0) {
+          len = static_cast<size_t>(std::min<uint64_t>(len, checkpoint_interval_ - position % checkpoint_interval_));
+        }
+        bool more = false;
+        {
+          StageTimer timer(latency_);
+          more = fn(data, len, position + len);
+        }
+        if (!more) {
+          return;
+        }
+      }
+      position += len;
+      stream_.consume(len, reader_);
+    }
+  }
+  bool atCheckpoint(uint64_t position) const {
+    return checkpoint_interval_ != 0 && position % checkpoint_interval_ == 0;
+  }
+
+  bool checkBlocks(const char* data, size_t len) {
+    if (!blocks_ || blocks_->update(data, len)) {
+      return true;
+    }
+    on_block_failure_("block " + std::to_string(blocks_->failedBlock()) + " (offset " +
+                      std::to_string(blocks_->failedBlock() * blocks_->blockSize()) + ") does not match its manifest");
+    return false;
+  }
+  bool resumeBlocks(uint64_t offset) {
+    resume_offset_ = offset;
+    return !blocks_ || blocks_->resumeAt(offset);
+  }
+  void publishCheckpoint(HashCheckpoint checkpoint);
+
+  virtual void run() = 0;
+
+  DigestResults results_;
+
+ private:
+  RingBuffer& stream_;
+  const size_t reader_;
+  std::unique_ptr<BlockVerifier> blocks_;
+  std::function<void(const std::string&)> on_block_failure_;
+  uint64_t checkpoint_interval_{0};
+  uint64_t resume_offset_{0};
+  LatencyHistogram* latency_{nullptr};
+  const std::atomic<bool>* cancel_{nullptr};
+  std::mutex checkpoint_mutex_;
+  HashCheckpoint checkpoint_;
+  bool checkpoint_pending_{false};
+  std::thread thread_;
+};
+
+template <template <class> class Digest, class... Algorithms>
+class MultiDigestStage : public HashStage {
+ public:
+  MultiDigestStage(RingBuffer& stream, size_t reader) : HashStage(stream, reader) {}
+  ~MultiDigestStage() override { wait(); }
+
+  bool resumeFrom(const HashCheckpoint& checkpoint) override {
+    if constexpr (MultiDigest<Digest, Algorithms...>::kResumable) {
+      return digest_.restoreState(checkpoint.states) && resumeBlocks(checkpoint.offset);
+    } else {
+      (void)checkpoint;
+      return false;
+    }
+  }
+
+ protected:
+  void run() override {
+    drain([this](const char* data, size_t len, uint64_t end) {
+      digest_.update(data, len);
+      if (!checkBlocks(data, len)) {
+        return false;
+      }
+      if constexpr (MultiDigest<Digest, Algorithms...>::kResumable) {
+        if (atCheckpoint(end)) {
+          publishCheckpoint(HashCheckpoint{end, digest_.saveState()});
+        }
+      }
+      return true;
+    });
+    results_ = digest_.finish();
+  }
+
+ private:
+  MultiDigest<Digest, Algorithms...> digest_;
+};
+
+// Creates a stage computing the given algorithms ("sha256", "sha512"), with
+// resumable digests if it is going to be checkpointed or resumed. Throws
+// std::runtime_error for an empty or unsupported set.
+std::unique_ptr<HashStage> makeHashStage(RingBuffer& stream, size_t reader, const std::set<std::string>& algorithms,
+                                         bool resumable = false);
+
+#endif  // SWUPDATE_POC_HASH_STAGE_H_
@@ -0,0 +1,153 @@
+#include "image_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <ctime>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "logging/logging.h"
+
+namespace fs = boost::filesystem;
+
+// Images being copied into the cache; never served and swept on eviction.
+static const std::string kIncomingSuffix = ".incoming";
+// Downloads staged in the cache directory; never served, evicted or swept, as
+// they may be resumed.
+static const std::string kPartialSuffix = ".partial";
+
+ImageCache::ImageCache(std::string dir, uint64_t max_bytes) : dir_{std::move(dir)}, max_bytes_{max_bytes} {
+  fs::create_directories(dir_);
+}
+
+std::string ImageCache::key(const std::string& target_digest) {
+  std::string key = target_digest;
+  std::replace(key.begin(), key.end(), ':', '-');
+  key.erase(std::remove(key.begin(), key.end(), '/'), key.end());
+  return key;
+}
+
+std::string ImageCache::stagingPath(const std::string& key) const {
+  return (fs::path(dir_) / (key + kPartialSuffix)).string();
+}
+
+std::string ImageCache::lookup(const std::string& key) const {
+  const fs::path path = fs::path(dir_) / key;
+  boost::system::error_code ec;
+  if (!fs::is_regular_file(path, ec)) {
+    return "";
+  }
+  fs::last_write_time(path, std::time(nullptr), ec);
+  return path.string();
+}
+
+std::vector<std::string> ImageCache::images() const {
+  std::vector<std::string> images;
+  boost::system::error_code ec;
+  for (fs::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec)) {
+    const fs::path& path = it->path();
+    if (fs::is_regular_file(path, ec) && path.extension() != kIncomingSuffix && path.extension() != kPartialSuffix) {
+      images.push_back(path.string());
+    }
+  }
+  return images;
+}
+
+void ImageCache::remove(const std::string& key) const {
+  boost::system::error_code ec;
+  fs::remove(fs::path(dir_) / key, ec);
+}
+
+bool ImageCache::insert(const std::string& key, const std::string& file) {
+  boost::system::error_code ec;
+  const uint64_t size = fs::file_size(file, ec);
+  if (ec || size > max_bytes_) {
+    return false;
+  }
+  evict(size);
+  const fs::path target = fs::path(dir_) / key;
+  if (file == stagingPath(key)) {
+    fs::rename(file, target, ec);
+  } else {
+    // Copy under a temporary name, so a crash never leaves a truncated image
+    // that a later lookup would serve.
+    const fs::path incoming = target.string() + kIncomingSuffix;
+    fs::remove(incoming, ec);
+    fs::copy_file(file, incoming, ec);
+    if (!ec) {
+      fs::rename(incoming, target, ec);
+    }
+  }
+  if (ec) {
+    LOG_WARNING << "Could not add " << file << " to the image cache: " << ec.message();
+    return false;
+  }
+  fs::last_write_time(target, std::time(nullptr), ec);
+  return true;
+}
+
+void ImageCache::evict(uint64_t incoming) const {
+  struct Entry {
+    std::time_t used;
+    uint64_t size;
+    fs::path path;
+  };
+  std::vector<Entry> entries;
+  uint64_t total = incoming;
+  boost::system::error_code ec;
+  for (fs::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec)) {
+    const fs::path& path = it->path();
+    if (!fs::is_regular_file(path, ec)) {
+      continue;
+    }
+    if (path.extension() == kIncomingSuffix) {
+      fs::remove(path, ec);  // left over from a crash
+      continue;
+    }
+    if (path.extension() == kPartialSuffix) {
+      continue;
+    }
+    Entry entry{fs::last_write_time(path, ec), fs::file_size(path, ec), path};
+    total += entry.size;
+    entries.push_back(std::move(entry));
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+  for (const auto& entry : entries) {
+    if (total <= max_bytes_) {
+      break;
+    }
+    LOG_INFO << "Evicting " << entry.path.filename().string() << " from the image cache";
+    fs::remove(entry.path, ec);
+    total -= entry.size;
+  }
+}
+
+MappedImage::MappedImage(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::runtime_error("Could not open " + path);
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Could not map " + path);
+  }
+  // The image is consumed front to back: read ahead aggressively.
+  madvise(data, size_, MADV_SEQUENTIAL);
+  madvise(data, size_, MADV_WILLNEED);
+  data_ = static_cast<const char*>(data);
+}
+
+MappedImage::~MappedImage() { munmap(const_cast<char*>(data_), size_); }
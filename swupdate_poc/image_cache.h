@@ -0,0 +1,63 @@
+#ifndef SWUPDATE_POC_IMAGE_CACHE_H_
+#define SWUPDATE_POC_IMAGE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Local store of previously downloaded images, keyed by target digest, so a
+// reinstall, a rollback to the other A/B slot or repeated bench runs of the
+// same image need no network at all. Each image is one file named after its
+// key in the cache directory. Its modification time records the last use;
+// once the cache grows past its size limit the least recently used images
+// are evicted.
+class ImageCache {
+ public:
+  // Creates dir if needed.
+  ImageCache(std::string dir, uint64_t max_bytes);
+
+  const std::string& dir() const { return dir_; }
+  // File name of a target digest given as "<algorithm>:<hex>".
+  static std::string key(const std::string& target_digest);
+
+  // Path of the cached image for key, or "" on a miss. Counts as a use.
+  std::string lookup(const std::string& key) const;
+  // Where to stage a download of key so that insert() can just rename it.
+  std::string stagingPath(const std::string& key) const;
+  // Adds the complete image at file under key, renaming it when it is the
+  // stagingPath() and copying it otherwise, then evicts down to the size
+  // limit. An image larger than the whole cache is not added.
+  bool insert(const std::string& key, const std::string& file);
+  // Paths of all cached images, e.g. as seeds for a delta update. Does not
+  // count as a use.
+  std::vector<std::string> images() const;
+  // Drops the image, e.g. after it failed verification.
+  void remove(const std::string& key) const;
+
+ private:
+  void evict(uint64_t incoming) const;
+
+  const std::string dir_;
+  const uint64_t max_bytes_;
+};
+
+// Read-only memory mapping of a whole file, for handing a cached image to
+// SWUpdate straight from the page cache.
+class MappedImage {
+ public:
+  // Throws if the file cannot be mapped.
+  explicit MappedImage(const std::string& path);
+  ~MappedImage();
+  MappedImage(const MappedImage&) = delete;
+  MappedImage& operator=(const MappedImage&) = delete;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_{nullptr};
+  size_t size_{0};
+};
+
+#endif  // SWUPDATE_POC_IMAGE_CACHE_H_
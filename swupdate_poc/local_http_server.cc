@@ -0,0 +1,254 @@
+#include "local_http_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <csignal>
+#include <memory>
+#include <stdexcept>
+
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+LocalHttpServer::LocalHttpServer(std::string body) : body_{std::move(body)} {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    throw std::runtime_error("socket failed");
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd_, 64) != 0 ||
+      getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+    close(listen_fd_);
+    throw std::runtime_error("Could not listen on 127.0.0.1");
+  }
+  port_ = ntohs(addr.sin_port);
+  acceptor_ = std::thread(&LocalHttpServer::acceptLoop, this);
+}
+
+LocalHttpServer::~LocalHttpServer() {
+  stopping_ = true;
+  shutdown(listen_fd_, SHUT_RDWR);
+  acceptor_.join();
+  close(listen_fd_);
+  std::vector<std::thread> connections;
+  {
+    // Unblock handlers stuck sending to a client that stopped reading.
+    std::lock_guard<std::mutex> guard(connections_mutex_);
+    for (int fd : open_fds_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    connections.swap(connections_);
+  }
+  for (auto& connection : connections) {
+    connection.join();
+  }
+  SSL_CTX_free(tls_);
+}
+
+std::string LocalHttpServer::url() const {
+  // The certificate is for localhost, and TLS only sends names, not addresses.
+  const std::string origin = tls_ != nullptr ? "https://localhost:" : "http://127.0.0.1:";
+  return origin + std::to_string(port_) + "/image.swu";
+}
+
+void LocalHttpServer::enableTls() {
+  std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> keygen(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr),
+                                                                      EVP_PKEY_CTX_free);
+  EVP_PKEY* raw_key = nullptr;
+  if (!keygen || EVP_PKEY_keygen_init(keygen.get()) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keygen.get(), NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(keygen.get(), &raw_key) <= 0) {
+    throw std::runtime_error("Could not generate a TLS key");
+  }
+  std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(raw_key, EVP_PKEY_free);
+
+  std::unique_ptr<X509, decltype(&X509_free)> cert(X509_new(), X509_free);
+  X509_set_version(cert.get(), 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert.get()), -60);
+  X509_gmtime_adj(X509_getm_notAfter(cert.get()), 24 * 3600);
+  X509_NAME* name = X509_get_subject_name(cert.get());
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1,
+                             0);
+  X509_set_issuer_name(cert.get(), name);
+  X509_set_pubkey(cert.get(), key.get());
+  X509V3_CTX v3{};
+  X509V3_set_ctx(&v3, cert.get(), cert.get(), nullptr, nullptr, 0);
+  X509_EXTENSION* san = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name,
+                                            const_cast<char*>("DNS:localhost,IP:127.0.0.1"));
+  if (san == nullptr || X509_add_ext(cert.get(), san, -1) != 1 || X509_sign(cert.get(), key.get(), EVP_sha256()) == 0) {
+    X509_EXTENSION_free(san);
+    throw std::runtime_error("Could not make a TLS certificate");
+  }
+  X509_EXTENSION_free(san);
+
+  std::unique_ptr<BIO, decltype(&BIO_free)> pem(BIO_new(BIO_s_mem()), BIO_free);
+  PEM_write_bio_X509(pem.get(), cert.get());
+  char* data = nullptr;
+  const long len = BIO_get_mem_data(pem.get(), &data);
+  certificate_.assign(data, static_cast<size_t>(len));
+
+  tls_ = SSL_CTX_new(TLS_server_method());
+  if (tls_ == nullptr || SSL_CTX_use_certificate(tls_, cert.get()) != 1 ||
+      SSL_CTX_use_PrivateKey(tls_, key.get()) != 1) {
+    throw std::runtime_error("Could not set up TLS");
+  }
+  signal(SIGPIPE, SIG_IGN);
+}
+
+void LocalHttpServer::acceptLoop() {
+  while (!stopping_) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    std::lock_guard<std::mutex> guard(connections_mutex_);
+    open_fds_.insert(fd);
+    connections_.emplace_back(&LocalHttpServer::serve, this, fd);
+  }
+}
+
+static bool sendAll(int fd, SSL* ssl, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ssl != nullptr ? SSL_write(ssl, data, static_cast<int>(std::min<size_t>(len, INT_MAX)))
+                               : send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Parses "bytes=<first>-[<last>]" out of the request's Range header, if any.
+static bool parseRange(std::string request, uint64_t size, uint64_t* first, uint64_t* last) {
+  std::transform(request.begin(), request.end(), request.begin(), ::tolower);
+  const std::string header = "\r\nrange: bytes=";
+  size_t pos = request.find(header);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos += header.size();
+  size_t dash = request.find('-', pos);
+  size_t eol = request.find("\r\n", pos);
+  *first = std::stoull(request.substr(pos, dash - pos));
+  std::string end = request.substr(dash + 1, eol - dash - 1);
+  *last = end.empty() ? size - 1 : std::min<uint64_t>(std::stoull(end), size - 1);
+  return true;
+}
+
+void LocalHttpServer::closeConnection(int fd) {
+  std::lock_guard<std::mutex> guard(connections_mutex_);
+  open_fds_.erase(fd);
+  close(fd);
+}
+
+void LocalHttpServer::serve(int fd) {
+  ++connections_accepted_;
+  SSL* ssl = nullptr;
+  if (tls_ != nullptr) {
+    ssl = SSL_new(tls_);
+    if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+      SSL_free(ssl);
+      closeConnection(fd);
+      return;
+    }
+    if (SSL_session_reused(ssl) != 0) {
+      ++resumed_sessions_;
+    }
+  }
+
+  std::string pending;
+  char buf[4096];
+  bool open = true;
+  while (open && !stopping_) {
+    size_t end;
+    while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+      const ssize_t n = ssl != nullptr ? SSL_read(ssl, buf, sizeof(buf)) : recv(fd, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        break;
+      }
+      pending.append(buf, static_cast<size_t>(n));
+    }
+    if (end == std::string::npos) {
+      break;
+    }
+    const std::string request = pending.substr(0, end + 4);
+    pending.erase(0, end + 4);
+    open = respond(fd, ssl, request) && keep_alive_;
+  }
+  SSL_free(ssl);
+  closeConnection(fd);
+}
+
+// Sends the response to request, returning false if the connection broke.
+bool LocalHttpServer::respond(int fd, SSL* ssl, const std::string& request) {
+  ++requests_;
+  std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms_.load()));
+
+  const std::string connection = keep_alive_ ? "" : "Connection: close\r\n";
+  uint64_t first = 0;
+  uint64_t last = body_.size() - 1;
+  std::string headers;
+  if (parseRange(request, body_.size(), &first, &last)) {
+    if (first >= body_.size()) {
+      headers = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n" + connection + "\r\n";
+      return sendAll(fd, ssl, headers.data(), headers.size());
+    }
+    headers = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(first) + "-" +
+              std::to_string(last) + "/" + std::to_string(body_.size()) + "\r\n";
+  } else {
+    headers = "HTTP/1.1 200 OK\r\n";
+  }
+  headers += "Content-Length: " + std::to_string(last - first + 1) + "\r\n" + connection + "\r\n";
+
+  bool ok = sendAll(fd, ssl, headers.data(), headers.size());
+  const size_t kSlice = 64 * 1024;
+  auto start = std::chrono::steady_clock::now();
+  uint64_t sent = 0;
+  const uint64_t cut_at = cut_at_;
+  const uint64_t stall_at = stall_at_;
+  size_t len = 0;
+  for (uint64_t pos = first; ok && pos <= last && !stopping_; pos += len) {
+    len = static_cast<size_t>(std::min<uint64_t>(kSlice, last + 1 - pos));
+    if (stall_at != 0 && pos == stall_at) {
+      const auto resume = std::chrono::steady_clock::now() + std::chrono::milliseconds(stall_ms_.load());
+      while (!stopping_ && std::chrono::steady_clock::now() < resume) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      start += std::chrono::milliseconds(stall_ms_.load());  // not to be made up for by the rate cap
+    }
+    // Slices end at the cut and stall offsets, so that both hit them exactly.
+    for (uint64_t offset : {cut_at, stall_at}) {
+      if (offset > pos && offset < pos + len) {
+        len = static_cast<size_t>(offset - pos);
+      }
+    }
+    if (cut_at != 0 && pos == cut_at) {
+      return false;
+    }
+    ok = sendAll(fd, ssl, body_.data() + pos, len);
+    if (ok) {
+      bytes_sent_ += len;
+    }
+    if (ok && send_observer_) {
+      send_observer_(pos + len);
+    }
+    sent += len;
+    const uint64_t rate = rate_;
+    if (rate != 0) {
+      std::this_thread::sleep_until(start + std::chrono::microseconds(sent * 1000000 / rate));
+    }
+  }
+  return ok && !stopping_;
+}
@@ -0,0 +1,95 @@
+#ifndef SWUPDATE_POC_LOCAL_HTTP_SERVER_H_
+#define SWUPDATE_POC_LOCAL_HTTP_SERVER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+// Minimal HTTP/1.1 server on 127.0.0.1 serving one in-memory image under any
+// path, for tests and benchmarks of the download pipeline. It honours
+// "Range: bytes=<first>-[<last>]" and can inject a delay before every
+// response and cap the transfer rate of each connection, to mimic a distant
+// or slow storage backend, or cut or stall responses mid-stream, to mimic a
+// failing one. Every connection serves a single request, unless
+// keep-alive is on. It can serve over TLS, to test session resumption.
+class LocalHttpServer {
+ public:
+  explicit LocalHttpServer(std::string body);
+  ~LocalHttpServer();
+  LocalHttpServer(const LocalHttpServer&) = delete;
+  LocalHttpServer& operator=(const LocalHttpServer&) = delete;
+
+  // Delay between receiving a request and sending the response headers.
+  void setLatency(std::chrono::milliseconds latency) { latency_ms_ = latency.count(); }
+  // Per-connection rate cap in bytes per second, 0 for none.
+  void setRate(uint64_t bytes_per_second) { rate_ = bytes_per_second; }
+  // Every response reaching image offset offset closes the connection there;
+  // 0 for none.
+  void setCutAt(uint64_t offset) { cut_at_ = offset; }
+  // Every response reaching image offset offset stops sending there for
+  // stall; 0 for none.
+  void setStallAt(uint64_t offset, std::chrono::milliseconds stall) {
+    stall_ms_ = stall.count();
+    stall_at_ = offset;
+  }
+  // Called from the connection threads with the image offset just past each
+  // slice of the body once it is handed to the socket. Set it before the
+  // first request; it must be thread-safe.
+  using SendObserver = std::function<void(uint64_t end_offset)>;
+  void setSendObserver(SendObserver observer) { send_observer_ = std::move(observer); }
+  // Serves any number of requests on a connection instead of one.
+  void setKeepAlive(bool keep_alive) { keep_alive_ = keep_alive; }
+  // Serves HTTPS with a fresh self-signed certificate for localhost and
+  // 127.0.0.1, which clients have to trust, see certificate(). Call before
+  // the first request. Ignores SIGPIPE, which OpenSSL cannot avoid raising
+  // when a client goes away.
+  void enableTls();
+  const std::string& certificate() const { return certificate_; }
+
+  uint16_t port() const { return port_; }
+  std::string url() const;
+  unsigned int requests() const { return requests_; }
+  unsigned int connections() const { return connections_accepted_; }
+  // TLS handshakes that resumed a session.
+  unsigned int resumedSessions() const { return resumed_sessions_; }
+  // Body bytes handed to sockets so far, including any a client cut off.
+  uint64_t bytesSent() const { return bytes_sent_; }
+
+ private:
+  void acceptLoop();
+  void serve(int fd);
+  bool respond(int fd, SSL* ssl, const std::string& request);
+  void closeConnection(int fd);
+
+  const std::string body_;
+  std::atomic<int64_t> latency_ms_{0};
+  std::atomic<uint64_t> rate_{0};
+  std::atomic<uint64_t> cut_at_{0};
+  std::atomic<uint64_t> stall_at_{0};
+  std::atomic<int64_t> stall_ms_{0};
+  std::atomic<bool> keep_alive_{false};
+  SSL_CTX* tls_{nullptr};
+  std::string certificate_;
+  std::atomic<unsigned int> requests_{0};
+  std::atomic<unsigned int> connections_accepted_{0};
+  std::atomic<unsigned int> resumed_sessions_{0};
+  std::atomic<uint64_t> bytes_sent_{0};
+  SendObserver send_observer_;
+  std::atomic<bool> stopping_{false};
+  int listen_fd_{-1};
+  uint16_t port_{0};
+  std::thread acceptor_;
+  std::mutex connections_mutex_;
+  std::vector<std::thread> connections_;
+  std::set<int> open_fds_;
+};
+
+#endif  // SWUPDATE_POC_LOCAL_HTTP_SERVER_H_
@@ -1,21 +1,36 @@
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <pthread.h>
 #include "json/json.h"
 // #include "libaktualizr/packagemanagerinterface.h"
 #include "libaktualizr/packagemanagerfactory.h"
 // #include "libaktualizr/config.h"
-#include "http/httpclient.h"
+#include "http/httpinterface.h"
 // #include "storage/invstorage.h"
 
 extern "C" {
 #include "network_ipc.h"
 }
 
+#include <fcntl.h>
+#include <sys/resource.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "crypto/crypto.h"
 #include "crypto/keymanager.h"
@@ -24,52 +39,490 @@ extern "C" {
 #include "uptane/fetcher.h"
 #include "utilities/apiqueue.h"
 
+#include "block_verifier.h"
+#include "chunk_store.h"
+#include "connection_cache.h"
+#include "decompress_stage.h"
+#include "digest.h"
+#include "download_checkpoint.h"
+#include "event_loop.h"
+#include "flow_control.h"
+#include "hash_stage.h"
+#include "image_cache.h"
+#include "metrics.h"
+#include "mirror_download.h"
+#include "parallel_download.h"
+#include "progress_reporter.h"
+#include "rate_limiter.h"
+#include "ring_buffer.h"
+#include "splice_transfer.h"
+#include "staging_writer.h"
+#include "swu_stage.h"
+#include "swupdate_poc.h"
+#include "targets_index.h"
+#include "update_scheduler.h"
+
+namespace bpo = boost::program_options;
+
+// Command line settings, see main().
+struct PipelineOptions {
+  // Pick these targets out of Uptane targets metadata, instead of taking the
+  // --target file as a single target. Several are updated as one campaign,
+  // see updateTargets().
+  std::vector<std::string> target_names;
+  // Most targets of a campaign downloaded at once; the memory budget may
+  // allow fewer.
+  unsigned int concurrent_targets{4};
+  // If set, the target must be meant for this hardware ID, and the image's
+  // sw-description must have a section for it if it has any board sections.
+  std::string hardware_id;
+  // If set, must be in the hardware-compatibility of the image's sw-description.
+  std::string hardware_revision;
+  // On-disk index of the targets metadata, built on first use.
+  std::string targets_index;
+  // Keep an on-disk copy of the image here; empty for a pure streaming install.
+  std::string staging_file;
+  // Persist download progress here so that an interrupted download resumes.
+  std::string checkpoint_file;
+  uint64_t checkpoint_interval{16 * 1024 * 1024};
+  // More than one fetches the image over that many Range connections.
+  unsigned int connections{1};
+  size_t segment_size{4 * 1024 * 1024};
+  // Splice plain-HTTP and file:// downloads straight into the install socket.
+  bool zero_copy{true};
+  // Drive the download and SWUpdate's IPC from one event loop, see
+  // EventLoopInstall.
+  bool event_loop{false};
+  // Keep TLS sessions here so that the next run resumes them.
+  std::string tls_session_file;
+  // Keep verified images here, keyed by digest, and install from them on a hit.
+  std::string cache_dir;
+  uint64_t cache_size{4ULL * 1024 * 1024 * 1024};
+  // Local copies of earlier images, e.g. the running rootfs partition, to
+  // take chunks from for a delta update.
+  std::vector<std::string> seeds;
+  // Threads decoding a compressed image made of independent frames.
+  unsigned int decode_threads{std::max(std::thread::hardware_concurrency(), 1U)};
+  // Bound on the buffers the pipeline allocates, see fixedBufferSize().
+  uint64_t memory_budget{64 * 1024 * 1024};
+  // Write per-stage latency histograms here, every metrics_interval while the
+  // update runs and once at its end; Prometheus text if it ends in ".prom".
+  std::string metrics_file;
+  std::chrono::milliseconds metrics_interval{5000};
+  // Least time between two progress reports.
+  std::chrono::milliseconds progress_interval{1000};
+  // Download, verify and stage the image without installing it, at low
+  // priority; install it later with install_staged, off local storage only.
+  bool prefetch{false};
+  bool install_staged{false};
+  // CPU priority of a prefetch, as a nice level.
+  int prefetch_nice{19};
+  // Cap on the download rate, in bytes per second, 0 for none, the bytes
+  // that may go over it in a burst, and time-of-day windows with a cap of
+  // their own. See RateLimiter.
+  uint64_t max_rate{0};
+  uint64_t rate_burst{1024 * 1024};
+  std::vector<RateLimiter::Window> rate_schedule;
+  // Further URLs of the image, after --url if given and before those the
+  // target lists, see selectMirrors().
+  std::vector<std::string> mirrors;
+  // Request the rest of the image from the next mirror as well once a
+  // download delivered nothing for this long; 0 never does.
+  std::chrono::milliseconds hedge_after{1000};
+};
+static PipelineOptions options;
+static PipelineMetrics metrics;
+// Pauses, resumes and aborts the update, see SignalFlowControl.
+static api::FlowControlToken flow_control;
+
+// How long a mirror has to answer the probe of selectMirrors().
+static constexpr std::chrono::milliseconds kMirrorProbeTimeout{2000};
+
+// Room for a few seconds of download ahead of the install; sized so the whole
+// image never has to be held in memory or staged on disk.
+static constexpr size_t kStreamBufferSize = 4 * 1024 * 1024;
+// Flow control: the transfer is paused once this much is queued for the
+// install side and resumed when it has drained down to the low watermark.
+// The gap between the two leaves room for the ~1 s granularity of curl's
+// progress callback, which is where the transfer gets resumed.
+static constexpr size_t kStreamHighWatermark = kStreamBufferSize / 4 * 3;
+static constexpr size_t kStreamLowWatermark = kStreamBufferSize / 4;
+// How long the write callback waits for the install side before pausing.
+static constexpr std::chrono::milliseconds kStreamPauseDelay{100};
+// The event loop resumes the transfer itself as soon as the stages have made
+// room, so it only leaves room for a few curl writes below the high watermark.
+static constexpr size_t kEventLoopResumeRoom = 256 * 1024;
+// The chunk index is fetched into memory; a 1 GiB image has ~16k chunks.
+static constexpr int64_t kMaxChunkIndexSize = 16 * 1024 * 1024;
+// Local runs shorter than this between two downloads are downloaded too.
+static constexpr uint64_t kDeltaMinLocalRun = 256 * 1024;
+// Readers of the stream ring. With transport compression the download ring
+// feeds the decompress stage in place of the install, and the decompressed
+// ring has the same readers. The archive stage only reads the ring SWUpdate
+// is fed from, after the hash stage if that ring has one.
+static constexpr size_t kInstallReader = 0;
+static constexpr size_t kHashReader = 1;
+static constexpr size_t kArchiveReader = 2;
+static constexpr size_t kStreamReaders = 3;
+
+// Memory the pipeline allocates up front for an image, apart from the slabs
+// of frames decoded in parallel: the stream rings, the staging writer's
+// buffers and the segments of a parallel download. Nothing on the data path
+// allocates beyond these, so the target's share of options.memory_budget
+// minus this is what the decompress stage gets.
+static uint64_t fixedBufferSize(Compression compression) {
+  uint64_t size = kStreamBufferSize * (compression == Compression::kNone ? 1 : 2);
+  if (!options.staging_file.empty() || !options.cache_dir.empty()) {
+    size += StagingWriter::bufferSize();
+  }
+  if (options.connections > 1) {
+    size += ParallelDownloader::bufferSize(options.connections, options.segment_size);
+  }
+  return size;
+}
+
+static Compression targetCompression(const Uptane::Target& target) {
+  return compressionFromName(target.custom_data()["swupdate"]["compression"].asString());
+}
+
+// Digests the metadata lists for the image: the transport digests under
+// "hashes" and those of the decoded image under "custom.swupdate.rawHashes".
+// With compression, "hashes" covers the download and rawHashes the
+// decompressed image. Without it, the download is the image and only "hashes"
+// is checked; rawHashes is not used.
+static std::vector<ExpectedDigest> expectedDigests(const Uptane::Target& target, bool transport, bool raw) {
+  std::vector<ExpectedDigest> expected;
+  for (const auto& hash : target.hashes()) {
+    if (transport) {
+      expected.push_back({"hashes", hash.TypeString(), hash.HashString()});
+    }
+  }
+  const Json::Value raw_hashes = target.custom_data()["swupdate"]["rawHashes"];
+  if (raw && raw_hashes.isObject()) {
+    for (const auto& algorithm : raw_hashes.getMemberNames()) {
+      std::string value = raw_hashes[algorithm].asString();
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      expected.push_back({"custom.swupdate.rawHashes", algorithm, value});
+    }
+  }
+  return expected;
+}
+
+static std::set<std::string> digestAlgorithms(const std::vector<ExpectedDigest>& expected) {
+  std::set<std::string> algorithms;
+  for (const auto& digest : expected) {
+    algorithms.insert(digest.algorithm);
+  }
+  return algorithms;
+}
+
+// Optional per-block manifest in the target's custom metadata:
+//   "swupdate": {"blockHashes": {"blockSize": 1048576, "sha256": ["<hex>", ...]}}
+// Returns nullptr when the target has none.
+static std::unique_ptr<BlockVerifier> blockVerifier(const Uptane::Target& target) {
+  const Json::Value manifest = target.custom_data()["swupdate"]["blockHashes"];
+  if (!manifest.isObject()) {
+    return nullptr;
+  }
+  for (const char* algorithm : {Sha256Algorithm::kName, Sha512Algorithm::kName}) {
+    const Json::Value& digests = manifest[algorithm];
+    if (!digests.isArray()) {
+      continue;
+    }
+    std::vector<std::string> block_digests;
+    for (const auto& digest : digests) {
+      std::string value = digest.asString();
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      block_digests.push_back(value);
+    }
+    return std_::make_unique<BlockVerifier>(algorithm, manifest["blockSize"].asUInt64(), std::move(block_digests),
+                                            target.length());
+  }
+  throw std::runtime_error("Block hash manifest lists no supported algorithm");
+}
+
+// Whether value is a hex digest of algorithm, one the hash stages compute.
+// Returns what is wrong with it, or an empty string.
+static std::string digestError(const std::string& field, const std::string& algorithm, std::string value) {
+  size_t length = 0;
+  if (algorithm == Sha256Algorithm::kName) {
+    length = 64;
+  } else if (algorithm == Sha512Algorithm::kName) {
+    length = 128;
+  } else {
+    return field + " uses unsupported hash algorithm " + algorithm;
+  }
+  std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+  std::string raw;
+  if (value.size() != length || !fromHex(value, &raw)) {
+    return field + "." + algorithm + " is not a " + algorithm + " digest: " + value;
+  }
+  return std::string();
+}
+
+// Checks the metadata of a target the pipeline relies on before any of it
+// is set up: its compression, and that every digest it lists is for an
+// algorithm the hash stages compute and is hex of the right length, so that
+// a malformed target is rejected up front rather than failing the digest
+// check after the whole download. Returns what is wrong, or an empty string.
+static std::string targetMetadataError(const Uptane::Target& target) {
+  Compression compression = Compression::kNone;
+  try {
+    compression = targetCompression(target);
+  } catch (const std::exception& e) {
+    return e.what();
+  }
+  for (const auto& hash : target.hashes()) {
+    std::string error = digestError("hashes", hash.TypeString(), hash.HashString());
+    if (!error.empty()) {
+      return error;
+    }
+  }
+  const Json::Value swupdate = target.custom_data()["swupdate"];
+  const Json::Value& raw_hashes = swupdate["rawHashes"];
+  if (compression != Compression::kNone && !raw_hashes.isNull()) {
+    if (!raw_hashes.isObject()) {
+      return "custom.swupdate.rawHashes is not an object";
+    }
+    for (const auto& algorithm : raw_hashes.getMemberNames()) {
+      std::string error = digestError("custom.swupdate.rawHashes", algorithm, raw_hashes[algorithm].asString());
+      if (!error.empty()) {
+        return error;
+      }
+    }
+  }
+  const Json::Value& manifest = swupdate["blockHashes"];
+  if (manifest.isObject()) {
+    for (const char* algorithm : {Sha256Algorithm::kName, Sha512Algorithm::kName}) {
+      const Json::Value& digests = manifest[algorithm];
+      if (!digests.isArray()) {
+        continue;
+      }
+      const uint64_t block_size = manifest["blockSize"].asUInt64();
+      if (block_size == 0 || digests.size() != (target.length() + block_size - 1) / block_size) {
+        return "Block hash manifest does not match the image length";
+      }
+      for (const auto& digest : digests) {
+        std::string error = digestError("custom.swupdate.blockHashes", algorithm, digest.asString());
+        if (!error.empty()) {
+          return error;
+        }
+      }
+      return std::string();
+    }
+    return "Block hash manifest lists no supported algorithm";
+  }
+  return std::string();
+}
+
+static SwuRequirements swuRequirements() {
+  SwuRequirements requirements;
+  requirements.board = options.hardware_id;
+  requirements.revision = options.hardware_revision;
+  return requirements;
+}
+
+// Called on the archive stage's thread for every entry of the image.
+static void reportEntry(const SwuEntry& entry) {
+  LOG_INFO << "Image entry " << entry.name << ": " << entry.size << " bytes at offset " << entry.offset
+           << ", sha256 " << entry.sha256 << (entry.expected_sha256.empty() ? "" : ", as in sw-description");
+}
+
+// The update of one target: its pipeline and everything the download and
+// the install keep of it, so that several targets can be updated at once.
 struct DownloadMetaStruct {
  public:
-  DownloadMetaStruct(Uptane::Target target_in, FetcherProgressCb progress_cb_in, const api::FlowControlToken* token_in)
-      : hash_type{target_in.hashes()[0].type()},
+  DownloadMetaStruct(Uptane::Target target_in, FetcherProgressCb progress_cb_in, const api::FlowControlToken* token_in,
+                     uint64_t memory_budget_in, bool resumable = false)
+      : memory_budget{memory_budget_in},
+        compression{targetCompression(target_in)},
+        expected_digests{expectedDigests(target_in, true, false)},
+        raw_digests{expectedDigests(target_in, false, compression != Compression::kNone)},
         target{std::move(target_in)},
         token{token_in},
         progress_cb{std::move(progress_cb_in)},
-        time_lastreport{std::chrono::steady_clock::now()} {}
-  uintmax_t downloaded_length{0};
-  unsigned int last_progress{0};
-  std::ofstream fhandle;
-  const Hash::Type hash_type;
-  MultiPartHasher& hasher() {
-    switch (hash_type) {
-      case Hash::Type::kSha256:
-        return sha256_hasher;
-      case Hash::Type::kSha512:
-        return sha512_hasher;
-      default:
-        throw std::runtime_error("Unknown hash algorithm");
+        // With compression, the archive stage reads the decompressed ring.
+        stream{kStreamBufferSize, compression == Compression::kNone ? kStreamReaders : kStreamReaders - 1},
+        hash_stage{makeHashStage(stream, kHashReader, digestAlgorithms(expected_digests), resumable)} {
+    hash_stage->setLatencyHistogram(&metrics.stage(Stage::kHash));
+    hash_stage->setCancel(&failed);
+    auto blocks = blockVerifier(target);
+    if (blocks) {
+      hash_stage->setBlockVerifier(std::move(blocks), [this](const std::string& reason) {
+        std::fprintf(stderr, "Aborting update, corrupt image: %s\n", reason.c_str());
+        corrupt = true;
+        failed = true;
+      });
+    }
+    if (compression != Compression::kNone) {
+      // Without raw digests, the archive stage takes the hash reader's place.
+      decoded = std_::make_unique<RingBuffer>(kStreamBufferSize,
+                                              raw_digests.empty() ? kStreamReaders - 1 : kStreamReaders);
+      decompress = std_::make_unique<DecompressStage>(
+          stream, kInstallReader, *decoded, compression, options.decode_threads,
+          memory_budget - std::min(memory_budget, fixedBufferSize(compression)), failed,
+          [this](const std::string& reason) {
+            std::fprintf(stderr, "Aborting update, corrupt image: %s\n", reason.c_str());
+            corrupt = true;
+            failed = true;
+          });
+      decompress->setLatencyHistogram(&metrics.stage(Stage::kDecompress));
+      if (!raw_digests.empty()) {
+        raw_hash_stage = makeHashStage(*decoded, kHashReader, digestAlgorithms(raw_digests));
+        raw_hash_stage->setLatencyHistogram(&metrics.stage(Stage::kHash));
+        raw_hash_stage->setCancel(&failed);
+      }
+    }
+    archive = std_::make_unique<SwuStage>(
+        installStream(), decoded && raw_digests.empty() ? kHashReader : kArchiveReader, swuRequirements(), failed,
+        [this](const std::string& reason) {
+          std::fprintf(stderr, "Aborting update, rejected image: %s\n", reason.c_str());
+          corrupt = true;
+          failed = true;
+        });
+    archive->setEntryCallback(reportEntry);
+    archive->setLatencyHistogram(&metrics.stage(Stage::kArchive));
+    progress = std_::make_unique<ProgressReporter>(
+        downloaded_length, target.length(), options.progress_interval,
+        [this](const ProgressUpdate& update) { reportProgress(update); },
+        [](const std::string& message) { std::printf("%s\n", message.c_str()); });
+  }
+  DownloadMetaStruct(const DownloadMetaStruct&) = delete;
+  DownloadMetaStruct& operator=(const DownloadMetaStruct&) = delete;
+  // The stream SWUpdate is fed from.
+  RingBuffer& installStream() { return decoded ? *decoded : stream; }
+  // Starts the threads reading the stream.
+  void startStages() {
+    hash_stage->start();
+    if (decompress) {
+      decompress->start();
+    }
+    if (raw_hash_stage) {
+      raw_hash_stage->start();
+    }
+    archive->start();
+  }
+  // Every digest that does not match, once the stages have finished.
+  std::vector<std::string> digestMismatches() {
+    auto mismatches = ::digestMismatches(expected_digests, cached ? cached_digests : hash_stage->wait());
+    if (raw_hash_stage) {
+      for (auto& mismatch : ::digestMismatches(raw_digests, raw_hash_stage->wait())) {
+        mismatches.push_back(std::move(mismatch));
+      }
+    }
+    if (!archive->wait()) {
+      mismatches.push_back(archive->error());
     }
+    return mismatches;
   }
+  // Waits while the update is paused through token. Returns false, and fails
+  // the update, once it is aborted; and once it has failed otherwise.
+  bool proceed() {
+    if (token != nullptr && !token->canContinue()) {
+      failed = true;
+    }
+    return !failed;
+  }
+  bool pausedByOperator() const { return token != nullptr && !token->canContinue(false); }
+  bool abortedByOperator() const { return token != nullptr && token->hasAborted(); }
+  // Reporter thread only: hands progress to progress_cb and the log.
+  void reportProgress(const ProgressUpdate& update) {
+    if (progress_cb && update.percent > last_progress) {
+      last_progress = update.percent;
+      progress_cb(target, "Downloading", update.percent);
+    }
+    const std::string eta =
+        update.eta_seconds < 0 ? std::string("unknown") : std::to_string(std::lround(update.eta_seconds)) + " s";
+    LOG_INFO << "Downloaded " << update.done / (1024 * 1024) << " of " << update.total / (1024 * 1024) << " MiB ("
+             << update.percent << "%), " << std::lround(update.bytes_per_second / (1024 * 1024))
+             << " MiB/s, ETA " << eta;
+  }
+  // Only written by the thread producing the stream; atomic so that the
+  // progress reporter can sample it.
+  std::atomic<uintmax_t> downloaded_length{0};
+  unsigned int last_progress{0};
+  // The target's share of options.memory_budget.
+  const uint64_t memory_budget;
+  // Where the image is staged and download progress kept; empty for none.
+  std::string staging_file;
+  std::string checkpoint_file;
+  // Every URL of the image, fastest first, url being the first one; see
+  // selectMirrors().
+  std::string url;
+  std::vector<std::string> mirrors;
+  // On-disk copy of the image, written behind the download; null when not staging.
+  std::unique_ptr<StagingWriter> staging;
+  const Compression compression;
+  // Digests of the download stream, and of the decompressed image if the
+  // download is compressed.
+  const std::vector<ExpectedDigest> expected_digests;
+  const std::vector<ExpectedDigest> raw_digests;
   Uptane::Target target;
   const api::FlowControlToken* token;
   FetcherProgressCb progress_cb;
-  // each LogProgressInterval msec log dowload progress for big files
-  std::chrono::time_point<std::chrono::steady_clock> time_lastreport;
-
- private:
-  MultiPartSHA256Hasher sha256_hasher;
-  MultiPartSHA512Hasher sha512_hasher;
+  // Download data on its way to SWUpdate: filled by DownloadHandler, drained by readimage.
+  RingBuffer stream;
+  // Digests the stream on its own thread, off the curl callback.
+  std::unique_ptr<HashStage> hash_stage;
+  // With transport compression: the decompressed image, the stage producing
+  // it, and the stage hashing it.
+  std::unique_ptr<RingBuffer> decoded;
+  std::unique_ptr<DecompressStage> decompress;
+  std::unique_ptr<HashStage> raw_hash_stage;
+  // Parses the stream SWUpdate is fed from as a .swu, see SwuStage. Nothing
+  // goes to SWUpdate before it has validated sw-description.
+  std::unique_ptr<SwuStage> archive;
+  // Set when the download fails or the image turns out to be corrupt. Stops the
+  // transfer and makes readimage cut the install stream short.
+  std::atomic<bool> failed{false};
+  // Set when the image failed its block manifest; its checkpoint is useless.
+  std::atomic<bool> corrupt{false};
+  // Verified image from the local cache, installed instead of downloading.
+  std::unique_ptr<MappedImage> cached;
+  DigestResults cached_digests;
+  // Handle of the running transfer, used to resume it once readimage has caught up.
+  CurlHandler curl;
+  // Only touched from curl callbacks, so no synchronisation needed.
+  bool paused{false};
+  // When the last curl write callback returned; unset while paused, so that
+  // backpressure does not count as waiting for the network.
+  std::chrono::steady_clock::time_point last_callback;
+  // The region of the install stream readimage last handed out, and when.
+  // Only touched by the thread reading the install stream.
+  size_t in_flight{0};
+  std::chrono::steady_clock::time_point returned;
+  // When readimage reported the end of the stream, for the time SWUpdate
+  // takes to finish the install. Set and read on SWUpdate's thread.
+  std::chrono::steady_clock::time_point stream_end;
+  // Outcome of the install, handed over by finishInstall(); install_status is
+  // valid once install_finished is set.
+  std::mutex install_mutex;
+  std::condition_variable install_done;
+  bool install_finished{false};
+  int install_status{EXIT_FAILURE};
+  // Samples downloaded_length and prints SWUpdate's notifications, off the
+  // data path and SWUpdate's IPC thread.
+  std::unique_ptr<ProgressReporter> progress;
 };
 
-Json::Value jsonDataOut;
+// Every target to update, in the order given.
+static std::vector<Uptane::Target> targets;
 
-static pthread_mutex_t mymutex;
-static pthread_cond_t cv_end = PTHREAD_COND_INITIALIZER;
+// The target SWUpdate is installing, for its callbacks, which get no user
+// data. SWUpdate installs one image at a time, see updateTargets().
+static DownloadMetaStruct* installing = nullptr;
 
 int verbose = 1;
-char buf[256];
 
 std::string url = "https://link.storjshare.io/s/juoufh4dg6rfg4jkbcmyu5lvsggq/gsoc/swupdate-torizon-benchmark-image-verdin-imx8mm-20240702064741.swu?download=1";
+// Every transfer of the run goes through the same connections and TLS
+// sessions, see ConnectionCache.
+std::shared_ptr<ConnectionCache> connection_cache;
+// Shapes every download of the run, if there is a cap.
+std::shared_ptr<RateLimiter> rate_limiter;
 std::shared_ptr<HttpInterface> http;
 // std::shared_ptr<INvStorage> storage;
 // std::shared_ptr<PackageManagerInterface> packageManager;
-std::unique_ptr<DownloadMetaStruct> ds;
 
 int parseJsonFile(const std::string& jsonFilePath, Json::Value& jsonData) {
   std::ifstream jsonFile(jsonFilePath, std::ifstream::binary);
@@ -87,115 +540,1321 @@ int parseJsonFile(const std::string& jsonFilePath, Json::Value& jsonData) {
   return 0;
 }
 
+// Loads the entry of target_name from the targets metadata at metadataPath.
+// Only that entry is parsed into a Json::Value: finding it takes a streaming
+// scan of the metadata, or an index lookup.
+int loadTarget(const std::string& metadataPath, const std::string& target_name, Json::Value& jsonData) {
+  TargetEntry entry;
+  try {
+    if (!findTarget(metadataPath, options.targets_index, target_name, &entry)) {
+      std::cerr << "No target " << target_name << " in " << metadataPath << std::endl;
+      return 1;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (!options.hardware_id.empty() &&
+      std::find(entry.hardware_ids.begin(), entry.hardware_ids.end(), options.hardware_id) ==
+          entry.hardware_ids.end()) {
+    std::cerr << "Target " << target_name << " is not for hardware ID " << options.hardware_id << std::endl;
+    return 1;
+  }
+
+  std::string text(entry.length, '\0');
+  std::ifstream metadataFile(metadataPath, std::ifstream::binary);
+  if (!metadataFile.seekg(static_cast<std::streamoff>(entry.offset)) ||
+      !metadataFile.read(&text[0], static_cast<std::streamsize>(text.size()))) {
+    std::cerr << "Could not read target " << target_name << " from " << metadataPath << std::endl;
+    return 1;
+  }
+  Json::CharReaderBuilder readerBuilder;
+  std::unique_ptr<Json::CharReader> reader(readerBuilder.newCharReader());
+  std::string errs;
+  if (!reader->parse(text.data(), text.data() + text.size(), &jsonData, &errs)) {
+    std::cerr << "Malformed target " << target_name << " in " << metadataPath << ": " << errs << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Waits up to kStreamPauseDelay for the stream to take len more bytes without
+// crossing the high watermark.
+static bool waitForStreamSpace(DownloadMetaStruct* dst, size_t len) {
+  if (dst->stream.size() + len <= kStreamHighWatermark) {
+    return true;
+  }
+  StageTimer timer(&metrics.stage(Stage::kQueueWait));
+  const auto deadline = std::chrono::steady_clock::now() + kStreamPauseDelay;
+  Backoff backoff;
+  while (dst->stream.size() + len > kStreamHighWatermark) {
+    if (dst->failed || std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    backoff.pause();
+  }
+  return true;
+}
+
 static size_t DownloadHandler(char* contents, size_t size, size_t nmemb, void* userp) {
   assert(userp);
   auto* dst = static_cast<DownloadMetaStruct*>(userp);
+  // While paused by the operator the callback blocks, and the data waits in
+  // the socket. That is no time spent waiting for the network. So does
+  // ProgressHandler, which curl calls while a transfer is paused for room in
+  // the stream: either way curl sits in a callback until the pause ends,
+  // which is meant, as nothing is to be read meanwhile, and an abort still
+  // gets through at once.
+  if (dst->pausedByOperator()) {
+    dst->last_callback = std::chrono::steady_clock::time_point{};
+  }
+  if (!dst->proceed()) {
+    return size * nmemb + 1;  // curl will abort if return unexpected size;
+  }
+  const auto called = std::chrono::steady_clock::now();
+  if (dst->last_callback != std::chrono::steady_clock::time_point{}) {
+    metrics.stage(Stage::kNetworkWait).record(called - dst->last_callback);
+  }
+  StageTimer timer(&metrics.stage(Stage::kCurlCallback));
   size_t downloaded = size * nmemb;
   uint64_t expected = dst->target.length();
-  if ((dst->downloaded_length + downloaded) > expected) {
+  if ((dst->downloaded_length + downloaded) > expected || dst->failed) {
     return downloaded + 1;  // curl will abort if return unexpected size;
   }
 
-  dst->fhandle.write(contents, static_cast<std::streamsize>(downloaded));
-  dst->hasher().update(reinterpret_cast<const unsigned char*>(contents), downloaded);
+  // Apply backpressure when the install side falls behind. A paused transfer
+  // is only resumed from ProgressHandler, which curl calls about once a
+  // second while paused, so short stalls are waited out here instead. Nothing
+  // has been consumed yet, so curl hands us the same chunk again once resumed.
+  if (!waitForStreamSpace(dst, downloaded)) {
+    dst->paused = true;
+    dst->last_callback = std::chrono::steady_clock::time_point{};
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  if (dst->staging) {
+    dst->staging->write(contents, downloaded);
+  }
+  dst->stream.write(contents, downloaded);
   dst->downloaded_length += downloaded;
+  metrics.addDownloaded(downloaded);
+  dst->last_callback = std::chrono::steady_clock::now();
   return downloaded;
 }
 
-int readimage(char **pbuf, int *size) {
-  // int ret;
-	// ret = read(fd, buf, sizeof(buf));
-	// *p = buf;
-	// *size = ret;
-	// return ret;
-  // std::string target_url = jsonDataOut["target"]["url"].asString();
+static std::string targetDigest(const Uptane::Target& target) {
+  return target.hashes()[0].TypeString() + ":" + target.hashes()[0].HashString();
+}
 
-  std::future<HttpResponse> future_response = http->downloadAsync(url,
-    DownloadHandler,
-    nullptr,  // ProgressHandler can be added if needed
-    ds.get(), // userp
-    static_cast<curl_off_t>(ds->downloaded_length), // from
-    nullptr //curlhandler easyp*
-  );
+// Persists the latest digest checkpoint of the hash stage. The hash stage
+// trails DownloadHandler, which has already handed everything it hashed to
+// the staging writer, so once that is synced the checkpoint never claims more
+// than is on disk. The sync and the checkpoint write both happen on the
+// staging writer's thread, so the download never waits for them.
+static void saveProgress(DownloadMetaStruct* dst) {
+  DownloadCheckpoint checkpoint;
+  if (!dst->hash_stage->takeCheckpoint(&checkpoint.hash)) {
+    return;
+  }
+  checkpoint.target_name = dst->target.filename();
+  checkpoint.target_length = dst->target.length();
+  checkpoint.target_digest = targetDigest(dst->target);
+  dst->staging->syncThen(
+      [checkpoint, staging_file = dst->staging_file, checkpoint_file = dst->checkpoint_file](bool synced) {
+        if (!synced) {
+          LOG_WARNING << "Could not sync " << staging_file << ", skipping checkpoint";
+        } else if (!saveCheckpoint(checkpoint_file, checkpoint)) {
+          LOG_WARNING << "Could not write checkpoint " << checkpoint_file;
+        }
+      });
+}
 
-  HttpResponse response = future_response.get();
+static int ProgressHandler(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+  (void)dltotal;
+  (void)dlnow;
+  (void)ultotal;
+  (void)ulnow;
+  auto* dst = static_cast<DownloadMetaStruct*>(clientp);
+  // Blocks while the operator has paused the update, see DownloadHandler.
+  if (!dst->proceed()) {
+    return 1;  // abort
+  }
+  if (!dst->checkpoint_file.empty()) {
+    saveProgress(dst);
+  }
+  // curl keeps calling us while the transfer is paused, and this is the only
+  // place it may be resumed from.
+  if (dst->paused && dst->stream.size() <= kStreamLowWatermark) {
+    dst->paused = false;
+    curl_easy_pause(dst->curl.get(), CURLPAUSE_CONT);
+  }
+  return 0;
+}
 
-  if (response.isOk()) {
-    // *size = response;
-    // return size;
-    return 0;
+// Hands SWUpdate a pointer straight into the stream ring. The region returned
+// by the previous call is released first: SWUpdate has written it to the
+// install socket by the time it asks for more.
+//
+// Nothing is handed out before the archive stage has validated the image's
+// sw-description, nor while the update is paused. A failed, corrupt,
+// rejected or aborted download is reported with a negative size. SWUpdate's
+// IPC client then closes the install connection mid-image, which makes
+// SWUpdate abort the installation.
+//
+// The time between two calls is what SWUpdate's IPC client took to write the
+// previous region to the install socket.
+static int readStream(DownloadMetaStruct* ds, char** pbuf, int* size) {
+  const auto called = std::chrono::steady_clock::now();
+  if (ds->in_flight != 0) {
+    metrics.stage(Stage::kIpcWrite).record(called - ds->returned);
+    metrics.addInstalled(ds->in_flight);
   }
+  RingBuffer& stream = ds->installStream();
+  stream.consume(ds->in_flight, kInstallReader);
+  ds->in_flight = 0;
+  StageTimer timer(&metrics.stage(Stage::kReadimageWait));
 
-  return -1;
+  const char* data = nullptr;
+  size_t available = 0;
+  Backoff backoff;
+  for (;;) {
+    if (!ds->proceed()) {
+      *size = -1;
+      return *size;
+    }
+    if (ds->archive->validated()) {
+      if ((available = stream.peek(&data, kInstallReader)) != 0) {
+        break;
+      }
+      if (stream.drained(kInstallReader)) {
+        ds->stream_end = std::chrono::steady_clock::now();
+        *size = 0;
+        return *size;
+      }
+    }
+    backoff.pause();
+  }
+
+  ds->in_flight = std::min(available, static_cast<size_t>(INT_MAX));
+  *pbuf = const_cast<char*>(data);
+  *size = static_cast<int>(ds->in_flight);
+  ds->returned = std::chrono::steady_clock::now();
+  return *size;
+}
+
+// SWUpdate's reader callback, see readStream().
+int readimage(char** pbuf, int* size) { return readStream(installing, pbuf, size); }
+
+// Hands SWUpdate the cached image straight out of its mapping, a few MiB at a
+// time. ds->downloaded_length tracks how far it got.
+int readcached(char** pbuf, int* size) {
+  static constexpr uint64_t kCachedChunk = 4 * 1024 * 1024;
+  DownloadMetaStruct* ds = installing;
+  if (!ds->proceed()) {
+    *size = -1;
+    return *size;
+  }
+  const uint64_t chunk = std::min(kCachedChunk, ds->cached->size() - ds->downloaded_length);
+  *pbuf = const_cast<char*>(ds->cached->data() + ds->downloaded_length);
+  *size = static_cast<int>(chunk);
+  ds->downloaded_length += chunk;
+  metrics.addInstalled(chunk);
+  if (chunk == 0) {
+    ds->stream_end = std::chrono::steady_clock::now();
+  }
+  return *size;
 }
 
+// Called on SWUpdate's IPC thread for every notification; the printing is
+// left to the progress reporter so that a slow console cannot hold it up.
 int printstatus(ipc_message *msg) {
   if (verbose) {
-    std::printf("Status: %d message: %s\n",
-              msg->data.notify.status,
-              msg->data.notify.msg);
+    installing->progress->post("Status: " + std::to_string(msg->data.notify.status) +
+                               " message: " + msg->data.notify.msg);
   }
   return 0;
 }
 
+// Checks every digest the metadata lists once the stages are through, and
+// reports all mismatches, not just the first.
+static bool digestsMatch(DownloadMetaStruct* ds) {
+  auto mismatches = ds->digestMismatches();
+  for (const auto& mismatch : mismatches) {
+    std::fprintf(stderr, "Digest mismatch: %s\n", mismatch.c_str());
+  }
+  return mismatches.empty();
+}
+
+// Hands the outcome to waitForInstall().
+static void finishInstall(DownloadMetaStruct* ds, int status) {
+  std::lock_guard<std::mutex> guard(ds->install_mutex);
+  ds->install_status = status;
+  ds->install_finished = true;
+  ds->install_done.notify_all();
+}
+
 int end(RECOVERY_STATUS status) {
+  DownloadMetaStruct* ds = installing;
+  ds->progress->stop();
+  if (ds->stream_end != std::chrono::steady_clock::time_point{}) {
+    metrics.stage(Stage::kInstallFinish).record(std::chrono::steady_clock::now() - ds->stream_end);
+  }
   int end_status = (status == SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
   std::printf("SWUpdate %s\n", (status == FAILURE) ? "*failed* !" : "was successful !");
 
   if (status == SUCCESS) {
     std::printf("Executing post-update actions.\n");
-    // Finalize the hash
-    auto final_hash = ds->hasher().getHash().HashString();
-    std::string val = "";
-    // val = jsonDataOut["custom"]["swupdate"]["rawHashes"]["sha256"].asString();
-    if (final_hash != val) {
+    if (!digestsMatch(ds)) {
       std::fprintf(stderr, "Running post-update failed!\n");
       end_status = EXIT_FAILURE;
       // does end_status actually cancel the update?
     }
   }
 
-  pthread_mutex_lock(&mymutex);
-  pthread_cond_signal(&cv_end);
-  pthread_mutex_unlock(&mymutex);
-
+  finishInstall(ds, end_status);
   return end_status;
 }
 
-int swupdate_test_func() {
+// Stands in for SWUpdate's reader thread when prefetching: takes the stream
+// through readimage() and drops it. The stages still parse, hash and stage
+// every byte, so the image is as verified as an installed one.
+static void prefetchImage(DownloadMetaStruct* ds) {
+  char* buf = nullptr;
+  int size = 0;
+  while (readStream(ds, &buf, &size) > 0) {
+  }
+  ds->progress->stop();
+  finishInstall(ds, size == 0 && digestsMatch(ds) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Opens the staging copy of the image. If the checkpoint belongs to an
+// interrupted download of this very target, the staged prefix is kept and the
+// digests continue from their saved midstates; otherwise staging starts over.
+// Returns the offset to resume the download from.
+static uint64_t openStagingFile(std::unique_ptr<DownloadMetaStruct>& ds) {
+  uint64_t offset = 0;
+  DownloadCheckpoint checkpoint;
+  boost::system::error_code ec;
+  if (!ds->checkpoint_file.empty() && loadCheckpoint(ds->checkpoint_file, &checkpoint) &&
+      checkpoint.target_name == ds->target.filename() && checkpoint.target_length == ds->target.length() &&
+      checkpoint.target_digest == targetDigest(ds->target) && checkpoint.hash.offset <= ds->target.length() &&
+      boost::filesystem::file_size(ds->staging_file, ec) >= checkpoint.hash.offset && !ec) {
+    if (ds->hash_stage->resumeFrom(checkpoint.hash)) {
+      offset = checkpoint.hash.offset;
+    } else {
+      LOG_WARNING << "Checkpoint " << ds->checkpoint_file << " does not fit this build, starting over";
+      auto fresh = std_::make_unique<DownloadMetaStruct>(ds->target, nullptr, &flow_control, ds->memory_budget, true);
+      fresh->staging_file = ds->staging_file;
+      fresh->checkpoint_file = ds->checkpoint_file;
+      ds = std::move(fresh);
+    }
+  }
+
+  ds->staging = std_::make_unique<StagingWriter>(ds->staging_file, offset, ds->target.length());
+  LOG_INFO << "Staging to " << ds->staging_file << " (" << ds->staging->backend() << ")";
+  ds->downloaded_length = offset;
+  return offset;
+}
+
+// Writes data to the stream ring, waiting for room. Returns false once the
+// update has failed.
+static bool writeStream(DownloadMetaStruct* ds, const char* data, size_t len) {
+  Backoff backoff;
+  size_t written = 0;
+  while (written < len) {
+    if (!ds->proceed()) {
+      return false;
+    }
+    size_t n = ds->stream.write(data + written, len - written);
+    if (n == 0) {
+      backoff.pause();
+      continue;
+    }
+    backoff.reset();
+    written += n;
+  }
+  return true;
+}
+
+// Feeds the staged prefix of a resumed download to SWUpdate, which always
+// needs the image from its start. The hash stage skips these bytes: its
+// restored midstates already cover them.
+static bool replayStagedPrefix(DownloadMetaStruct* ds, uint64_t length) {
+  std::ifstream staged(ds->staging_file, std::ios::binary);
+  std::vector<char> chunk(64 * 1024);
+  uint64_t replayed = 0;
+  while (replayed < length) {
+    staged.read(chunk.data(), static_cast<std::streamsize>(std::min<uint64_t>(chunk.size(), length - replayed)));
+    size_t n = static_cast<size_t>(staged.gcount());
+    if (n == 0 || !writeStream(ds, chunk.data(), n)) {
+      return false;
+    }
+    replayed += n;
+  }
+  return true;
+}
+
+// Queues the next bytes of the image for the install and hash readers
+// exactly like DownloadHandler does, for producers that are not curl write
+// callbacks. The ring throttles them here instead of curl pausing. Returns
+// false once the update has failed.
+static bool queueImageData(DownloadMetaStruct* ds, const char* data, size_t len, Backoff& backoff) {
+  if (ds->staging) {
+    ds->staging->write(data, len);
+  }
+  size_t written = 0;
+  std::chrono::steady_clock::time_point waiting;
+  while (written < len) {
+    if (!ds->proceed()) {
+      return false;
+    }
+    if (ds->stream.size() > kStreamHighWatermark) {
+      if (waiting == std::chrono::steady_clock::time_point{}) {
+        waiting = std::chrono::steady_clock::now();
+      }
+      backoff.pause();
+      continue;
+    }
+    if (waiting != std::chrono::steady_clock::time_point{}) {
+      metrics.stage(Stage::kQueueWait).record(std::chrono::steady_clock::now() - waiting);
+      waiting = std::chrono::steady_clock::time_point{};
+    }
+    size_t n = ds->stream.write(data + written, std::min(len - written, kStreamHighWatermark));
+    backoff.reset();
+    written += n;
+  }
+  ds->downloaded_length += len;
+  metrics.addDownloaded(len);
+  if (!ds->checkpoint_file.empty()) {
+    saveProgress(ds);
+  }
+  return true;
+}
+
+// Parallel connections each get a client of their own, all on the one rate
+// limiter, so that they share the cap between them.
+static std::shared_ptr<HttpInterface> makeHttpClient() {
+  auto client = std::make_shared<CachedHttpClient>(connection_cache);
+  client->setRateLimiter(rate_limiter);
+  return client;
+}
+
+// Gathers the URLs of the image: --url if given, --mirror, the target's uri
+// and the mirrors its metadata lists, in that order and without duplicates,
+// or the built-in url without any. Several are probed for their time to
+// first byte and tried fastest first.
+static void selectMirrors(DownloadMetaStruct* ds) {
+  std::vector<std::string> urls;
+  auto add = [&urls](const std::string& candidate) {
+    if (!candidate.empty() && std::find(urls.begin(), urls.end(), candidate) == urls.end()) {
+      urls.push_back(candidate);
+    }
+  };
+  for (const auto& mirror : options.mirrors) {
+    add(mirror);
+  }
+  add(ds->target.uri());
+  for (const auto& mirror : ds->target.custom_data()["swupdate"]["mirrors"]) {
+    add(mirror.isString() ? mirror.asString() : std::string());
+  }
+  if (urls.empty()) {
+    add(url);
+  }
+  if (urls.size() > 1) {
+    auto make_http = [] { return std::make_shared<CachedHttpClient>(connection_cache); };
+    const std::vector<Mirror> probed = probeMirrors(make_http, urls, kMirrorProbeTimeout);
+    urls.clear();
+    for (const auto& mirror : probed) {
+      if (mirror.first_byte.count() >= 0) {
+        LOG_INFO << "Mirror " << mirror.url << ": first byte after "
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(mirror.first_byte).count() << " ms";
+      } else {
+        LOG_WARNING << "Mirror " << mirror.url << " did not answer its probe";
+      }
+      urls.push_back(mirror.url);
+    }
+  }
+  ds->mirrors = urls;
+  ds->url = ds->mirrors.front();
+}
+
+// Downloads the rest of the image over options.connections connections. The
+// segments come back in stream order. A blocked sink keeps the downloader
+// from recycling segment buffers and so from starting new requests.
+static bool parallelDownload(DownloadMetaStruct* ds) {
+  ParallelDownloader downloader(makeHttpClient, ds->url, options.connections, options.segment_size);
+  downloader.setMirrors(ds->mirrors);
+  downloader.setFlowControl(ds->token);
+  Backoff backoff;
+  bool ok = downloader.download(ds->downloaded_length, ds->target.length(),
+                                [ds, &backoff](const char* data, size_t len) {
+                                  return queueImageData(ds, data, len, backoff);
+                                });
+  if (!ok && !ds->failed && !ds->abortedByOperator()) {
+    std::fprintf(stderr, "Download failed: %s\n", downloader.error().c_str());
+  }
+  return ok;
+}
+
+// How to produce the image from local chunks plus downloads, see planDelta().
+struct DeltaUpdate {
+  ChunkIndex index;
+  std::unique_ptr<ChunkStore> store;
+  std::vector<DeltaSpan> spans;
+};
+
+// Plans a delta update if the target has a chunk index and there are seeds to
+// take chunks from. Returns nullptr to download the whole image instead.
+static std::unique_ptr<DeltaUpdate> prepareDelta(DownloadMetaStruct* ds, const std::vector<std::string>& seeds) {
+  const Json::Value reference = ds->target.custom_data()["swupdate"]["chunkIndex"];
+  if (!reference.isObject() || seeds.empty()) {
+    return nullptr;
+  }
+  const std::string index_url = reference["url"].asString();
+  HttpResponse response = http->get(index_url, kMaxChunkIndexSize);
+  if (!response.isOk()) {
+    LOG_WARNING << "Could not fetch chunk index " << index_url << ", downloading the whole image";
+    return nullptr;
+  }
+  // The index is only as trustworthy as the signed metadata pointing at it.
+  EvpDigest digest(EVP_sha256());
+  digest.update(response.body.data(), response.body.size());
+  std::string expected = reference["sha256"].asString();
+  std::transform(expected.begin(), expected.end(), expected.begin(), ::tolower);
+  if (digest.hexDigest() != expected) {
+    LOG_WARNING << "Chunk index " << index_url << " does not match its digest, downloading the whole image";
+    return nullptr;
+  }
+
+  auto delta = std_::make_unique<DeltaUpdate>();
+  try {
+    delta->index = parseChunkIndex(response.body);
+  } catch (const std::runtime_error& e) {
+    LOG_WARNING << e.what() << ", downloading the whole image";
+    return nullptr;
+  }
+  if (delta->index.length != ds->target.length()) {
+    LOG_WARNING << "Chunk index is for a different image, downloading the whole image";
+    return nullptr;
+  }
+  delta->store = std_::make_unique<ChunkStore>(delta->index.params);
+  for (const auto& seed : seeds) {
+    if (!delta->store->addSeed(seed)) {
+      LOG_WARNING << "Could not read seed " << seed;
+    }
+  }
+  delta->spans = planDelta(delta->index, *delta->store, ds->downloaded_length, kDeltaMinLocalRun);
+
+  uint64_t local = 0;
+  uint64_t remote = 0;
+  size_t requests = 0;
+  for (const auto& span : delta->spans) {
+    if (span.local != nullptr) {
+      local += span.length;
+    } else {
+      remote += span.length;
+      ++requests;
+    }
+  }
+  LOG_INFO << "Delta update: " << local << " bytes from local chunks, downloading " << remote << " bytes in "
+           << requests << " requests";
+  return delta;
+}
+
+// Produces the rest of the image span by span, in stream order: local chunks
+// straight from their seed, missing ones with Range requests. A seed chunk
+// that changed since it was indexed is downloaded instead.
+static bool deltaDownload(DownloadMetaStruct* ds, const DeltaUpdate& delta) {
+  ParallelDownloader downloader(makeHttpClient, ds->url, options.connections, options.segment_size);
+  downloader.setMirrors(ds->mirrors);
+  downloader.setFlowControl(ds->token);
+  Backoff backoff;
+  auto sink = [ds, &backoff](const char* data, size_t len) { return queueImageData(ds, data, len, backoff); };
+  // Sized on the chunks actually read, which parseChunkIndex() caps at max_size.
+  size_t longest = 0;
+  for (const auto& span : delta.spans) {
+    if (span.local != nullptr) {
+      longest = std::max<size_t>(longest, span.local->length);
+    }
+  }
+  std::vector<char> chunk(longest);
+  for (const auto& span : delta.spans) {
+    if (span.local != nullptr && delta.store->read(*span.local, chunk.data())) {
+      if (!sink(chunk.data() + (span.offset - span.local->offset), span.length)) {
+        return false;
+      }
+      continue;
+    }
+    if (span.local != nullptr) {
+      LOG_WARNING << "Seed chunk " << span.local->sha256 << " changed, downloading it";
+    }
+    if (!downloader.download(span.offset, span.offset + span.length, sink)) {
+      if (!ds->failed && !ds->abortedByOperator()) {
+        std::fprintf(stderr, "Download failed: %s\n", downloader.error().c_str());
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+// Installs the image from source, a plain file or HTTP connection positioned
+// at the first byte, by splicing it into the install socket. This drives
+// SWUpdate's IPC directly, as swupdate_async_start() only takes data through
+// the readimage copy, but the outcome goes through end() the same way. The
+// splice cannot wait for the archive stage, so an image it rejects is cut
+// short a pipe's worth after sw-description instead of before it.
+static int zeroCopyInstall(DownloadMetaStruct* ds, int source, swupdate_request* req) {
+  installing = ds;
+  int connfd = ipc_inst_start_ext(req, sizeof(*req));
+  if (connfd < 0) {
+    close(source);
+    std::cout << "swupdate start error" << std::endl;
+    return -1;
+  }
+  LOG_INFO << "SHA acceleration: " << shaAcceleration() << ", zero-copy transfer";
+  ds->startStages();
+  if (spliceTransfer(source, connfd, ds->target.length(), ds->stream, kInstallReader, ds->failed, ds->token)) {
+    ds->downloaded_length = ds->target.length();
+    metrics.addDownloaded(ds->downloaded_length);
+    metrics.addInstalled(ds->downloaded_length);
+  } else if (ds->abortedByOperator()) {
+    ds->failed = true;
+  } else if (!ds->failed) {
+    std::fprintf(stderr, "Download failed after splicing\n");
+    ds->failed = true;
+  }
+  close(source);
+  ds->stream.close();
+  ds->stream_end = std::chrono::steady_clock::now();
+  // Closing the install connection before the whole image is through makes
+  // SWUpdate abort, just like a negative size from readimage.
+  ipc_end(connfd);
+  end(static_cast<RECOVERY_STATUS>(ipc_wait_for_complete(printstatus)));
+  return (ds->install_status == EXIT_SUCCESS && !ds->failed) ? 0 : -1;
+}
+
+// Installs with EventLoopInstall: the staged prefix of a resumed download,
+// the rest of the download and SWUpdate's IPC, all on this thread. Like
+// zeroCopyInstall() this drives the IPC directly, and the outcome goes
+// through end() the same way.
+static void eventLoopInstall(DownloadMetaStruct* ds, int connfd, uint64_t resume_offset) {
+  EventLoopInstall loop(ds->stream, ds->installStream(), kInstallReader, kStreamHighWatermark,
+                        kStreamHighWatermark - kEventLoopResumeRoom, ds->failed);
+  loop.setMetrics(&metrics);
+  loop.setConnectionCache(connection_cache.get());
+  loop.setRateLimiter(rate_limiter.get());
+  loop.setInstallGate(&ds->archive->validated());
+  loop.setFlowControl(ds->token);
+  if (resume_offset > 0) {
+    int staged = open(ds->staging_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (staged >= 0) {
+      loop.setPrefix(staged, resume_offset);
+    } else {
+      std::fprintf(stderr, "Could not read back staged image\n");
+      ds->failed = true;
+    }
+  }
+  loop.setDownload(
+      ds->url, ds->downloaded_length, ds->target.length(),
+      [ds](const char* data, size_t len) {
+        if (ds->staging) {
+          ds->staging->write(data, len);
+        }
+        ds->downloaded_length += len;
+      },
+      [ds] {
+        if (!ds->checkpoint_file.empty()) {
+          saveProgress(ds);
+        }
+      });
+  const RECOVERY_STATUS status = loop.run(connfd, printstatus);
+  if (!loop.error().empty() && !ds->abortedByOperator()) {
+    std::fprintf(stderr, "Download failed: %s\n", loop.error().c_str());
+  }
+  ds->stream_end = loop.streamEnd();
+  end(status);
+}
+
+static void waitForInstall(DownloadMetaStruct* ds) {
+  std::unique_lock<std::mutex> lock(ds->install_mutex);
+  ds->install_done.wait(lock, [ds] { return ds->install_finished; });
+}
+
+// Maps the image at path and checks it against every digest of the target
+// before anything is installed from it; storage can rot.
+static bool loadVerifiedImage(DownloadMetaStruct* ds, const std::string& path) {
+  std::unique_ptr<MappedImage> image;
+  try {
+    image = std_::make_unique<MappedImage>(path);
+  } catch (const std::runtime_error& e) {
+    LOG_WARNING << e.what();
+    return false;
+  }
+  if (image->size() != ds->target.length()) {
+    LOG_WARNING << "Image " << path << " is incomplete";
+    return false;
+  }
+  DigestResults digests = digestBuffer(image->data(), image->size(), digestAlgorithms(ds->expected_digests));
+  if (!digestMismatches(ds->expected_digests, digests).empty()) {
+    LOG_WARNING << "Image " << path << " is corrupt";
+    return false;
+  }
+  ds->cached = std::move(image);
+  ds->cached_digests = std::move(digests);
+  return true;
+}
+
+// Loads the cached image for key, see loadVerifiedImage(). A bad entry is
+// dropped and the image downloaded again.
+static bool loadCachedImage(DownloadMetaStruct* ds, ImageCache& cache, const std::string& key) {
+  const std::string path = cache.lookup(key);
+  if (path.empty()) {
+    return false;
+  }
+  if (!loadVerifiedImage(ds, path)) {
+    cache.remove(key);
+    return false;
+  }
+  return true;
+}
+
+// Checks the sw-description of an image installed straight from the cache.
+// The rest of it was verified against the target's digests already.
+static bool checkCachedArchive(DownloadMetaStruct* ds) {
+  static constexpr uint64_t kChunk = 64 * 1024;
+  SwuParser parser(swuRequirements());
+  for (uint64_t offset = 0; !parser.validated(); offset += kChunk) {
+    const uint64_t len = std::min(kChunk, ds->cached->size() - std::min(offset, ds->cached->size()));
+    if (!(len == 0 ? parser.finish() : parser.update(ds->cached->data() + offset, len))) {
+      std::fprintf(stderr, "Aborting update, rejected image: %s\n", parser.error().c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Installs the verified local image in ds->cached, from source. A compressed
+// image goes through the stream and the decompress stage like a download;
+// anything else is handed to SWUpdate straight from the mapping.
+static int cachedInstall(DownloadMetaStruct* ds, swupdate_request* req, const std::string& source) {
+  LOG_INFO << "Installing " << ds->target.filename() << " from " << source;
+  const bool compressed = ds->compression != Compression::kNone;
+  if (!compressed && !checkCachedArchive(ds)) {
+    return -1;
+  }
+  installing = ds;
+  if (swupdate_async_start(compressed ? readimage : readcached, printstatus, end, req, sizeof(*req)) < 0) {
+    std::cout << "swupdate start error" << std::endl;
+    return -1;
+  }
+  if (compressed) {
+    ds->startStages();
+    writeStream(ds, ds->cached->data(), ds->cached->size());
+    ds->downloaded_length = ds->cached->size();
+    ds->stream.close();
+  }
+  waitForInstall(ds);
+  return ds->install_status == EXIT_SUCCESS ? 0 : -1;
+}
+
+// Installs the image a --prefetch run left in the image cache or the staging
+// file, without touching the network. It is verified once more first, as it
+// may have sat on disk for a while.
+static int stagedInstall(DownloadMetaStruct* ds, swupdate_request* req, ImageCache* cache,
+                         const std::string& cache_key) {
+  const std::string cached = cache != nullptr ? cache->lookup(cache_key) : std::string();
+  const std::string path = cached.empty() ? ds->staging_file : cached;
+  if (path.empty() || !loadVerifiedImage(ds, path)) {
+    std::fprintf(stderr, "No verified image of %s staged, run with --prefetch first\n",
+                 ds->target.filename().c_str());
+    return -1;
+  }
+  return cachedInstall(ds, req, path);
+}
+
+// Starts the install of ds through SWUpdate's IPC client, which hands the
+// image over with read_cb on a thread of its own. Right after end() ran for
+// the previous install of a campaign, that thread may still be on its way
+// out, which the client refuses with -EBUSY for a moment.
+static int startInstall(DownloadMetaStruct* ds, writedata read_cb, swupdate_request* req) {
+  static constexpr int kBusyRetries = 100;
+  installing = ds;
+  for (int retry = 0;; ++retry) {
+    const int rc = swupdate_async_start(read_cb, printstatus, end, req, sizeof(*req));
+    if (rc != -EBUSY || retry == kBusyRetries) {
+      return rc;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+// One target of the update, see updateTargets().
+struct TargetPlan {
+  explicit TargetPlan(Uptane::Target target_in) : target{std::move(target_in)} {}
+
+  Uptane::Target target;
+  // With a single target, those of the options.
+  std::string staging_file;
+  std::string checkpoint_file;
+  // The target's share of options.memory_budget.
+  uint64_t memory_budget{0};
+  // Download, verify and stage the image without installing it: a
+  // --prefetch, or a target of a campaign installed later from image.
+  bool fetch_only{false};
+  // The image a fetch left, and the digests it was verified with.
+  std::unique_ptr<MappedImage> image;
+  DigestResults digests;
+  // What is wrong with the target's metadata, see targetMetadataError().
+  std::string metadata_error;
+};
+
+// Keeps the verified image ds fetched for the install of plan, see
+// installFetched(). The mapping stays valid even if the image cache evicts
+// the file meanwhile.
+static bool keepImage(TargetPlan& plan, DownloadMetaStruct* ds) {
+  if (ds->cached) {
+    plan.image = std::move(ds->cached);
+    plan.digests = std::move(ds->cached_digests);
+    return true;
+  }
+  try {
+    plan.image = std_::make_unique<MappedImage>(ds->staging_file);
+  } catch (const std::runtime_error& e) {
+    LOG_WARNING << e.what();
+    return false;
+  }
+  plan.digests = ds->hash_stage->wait();
+  return true;
+}
+
+// Updates the target of plan: installs it from the image cache, from what a
+// --prefetch staged, or while downloading it; or, with plan.fetch_only,
+// downloads, verifies and stages it only. Returns 0 on success.
+static int updateTarget(TargetPlan& plan) {
   struct swupdate_request req;
   int rc;
 
-  // Initialize the actual `PackageManagerInterface`
-  http = std::make_shared<HttpClient>();
-  // PackageConfig pconfig;
-  // BootloaderConfig bconfig;
-  // packageManager = PackageManagerFactory::makePackageManager(pconfig, bconfig, storage, http);
-  Uptane::Target target("test", jsonDataOut);
-  ds = std_::make_unique<DownloadMetaStruct>(target, nullptr, nullptr);
+  if (!plan.metadata_error.empty()) {
+    std::fprintf(stderr, "Rejecting target %s: %s\n", plan.target.filename().c_str(), plan.metadata_error.c_str());
+    return -1;
+  }
+
+  auto ds = std_::make_unique<DownloadMetaStruct>(plan.target, nullptr, &flow_control, plan.memory_budget,
+                                                  !plan.checkpoint_file.empty());
+  ds->staging_file = plan.staging_file;
+  ds->checkpoint_file = plan.checkpoint_file;
 
   swupdate_prepare_req(&req);
 
-  rc = swupdate_async_start(readimage, printstatus, end, &req, sizeof(req));
+  // On a miss the download is staged in the cache directory, to be added to
+  // the cache once it installed and verified.
+  std::unique_ptr<ImageCache> cache;
+  std::string cache_key;
+  if (!options.cache_dir.empty()) {
+    cache = std_::make_unique<ImageCache>(options.cache_dir, options.cache_size);
+    cache_key = ImageCache::key(targetDigest(ds->target));
+    if (loadCachedImage(ds.get(), *cache, cache_key)) {
+      if (plan.fetch_only) {
+        std::printf("%s is already in the image cache\n", ds->target.filename().c_str());
+        return keepImage(plan, ds.get()) ? 0 : -1;
+      }
+      return cachedInstall(ds.get(), &req, "the image cache");
+    }
+    if (ds->staging_file.empty()) {
+      ds->staging_file = cache->stagingPath(cache_key);
+    }
+  }
+  if (options.install_staged) {
+    return stagedInstall(ds.get(), &req, cache.get(), cache_key);
+  }
+  // Without a cache, a finished prefetch leaves just the staging file.
+  boost::system::error_code ec;
+  if (plan.fetch_only && !cache && boost::filesystem::file_size(ds->staging_file, ec) == ds->target.length() &&
+      !ec && loadVerifiedImage(ds.get(), ds->staging_file)) {
+    std::printf("%s is already staged at %s\n", ds->target.filename().c_str(), ds->staging_file.c_str());
+    return keepImage(plan, ds.get()) ? 0 : -1;
+  }
+
+  uint64_t resume_offset = 0;
+  if (!ds->staging_file.empty()) {
+    resume_offset = openStagingFile(ds);
+    if (!ds->checkpoint_file.empty()) {
+      ds->hash_stage->setCheckpointInterval(options.checkpoint_interval);
+    }
+  }
+
+  // Earlier images in the cache make good seeds too.
+  std::vector<std::string> seeds = options.seeds;
+  if (cache) {
+    for (const auto& image : cache->images()) {
+      seeds.push_back(image);
+    }
+  }
+  std::unique_ptr<DeltaUpdate> delta = prepareDelta(ds.get(), seeds);
+  selectMirrors(ds.get());
+
+  // The zero-copy path streams straight from the source to SWUpdate, so it
+  // has no staging copy to resume from, no segments to reassemble, no rate
+  // cap and no other mirror to fail over to. A prefetch always stages.
+  if (options.zero_copy && !options.event_loop && ds->staging_file.empty() && options.connections <= 1 && !delta &&
+      ds->compression == Compression::kNone && !rate_limiter && ds->mirrors.size() <= 1) {
+    int source = openSpliceSource(ds->url, 0, ds->target.length());
+    if (source >= 0) {
+      return zeroCopyInstall(ds.get(), source, &req);
+    }
+    LOG_INFO << "Zero-copy transfer not possible for " << ds->url << ", copying through curl";
+  }
+
+  // The event loop takes over from the download thread, SWUpdate's reader
+  // thread and the wait for the result. Delta, parallel and mirrored
+  // downloads keep their threads, and a prefetch has no SWUpdate to feed.
+  const bool event_loop =
+      options.event_loop && !delta && options.connections <= 1 && !plan.fetch_only && ds->mirrors.size() <= 1;
+  if (options.event_loop && !event_loop) {
+    LOG_INFO << "No event loop for delta, parallel or mirrored downloads or prefetching, using threads";
+  }
+  int connfd = -1;
+  std::thread prefetcher;
+  if (plan.fetch_only) {
+    LOG_INFO << "Prefetching " << ds->target.filename() << " to " << ds->staging_file;
+    prefetcher = std::thread(prefetchImage, ds.get());
+    rc = 0;
+  } else if (event_loop) {
+    installing = ds.get();
+    connfd = ipc_inst_start_ext(&req, sizeof(req));
+    rc = connfd;
+  } else {
+    rc = startInstall(ds.get(), readimage, &req);
+  }
   if (rc < 0) {
     std::cout << "swupdate start error" << std::endl;
-    pthread_mutex_unlock(&mymutex);
     return -1;
   }
 
-  pthread_mutex_lock(&mymutex);
-  pthread_cond_wait(&cv_end, &mymutex);
-  pthread_mutex_unlock(&mymutex);
+  LOG_INFO << "SHA acceleration: " << shaAcceleration() << (event_loop ? ", event loop" : "");
+  if (ds->decompress) {
+    const size_t window = ds->decompress->window();
+    LOG_INFO << "Decompressing " << compressionName(ds->compression) << " image, "
+             << (window > 0 ? "up to " + std::to_string(window) + " frames in parallel" : std::string("streaming"));
+  }
+  ds->startStages();
+  if (resume_offset > 0) {
+    LOG_INFO << "Resuming download of " << ds->target.filename() << " at " << resume_offset << " bytes";
+  }
 
-  return 0;
+  if (event_loop) {
+    eventLoopInstall(ds.get(), connfd, resume_offset);
+  } else {
+    if (resume_offset > 0 && !replayStagedPrefix(ds.get(), resume_offset)) {
+      std::fprintf(stderr, "Could not read back staged image\n");
+      ds->failed = true;
+    }
+
+    // Download while SWUpdate's reader thread installs from the ring, or the
+    // prefetcher drops what the stages are done with. MirrorDownload hands us
+    // the curl handle of the transfer carrying the download, which
+    // ProgressHandler needs to resume a transfer paused by DownloadHandler,
+    // and moves on to another mirror if this one stalls or fails. A resumed
+    // download continues with a Range request from the checkpoint offset.
+    // With --connections the rest of the image is fetched in segments
+    // instead, see parallelDownload(). A delta update only fetches what the
+    // seeds do not have, see deltaDownload().
+    if (!ds->failed && ds->downloaded_length < ds->target.length() && delta) {
+      if (!deltaDownload(ds.get(), *delta)) {
+        ds->failed = true;
+      }
+    } else if (!ds->failed && ds->downloaded_length < ds->target.length() && options.connections > 1) {
+      if (!parallelDownload(ds.get())) {
+        ds->failed = true;
+      }
+    } else if (!ds->failed && ds->downloaded_length < ds->target.length()) {
+      MirrorDownload download(http, ds->mirrors, DownloadHandler, ProgressHandler, ds.get());
+      download.setHedgeAfter(options.hedge_after);
+      DownloadMetaStruct* dst = ds.get();
+      download.setHandleCallback([dst](const CurlHandler& easy) { dst->curl = easy; });
+      const bool ok = download.download(ds->downloaded_length, ds->target.length());
+      if (!ds->failed && !ds->abortedByOperator() && (!ok || ds->downloaded_length != ds->target.length())) {
+        std::fprintf(stderr, "Download failed: %s\n", download.error().c_str());
+        ds->failed = true;
+      }
+      if (download.hedges() != 0 || download.failovers() != 0) {
+        LOG_INFO << "Download ended on " << download.url() << " after " << download.hedges()
+                 << " hedged requests and " << download.failovers() << " failovers";
+      }
+    }
+  }
+  // The install does not depend on the staging copy, and a checkpoint is
+  // only saved once the data it covers is synced, so a failing disk just
+  // means less to resume from.
+  bool staged = ds->staging && ds->staging->finish();
+  if (ds->staging && !staged) {
+    LOG_WARNING << "Could not write staging file " << ds->staging_file;
+  }
+  ds->stream.close();
+
+  waitForInstall(ds.get());
+  if (prefetcher.joinable()) {
+    prefetcher.join();
+  }
+  const bool installed = ds->install_status == EXIT_SUCCESS && !ds->failed;
+
+  if (cache) {
+    if (installed && staged && ds->downloaded_length == ds->target.length()) {
+      if (cache->insert(cache_key, ds->staging_file) && plan.fetch_only) {
+        ds->staging_file = cache->lookup(cache_key);
+      }
+    } else if (ds->checkpoint_file.empty() && ds->staging_file == cache->stagingPath(cache_key)) {
+      boost::filesystem::remove(ds->staging_file);  // nothing can resume from it
+    }
+  }
+
+  // Only an interrupted download, aborted ones included, is worth resuming.
+  // A complete or corrupt one would just be replayed into the same result.
+  if (!ds->checkpoint_file.empty() &&
+      (ds->downloaded_length == ds->target.length() || ds->corrupt)) {
+    removeCheckpoint(ds->checkpoint_file);
+  }
+  if (options.prefetch && installed && staged) {
+    std::printf("Prefetched and verified %s at %s, install it with --install-staged\n",
+                ds->target.filename().c_str(), ds->staging_file.c_str());
+  } else if (plan.fetch_only && installed && !staged) {
+    std::fprintf(stderr, "Verified %s, but could not stage it\n", ds->target.filename().c_str());
+  }
+
+  if (!installed || (plan.fetch_only && !staged)) {
+    return -1;
+  }
+  return plan.fetch_only && !keepImage(plan, ds.get()) ? -1 : 0;
+}
+
+// Installs the image fetched for plan, see keepImage().
+static int installFetched(TargetPlan& plan) {
+  auto ds = std_::make_unique<DownloadMetaStruct>(plan.target, nullptr, &flow_control, plan.memory_budget);
+  ds->cached = std::move(plan.image);
+  ds->cached_digests = std::move(plan.digests);
+  struct swupdate_request req;
+  swupdate_prepare_req(&req);
+  return cachedInstall(ds.get(), &req, "the image cache");
 }
 
-int main() {
-  std::string jsonFilePath = "./test.json";
+// Updates every target, see UpdateScheduler. A single target is downloaded
+// while SWUpdate installs it, as always. Of several, the largest is too,
+// while up to options.concurrent_targets - 1 others are fetched into the
+// image cache alongside it, to be installed from there one after another
+// once SWUpdate is free. Targets running at once share the connections, the
+// rate cap and the memory budget, of which each gets an equal share. With
+// --prefetch every target is only fetched, and with --install-staged every
+// one is installed from what a prefetch staged.
+static int updateTargets() {
+  std::vector<std::string> metadata_errors;
+  uint64_t fixed_buffers = 0;
+  for (const auto& target : targets) {
+    metadata_errors.push_back(targetMetadataError(target));
+    if (metadata_errors.back().empty()) {
+      fixed_buffers = std::max(fixed_buffers, fixedBufferSize(targetCompression(target)));
+    }
+  }
+  // The budget is only checked against the targets that get as far as using it.
+  fixed_buffers = std::max<uint64_t>(fixed_buffers, 1);
+  if (fixed_buffers > options.memory_budget) {
+    std::fprintf(stderr, "The buffers for these options need %llu MiB, more than --memory-budget\n",
+                 static_cast<unsigned long long>((fixed_buffers + 1024 * 1024 - 1) / (1024 * 1024)));
+    return -1;
+  }
+  const auto concurrent = static_cast<unsigned int>(std::min<uint64_t>(
+      {targets.size(), std::max(options.concurrent_targets, 1U), options.memory_budget / fixed_buffers}));
+  const bool streaming = !options.prefetch && !options.install_staged;
+  if (targets.size() > 1 && concurrent < std::min<size_t>(targets.size(), options.concurrent_targets)) {
+    LOG_INFO << "The memory budget allows " << concurrent << " targets at once";
+  }
+  size_t largest = 0;
+  for (size_t i = 1; i < targets.size(); ++i) {
+    if (targets[i].length() > targets[largest].length()) {
+      largest = i;
+    }
+  }
 
-  if (parseJsonFile(jsonFilePath, jsonDataOut) == 0) {
-    swupdate_test_func();
+  std::vector<TargetPlan> plans;
+  plans.reserve(targets.size());
+  for (size_t i = 0; i < targets.size(); ++i) {
+    plans.emplace_back(targets[i]);
+    TargetPlan& plan = plans.back();
+    plan.staging_file = options.staging_file;
+    plan.checkpoint_file = options.checkpoint_file;
+    if (targets.size() > 1 && !plan.checkpoint_file.empty()) {
+      plan.checkpoint_file += "." + ImageCache::key(targetDigest(plan.target));
+    }
+    plan.memory_budget = options.memory_budget / (options.install_staged ? 1 : concurrent);
+    plan.fetch_only = options.prefetch || (streaming && concurrent > 1 && i != largest);
+    plan.metadata_error = metadata_errors[i];
+  }
+  UpdateScheduler scheduler(streaming && concurrent > 1 ? concurrent - 1 : concurrent);
+  for (auto& plan : plans) {
+    UpdateScheduler::Job job;
+    job.name = plan.target.filename();
+    job.size = plan.target.length();
+    TargetPlan* target_plan = &plan;
+    auto update = [target_plan] { return updateTarget(*target_plan) == 0; };
+    if (!plan.fetch_only) {
+      job.install = update;
+    } else {
+      job.fetch = update;
+      if (!options.prefetch) {
+        job.install = [target_plan] { return installFetched(*target_plan) == 0; };
+      }
+    }
+    scheduler.add(std::move(job));
   }
 
-  return 0;
+  const std::vector<UpdateScheduler::Outcome> outcomes = scheduler.run();
+  bool done = true;
+  for (size_t i = 0; i < outcomes.size(); ++i) {
+    done = done && outcomes[i] == UpdateScheduler::Outcome::kDone;
+    if (!scheduler.error(i).empty()) {
+      LOG_ERROR << "Update of " << targets[i].filename() << " failed: " << scheduler.error(i);
+    }
+    if (targets.size() > 1) {
+      std::printf("%s: %s\n", targets[i].filename().c_str(),
+                  outcomes[i] == UpdateScheduler::Outcome::kDone     ? (options.prefetch ? "fetched" : "installed")
+                  : outcomes[i] == UpdateScheduler::Outcome::kFailed ? "FAILED"
+                                                                     : "skipped");
+    }
+  }
+  return done ? 0 : -1;
 }
+
+int swupdate_test_func() {
+  // Initialize the actual `PackageManagerInterface`
+  connection_cache = ConnectionCache::create(options.tls_session_file);
+  rate_limiter.reset();
+  if (options.max_rate != 0 || !options.rate_schedule.empty()) {
+    rate_limiter = std::make_shared<RateLimiter>(options.max_rate, options.rate_burst, options.rate_schedule);
+  }
+  http = makeHttpClient();
+  // PackageConfig pconfig;
+  // BootloaderConfig bconfig;
+  // packageManager = PackageManagerFactory::makePackageManager(pconfig, bconfig, storage, http);
+
+  // Writes the metrics once more on every way out, after the install ended.
+  std::unique_ptr<MetricsReporter> reporter;
+  if (!options.metrics_file.empty()) {
+    reporter = std_::make_unique<MetricsReporter>(metrics, options.metrics_file, options.metrics_interval);
+  }
+
+  const int rc = updateTargets();
+  if (!connection_cache->saveSessions()) {
+    LOG_WARNING << "Could not write TLS sessions to " << options.tls_session_file;
+  }
+  LOG_DEBUG << "Connections: " << connection_cache->connections() << " opened, "
+            << connection_cache->reusedConnections() << " reused, " << connection_cache->resumedSessions()
+            << " TLS sessions resumed";
+  return rc;
+}
+
+// Linux I/O priorities, from linux/ioprio.h, which older kernel headers lack.
+static constexpr int kIoprioWhoProcess = 1;
+static constexpr int kIoprioClassShift = 13;
+static constexpr int kIoprioClassIdle = 3;
+
+// Runs the update as a background job while it lives: at a low CPU priority,
+// and in the idle I/O class, which only gets the disk when no one else wants
+// it. Both are per thread on Linux, and only the threads started afterwards
+// inherit them, so it must be set up before the update starts any. The
+// previous priorities are restored at the end where permitted.
+class BackgroundPriority {
+ public:
+  explicit BackgroundPriority(int nice_level) {
+    errno = 0;
+    const int nice_before = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0) {
+      nice_ = nice_before;
+    }
+    if (setpriority(PRIO_PROCESS, 0, nice_level) != 0) {
+      LOG_WARNING << "Could not lower the CPU priority: " << std::strerror(errno);
+    }
+    ioprio_ = static_cast<int>(syscall(SYS_ioprio_get, kIoprioWhoProcess, 0));
+    if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift) != 0) {
+      LOG_WARNING << "Could not switch to the idle I/O class: " << std::strerror(errno);
+    }
+  }
+  ~BackgroundPriority() {
+    if (ioprio_ >= 0) {
+      syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, ioprio_);
+    }
+    if (nice_ != kUnknown) {
+      setpriority(PRIO_PROCESS, 0, nice_);
+    }
+  }
+  BackgroundPriority(const BackgroundPriority&) = delete;
+  BackgroundPriority& operator=(const BackgroundPriority&) = delete;
+
+ private:
+  static constexpr int kUnknown = INT_MIN;
+  int nice_{kUnknown};
+  int ioprio_{-1};
+};
+
+int swupdate_poc_main(int argc, char** argv) {
+  std::string jsonFilePath;
+  uint64_t checkpoint_interval_mb = 0;
+  size_t segment_size_mb = 0;
+  uint64_t cache_size_mb = 0;
+  uint64_t memory_budget_mb = 0;
+  double metrics_interval_s = 0;
+  double progress_interval_s = 0;
+  double max_rate_mb = 0;
+  double rate_burst_mb = 0;
+  std::string rate_schedule;
+  uint64_t hedge_after_ms = 0;
+
+  bpo::options_description description("swupdate-poc command line options");
+  // clang-format off
+  description.add_options()
+      ("help,h", "print usage")
+      ("target,t", bpo::value<std::string>(&jsonFilePath)->default_value("./test.json"), "target metadata (JSON)")
+      ("target-name", bpo::value<std::vector<std::string>>(&options.target_names)->composing(),
+       "take --target as Uptane targets metadata and install the target of this name; repeatable")
+      ("concurrent-targets", bpo::value<unsigned int>(&options.concurrent_targets)->default_value(4),
+       "with several --target-name, download this many at once while installing one after another")
+      ("hardware-id", bpo::value<std::string>(&options.hardware_id),
+       "refuse an image whose sw-description is for other boards, and with --target-name a target for others")
+      ("hardware-revision", bpo::value<std::string>(&options.hardware_revision),
+       "refuse an image whose sw-description hardware-compatibility lacks this revision")
+      ("targets-index", bpo::value<std::string>(&options.targets_index),
+       "with --target-name, look the target up in an index kept at this path")
+      ("url,u", bpo::value<std::string>(&url)->default_value(url), "image URL")
+      ("mirror", bpo::value<std::vector<std::string>>(&options.mirrors)->composing(),
+       "another URL of the image, to fail over to or pick if it answers faster; repeatable")
+      ("hedge-after", bpo::value<uint64_t>(&hedge_after_ms)->default_value(1000),
+       "ms without data after which the next mirror is asked for the rest of the image too, 0 for never")
+      ("staging-file", bpo::value<std::string>(&options.staging_file), "keep an on-disk copy of the image at this path")
+      ("checkpoint-file", bpo::value<std::string>(&options.checkpoint_file),
+       "persist download progress here to resume after a crash, needs --staging-file")
+      ("checkpoint-interval", bpo::value<uint64_t>(&checkpoint_interval_mb)->default_value(16), "MiB between checkpoints")
+      ("connections", bpo::value<unsigned int>(&options.connections)->default_value(1),
+       "download over this many parallel Range connections")
+      ("segment-size", bpo::value<size_t>(&segment_size_mb)->default_value(4), "MiB per Range request with --connections")
+      ("no-zero-copy", "always copy the download through curl, also where it could be spliced")
+      ("tls-session-file", bpo::value<std::string>(&options.tls_session_file),
+       "keep TLS sessions in this file so that the next run resumes them instead of a full handshake")
+      ("event-loop", "download and feed SWUpdate from one event loop thread instead of blocking threads")
+      ("prefetch", "download, verify and stage the image in the background without installing it")
+      ("prefetch-nice", bpo::value<int>(&options.prefetch_nice)->default_value(19), "nice level of a --prefetch")
+      ("install-staged", "install the image --prefetch staged, without downloading anything")
+      ("max-rate", bpo::value<double>(&max_rate_mb)->default_value(0),
+       "cap the download at this many MiB/s, 0 for none")
+      ("rate-burst", bpo::value<double>(&rate_burst_mb)->default_value(1), "MiB that may go over --max-rate at once")
+      ("rate-schedule", bpo::value<std::string>(&rate_schedule),
+       "caps for times of day instead of --max-rate, as HH:MM-HH:MM=MiB/s[,...] in local time, 0 for none")
+      ("cache-dir", bpo::value<std::string>(&options.cache_dir), "keep verified images here and reinstall from them")
+      ("cache-size", bpo::value<uint64_t>(&cache_size_mb)->default_value(4096), "MiB the image cache may use")
+      ("seed", bpo::value<std::vector<std::string>>(&options.seeds)->composing(),
+       "file or partition holding an earlier image, for delta updates; repeatable")
+      ("decode-threads", bpo::value<unsigned int>(&options.decode_threads)->default_value(options.decode_threads),
+       "threads decoding a compressed image made of independent frames")
+      ("memory-budget", bpo::value<uint64_t>(&memory_budget_mb)->default_value(64),
+       "MiB the pipeline may allocate for buffers; what rings, staging and --connections leave decodes frames")
+      ("metrics-file", bpo::value<std::string>(&options.metrics_file),
+       "write per-stage latency histograms here, as Prometheus text if it ends in .prom, else JSON")
+      ("metrics-interval", bpo::value<double>(&metrics_interval_s)->default_value(5), "seconds between metrics writes")
+      ("progress-interval", bpo::value<double>(&progress_interval_s)->default_value(1),
+       "least seconds between two progress reports");
+  // clang-format on
+
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::parse_command_line(argc, argv, description), vm);
+    bpo::notify(vm);
+  } catch (const bpo::error& e) {
+    std::cerr << e.what() << std::endl << description;
+    return EXIT_FAILURE;
+  }
+  if (vm.count("help") != 0) {
+    std::cout << description;
+    return EXIT_SUCCESS;
+  }
+  if (!options.checkpoint_file.empty() && options.staging_file.empty() && options.cache_dir.empty()) {
+    std::cerr << "--checkpoint-file needs --staging-file or --cache-dir" << std::endl;
+    return EXIT_FAILURE;
+  }
+  options.checkpoint_interval = std::max<uint64_t>(checkpoint_interval_mb, 1) * 1024 * 1024;
+  options.segment_size = std::max<size_t>(segment_size_mb, 1) * 1024 * 1024;
+  options.zero_copy = vm.count("no-zero-copy") == 0;
+  options.event_loop = vm.count("event-loop") != 0;
+  options.prefetch = vm.count("prefetch") != 0;
+  options.install_staged = vm.count("install-staged") != 0;
+  if (!vm["url"].defaulted()) {
+    options.mirrors.insert(options.mirrors.begin(), url);
+  }
+  options.hedge_after = std::chrono::milliseconds(hedge_after_ms);
+  options.max_rate = static_cast<uint64_t>(std::llround(std::max(max_rate_mb, 0.0) * 1024 * 1024));
+  options.rate_burst = static_cast<uint64_t>(std::llround(std::max(rate_burst_mb, 0.0) * 1024 * 1024));
+  options.cache_size = cache_size_mb * 1024 * 1024;
+  options.memory_budget = memory_budget_mb * 1024 * 1024;
+  options.metrics_interval = std::chrono::milliseconds(std::max<int64_t>(std::llround(metrics_interval_s * 1000), 100));
+  options.progress_interval =
+      std::chrono::milliseconds(std::max<int64_t>(std::llround(progress_interval_s * 1000), 10));
+
+  if (options.prefetch && options.install_staged) {
+    std::cerr << "--prefetch and --install-staged are two separate runs" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if ((options.prefetch || options.install_staged) && options.staging_file.empty() && options.cache_dir.empty()) {
+    std::cerr << "--prefetch and --install-staged need --staging-file or --cache-dir" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!rate_schedule.empty() && !RateLimiter::parseSchedule(rate_schedule, &options.rate_schedule)) {
+    std::cerr << "Malformed --rate-schedule " << rate_schedule << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!options.targets_index.empty() && options.target_names.empty()) {
+    std::cerr << "--targets-index needs --target-name" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (options.target_names.size() > 1) {
+    if (options.cache_dir.empty() || !options.staging_file.empty()) {
+      std::cerr << "Several --target-name stage their images in --cache-dir, not --staging-file" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (!options.mirrors.empty()) {
+      std::cerr << "--url and --mirror are for a single target; several take theirs from the metadata" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Both before the update starts any thread, see BackgroundPriority and
+  // SignalFlowControl.
+  std::unique_ptr<BackgroundPriority> background;
+  if (options.prefetch) {
+    background = std_::make_unique<BackgroundPriority>(options.prefetch_nice);
+  }
+  flow_control.reset();
+  SignalFlowControl signals(flow_control);
+
+  targets.clear();
+  int parsed = 0;
+  if (options.target_names.empty()) {
+    Json::Value jsonDataOut;
+    parsed = parseJsonFile(jsonFilePath, jsonDataOut);
+    targets.emplace_back("test", jsonDataOut);
+  }
+  for (const auto& target_name : options.target_names) {
+    Json::Value jsonDataOut;
+    if (parsed == 0 && (parsed = loadTarget(jsonFilePath, target_name, jsonDataOut)) == 0) {
+      targets.emplace_back(target_name, jsonDataOut);
+    }
+  }
+  if (parsed != 0 || swupdate_test_func() != 0) {
+    if (flow_control.hasAborted()) {
+      std::printf("Update aborted\n");
+    }
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char** argv) { return swupdate_poc_main(argc, argv); }
+#endif
@@ -0,0 +1,155 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+// Prometheus buckets start at 2^10 ns, about 1 us; shorter samples are not
+// worth a series of their own.
+static constexpr size_t kFirstExportedBucket = 10;
+
+void LatencyHistogram::record(std::chrono::nanoseconds duration) {
+  const uint64_t ns = duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0;
+  size_t bucket = ns == 0 ? 0 : static_cast<size_t>(64 - __builtin_clzll(ns));
+  bucket = std::min(bucket, kBuckets - 1);
+  counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+  uint64_t max = max_ns_.load(std::memory_order_relaxed);
+  while (ns > max && !max_ns_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+  }
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+  Snapshot snapshot;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    snapshot.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    snapshot.count += snapshot.counts[i];
+  }
+  snapshot.sum_ns = sum_ns_.load(std::memory_order_relaxed);
+  snapshot.max_ns = max_ns_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+uint64_t LatencyHistogram::Snapshot::quantileNs(double q) const {
+  const auto rank = static_cast<uint64_t>(q * static_cast<double>(count));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += counts[i];
+    if (seen > rank) {
+      return std::min(bucketLimitNs(i), max_ns);
+    }
+  }
+  return max_ns;
+}
+
+const char* stageName(Stage stage) {
+  switch (stage) {
+    case Stage::kNetworkWait:
+      return "network_wait";
+    case Stage::kCurlCallback:
+      return "curl_callback";
+    case Stage::kQueueWait:
+      return "queue_wait";
+    case Stage::kHash:
+      return "hash";
+    case Stage::kDecompress:
+      return "decompress";
+    case Stage::kArchive:
+      return "archive";
+    case Stage::kReadimageWait:
+      return "readimage_wait";
+    case Stage::kIpcWrite:
+      return "ipc_write";
+    case Stage::kInstallFinish:
+      return "install_finish";
+    case Stage::kCount:
+    default:
+      return "unknown";
+  }
+}
+
+static double seconds(uint64_t ns) { return static_cast<double>(ns) / 1e9; }
+
+// Written by hand rather than with jsoncpp, so that the pipeline benchmark
+// can link the instrumented stages without it.
+std::string PipelineMetrics::json() const {
+  std::ostringstream out;
+  out << "{\n  \"elapsed_seconds\": "
+      << std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count() << ",\n"
+      << "  \"bytes\": {\"downloaded\": " << downloaded_.load(std::memory_order_relaxed)
+      << ", \"installed\": " << installed_.load(std::memory_order_relaxed) << "},\n"
+      << "  \"stages\": {";
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    const auto snapshot = stages_[i].snapshot();
+    out << (i == 0 ? "\n" : ",\n") << "    \"" << stageName(static_cast<Stage>(i)) << "\": {"
+        << "\"count\": " << snapshot.count << ", \"sum_seconds\": " << seconds(snapshot.sum_ns)
+        << ", \"max_seconds\": " << seconds(snapshot.max_ns)
+        << ", \"p50_seconds\": " << seconds(snapshot.quantileNs(0.50))
+        << ", \"p99_seconds\": " << seconds(snapshot.quantileNs(0.99)) << "}";
+  }
+  out << "\n  }\n}\n";
+  return out.str();
+}
+
+std::string PipelineMetrics::prometheus() const {
+  std::ostringstream out;
+  out << "# HELP swupdate_poc_stage_seconds Time taken by each event of an update pipeline stage.\n"
+      << "# TYPE swupdate_poc_stage_seconds histogram\n";
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    const auto snapshot = stages_[i].snapshot();
+    const std::string label = std::string("stage=\"") + stageName(static_cast<Stage>(i)) + "\"";
+    uint64_t cumulative = 0;
+    for (size_t bucket = 0; bucket < LatencyHistogram::kBuckets - 1; ++bucket) {
+      cumulative += snapshot.counts[bucket];
+      if (bucket >= kFirstExportedBucket) {
+        out << "swupdate_poc_stage_seconds_bucket{" << label << ",le=\""
+            << seconds(LatencyHistogram::bucketLimitNs(bucket)) << "\"} " << cumulative << "\n";
+      }
+    }
+    out << "swupdate_poc_stage_seconds_bucket{" << label << ",le=\"+Inf\"} " << snapshot.count << "\n"
+        << "swupdate_poc_stage_seconds_sum{" << label << "} " << seconds(snapshot.sum_ns) << "\n"
+        << "swupdate_poc_stage_seconds_count{" << label << "} " << snapshot.count << "\n";
+  }
+  out << "# HELP swupdate_poc_bytes_total Image bytes downloaded and handed to SWUpdate.\n"
+      << "# TYPE swupdate_poc_bytes_total counter\n"
+      << "swupdate_poc_bytes_total{direction=\"downloaded\"} " << downloaded_.load(std::memory_order_relaxed) << "\n"
+      << "swupdate_poc_bytes_total{direction=\"installed\"} " << installed_.load(std::memory_order_relaxed) << "\n";
+  return out.str();
+}
+
+bool PipelineMetrics::write(const std::string& path) const {
+  const bool prom = path.size() > 5 && path.compare(path.size() - 5, 5, ".prom") == 0;
+  // Scrapers must never see a half-written file.
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::trunc);
+    file << (prom ? prometheus() : json());
+    if (!file) {
+      return false;
+    }
+  }
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+MetricsReporter::MetricsReporter(const PipelineMetrics& metrics, std::string path, std::chrono::milliseconds interval)
+    : metrics_{metrics}, path_{std::move(path)}, interval_{interval} {
+  thread_ = std::thread(&MetricsReporter::run, this);
+}
+
+MetricsReporter::~MetricsReporter() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  metrics_.write(path_);
+}
+
+void MetricsReporter::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!cv_.wait_for(lock, interval_, [this] { return stop_; })) {
+    metrics_.write(path_);
+  }
+}
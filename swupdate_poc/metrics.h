@@ -0,0 +1,122 @@
+#ifndef SWUPDATE_POC_METRICS_H_
+#define SWUPDATE_POC_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Latency distribution with power-of-two buckets: bucket i counts samples
+// below 2^i ns (and at least 2^(i-1) ns). Recording is a few relaxed atomic
+// increments and never blocks, so it can sit on every chunk of the data path;
+// readers get a snapshot that may be a few samples behind.
+class LatencyHistogram {
+ public:
+  // Up to 2^39 ns, about 9 minutes; anything longer lands in the last bucket.
+  static constexpr size_t kBuckets = 40;
+
+  void record(std::chrono::nanoseconds duration);
+
+  struct Snapshot {
+    std::array<uint64_t, kBuckets> counts{};
+    uint64_t count{0};
+    uint64_t sum_ns{0};
+    uint64_t max_ns{0};
+    // Upper bound of the bucket holding quantile q, in ns.
+    uint64_t quantileNs(double q) const;
+  };
+  Snapshot snapshot() const;
+
+  static uint64_t bucketLimitNs(size_t bucket) { return uint64_t{1} << bucket; }
+
+ private:
+  std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+  std::atomic<uint64_t> sum_ns_{0};
+  std::atomic<uint64_t> max_ns_{0};
+};
+
+// Where the time of an update goes.
+enum class Stage : size_t {
+  kNetworkWait,     // between curl write callbacks, i.e. waiting for the network
+  kCurlCallback,    // inside the curl write callback, queue waits included
+  kQueueWait,       // a producer that found the stream ring full waiting for room
+  kHash,            // hashing one chunk
+  kDecompress,      // decoding one chunk or frame
+  kArchive,         // parsing and hashing one chunk of the .swu archive
+  kReadimageWait,   // readimage waiting for data
+  kIpcWrite,        // SWUpdate's IPC client writing what readimage handed it
+  kInstallFinish,   // from the end of the stream to SWUpdate's result
+  kCount,
+};
+const char* stageName(Stage stage);
+
+// Histograms and counters of one update.
+class PipelineMetrics {
+ public:
+  PipelineMetrics() : start_{std::chrono::steady_clock::now()} {}
+
+  LatencyHistogram& stage(Stage stage) { return stages_[static_cast<size_t>(stage)]; }
+  void addDownloaded(uint64_t bytes) { downloaded_.fetch_add(bytes, std::memory_order_relaxed); }
+  void addInstalled(uint64_t bytes) { installed_.fetch_add(bytes, std::memory_order_relaxed); }
+
+  std::string json() const;
+  // Prometheus text exposition format, for node_exporter's textfile collector.
+  std::string prometheus() const;
+  // Replaces path atomically with prometheus() if it ends in ".prom", with
+  // json() otherwise.
+  bool write(const std::string& path) const;
+
+ private:
+  std::array<LatencyHistogram, static_cast<size_t>(Stage::kCount)> stages_;
+  std::atomic<uint64_t> downloaded_{0};
+  std::atomic<uint64_t> installed_{0};
+  const std::chrono::steady_clock::time_point start_;
+};
+
+// Records the lifetime of the timer into a histogram; does nothing if the
+// histogram is null, so optional instrumentation costs one branch.
+class StageTimer {
+ public:
+  explicit StageTimer(LatencyHistogram* histogram)
+      : histogram_{histogram},
+        start_{histogram != nullptr ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{}} {}
+  ~StageTimer() {
+    if (histogram_ != nullptr) {
+      histogram_->record(std::chrono::steady_clock::now() - start_);
+    }
+  }
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+  LatencyHistogram* const histogram_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+// Writes the metrics to a file every interval while the update runs, and once
+// more when destroyed.
+class MetricsReporter {
+ public:
+  MetricsReporter(const PipelineMetrics& metrics, std::string path, std::chrono::milliseconds interval);
+  ~MetricsReporter();
+  MetricsReporter(const MetricsReporter&) = delete;
+  MetricsReporter& operator=(const MetricsReporter&) = delete;
+
+ private:
+  void run();
+
+  const PipelineMetrics& metrics_;
+  const std::string path_;
+  const std::chrono::milliseconds interval_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_{false};
+  std::thread thread_;
+};
+
+#endif  // SWUPDATE_POC_METRICS_H_
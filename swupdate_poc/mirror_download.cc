@@ -0,0 +1,292 @@
+#include "mirror_download.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <stdexcept>
+#include <thread>
+
+#include "logging/logging.h"
+
+// How often download() looks for finished and stalled transfers.
+static constexpr std::chrono::milliseconds kPollInterval{10};
+// Least time probeMirrors() waits for other mirrors once one answered.
+static constexpr std::chrono::milliseconds kProbeGrace{20};
+// Failures after which a mirror is given up on.
+static constexpr unsigned int kMirrorAttempts = 2;
+
+std::vector<Mirror> probeMirrors(const std::function<std::shared_ptr<CachedHttpClient>()>& make_http,
+                                 const std::vector<std::string>& urls, std::chrono::milliseconds timeout) {
+  // Shared with the probes, which may outlive the call.
+  struct Probes {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Mirror> mirrors;
+    size_t pending{0};
+    std::chrono::steady_clock::time_point first_answer;
+  };
+  auto probes = std::make_shared<Probes>();
+  const auto start = std::chrono::steady_clock::now();
+  probes->pending = urls.size();
+  for (const auto& url : urls) {
+    probes->mirrors.push_back(Mirror{url, std::chrono::microseconds(-1)});
+  }
+  for (size_t i = 0; i < urls.size(); ++i) {
+    std::thread([probes, http = make_http(), url = urls[i], i, timeout] {
+      const std::chrono::microseconds first_byte = http->probe(url, timeout);
+      std::lock_guard<std::mutex> guard(probes->mutex);
+      probes->mirrors[i].first_byte = first_byte;
+      if (first_byte.count() >= 0 && probes->first_answer == std::chrono::steady_clock::time_point{}) {
+        probes->first_answer = std::chrono::steady_clock::now();
+      }
+      --probes->pending;
+      probes->cv.notify_all();
+    }).detach();
+  }
+
+  // Mirrors that take more than twice as long as the fastest are not worth
+  // waiting for; they count as failed.
+  std::vector<Mirror> mirrors;
+  {
+    std::unique_lock<std::mutex> lock(probes->mutex);
+    probes->cv.wait_until(lock, start + timeout, [&probes] {
+      return probes->pending == 0 || probes->first_answer != std::chrono::steady_clock::time_point{};
+    });
+    if (probes->pending != 0 && probes->first_answer != std::chrono::steady_clock::time_point{}) {
+      const auto grace = std::max<std::chrono::steady_clock::duration>(probes->first_answer - start, kProbeGrace);
+      probes->cv.wait_until(lock, probes->first_answer + grace, [&probes] { return probes->pending == 0; });
+    }
+    mirrors = probes->mirrors;
+  }
+  std::stable_sort(mirrors.begin(), mirrors.end(), [](const Mirror& a, const Mirror& b) {
+    const bool a_ok = a.first_byte.count() >= 0;
+    const bool b_ok = b.first_byte.count() >= 0;
+    return a_ok && (!b_ok || a.first_byte < b.first_byte);
+  });
+  return mirrors;
+}
+
+MirrorDownload::MirrorDownload(std::shared_ptr<HttpInterface> http, std::vector<std::string> urls,
+                               curl_write_callback write_cb, curl_xferinfo_callback progress_cb, void* userp)
+    : http_{std::move(http)},
+      urls_{std::move(urls)},
+      write_cb_{write_cb},
+      progress_cb_{progress_cb},
+      userp_{userp},
+      wakeable_{dynamic_cast<CachedHttpClient*>(http_.get()) != nullptr},
+      failures_(urls_.size(), 0) {
+  if (urls_.empty()) {
+    throw std::invalid_argument("No mirror to download from");
+  }
+}
+
+// Takes the download over for leg if it delivers the next byte and the
+// current transfer is not in a callback; otherwise leg has lost the race.
+bool MirrorDownload::claim(Leg* leg) {
+  if (leg->lost) {
+    return false;
+  }
+  if (owner_ == leg) {
+    return true;
+  }
+  if (in_callback_ != 0 || leg->offset != delivered_) {
+    leg->lost = true;
+    return false;
+  }
+  if (owner_ != nullptr) {
+    LOG_INFO << "Continuing download at " << delivered_ << " bytes from " << urls_[leg->mirror];
+  }
+  for (auto& other : legs_) {
+    if (other.get() != leg) {
+      cancel(other.get());
+    }
+  }
+  owner_ = leg;
+  current_ = leg->mirror;
+  if (on_handle_) {
+    on_handle_(leg->easy);
+  }
+  return true;
+}
+
+// The transfer stops at its next callback, which a transfer through a
+// ConnectionCache gets right away.
+void MirrorDownload::cancel(Leg* leg) {
+  leg->lost = true;
+  if (wakeable_ && leg->easy) {
+    ConnectionCache::wakeup(leg->easy.get());
+  }
+}
+
+size_t MirrorDownload::WriteHandler(char* contents, size_t size, size_t nmemb, void* userp) {
+  auto* leg = static_cast<Leg*>(userp);
+  MirrorDownload* self = leg->download;
+  const size_t len = size * nmemb;
+  {
+    std::lock_guard<std::mutex> guard(self->mutex_);
+    if (!self->claim(leg)) {
+      return len + 1;  // curl will abort if return unexpected size;
+    }
+    ++self->in_callback_;
+    leg->held = false;
+    leg->last_data = std::chrono::steady_clock::now();
+  }
+  const size_t written = self->write_cb_(contents, size, nmemb, self->userp_);
+  std::lock_guard<std::mutex> guard(self->mutex_);
+  --self->in_callback_;
+  if (written == len) {
+    leg->offset += len;
+    self->delivered_ += len;
+  } else if (written == CURL_WRITEFUNC_PAUSE) {
+    leg->held = true;
+  } else {
+    self->stopped_ = true;
+  }
+  return written;
+}
+
+// Only the transfer carrying the download, or the first one before any
+// carries it, reports progress, so that progress_cb never sees two.
+int MirrorDownload::ProgressHandler(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                                    curl_off_t ulnow) {
+  auto* leg = static_cast<Leg*>(clientp);
+  MirrorDownload* self = leg->download;
+  {
+    std::lock_guard<std::mutex> guard(self->mutex_);
+    if (leg->lost || self->stopped_) {
+      return 1;  // cancels the transfer
+    }
+    if (self->progress_cb_ == nullptr || self->in_callback_ != 0 ||
+        (self->owner_ != leg && (self->owner_ != nullptr || leg != self->first_leg_))) {
+      return 0;
+    }
+    ++self->in_callback_;
+  }
+  const int result = self->progress_cb_(self->userp_, dltotal, dlnow, ultotal, ulnow);
+  std::lock_guard<std::mutex> guard(self->mutex_);
+  --self->in_callback_;
+  if (result != 0) {
+    self->stopped_ = true;
+  }
+  return result;
+}
+
+void MirrorDownload::start(size_t mirror) {
+  std::unique_ptr<Leg> leg(new Leg{this, mirror, delivered_, {}, {}, std::chrono::steady_clock::now()});
+  if (legs_.empty() && owner_ == nullptr) {
+    first_leg_ = leg.get();
+  }
+  leg->response = http_->downloadAsync(urls_[mirror], WriteHandler, ProgressHandler, leg.get(),
+                                       static_cast<curl_off_t>(delivered_), &leg->easy);
+  legs_.push_back(std::move(leg));
+}
+
+size_t MirrorDownload::nextMirror(size_t after) const {
+  for (size_t i = 1; i <= urls_.size(); ++i) {
+    const size_t mirror = (after + i) % urls_.size();
+    const bool busy = std::any_of(legs_.begin(), legs_.end(),
+                                  [mirror](const std::unique_ptr<Leg>& leg) { return leg->mirror == mirror; });
+    if (!busy && failures_[mirror] < kMirrorAttempts) {
+      return mirror;
+    }
+  }
+  return std::string::npos;
+}
+
+bool MirrorDownload::stalled(std::chrono::steady_clock::time_point now) const {
+  if (hedge_after_.count() == 0 || legs_.size() != 1 || in_callback_ != 0) {
+    return false;
+  }
+  const Leg& leg = *legs_.front();
+  return !leg.held && !leg.lost && now - leg.last_data >= hedge_after_;
+}
+
+void MirrorDownload::finish(Leg* leg) {
+  const HttpResponse response = leg->response.get();
+  if (owner_ == leg) {
+    owner_ = nullptr;
+  }
+  if (first_leg_ == leg) {
+    first_leg_ = nullptr;
+  }
+  if (leg->lost || stopped_ || delivered_ >= length_) {
+    return;
+  }
+  ++failures_[leg->mirror];
+  error_ = urls_[leg->mirror] + ": " +
+           (response.isOk() ? "response ended after " + std::to_string(leg->offset) + " bytes"
+                            : response.getStatusStr());
+  LOG_WARNING << "Download from " << error_;
+}
+
+bool MirrorDownload::download(uint64_t from, uint64_t length) {
+  length_ = length;
+  delivered_ = from;
+  stopped_ = false;
+  owner_ = nullptr;
+  first_leg_ = nullptr;
+  std::fill(failures_.begin(), failures_.end(), 0);
+  error_.clear();
+  if (from >= length) {
+    return true;
+  }
+
+  bool ok = false;
+  std::unique_lock<std::mutex> lock(mutex_);
+  start(current_ = 0);
+  for (;;) {
+    for (auto it = legs_.begin(); it != legs_.end();) {
+      if ((*it)->response.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        ++it;
+        continue;
+      }
+      finish(it->get());
+      it = legs_.erase(it);
+    }
+    if (stopped_) {
+      break;
+    }
+    if (delivered_ >= length_) {
+      ok = true;
+      break;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    // Time a transfer spends paused for the rate limiter is no stall.
+    for (auto& leg : legs_) {
+      if (wakeable_ && leg->easy && ConnectionCache::throttled(leg->easy.get())) {
+        leg->last_data = now;
+      }
+    }
+    if (legs_.empty()) {
+      const size_t next = nextMirror(current_);
+      if (next == std::string::npos) {
+        error_ = "every mirror failed, last " + error_;
+        break;
+      }
+      ++failovers_;
+      LOG_INFO << "Resuming download at " << delivered_ << " bytes from " << urls_[next];
+      start(current_ = next);
+    } else if (stalled(now)) {
+      const size_t next = nextMirror(legs_.front()->mirror);
+      if (next != std::string::npos) {
+        ++hedges_;
+        LOG_INFO << "No data from " << urls_[legs_.front()->mirror] << " for " << hedge_after_.count()
+                 << " ms, also requesting bytes from " << delivered_ << " of " << urls_[next];
+        start(next);
+      }
+    }
+    lock.unlock();
+    legs_.front()->response.wait_for(kPollInterval);
+    lock.lock();
+  }
+
+  // What is still running has lost, or the download is off.
+  for (auto& leg : legs_) {
+    cancel(leg.get());
+  }
+  lock.unlock();
+  for (auto& leg : legs_) {
+    leg->response.wait();
+  }
+  legs_.clear();
+  return ok;
+}
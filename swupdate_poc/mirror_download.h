@@ -0,0 +1,132 @@
+#ifndef SWUPDATE_POC_MIRROR_DOWNLOAD_H_
+#define SWUPDATE_POC_MIRROR_DOWNLOAD_H_
+
+#include <curl/curl.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "connection_cache.h"
+#include "http/httpinterface.h"
+
+struct Mirror {
+  std::string url;
+  // Time to first byte when probed; negative if the probe failed or was
+  // not waited for.
+  std::chrono::microseconds first_byte{-1};
+};
+
+// Probes the time to first byte of every url at once, see
+// CachedHttpClient::probe(), and returns them fastest first, followed by
+// those that failed, or did not answer within twice the time the fastest
+// took, in their original order. Returns once that is known, or after
+// timeout.
+std::vector<Mirror> probeMirrors(const std::function<std::shared_ptr<CachedHttpClient>()>& make_http,
+                                 const std::vector<std::string>& urls, std::chrono::milliseconds timeout);
+
+// Downloads one image from whichever of several mirrors serves it best, over
+// one connection at a time.
+//
+// The download starts on the first mirror. If it stalls, i.e. delivers
+// nothing for the hedge delay while neither the write callback nor a rate
+// limiter is holding it back, the same bytes are requested from the next mirror as well; whichever
+// transfer delivers the next byte first carries on with the download and the
+// other one is cancelled. If a mirror fails, the download continues on the
+// next one with a Range request where it stopped. Either way the write
+// callback sees a single sequential stream, so whatever consumes it, such as
+// a running digest, just carries on.
+//
+// write_cb and progress_cb are called as for HttpInterface::downloadAsync(),
+// but only for the transfer currently carrying the download, and never from
+// two transfers at once. Mirrors have to honour Range requests.
+class MirrorDownload {
+ public:
+  // Sees the easy handle of the transfer carrying the download whenever it
+  // changes, e.g. for progress_cb to resume it.
+  using HandleCallback = std::function<void(const CurlHandler& easy)>;
+
+  MirrorDownload(std::shared_ptr<HttpInterface> http, std::vector<std::string> urls, curl_write_callback write_cb,
+                 curl_xferinfo_callback progress_cb, void* userp);
+  MirrorDownload(const MirrorDownload&) = delete;
+  MirrorDownload& operator=(const MirrorDownload&) = delete;
+
+  // Hedge delay; 0 never hedges.
+  void setHedgeAfter(std::chrono::milliseconds delay) { hedge_after_ = delay; }
+  void setHandleCallback(HandleCallback on_handle) { on_handle_ = std::move(on_handle); }
+
+  // Downloads bytes [from, length) of the image. Returns false once every
+  // mirror failed, or once the callbacks stopped the download.
+  bool download(uint64_t from, uint64_t length);
+
+  const std::string& error() const { return error_; }
+  // Mirror the download finished, or last ran, on.
+  const std::string& url() const { return urls_[current_]; }
+  // Hedged requests sent, and mirrors given up on mid-download.
+  unsigned int hedges() const { return hedges_; }
+  unsigned int failovers() const { return failovers_; }
+
+ private:
+  // One request to one mirror.
+  struct Leg {
+    MirrorDownload* download;
+    size_t mirror;
+    // Offset of the next byte it delivers.
+    uint64_t offset;
+    CurlHandler easy;
+    std::future<HttpResponse> response;
+    std::chrono::steady_clock::time_point last_data;
+    // The write callback paused it; it is not stalled.
+    bool held{false};
+    // Another transfer carries the download; it is to stop.
+    bool lost{false};
+  };
+
+  static size_t WriteHandler(char* contents, size_t size, size_t nmemb, void* userp);
+  static int ProgressHandler(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                             curl_off_t ulnow);
+
+  bool claim(Leg* leg);
+  void cancel(Leg* leg);
+  void start(size_t mirror);
+  // The mirror to try next, or npos once every mirror failed too often.
+  size_t nextMirror(size_t after) const;
+  bool stalled(std::chrono::steady_clock::time_point now) const;
+  void finish(Leg* leg);
+
+  const std::shared_ptr<HttpInterface> http_;
+  const std::vector<std::string> urls_;
+  const curl_write_callback write_cb_;
+  const curl_xferinfo_callback progress_cb_;
+  void* const userp_;
+  // Transfers run through a ConnectionCache and can be woken to cancel them.
+  const bool wakeable_;
+  std::chrono::milliseconds hedge_after_{1000};
+  HandleCallback on_handle_;
+
+  uint64_t length_{0};
+  std::vector<unsigned int> failures_;
+  std::vector<std::unique_ptr<Leg>> legs_;
+  std::mutex mutex_;
+  // The transfer carrying the download, and how many of its callbacks are
+  // running; it cannot be replaced while any is.
+  Leg* owner_{nullptr};
+  int in_callback_{0};
+  // Reports progress until a transfer carries the download.
+  Leg* first_leg_{nullptr};
+  // Offset of the next byte the write callback takes.
+  uint64_t delivered_{0};
+  // The callbacks failed a transfer: the download is off.
+  bool stopped_{false};
+  size_t current_{0};
+  unsigned int hedges_{0};
+  unsigned int failovers_{0};
+  std::string error_;
+};
+
+#endif  // SWUPDATE_POC_MIRROR_DOWNLOAD_H_
@@ -0,0 +1,160 @@
+#include "mock_swupdate_ipc.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <tuple>
+
+extern "C" {
+#include "network_ipc.h"
+}
+
+MockSwupdateIpc::MockSwupdateIpc(std::string socket_path, uint64_t expected_length)
+    : MockSwupdateIpc(std::move(socket_path), std::vector<uint64_t>{expected_length}) {}
+
+MockSwupdateIpc::MockSwupdateIpc(std::string socket_path, std::vector<uint64_t> expected_lengths)
+    : socket_path_{std::move(socket_path)}, expected_lengths_{std::move(expected_lengths)} {
+  sockaddr_un addr{};
+  if (socket_path_.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + socket_path_);
+  }
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    throw std::runtime_error("socket failed");
+  }
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd_, 8) != 0) {
+    close(listen_fd_);
+    throw std::runtime_error("Could not listen on " + socket_path_ + ", is SWUpdate running?");
+  }
+  acceptor_ = std::thread(&MockSwupdateIpc::acceptLoop, this);
+}
+
+MockSwupdateIpc::~MockSwupdateIpc() {
+  stopping_ = true;
+  shutdown(listen_fd_, SHUT_RDWR);
+  acceptor_.join();
+  close(listen_fd_);
+  unlink(socket_path_.c_str());
+  {
+    // Polls still waiting see stopping_ once they wake up.
+    std::lock_guard<std::mutex> guard(mutex_);
+  }
+  cv_.notify_all();
+  for (auto& connection : connections_) {
+    connection.join();
+  }
+}
+
+void MockSwupdateIpc::acceptLoop() {
+  while (!stopping_) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    connections_.emplace_back(&MockSwupdateIpc::serve, this, fd);
+  }
+}
+
+static bool readAll(int fd, void* data, size_t len) {
+  auto* p = static_cast<char*>(data);
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const void* data, size_t len) {
+  const auto* p = static_cast<const char*>(data);
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Every client connection starts with one ipc_message: status polls from
+// ipc_wait_for_complete() and the install request from ipc_inst_start_ext(),
+// which is then followed by the raw image on the same connection.
+void MockSwupdateIpc::serve(int fd) {
+  ipc_message msg{};
+  if (readAll(fd, &msg, sizeof(msg)) && msg.magic == IPC_MAGIC) {
+    if (msg.type == GET_STATUS) {
+      reportStatus(fd);
+    } else {
+      receiveImage(fd);
+    }
+  }
+  close(fd);
+}
+
+void MockSwupdateIpc::receiveImage(int fd) {
+  ipc_message reply{};
+  reply.magic = IPC_MAGIC;
+  reply.type = ACK;
+  uint64_t length = 0;
+  if (writeAll(fd, &reply, sizeof(reply))) {
+    std::vector<char> buf(256 * 1024);
+    ssize_t n;
+    while ((n = read(fd, buf.data(), buf.size())) > 0) {
+      length += static_cast<uint64_t>(n);
+      received_ += static_cast<uint64_t>(n);
+      if (receive_observer_) {
+        receive_observer_(received_);
+      }
+    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto expected = std::find(expected_lengths_.begin(), expected_lengths_.end(), length);
+    const bool ok = expected != expected_lengths_.end();
+    if (ok) {
+      expected_lengths_.erase(expected);
+      ++installs_;
+    }
+    results_.emplace_back(ok, length);
+  }
+  cv_.notify_all();
+}
+
+// Holds the poll until the install connection has closed, so the client sees
+// the final state right away instead of polling once a second. Each install
+// is polled for once, after its connection, so polls take the results in
+// order, whichever thread got to its connection first. The reply is
+// IDLE with the result, which ends ipc_wait_for_complete(); the description
+// is set because the client sleeps before acting on an empty, unchanged one.
+void MockSwupdateIpc::reportStatus(int fd) {
+  bool ok = false;
+  uint64_t length = 0;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !results_.empty() || stopping_; });
+    if (!results_.empty()) {
+      std::tie(ok, length) = results_.front();
+      results_.pop_front();
+    }
+  }
+  ipc_message reply{};
+  reply.magic = IPC_MAGIC;
+  reply.type = ACK;
+  reply.data.status.current = IDLE;
+  reply.data.status.last_result = ok ? SUCCESS : FAILURE;
+  std::snprintf(reply.data.status.desc, sizeof(reply.data.status.desc), "mock install %s, %llu bytes",
+                ok ? "done" : "failed", static_cast<unsigned long long>(length));
+  writeAll(fd, &reply, sizeof(reply));
+}
@@ -0,0 +1,65 @@
+#ifndef SWUPDATE_POC_MOCK_SWUPDATE_IPC_H_
+#define SWUPDATE_POC_MOCK_SWUPDATE_IPC_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Stand-in for the SWUpdate daemon's control socket, for benchmarking the
+// tool without a device. It speaks just enough of the IPC protocol for
+// swupdate_async_start(): it acknowledges the install request, swallows the
+// image sent over that connection and answers status requests with the
+// result once the image is complete. Nothing is parsed or installed; an
+// install succeeds when exactly expected_length bytes arrived.
+//
+// Several installs, one after another as SWUpdate runs them, each succeed
+// when as many bytes arrived as one of expected_lengths not matched yet.
+class MockSwupdateIpc {
+ public:
+  MockSwupdateIpc(std::string socket_path, uint64_t expected_length);
+  MockSwupdateIpc(std::string socket_path, std::vector<uint64_t> expected_lengths);
+  ~MockSwupdateIpc();
+  MockSwupdateIpc(const MockSwupdateIpc&) = delete;
+  MockSwupdateIpc& operator=(const MockSwupdateIpc&) = delete;
+
+  // Called on the install connection's thread with the total number of image
+  // bytes received, over all installs, after every read. Set it before the
+  // first install starts.
+  using ReceiveObserver = std::function<void(uint64_t received)>;
+  void setReceiveObserver(ReceiveObserver observer) { receive_observer_ = std::move(observer); }
+
+  uint64_t received() const { return received_; }
+  // Installs that succeeded.
+  unsigned int installs() const { return installs_; }
+
+ private:
+  void acceptLoop();
+  void serve(int fd);
+  void receiveImage(int fd);
+  void reportStatus(int fd);
+
+  const std::string socket_path_;
+  ReceiveObserver receive_observer_;
+  std::atomic<uint64_t> received_{0};
+  std::atomic<bool> stopping_{false};
+  int listen_fd_{-1};
+  std::thread acceptor_;
+  std::vector<std::thread> connections_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Lengths of the installs still to come.
+  std::vector<uint64_t> expected_lengths_;
+  // Outcome and length of every install whose status was not asked for yet.
+  std::deque<std::pair<bool, uint64_t>> results_;
+  std::atomic<unsigned int> installs_{0};
+};
+
+#endif  // SWUPDATE_POC_MOCK_SWUPDATE_IPC_H_
@@ -0,0 +1,200 @@
+#include "parallel_download.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "connection_cache.h"
+
+// A failing segment is retried from where it got to this many times, on
+// every mirror.
+static constexpr int kSegmentAttempts = 3;
+
+ParallelDownloader::ParallelDownloader(HttpFactory make_http, std::string url, unsigned int connections,
+                                       size_t segment_size)
+    : make_http_{std::move(make_http)},
+      urls_{std::move(url)},
+      connections_{std::max(connections, 1U)},
+      segment_size_{segment_size},
+      window_{2 * connections_},
+      segments_(window_) {
+  for (auto& segment : segments_) {
+    segment.buffer.resize(segment_size_);
+  }
+}
+
+void ParallelDownloader::setMirrors(std::vector<std::string> urls) {
+  if (!urls.empty()) {
+    urls_ = std::move(urls);
+    mirror_ = 0;
+  }
+}
+
+size_t ParallelDownloader::SegmentHandler(char* contents, size_t size, size_t nmemb, void* userp) {
+  auto* transfer = static_cast<Transfer*>(userp);
+  Segment* segment = transfer->segment;
+  size_t downloaded = size * nmemb;
+  // Waits while paused, leaving the data in the socket.
+  const api::FlowControlToken* token = transfer->downloader->flow_control_;
+  if (transfer->downloader->stop_ || (token != nullptr && !token->canContinue())) {
+    return downloaded + 1;  // curl will abort if return unexpected size;
+  }
+
+  // Unless the client can bound it, the Range request is open-ended, so the
+  // server keeps sending past the end of the segment; take what belongs to it
+  // and cut the transfer there. A bounded one ends with the segment and keeps
+  // its connection.
+  size_t n = std::min(downloaded, segment->length - segment->filled);
+  std::memcpy(segment->buffer.data() + segment->filled, contents, n);
+  segment->filled += n;
+  return n == downloaded ? downloaded : downloaded + 1;
+}
+
+bool ParallelDownloader::fetch(HttpInterface& http, Segment& segment) {
+  Transfer transfer{this, &segment};
+  auto* cached = dynamic_cast<CachedHttpClient*>(&http);
+  const size_t attempts = kSegmentAttempts * urls_.size();
+  for (size_t attempt = 0; attempt < attempts && !stop_ && !aborted(); ++attempt) {
+    size_t mirror = mirror_;
+    const std::string& url = urls_[mirror];
+    const auto from = static_cast<curl_off_t>(segment.offset + segment.filled);
+    const auto last = static_cast<curl_off_t>(segment.offset + segment.length - 1);
+    HttpResponse response = cached != nullptr ? cached->downloadRange(url, SegmentHandler, &transfer, from, last)
+                                              : http.download(url, SegmentHandler, nullptr, &transfer, from);
+    if (segment.filled == segment.length) {
+      return true;  // a write error here is just us cutting the transfer
+    }
+    if (urls_.size() > 1) {
+      // Unless another connection has moved on already.
+      mirror_.compare_exchange_strong(mirror, (mirror + 1) % urls_.size());
+    } else if (response.isOk()) {
+      break;  // the server ended the response early, retrying will not help
+    }
+  }
+  return false;
+}
+
+ParallelDownloader::~ParallelDownloader() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    shutdown_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ParallelDownloader::worker() {
+  auto http = make_http_();
+  uint64_t job = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this, job] { return shutdown_ || job_ != job; });
+    if (shutdown_) {
+      return;
+    }
+    job = job_;
+    ++busy_;
+    runJob(lock, *http);
+    --busy_;
+    cv_.notify_all();
+  }
+}
+
+void ParallelDownloader::runJob(std::unique_lock<std::mutex>& lock, HttpInterface& http) {
+  for (;;) {
+    // Only start a segment once its buffer is free, i.e. the segment a
+    // window before it has been delivered.
+    cv_.wait(lock, [this] {
+      return stop_ || next_to_fetch_ >= segment_count_ || next_to_fetch_ < next_to_deliver_ + window_;
+    });
+    if (stop_ || next_to_fetch_ >= segment_count_) {
+      return;
+    }
+    Segment& segment = segments_[next_to_fetch_++ % window_];
+    lock.unlock();
+    const bool ok = fetch(http, segment);
+    lock.lock();
+    if (!ok) {
+      if (!stop_) {
+        error_ = aborted() ? std::string("Download aborted")
+                           : "Could not download bytes " + std::to_string(segment.offset) + "-" +
+                                 std::to_string(segment.offset + segment.length - 1);
+        stop_ = true;
+      }
+      cv_.notify_all();
+      return;
+    }
+    segment.done = true;
+    cv_.notify_all();
+  }
+}
+
+void ParallelDownloader::fail(const std::string& error) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!stop_) {
+    error_ = error;
+    stop_ = true;
+  }
+  cv_.notify_all();
+}
+
+bool ParallelDownloader::download(uint64_t from, uint64_t length, const Sink& sink) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    from_ = from;
+    length_ = length;
+    segment_count_ = (length - from + segment_size_ - 1) / segment_size_;
+    next_to_fetch_ = 0;
+    next_to_deliver_ = 0;
+    stop_ = false;
+    error_.clear();
+    for (uint64_t index = 0; index < std::min<uint64_t>(segment_count_, window_); ++index) {
+      Segment& segment = segments_[index];
+      segment.offset = from_ + index * segment_size_;
+      segment.length = static_cast<size_t>(std::min<uint64_t>(segment_size_, length_ - segment.offset));
+      segment.filled = 0;
+      segment.done = false;
+    }
+    ++job_;
+    while (workers_.size() < std::min<uint64_t>(connections_, segment_count_)) {
+      workers_.emplace_back(&ParallelDownloader::worker, this);
+    }
+  }
+  cv_.notify_all();
+
+  while (next_to_deliver_ < segment_count_) {
+    Segment* segment = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || segments_[next_to_deliver_ % window_].done; });
+      if (stop_) {
+        break;
+      }
+      segment = &segments_[next_to_deliver_ % window_];
+    }
+
+    if (!sink(segment->buffer.data(), segment->length)) {
+      fail("Download stopped");
+      break;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    // Recycle the buffer for the segment one window further on.
+    const uint64_t reuse = next_to_deliver_ + window_;
+    segment->offset = from_ + reuse * segment_size_;
+    segment->length = reuse < segment_count_
+                          ? static_cast<size_t>(std::min<uint64_t>(segment_size_, length_ - segment->offset))
+                          : 0;
+    segment->filled = 0;
+    segment->done = false;
+    ++next_to_deliver_;
+    cv_.notify_all();
+  }
+
+  // The buffers are reused by the next download once no worker is on them.
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return busy_ == 0; });
+  return !stop_;
+}
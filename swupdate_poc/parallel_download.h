@@ -0,0 +1,106 @@
+#ifndef SWUPDATE_POC_PARALLEL_DOWNLOAD_H_
+#define SWUPDATE_POC_PARALLEL_DOWNLOAD_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http/httpinterface.h"
+#include "utilities/apiqueue.h"
+
+// Downloads one image over several concurrent connections.
+//
+// The image is cut into fixed-size segments which the connections fetch with
+// Range requests, lowest segment first. Finished segments are handed to the
+// sink strictly in stream order from the calling thread, so everything
+// downstream (hashing, staging, SWUpdate) still sees one sequential stream.
+// At most a window of 2 x connections segments is in flight or waiting for
+// an earlier one, all in buffers allocated up front, so memory is bounded by
+// 2 x connections x segment_size however the segments arrive. The
+// connections run on threads started by the first download() and kept, with
+// their clients, for the next ones until the downloader is destroyed.
+class ParallelDownloader {
+ public:
+  using HttpFactory = std::function<std::shared_ptr<HttpInterface>()>;
+  // Receives the stream in order. Returning false stops the download.
+  using Sink = std::function<bool(const char* data, size_t len)>;
+
+  // Every connection gets its own client from make_http.
+  ParallelDownloader(HttpFactory make_http, std::string url, unsigned int connections, size_t segment_size);
+  ~ParallelDownloader();
+  ParallelDownloader(const ParallelDownloader&) = delete;
+  ParallelDownloader& operator=(const ParallelDownloader&) = delete;
+
+  // Downloads bytes [from, length) of the image into sink. Returns false if
+  // a segment could not be fetched or the sink stopped the download.
+  bool download(uint64_t from, uint64_t length, const Sink& sink);
+  // The connections stop reading while token is paused, and the download
+  // stops once it is aborted.
+  void setFlowControl(const api::FlowControlToken* token) { flow_control_ = token; }
+  // Mirrors of the image, the first one replacing url. A failing segment is
+  // retried on the next mirror, which the other connections then move to as
+  // well.
+  void setMirrors(std::vector<std::string> urls);
+  const std::string& error() const { return error_; }
+  // Memory a downloader allocates for its segment buffers.
+  static size_t bufferSize(unsigned int connections, size_t segment_size) {
+    return 2 * std::max(connections, 1U) * segment_size;
+  }
+
+ private:
+  struct Segment {
+    uint64_t offset{0};
+    size_t length{0};
+    size_t filled{0};
+    bool done{false};
+    std::vector<char> buffer;
+  };
+  struct Transfer {
+    ParallelDownloader* downloader;
+    Segment* segment;
+  };
+
+  static size_t SegmentHandler(char* contents, size_t size, size_t nmemb, void* userp);
+  void worker();
+  // Fetches segments of the current download until there are none left.
+  void runJob(std::unique_lock<std::mutex>& lock, HttpInterface& http);
+  bool fetch(HttpInterface& http, Segment& segment);
+  void fail(const std::string& error);
+  bool aborted() const { return flow_control_ != nullptr && flow_control_->hasAborted(); }
+
+  const HttpFactory make_http_;
+  std::vector<std::string> urls_;
+  // The mirror new requests go to.
+  std::atomic<size_t> mirror_{0};
+  const unsigned int connections_;
+  const size_t segment_size_;
+  const size_t window_;
+  std::vector<Segment> segments_;
+  const api::FlowControlToken* flow_control_{nullptr};
+
+  uint64_t from_{0};
+  uint64_t length_{0};
+  uint64_t segment_count_{0};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  uint64_t next_to_fetch_{0};
+  uint64_t next_to_deliver_{0};
+  std::atomic<bool> stop_{false};
+  std::string error_;
+  std::vector<std::thread> workers_;
+  // Counts the download() calls; a worker that has not seen the current one
+  // joins it.
+  uint64_t job_{0};
+  // Workers fetching segments of the current download.
+  unsigned int busy_{0};
+  bool shutdown_{false};
+};
+
+#endif  // SWUPDATE_POC_PARALLEL_DOWNLOAD_H_
@@ -0,0 +1,125 @@
+#include "progress_reporter.h"
+
+#include <algorithm>
+#include <cmath>
+
+void ThroughputEstimator::sample(uint64_t done, std::chrono::steady_clock::time_point when) {
+  if (!started_ || done < last_done_) {
+    started_ = true;
+    last_done_ = done;
+    last_time_ = when;
+    return;
+  }
+  const double elapsed = std::chrono::duration<double>(when - last_time_).count();
+  if (elapsed <= 0) {
+    return;
+  }
+  const double instant = static_cast<double>(done - last_done_) / elapsed;
+  if (!rated_) {
+    rate_ = instant;
+    rated_ = true;
+  } else {
+    const double alpha = 1.0 - std::exp(-elapsed / time_constant_);
+    rate_ += alpha * (instant - rate_);
+  }
+  last_done_ = done;
+  last_time_ = when;
+}
+
+double ThroughputEstimator::etaSeconds(uint64_t done, uint64_t total) const {
+  if (done >= total) {
+    return 0;
+  }
+  if (!rated_ || rate_ <= 0) {
+    return -1;
+  }
+  return static_cast<double>(total - done) / rate_;
+}
+
+// Smoothing over a few publish intervals keeps the ETA steady without
+// hiding a real change of pace for long.
+static constexpr unsigned int kSmoothingIntervals = 5;
+
+ProgressReporter::ProgressReporter(const std::atomic<uintmax_t>& done, uint64_t total,
+                                   std::chrono::milliseconds interval, ProgressCallback on_progress,
+                                   MessageCallback on_message)
+    : done_{done},
+      total_{total},
+      interval_{interval},
+      on_progress_{std::move(on_progress)},
+      on_message_{std::move(on_message)},
+      throughput_{interval * kSmoothingIntervals} {
+  throughput_.sample(done_.load(std::memory_order_relaxed), std::chrono::steady_clock::now());
+  thread_ = std::thread(&ProgressReporter::run, this);
+}
+
+ProgressReporter::~ProgressReporter() { stop(); }
+
+void ProgressReporter::post(std::string message) {
+  if (stopped_) {
+    on_message_(message);
+    return;
+  }
+  if (!messages_.push(std::move(message))) {
+    ++dropped_;
+    return;
+  }
+  // Without the mutex the wakeup may be missed; the message then waits for
+  // the next interval at most.
+  cv_.notify_one();
+}
+
+void ProgressReporter::stop() {
+  if (stopped_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+  deliverMessages();
+  publish(std::chrono::steady_clock::now());
+  stopped_ = true;
+}
+
+void ProgressReporter::run() {
+  auto next = std::chrono::steady_clock::now() + interval_;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    cv_.wait_until(lock, next);
+    lock.unlock();
+    deliverMessages();
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= next) {
+      publish(now);
+      next = now + interval_;
+    }
+    lock.lock();
+  }
+}
+
+void ProgressReporter::deliverMessages() {
+  std::string message;
+  while (messages_.pop(&message)) {
+    on_message_(message);
+  }
+}
+
+// Only called from the reporter thread, or after it has stopped.
+void ProgressReporter::publish(std::chrono::steady_clock::time_point now) {
+  const uint64_t done = done_.load(std::memory_order_relaxed);
+  throughput_.sample(done, now);
+  if (done == published_) {
+    return;
+  }
+  published_ = done;
+  ProgressUpdate update;
+  update.done = done;
+  update.total = total_;
+  update.percent = total_ == 0 ? 100 : static_cast<unsigned int>(std::min<uint64_t>(done, total_) * 100 / total_);
+  update.bytes_per_second = throughput_.bytesPerSecond();
+  update.eta_seconds = throughput_.etaSeconds(done, total_);
+  on_progress_(update);
+}
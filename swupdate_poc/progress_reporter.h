@@ -0,0 +1,129 @@
+#ifndef SWUPDATE_POC_PROGRESS_REPORTER_H_
+#define SWUPDATE_POC_PROGRESS_REPORTER_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+// Progress of an update as handed to the progress callback and the log.
+struct ProgressUpdate {
+  uint64_t done{0};
+  uint64_t total{0};
+  unsigned int percent{0};
+  // Smoothed throughput, see ThroughputEstimator.
+  double bytes_per_second{0};
+  // Negative while the throughput is unknown.
+  double eta_seconds{-1};
+};
+
+// Exponentially weighted moving average of throughput. Samples are weighted
+// by the time they cover, so irregular intervals do not skew the average: a
+// stall of one time constant takes the estimate ~63% of the way to zero.
+class ThroughputEstimator {
+ public:
+  explicit ThroughputEstimator(std::chrono::duration<double> time_constant) : time_constant_{time_constant.count()} {}
+
+  void sample(uint64_t done, std::chrono::steady_clock::time_point when);
+  double bytesPerSecond() const { return rate_; }
+  // Seconds until total at the current rate; negative while unknown.
+  double etaSeconds(uint64_t done, uint64_t total) const;
+
+ private:
+  const double time_constant_;
+  bool started_{false};
+  bool rated_{false};
+  uint64_t last_done_{0};
+  std::chrono::steady_clock::time_point last_time_;
+  double rate_{0};
+};
+
+// Bounded single-producer single-consumer queue that never blocks: push()
+// drops the item and returns false when the queue is full.
+template <class T, size_t Capacity>
+class DropQueue {
+ public:
+  bool push(T item) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    slots_[head % Capacity] = std::move(item);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(T* item) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (head_.load(std::memory_order_acquire) == tail) {
+      return false;
+    }
+    *item = std::move(slots_[tail % Capacity]);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::array<T, Capacity> slots_;
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
+
+// Publishes update progress from its own thread.
+//
+// The data path only bumps the byte counter it already keeps; the reporter
+// samples it, at most once per interval, and hands the callbacks a smoothed
+// throughput and ETA. Status messages, e.g. SWUpdate's notifications, are
+// queued with post() and delivered on the same thread, so a slow terminal or
+// log sink never stalls the thread that produced them.
+class ProgressReporter {
+ public:
+  using ProgressCallback = std::function<void(const ProgressUpdate&)>;
+  using MessageCallback = std::function<void(const std::string&)>;
+
+  ProgressReporter(const std::atomic<uintmax_t>& done, uint64_t total, std::chrono::milliseconds interval,
+                   ProgressCallback on_progress, MessageCallback on_message);
+  ~ProgressReporter();
+  ProgressReporter(const ProgressReporter&) = delete;
+  ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+  // Queues a message for the reporter thread. Never blocks; a message that
+  // does not fit is dropped and counted. After stop() messages are delivered
+  // on the calling thread. Must only be called from one thread at a time, and
+  // not concurrently with stop().
+  void post(std::string message);
+  // Publishes the final progress and any queued messages, then stops the
+  // thread. Idempotent.
+  void stop();
+  uint64_t droppedMessages() const { return dropped_; }
+
+ private:
+  static constexpr size_t kQueuedMessages = 64;
+
+  void run();
+  void deliverMessages();
+  void publish(std::chrono::steady_clock::time_point now);
+
+  const std::atomic<uintmax_t>& done_;
+  const uint64_t total_;
+  const std::chrono::milliseconds interval_;
+  ProgressCallback on_progress_;
+  MessageCallback on_message_;
+  ThroughputEstimator throughput_;
+  uint64_t published_{UINT64_MAX};
+  DropQueue<std::string, kQueuedMessages> messages_;
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<bool> stopped_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_{false};
+  std::thread thread_;
+};
+
+#endif  // SWUPDATE_POC_PROGRESS_REPORTER_H_
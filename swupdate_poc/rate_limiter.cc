@@ -0,0 +1,97 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <sstream>
+
+// How often the time of day is checked against the schedule.
+static constexpr std::chrono::seconds kScheduleCheckInterval{1};
+static constexpr int kMinutesPerDay = 24 * 60;
+
+static int minuteOfDay() {
+  const std::time_t now = std::time(nullptr);
+  std::tm local{};
+  localtime_r(&now, &local);
+  return local.tm_hour * 60 + local.tm_min;
+}
+
+RateLimiter::RateLimiter(uint64_t rate, uint64_t burst, std::vector<Window> schedule)
+    : base_rate_{rate}, burst_{std::max<uint64_t>(burst, 1)}, schedule_{std::move(schedule)} {
+  tokens_ = static_cast<double>(burst_);
+}
+
+bool RateLimiter::parseSchedule(const std::string& text, std::vector<Window>* schedule) {
+  std::istringstream windows(text);
+  std::string window;
+  schedule->clear();
+  while (std::getline(windows, window, ',')) {
+    int start_hour = 0;
+    int start_minute = 0;
+    int end_hour = 0;
+    int end_minute = 0;
+    double rate_mb = 0;
+    int consumed = 0;
+    if (std::sscanf(window.c_str(), " %d:%d-%d:%d=%lf %n", &start_hour, &start_minute, &end_hour, &end_minute,
+                    &rate_mb, &consumed) != 5 ||
+        static_cast<size_t>(consumed) != window.size()) {
+      return false;
+    }
+    // 24:00 is the end of the day.
+    if (start_hour < 0 || start_hour > 23 || end_hour < 0 || end_hour > 24 || start_minute < 0 ||
+        start_minute > 59 || end_minute < 0 || end_minute > 59 || (end_hour == 24 && end_minute != 0) ||
+        !(rate_mb >= 0)) {
+      return false;
+    }
+    schedule->push_back(Window{start_hour * 60 + start_minute, end_hour * 60 + end_minute,
+                               static_cast<uint64_t>(std::llround(rate_mb * 1024 * 1024))});
+  }
+  return !schedule->empty();
+}
+
+uint64_t RateLimiter::rateAt(int minute) const {
+  minute = ((minute % kMinutesPerDay) + kMinutesPerDay) % kMinutesPerDay;
+  for (const Window& window : schedule_) {
+    const bool open = window.start <= window.end ? minute >= window.start && minute < window.end
+                                                 : minute >= window.start || minute < window.end;
+    if (open) {
+      return window.rate;
+    }
+  }
+  return base_rate_;
+}
+
+void RateLimiter::refill(Clock::time_point now) {
+  if (now >= next_schedule_check_) {
+    next_schedule_check_ = now + kScheduleCheckInterval;
+    rate_ = schedule_.empty() ? base_rate_ : rateAt(minuteOfDay());
+  }
+  if (rate_ == 0) {
+    tokens_ = static_cast<double>(burst_);
+  } else if (filled_ != Clock::time_point{}) {
+    const double elapsed = std::chrono::duration<double>(now - filled_).count();
+    tokens_ = std::min(static_cast<double>(burst_), tokens_ + elapsed * static_cast<double>(rate_));
+  }
+  filled_ = now;
+}
+
+RateLimiter::Clock::duration RateLimiter::acquire(size_t len) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  refill(Clock::now());
+  const double needed = std::min(static_cast<double>(len), static_cast<double>(burst_));
+  if (tokens_ >= needed) {
+    tokens_ -= static_cast<double>(len);
+    return Clock::duration::zero();
+  }
+  // Waiting for more than the chunk at hand saves pausing and resuming for
+  // every few kilobytes; the bucket keeps what comes in meanwhile.
+  const double target = std::max(needed, static_cast<double>(burst_) / 4);
+  const std::chrono::duration<double> wait((target - tokens_) / static_cast<double>(rate_));
+  return std::max(std::chrono::duration_cast<Clock::duration>(wait), Clock::duration(1));
+}
+
+void RateLimiter::refund(size_t len) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  tokens_ = std::min(static_cast<double>(burst_), tokens_ + static_cast<double>(len));
+}
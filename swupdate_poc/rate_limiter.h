@@ -0,0 +1,72 @@
+#ifndef SWUPDATE_POC_RATE_LIMITER_H_
+#define SWUPDATE_POC_RATE_LIMITER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Caps the bandwidth of an update's downloads, so that they leave room on
+// the uplink for the device's own traffic.
+//
+// A token bucket: it fills at the current rate up to burst bytes, and every
+// byte received takes a token. A transfer that finds the bucket short does
+// not wait in its write callback but pauses for as long as acquire() says,
+// leaving the data with curl and, once the socket buffers fill up, with the
+// server. All connections of an update share one limiter and so the rate.
+//
+// The rate may follow the time of day: while a window of the schedule is
+// open, in local time, its rate replaces the base rate.
+//
+// Shared between threads.
+class RateLimiter {
+ public:
+  using Clock = std::chrono::steady_clock;
+  // Minutes [start, end) since local midnight; one with end before start
+  // wraps past midnight.
+  struct Window {
+    int start{0};
+    int end{0};
+    // Bytes per second, 0 for no cap.
+    uint64_t rate{0};
+  };
+
+  // rate in bytes per second, 0 for no cap outside the schedule's windows.
+  RateLimiter(uint64_t rate, uint64_t burst, std::vector<Window> schedule = {});
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  // Parses "HH:MM-HH:MM=MiB/s" windows separated by commas, e.g.
+  // "08:00-18:00=2,18:00-08:00=0", the first one open taking precedence.
+  static bool parseSchedule(const std::string& text, std::vector<Window>* schedule);
+
+  // Takes len bytes from the bucket and returns zero if it holds them.
+  // Otherwise takes nothing and returns how long the transfer should pause
+  // before offering the same bytes again, by when a quarter of the burst has
+  // come back. Beyond the burst, len goes through on a full bucket.
+  Clock::duration acquire(size_t len);
+  // Gives back bytes acquire() took that the transfer did not take after all.
+  void refund(size_t len);
+
+  // The cap at a minute of the day, in bytes per second; 0 for none.
+  uint64_t rateAt(int minute) const;
+  uint64_t burst() const { return burst_; }
+
+ private:
+  void refill(Clock::time_point now);
+
+  const uint64_t base_rate_;
+  const uint64_t burst_;
+  const std::vector<Window> schedule_;
+
+  std::mutex mutex_;
+  uint64_t rate_{0};
+  double tokens_{0};
+  Clock::time_point filled_;
+  // When to look at the time of day again.
+  Clock::time_point next_schedule_check_;
+};
+
+#endif  // SWUPDATE_POC_RATE_LIMITER_H_
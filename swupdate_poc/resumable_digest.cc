@@ -0,0 +1,80 @@
+// The low-level SHA-2 API is deprecated in OpenSSL 3 but remains the only one
+// whose state can be serialised; keep its use confined to this file.
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "digest.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <openssl/sha.h>
+
+namespace {
+
+template <class Algorithm>
+struct LowLevelSha;
+
+template <>
+struct LowLevelSha<Sha256Algorithm> {
+  static constexpr size_t kDigestLength = SHA256_DIGEST_LENGTH;
+  static int init(SHA256_CTX* ctx) { return SHA256_Init(ctx); }
+  static int update(SHA256_CTX* ctx, const void* data, size_t len) { return SHA256_Update(ctx, data, len); }
+  static int final(unsigned char* md, SHA256_CTX* ctx) { return SHA256_Final(md, ctx); }
+};
+
+template <>
+struct LowLevelSha<Sha512Algorithm> {
+  static constexpr size_t kDigestLength = SHA512_DIGEST_LENGTH;
+  static int init(SHA512_CTX* ctx) { return SHA512_Init(ctx); }
+  static int update(SHA512_CTX* ctx, const void* data, size_t len) { return SHA512_Update(ctx, data, len); }
+  static int final(unsigned char* md, SHA512_CTX* ctx) { return SHA512_Final(md, ctx); }
+};
+
+}  // namespace
+
+template <class Algorithm>
+ResumableDigest<Algorithm>::ResumableDigest() : ctx_{new typename Algorithm::Context()} {
+  reset();
+}
+
+template <class Algorithm>
+ResumableDigest<Algorithm>::~ResumableDigest() {
+  delete ctx_;
+}
+
+template <class Algorithm>
+void ResumableDigest<Algorithm>::update(const void* data, size_t len) {
+  LowLevelSha<Algorithm>::update(ctx_, data, len);
+}
+
+template <class Algorithm>
+std::string ResumableDigest<Algorithm>::hexDigest() {
+  unsigned char md[LowLevelSha<Algorithm>::kDigestLength];
+  LowLevelSha<Algorithm>::final(md, ctx_);
+  return toHex(md, sizeof(md));
+}
+
+template <class Algorithm>
+void ResumableDigest<Algorithm>::reset() {
+  if (LowLevelSha<Algorithm>::init(ctx_) != 1) {
+    throw std::runtime_error(std::string("Failed to initialise ") + Algorithm::kName);
+  }
+}
+
+template <class Algorithm>
+std::string ResumableDigest<Algorithm>::saveState() const {
+  return toHex(reinterpret_cast<const unsigned char*>(ctx_), sizeof(*ctx_));
+}
+
+template <class Algorithm>
+bool ResumableDigest<Algorithm>::restoreState(const std::string& state) {
+  std::string raw;
+  if (!fromHex(state, &raw) || raw.size() != sizeof(*ctx_)) {
+    return false;
+  }
+  std::memcpy(ctx_, raw.data(), raw.size());
+  return true;
+}
+
+template class ResumableDigest<Sha256Algorithm>;
+template class ResumableDigest<Sha512Algorithm>;
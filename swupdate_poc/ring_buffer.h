@@ -0,0 +1,148 @@
+#ifndef SWUPDATE_POC_RING_BUFFER_H_
+#define SWUPDATE_POC_RING_BUFFER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+// Escalating wait used by both ends of the ring when there is nothing to do:
+// spin briefly, then yield, then sleep, so that an idle side neither burns a
+// core nor adds a full scheduler tick of latency to the common case.
+class Backoff {
+ public:
+  void pause() {
+    if (iteration_ < kSpinIterations) {
+      ++iteration_;
+    } else if (iteration_ < kSpinIterations + kYieldIterations) {
+      ++iteration_;
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(kSleepMicroseconds));
+    }
+  }
+  void reset() { iteration_ = 0; }
+
+ private:
+  static constexpr unsigned int kSpinIterations = 64;
+  static constexpr unsigned int kYieldIterations = 64;
+  static constexpr unsigned int kSleepMicroseconds = 200;
+  unsigned int iteration_{0};
+};
+
+// Fixed-capacity single-producer byte ring.
+//
+// The producer (curl write callback) copies network data in with write(); the
+// consumer (SWUpdate readimage callback) gets a pointer straight into the ring
+// with peek() and releases the bytes with consume() once SWUpdate is done with
+// them. Head and tail are free-running counters, so the only synchronisation is
+// one acquire/release pair per side and no lock is taken on the data path.
+//
+// A ring can be created with several readers, e.g. one feeding SWUpdate and
+// one hashing. Each reader has its own tail and sees the whole stream; space
+// is only reused once every reader has consumed it. Each reader must be
+// driven from a single thread.
+class RingBuffer {
+ public:
+  // Capacity is rounded up to the next power of two.
+  explicit RingBuffer(size_t capacity, size_t readers = 1)
+      : capacity_{roundUp(capacity)}, mask_{capacity_ - 1}, readers_{readers} {
+    data_.reset(new char[capacity_]);
+    tails_.reset(new Cursor[readers_]);
+  }
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  size_t capacity() const { return capacity_; }
+  // Bytes written but not consumed yet by the slowest reader.
+  size_t size() const {
+    // Tails first: head only grows and is never behind a tail, so reading it
+    // last cannot produce a negative size.
+    const size_t tail = slowestTail();
+    return head_.load(std::memory_order_acquire) - tail;
+  }
+  size_t freeSpace() const { return capacity_ - size(); }
+
+  // Producer side. Copies as much of data as currently fits and returns the
+  // number of bytes written.
+  size_t write(const char* data, size_t len) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    const size_t tail = slowestTail();
+    len = std::min(len, capacity_ - (head - tail));
+    const size_t offset = head & mask_;
+    const size_t first = std::min(len, capacity_ - offset);
+    std::memcpy(data_.get() + offset, data, first);
+    std::memcpy(data_.get(), data + first, len - first);
+    head_.store(head + len, std::memory_order_release);
+    return len;
+  }
+  // Producer side, for filling the ring in place (e.g. with read()) instead of
+  // copying through write(): points data at the free space and returns how
+  // many bytes are free contiguously there. They are published with commit().
+  size_t reserve(char** data) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    const size_t offset = head & mask_;
+    *data = data_.get() + offset;
+    return std::min(capacity_ - (head - slowestTail()), capacity_ - offset);
+  }
+  void commit(size_t len) { head_.store(head_.load(std::memory_order_relaxed) + len, std::memory_order_release); }
+  // Producer side. Marks the end of the stream; readers drain what is left.
+  void close() { closed_.store(true, std::memory_order_release); }
+
+  // Consumer side. Points data at the oldest byte the reader has not consumed
+  // and returns how many bytes are readable contiguously from there (0 if
+  // there are none). The region stays valid until it is released with
+  // consume().
+  size_t peek(const char** data, size_t reader = 0) const {
+    const size_t tail = tails_[reader].value.load(std::memory_order_relaxed);
+    const size_t head = head_.load(std::memory_order_acquire);
+    const size_t offset = tail & mask_;
+    *data = data_.get() + offset;
+    return std::min(head - tail, capacity_ - offset);
+  }
+  void consume(size_t len, size_t reader = 0) {
+    std::atomic<size_t>& tail = tails_[reader].value;
+    tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+  }
+  // True once the producer has closed the ring and the reader consumed everything.
+  bool drained(size_t reader = 0) const {
+    return closed_.load(std::memory_order_acquire) &&
+           head_.load(std::memory_order_acquire) == tails_[reader].value.load(std::memory_order_acquire);
+  }
+
+ private:
+  // Keep every cursor on its own cache line so the producer and reader cores
+  // do not invalidate each other on every update.
+  struct alignas(64) Cursor {
+    std::atomic<size_t> value{0};
+  };
+
+  size_t slowestTail() const {
+    size_t tail = tails_[0].value.load(std::memory_order_acquire);
+    for (size_t i = 1; i < readers_; ++i) {
+      tail = std::min(tail, tails_[i].value.load(std::memory_order_acquire));
+    }
+    return tail;
+  }
+
+  static size_t roundUp(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const size_t capacity_;
+  const size_t mask_;
+  const size_t readers_;
+  std::unique_ptr<char[]> data_;
+  std::unique_ptr<Cursor[]> tails_;
+  std::atomic<bool> closed_{false};
+  alignas(64) std::atomic<size_t> head_{0};
+};
+
+#endif  // SWUPDATE_POC_RING_BUFFER_H_
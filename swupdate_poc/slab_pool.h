@@ -0,0 +1,135 @@
+#ifndef SWUPDATE_POC_SLAB_POOL_H_
+#define SWUPDATE_POC_SLAB_POOL_H_
+
+#include <stdlib.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Fixed set of equally sized buffers for chunks of the image in flight
+// between pipeline stages.
+//
+// All slabs are carved out of one allocation made up front, each starting on
+// a cache line, so a stage working on one slab never shares a line with the
+// next, and taking and returning slabs never touches the heap. The pool is
+// the memory budget: acquire() waits for a slab to come back rather than
+// allocating another.
+//
+// A Slab owns its buffer until it is destroyed or reset(), so its lifetime
+// is explicit: a consumer keeps the slab for as long as anyone may still read
+// from it. Slabs must not outlive their pool.
+class SlabPool {
+ public:
+  static constexpr size_t kAlignment = 64;
+
+  class Slab {
+   public:
+    Slab() = default;
+    ~Slab() { reset(); }
+    Slab(Slab&& other) noexcept : pool_{other.pool_}, index_{other.index_}, size_{other.size_} {
+      other.pool_ = nullptr;
+    }
+    Slab& operator=(Slab&& other) noexcept {
+      if (this != &other) {
+        reset();
+        pool_ = other.pool_;
+        index_ = other.index_;
+        size_ = other.size_;
+        other.pool_ = nullptr;
+      }
+      return *this;
+    }
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    explicit operator bool() const { return pool_ != nullptr; }
+    char* data() const { return pool_->memory_.get() + index_ * pool_->slab_size_; }
+    size_t capacity() const { return pool_->slab_size_; }
+    // Bytes of the slab in use, as set by whoever filled it.
+    size_t size() const { return size_; }
+    void setSize(size_t size) { size_ = size; }
+    // Hands the buffer back to the pool.
+    void reset() {
+      if (pool_ != nullptr) {
+        pool_->release(index_);
+        pool_ = nullptr;
+      }
+    }
+
+   private:
+    friend class SlabPool;
+    Slab(SlabPool* pool, size_t index) : pool_{pool}, index_{index} {}
+
+    SlabPool* pool_{nullptr};
+    size_t index_{0};
+    size_t size_{0};
+  };
+
+  // slab_size is rounded up to whole cache lines. Throws std::bad_alloc if
+  // the memory cannot be had.
+  SlabPool(size_t slab_size, size_t slabs)
+      : slab_size_{(slab_size + kAlignment - 1) / kAlignment * kAlignment}, slabs_{slabs}, memory_{nullptr, free} {
+    void* memory = nullptr;
+    if (slabs_ != 0 && posix_memalign(&memory, kAlignment, slab_size_ * slabs_) != 0) {
+      throw std::bad_alloc();
+    }
+    memory_.reset(static_cast<char*>(memory));
+    free_.reserve(slabs_);
+    for (size_t i = slabs_; i > 0; --i) {
+      free_.push_back(i - 1);
+    }
+  }
+  SlabPool(const SlabPool&) = delete;
+  SlabPool& operator=(const SlabPool&) = delete;
+
+  // Waits for a free slab. Returns an empty one once the pool is closed.
+  Slab acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return closed_ || !free_.empty(); });
+    return closed_ ? Slab() : take();
+  }
+  // Returns an empty slab if none is free.
+  Slab tryAcquire() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return free_.empty() ? Slab() : take();
+  }
+  // Wakes everyone waiting in acquire(), for good.
+  void close() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+  size_t slabSize() const { return slab_size_; }
+  size_t slabs() const { return slabs_; }
+  size_t available() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return free_.size();
+  }
+
+ private:
+  Slab take() {
+    const size_t index = free_.back();
+    free_.pop_back();
+    return Slab(this, index);
+  }
+  void release(size_t index) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    free_.push_back(index);  // never reallocates: capacity is slabs_
+    cv_.notify_one();
+  }
+
+  const size_t slab_size_;
+  const size_t slabs_;
+  std::unique_ptr<char, void (*)(void*)> memory_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<size_t> free_;
+  bool closed_{false};
+};
+
+#endif  // SWUPDATE_POC_SLAB_POOL_H_
@@ -0,0 +1,257 @@
+#include "splice_transfer.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+
+#include "logging/logging.h"
+
+// Bytes moved per splice() call; the pipes are grown to match.
+static constexpr size_t kSpliceChunk = 256 * 1024;
+// A stalled server fails the transfer instead of hanging the install.
+static constexpr int kSocketTimeoutSeconds = 30;
+
+static int openFileSource(const std::string& path, uint64_t from, uint64_t length) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != length ||
+      lseek(fd, static_cast<off_t>(from), SEEK_SET) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int connectTo(const std::string& host, const std::string& port) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo* a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd >= 0) {
+    timeval timeout{kSocketTimeoutSeconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+  return fd;
+}
+
+// Reads the response headers one byte at a time, so that not a single byte of
+// the body is taken off the socket.
+static bool readHeaders(int fd, std::string* headers) {
+  char c;
+  while (headers->size() < 16 * 1024) {
+    if (recv(fd, &c, 1, 0) != 1) {
+      return false;
+    }
+    headers->push_back(c);
+    if (headers->size() >= 4 && headers->compare(headers->size() - 4, 4, "\r\n\r\n") == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::string headerValue(const std::string& lowercase_headers, const std::string& name) {
+  const std::string key = "\r\n" + name + ":";
+  size_t pos = lowercase_headers.find(key);
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos += key.size();
+  size_t eol = lowercase_headers.find("\r\n", pos);
+  std::string value = lowercase_headers.substr(pos, eol - pos);
+  value.erase(0, value.find_first_not_of(' '));
+  value.erase(value.find_last_not_of(' ') + 1);
+  return value;
+}
+
+// Whether the environment names a proxy curl could route http:// through.
+// no_proxy is left to curl: with any of these set, it does the transfer.
+static bool proxyConfigured() {
+  for (const char* name : {"http_proxy", "HTTP_PROXY", "all_proxy", "ALL_PROXY"}) {
+    const char* value = std::getenv(name);
+    if (value != nullptr && *value != '\0') {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int openHttpSource(const std::string& url, uint64_t from, uint64_t length) {
+  if (proxyConfigured()) {
+    LOG_DEBUG << "Proxy configured, not splicing " << url;
+    return -1;
+  }
+  const std::string rest = url.substr(7);
+  const size_t slash = rest.find('/');
+  const std::string authority = rest.substr(0, slash);
+  const std::string path = slash == std::string::npos ? "/" : rest.substr(slash);
+  if (authority.find('@') != std::string::npos || authority.find('[') != std::string::npos) {
+    return -1;  // credentials and IPv6 literals are left to curl
+  }
+  const size_t colon = authority.find(':');
+  const std::string host = authority.substr(0, colon);
+  const std::string port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+
+  int fd = connectTo(host, port);
+  if (fd < 0) {
+    return -1;
+  }
+  std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + authority +
+                        "\r\nAccept-Encoding: identity\r\nConnection: close\r\n";
+  if (from > 0) {
+    request += "Range: bytes=" + std::to_string(from) + "-\r\n";
+  }
+  request += "\r\n";
+  std::string headers;
+  if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()) ||
+      !readHeaders(fd, &headers)) {
+    close(fd);
+    return -1;
+  }
+
+  std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+  const std::string expected_status = from > 0 ? " 206 " : " 200 ";
+  const std::string content_length = headerValue(headers, "content-length");
+  const std::string transfer_encoding = headerValue(headers, "transfer-encoding");
+  const std::string content_encoding = headerValue(headers, "content-encoding");
+  if (headers.compare(0, 8, "http/1.1") != 0 || headers.compare(8, 5, expected_status) != 0 ||
+      content_length != std::to_string(length - from) || !transfer_encoding.empty() ||
+      (!content_encoding.empty() && content_encoding != "identity")) {
+    LOG_DEBUG << "Response not suitable for splicing: " << headers.substr(0, headers.find('\r'));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int openSpliceSource(const std::string& url, uint64_t from, uint64_t length) {
+  if (url.compare(0, 7, "file://") == 0) {
+    return openFileSource(url.substr(7), from, length);
+  }
+  if (url.compare(0, 7, "http://") == 0) {
+    return openHttpSource(url, from, length);
+  }
+  return -1;
+}
+
+namespace {
+// A pipe, grown to one splice chunk so each call can move a full chunk.
+struct Pipe {
+  Pipe() {
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+      fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(kSpliceChunk));
+    }
+  }
+  ~Pipe() {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+  Pipe(const Pipe&) = delete;
+  Pipe& operator=(const Pipe&) = delete;
+  bool ok() const { return fds[0] >= 0; }
+  int fds[2]{-1, -1};
+};
+}  // namespace
+
+// Reads len bytes from the hash pipe straight into the stream ring.
+static bool commitToStream(int fd, size_t len, RingBuffer& stream, size_t install_reader,
+                           const std::atomic<bool>& failed) {
+  Backoff backoff;
+  while (len > 0) {
+    char* data = nullptr;
+    size_t room = stream.reserve(&data);
+    if (room == 0) {
+      if (failed) {
+        return false;
+      }
+      backoff.pause();  // the hash stage is behind
+      continue;
+    }
+    backoff.reset();
+    ssize_t n = read(fd, data, std::min(room, len));
+    if (n <= 0) {
+      return false;
+    }
+    stream.commit(static_cast<size_t>(n));
+    stream.consume(static_cast<size_t>(n), install_reader);
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+static bool spliceAll(int from, int to, size_t len) {
+  while (len > 0) {
+    ssize_t n = splice(from, nullptr, to, nullptr, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n <= 0) {
+      return false;
+    }
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool spliceTransfer(int src, int dst, uint64_t length, RingBuffer& stream, size_t install_reader,
+                    const std::atomic<bool>& failed, const api::FlowControlToken* token) {
+  Pipe payload;
+  Pipe copy;
+  if (!payload.ok() || !copy.ok()) {
+    return false;
+  }
+  uint64_t moved = 0;
+  while (moved < length && !failed) {
+    // Blocks while paused; the source's socket buffer then fills and TCP
+    // holds the sender back.
+    if (token != nullptr && !token->canContinue()) {
+      LOG_INFO << "Zero-copy download aborted after " << moved << " bytes";
+      return false;
+    }
+    ssize_t in = splice(src, nullptr, payload.fds[1], nullptr, std::min<uint64_t>(kSpliceChunk, length - moved),
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in <= 0) {
+      if (in < 0 && errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR << "Zero-copy download stopped after " << moved << " bytes";
+      return false;
+    }
+    // tee() does not consume, so each duplicated part is sent on before the
+    // next one is duplicated.
+    size_t pending = static_cast<size_t>(in);
+    while (pending > 0) {
+      ssize_t teed = tee(payload.fds[0], copy.fds[1], pending, 0);
+      if (teed <= 0 || !commitToStream(copy.fds[0], static_cast<size_t>(teed), stream, install_reader, failed) ||
+          !spliceAll(payload.fds[0], dst, static_cast<size_t>(teed))) {
+        return false;
+      }
+      pending -= static_cast<size_t>(teed);
+    }
+    moved += static_cast<uint64_t>(in);
+  }
+  return moved == length;
+}
@@ -0,0 +1,37 @@
+#ifndef SWUPDATE_POC_SPLICE_TRANSFER_H_
+#define SWUPDATE_POC_SPLICE_TRANSFER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "ring_buffer.h"
+#include "utilities/apiqueue.h"
+
+// Zero-copy data path for images that need neither TLS nor anything else
+// only curl can do: the payload moves from the download fd to the SWUpdate
+// install socket inside the kernel, through a pipe, with splice(). The hash
+// stage gets its copy with tee() into a second pipe, read straight into the
+// stream ring, so the payload crosses into user space once instead of three
+// times (curl buffer, ring, install socket).
+
+// Opens url for splice_transfer() positioned at byte from of an image of
+// length bytes. Supports "file://<path>" and "http://host[:port]/path"; for
+// the latter the GET request is sent and the response headers consumed.
+// Returns -1 for any other URL and for any response but a plain 200/206 of
+// the expected length, such as a redirect or a chunked or compressed body,
+// which are left to curl. So are all http:// URLs while http_proxy,
+// all_proxy or their upper case forms are set, as the connection made here
+// would not go through the proxy.
+int openSpliceSource(const std::string& url, uint64_t from, uint64_t length);
+
+// Moves length bytes from src to dst. Every byte is also committed to
+// stream before it is sent on, for the hash stage to read. dst stands in for
+// stream's install_reader, whose cursor is advanced past each committed byte
+// right away. Stops early once failed is set. If there is a token, the
+// transfer waits between chunks while it is paused and stops once it is
+// aborted. Returns false if the transfer did not complete.
+bool spliceTransfer(int src, int dst, uint64_t length, RingBuffer& stream, size_t install_reader,
+                    const std::atomic<bool>& failed, const api::FlowControlToken* token = nullptr);
+
+#endif  // SWUPDATE_POC_SPLICE_TRANSFER_H_
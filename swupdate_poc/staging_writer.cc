@@ -0,0 +1,324 @@
+#include "staging_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "logging/logging.h"
+
+// 32 blocks of 256 KiB: 8 MiB of writes can be outstanding before the download
+// waits for storage, and a checkpoint copies at most one block.
+static constexpr size_t kBlockSize = 256 * 1024;
+static constexpr size_t kBlockCount = 32;
+// Offset and length alignment O_DIRECT needs on common block devices.
+static constexpr size_t kAlignment = 4096;
+
+static uint64_t alignDown(uint64_t value) { return value & ~static_cast<uint64_t>(kAlignment - 1); }
+static uint64_t alignUp(uint64_t value) { return alignDown(value + kAlignment - 1); }
+
+// Carries out the block writes for StagingWriter on its writer thread and
+// reports each one to complete(tag, ok), in any order.
+class StagingEngine {
+ public:
+  using Completion = std::function<void(void* tag, bool ok)>;
+  StagingEngine(int fd, Completion complete) : fd_{fd}, complete_{std::move(complete)} {}
+  virtual ~StagingEngine() = default;
+  StagingEngine(const StagingEngine&) = delete;
+  StagingEngine& operator=(const StagingEngine&) = delete;
+
+  virtual const char* name() const = 0;
+  virtual void submit(const char* data, size_t len, uint64_t offset, void* tag) = 0;
+  // Waits for every submitted write to complete.
+  virtual void drain() = 0;
+
+ protected:
+  const int fd_;
+  const Completion complete_;
+};
+
+namespace {
+
+class ThreadEngine : public StagingEngine {
+ public:
+  using StagingEngine::StagingEngine;
+  const char* name() const override { return "thread"; }
+  void submit(const char* data, size_t len, uint64_t offset, void* tag) override {
+    while (len > 0) {
+      ssize_t n = pwrite(fd_, data, len, static_cast<off_t>(offset));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      data += n;
+      len -= static_cast<size_t>(n);
+      offset += static_cast<uint64_t>(n);
+    }
+    complete_(tag, len == 0);
+  }
+  void drain() override {}
+};
+
+#ifdef HAVE_LIBURING
+// Keeps up to kDepth writes in flight, which lets eMMC and NVMe controllers
+// work on several at once where pwrite() would issue one at a time.
+class UringEngine : public StagingEngine {
+ public:
+  static constexpr unsigned int kDepth = 8;
+
+  UringEngine(int fd, Completion complete) : StagingEngine(fd, std::move(complete)) {
+    if (io_uring_queue_init(kDepth, &ring_, 0) != 0) {
+      throw std::runtime_error("io_uring not available");
+    }
+  }
+  ~UringEngine() override {
+    drain();
+    io_uring_queue_exit(&ring_);
+  }
+  const char* name() const override { return "io_uring"; }
+
+  void submit(const char* data, size_t len, uint64_t offset, void* tag) override {
+    if (in_flight_ == kDepth) {
+      reap();
+    }
+    size_t slot = 0;
+    while (pending_[slot].tag != nullptr) {
+      ++slot;
+    }
+    pending_[slot] = {tag, len};
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    io_uring_prep_write(sqe, fd_, data, static_cast<unsigned int>(len), offset);
+    io_uring_sqe_set_data(sqe, &pending_[slot]);
+    io_uring_submit(&ring_);
+    ++in_flight_;
+  }
+  void drain() override {
+    while (in_flight_ > 0) {
+      reap();
+    }
+  }
+
+ private:
+  struct Pending {
+    void* tag;
+    size_t len;
+  };
+
+  void reap() {
+    io_uring_cqe* cqe = nullptr;
+    int rc;
+    while ((rc = io_uring_wait_cqe(&ring_, &cqe)) == -EINTR) {
+    }
+    if (rc != 0) {
+      // The ring is unusable; fail whatever is still in flight.
+      for (auto& pending : pending_) {
+        if (pending.tag != nullptr) {
+          void* tag = pending.tag;
+          pending.tag = nullptr;
+          complete_(tag, false);
+        }
+      }
+      in_flight_ = 0;
+      return;
+    }
+    auto* pending = static_cast<Pending*>(io_uring_cqe_get_data(cqe));
+    // A short write only happens when the disk is full; treat it as such.
+    const bool ok = cqe->res >= 0 && static_cast<size_t>(cqe->res) == pending->len;
+    io_uring_cqe_seen(&ring_, cqe);
+    void* tag = pending->tag;
+    pending->tag = nullptr;
+    --in_flight_;
+    complete_(tag, ok);
+  }
+
+  io_uring ring_{};
+  Pending pending_[kDepth]{};
+  unsigned int in_flight_{0};
+};
+#endif
+
+std::unique_ptr<StagingEngine> makeEngine(int fd, StagingEngine::Completion complete) {
+#ifdef HAVE_LIBURING
+  try {
+    return std::unique_ptr<StagingEngine>(new UringEngine(fd, complete));
+  } catch (const std::runtime_error& e) {
+    LOG_INFO << "Staging through a writer thread: " << e.what();
+  }
+#endif
+  return std::unique_ptr<StagingEngine>(new ThreadEngine(fd, std::move(complete)));
+}
+
+}  // namespace
+
+StagingWriter::StagingWriter(const std::string& path, uint64_t keep, uint64_t length) : memory_{nullptr, free} {
+  // O_DIRECT is refused by some filesystems, tmpfs among them.
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | O_DIRECT, 0600);
+  direct_ = fd_ >= 0;
+  if (fd_ < 0) {
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  }
+  if (fd_ < 0 || ftruncate(fd_, static_cast<off_t>(keep)) != 0) {
+    throw std::runtime_error("Could not open staging file " + path);
+  }
+  // Reserve the space up front so the file does not fragment and a full disk
+  // shows up now rather than halfway through. Not all filesystems can.
+  if (length > keep && fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(length)) != 0) {
+    LOG_DEBUG << "Could not preallocate " << path << ": " << std::strerror(errno);
+  }
+
+  void* memory = nullptr;
+  if (posix_memalign(&memory, kAlignment, kBlockSize * kBlockCount) != 0) {
+    close(fd_);
+    throw std::bad_alloc();
+  }
+  memory_.reset(static_cast<char*>(memory));
+  blocks_.resize(kBlockCount);
+  for (size_t i = 0; i < kBlockCount; ++i) {
+    blocks_[i].data = memory_.get() + i * kBlockSize;
+    free_.push_back(&blocks_[i]);
+  }
+
+  // Blocks stay aligned to the file, so a resumed file's partial last block
+  // is read back and rewritten as a whole.
+  current_ = takeFreeBlock();
+  current_->offset = alignDown(keep);
+  current_->len = static_cast<size_t>(keep - current_->offset);
+  end_ = keep;
+  if (current_->len > 0) {
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = in >= 0 && pread(in, current_->data, current_->len, static_cast<off_t>(current_->offset)) ==
+                             static_cast<ssize_t>(current_->len);
+    if (in >= 0) {
+      close(in);
+    }
+    if (!ok) {
+      close(fd_);
+      throw std::runtime_error("Could not read back staging file " + path);
+    }
+  }
+
+  engine_ = makeEngine(fd_, [this](void* tag, bool ok) {
+    if (!ok) {
+      failed_ = true;
+    }
+    releaseBlock(static_cast<Block*>(tag));
+  });
+  writer_ = std::thread(&StagingWriter::run, this);
+}
+
+StagingWriter::~StagingWriter() { finish(); }
+
+size_t StagingWriter::bufferSize() { return kBlockSize * kBlockCount; }
+
+std::string StagingWriter::backend() const { return std::string(engine_->name()) + (direct_ ? "+O_DIRECT" : ""); }
+
+StagingWriter::Block* StagingWriter::takeFreeBlock() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  free_cv_.wait(lock, [this] { return !free_.empty(); });
+  Block* block = free_.back();
+  free_.pop_back();
+  block->len = 0;
+  return block;
+}
+
+void StagingWriter::releaseBlock(Block* block) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    free_.push_back(block);
+  }
+  free_cv_.notify_one();
+}
+
+void StagingWriter::queue(Task task) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  task_cv_.notify_one();
+}
+
+void StagingWriter::write(const char* data, size_t len) {
+  while (len > 0) {
+    size_t n = std::min(len, kBlockSize - current_->len);
+    std::memcpy(current_->data + current_->len, data, n);
+    current_->len += n;
+    end_ += n;
+    data += n;
+    len -= n;
+    if (current_->len == kBlockSize) {
+      const uint64_t next = current_->offset + kBlockSize;
+      queue(Task{current_, nullptr, false});
+      current_ = takeFreeBlock();
+      current_->offset = next;
+    }
+  }
+}
+
+void StagingWriter::syncThen(std::function<void(bool)> done) {
+  if (current_->len > 0) {
+    // The partial block goes out as it is and filling continues in a copy,
+    // which is written again over the same range once it is full.
+    Block* copy = takeFreeBlock();
+    std::memcpy(copy->data, current_->data, current_->len);
+    copy->offset = current_->offset;
+    copy->len = current_->len;
+    queue(Task{current_, nullptr, false});
+    current_ = copy;
+  }
+  queue(Task{nullptr, std::move(done), false});
+}
+
+bool StagingWriter::finish() {
+  if (finished_) {
+    return !failed_;
+  }
+  finished_ = true;
+  if (current_->len > 0) {
+    queue(Task{current_, nullptr, false});
+  } else {
+    releaseBlock(current_);
+  }
+  current_ = nullptr;
+  queue(Task{nullptr, nullptr, true});
+  writer_.join();
+  // Padding of a direct write past the end of the image is cut off again.
+  if ((direct_ && ftruncate(fd_, static_cast<off_t>(end_)) != 0) || fdatasync(fd_) != 0) {
+    failed_ = true;
+  }
+  close(fd_);
+  return !failed_;
+}
+
+void StagingWriter::run() {
+  for (;;) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_cv_.wait(lock, [this] { return !tasks_.empty(); });
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    if (task.block != nullptr) {
+      const size_t len = direct_ ? static_cast<size_t>(alignUp(task.block->len)) : task.block->len;
+      engine_->submit(task.block->data, len, task.block->offset, task.block);
+    }
+    if (task.done) {
+      engine_->drain();
+      task.done(!failed_ && fdatasync(fd_) == 0);
+    }
+    if (task.stop) {
+      engine_->drain();
+      return;
+    }
+  }
+}
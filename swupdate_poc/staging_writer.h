@@ -0,0 +1,85 @@
+#ifndef SWUPDATE_POC_STAGING_WRITER_H_
+#define SWUPDATE_POC_STAGING_WRITER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class StagingEngine;
+
+// Writes the staging copy of the image off the download thread.
+//
+// write() only copies into one of a fixed set of aligned blocks; full blocks
+// are written out by a writer thread, through io_uring with several writes in
+// flight when built with liburing and the kernel allows it, or with pwrite()
+// otherwise. The file is opened with O_DIRECT where the filesystem supports
+// it, so writeback never piles up in the page cache, and preallocated to the
+// image length. The download only waits for storage once every block is
+// queued, i.e. when storage is slower than the network for longer than the
+// buffers last.
+class StagingWriter {
+ public:
+  // Opens path keeping its first keep bytes, from an interrupted download,
+  // and preallocates room for length bytes. Throws if it cannot be opened.
+  StagingWriter(const std::string& path, uint64_t keep, uint64_t length);
+  ~StagingWriter();
+  StagingWriter(const StagingWriter&) = delete;
+  StagingWriter& operator=(const StagingWriter&) = delete;
+
+  // Appends data. Blocks only while all buffers are queued for writing.
+  void write(const char* data, size_t len);
+  // Once everything written so far is on stable storage, calls done(true) on
+  // the writer thread, or done(false) if a write or the sync failed.
+  void syncThen(std::function<void(bool)> done);
+  // Writes and syncs the rest and closes the file. Returns false if anything
+  // failed to reach the disk since the writer was opened.
+  bool finish();
+
+  // "io_uring" or "thread", plus "+O_DIRECT" when the page cache is bypassed.
+  std::string backend() const;
+  // Memory a writer allocates for its buffers.
+  static size_t bufferSize();
+
+ private:
+  struct Block {
+    char* data{nullptr};
+    uint64_t offset{0};  // file offset of data[0], aligned
+    size_t len{0};
+  };
+  struct Task {
+    Block* block{nullptr};
+    std::function<void(bool)> done;
+    bool stop{false};
+  };
+
+  Block* takeFreeBlock();
+  void releaseBlock(Block* block);
+  void queue(Task task);
+  void run();
+
+  int fd_{-1};
+  bool direct_{false};
+  uint64_t end_{0};  // logical file length, i.e. bytes written
+  std::unique_ptr<char, void (*)(void*)> memory_;
+  std::vector<Block> blocks_;
+  Block* current_{nullptr};
+  std::unique_ptr<StagingEngine> engine_;
+  std::atomic<bool> failed_{false};
+  bool finished_{false};
+
+  std::mutex mutex_;
+  std::condition_variable free_cv_;
+  std::condition_variable task_cv_;
+  std::vector<Block*> free_;
+  std::deque<Task> tasks_;
+  std::thread writer_;
+};
+
+#endif  // SWUPDATE_POC_STAGING_WRITER_H_
@@ -0,0 +1,616 @@
+#include "swu_stage.h"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cctype>
+#include <regex>
+#include <stdexcept>
+
+// A newc or crc CPIO header: the magic and 13 fields of 8 hex digits.
+static constexpr size_t kCpioHeaderSize = 110;
+static constexpr size_t kCpioFields = 13;
+static constexpr size_t kCpioFileSize = 6;
+static constexpr size_t kCpioNameSize = 11;
+static constexpr size_t kCpioCheck = 12;
+// Longest file name accepted, NUL included.
+static constexpr uint64_t kMaxNameSize = 4096;
+// sw-description is held in memory until it is complete; real ones take a
+// few KiB.
+static constexpr uint64_t kMaxDescriptionSize = 1024 * 1024;
+// Deepest nesting of groups and lists in sw-description.
+static constexpr int kMaxDepth = 64;
+
+static uint64_t padding(uint64_t size) { return (4 - size % 4) % 4; }
+
+namespace {
+
+// A setting of sw-description: a scalar, a group of named settings, or a
+// list or array of unnamed ones.
+struct ConfigNode {
+  enum class Kind { kScalar, kGroup, kList };
+
+  const ConfigNode* find(const std::string& name) const {
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == name) {
+        return &children[i];
+      }
+    }
+    return nullptr;
+  }
+
+  Kind kind{Kind::kScalar};
+  // Scalars as written, numbers and booleans included; strings unquoted.
+  std::string scalar;
+  std::vector<std::string> names;
+  std::vector<ConfigNode> children;
+};
+
+// Parses the libconfig syntax of sw-description, and the JSON one, which is
+// a single top-level group with quoted names. Throws std::runtime_error on
+// anything else.
+class ConfigParser {
+ public:
+  explicit ConfigParser(const std::string& text) : text_{text} {}
+
+  ConfigNode parse() {
+    ConfigNode root;
+    root.kind = ConfigNode::Kind::kGroup;
+    skipSpace();
+    if (peek() == '{') {
+      ++pos_;
+      parseSettings(&root, '}', 1);
+      skipSpace();
+      if (pos_ != text_.size()) {
+        fail("unexpected text after the top-level object");
+      }
+    } else {
+      parseSettings(&root, '\0', 1);
+    }
+    return root;
+  }
+
+ private:
+  [[noreturn]] void fail(const std::string& what) const {
+    throw std::runtime_error("sw-description: " + what + " at offset " + std::to_string(pos_));
+  }
+  char peek() const { return pos_ < text_.size() ? text_[pos_] : '\0'; }
+  bool accept(char c) {
+    if (peek() != c || c == '\0') {
+      return false;
+    }
+    ++pos_;
+    return true;
+  }
+
+  // Skips white space and #, // and /* */ comments.
+  void skipSpace() {
+    while (pos_ < text_.size()) {
+      const char c = text_[pos_];
+      if (std::isspace(static_cast<unsigned char>(c)) != 0) {
+        ++pos_;
+      } else if (c == '#' || text_.compare(pos_, 2, "//") == 0) {
+        pos_ = std::min(text_.find('\n', pos_), text_.size());
+      } else if (text_.compare(pos_, 2, "/*") == 0) {
+        const size_t end = text_.find("*/", pos_ + 2);
+        if (end == std::string::npos) {
+          fail("unterminated comment");
+        }
+        pos_ = end + 2;
+      } else {
+        return;
+      }
+    }
+  }
+
+  // Settings up to close, or to the end of the text if close is '\0'.
+  void parseSettings(ConfigNode* group, char close, int depth) {
+    for (;;) {
+      skipSpace();
+      if (pos_ == text_.size()) {
+        if (close != '\0') {
+          fail("unterminated group");
+        }
+        return;
+      }
+      if (accept(close)) {
+        return;
+      }
+      if (peek() == '@') {
+        fail("@include is not supported");
+      }
+      std::string name = peek() == '"' ? parseString() : parseName();
+      skipSpace();
+      if (!accept('=') && !accept(':')) {
+        fail("expected = or : after " + name);
+      }
+      ConfigNode value = parseValue(depth + 1);
+      skipSpace();
+      if (!accept(';')) {
+        accept(',');
+      }
+      group->names.push_back(std::move(name));
+      group->children.push_back(std::move(value));
+    }
+  }
+
+  void parseElements(ConfigNode* list, char close, int depth) {
+    for (;;) {
+      skipSpace();
+      if (pos_ == text_.size()) {
+        fail("unterminated list");
+      }
+      if (accept(close)) {
+        return;
+      }
+      list->children.push_back(parseValue(depth + 1));
+      list->names.emplace_back();
+      skipSpace();
+      if (!accept(',') && peek() != close) {
+        fail(std::string("expected , or ") + close);
+      }
+    }
+  }
+
+  ConfigNode parseValue(int depth) {
+    if (depth > kMaxDepth) {
+      fail("nested too deeply");
+    }
+    skipSpace();
+    ConfigNode node;
+    const char c = peek();
+    if (accept('{')) {
+      node.kind = ConfigNode::Kind::kGroup;
+      parseSettings(&node, '}', depth);
+    } else if (accept('(') || accept('[')) {
+      node.kind = ConfigNode::Kind::kList;
+      parseElements(&node, c == '(' ? ')' : ']', depth);
+    } else if (c == '"') {
+      // Adjacent strings are concatenated, as in libconfig.
+      do {
+        node.scalar += parseString();
+        skipSpace();
+      } while (peek() == '"');
+    } else {
+      const size_t start = pos_;
+      while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_])) == 0 &&
+             std::string(",;)]}").find(text_[pos_]) == std::string::npos) {
+        ++pos_;
+      }
+      if (pos_ == start) {
+        fail("expected a value");
+      }
+      node.scalar = text_.substr(start, pos_ - start);
+    }
+    return node;
+  }
+
+  std::string parseName() {
+    const size_t start = pos_;
+    while (pos_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[pos_])) != 0 ||
+                                   std::string("_-*.").find(text_[pos_]) != std::string::npos)) {
+      ++pos_;
+    }
+    if (pos_ == start) {
+      fail("expected a setting name");
+    }
+    return text_.substr(start, pos_ - start);
+  }
+
+  std::string parseString() {
+    ++pos_;  // opening quote
+    std::string value;
+    for (;;) {
+      if (pos_ >= text_.size()) {
+        fail("unterminated string");
+      }
+      const char c = text_[pos_++];
+      if (c == '"') {
+        return value;
+      }
+      if (c != '\\') {
+        value.push_back(c);
+        continue;
+      }
+      const char escape = peek();
+      ++pos_;
+      switch (escape) {
+        case '"':
+        case '\\':
+        case '/':
+          value.push_back(escape);
+          break;
+        case 'b':
+          value.push_back('\b');
+          break;
+        case 'f':
+          value.push_back('\f');
+          break;
+        case 'n':
+          value.push_back('\n');
+          break;
+        case 'r':
+          value.push_back('\r');
+          break;
+        case 't':
+          value.push_back('\t');
+          break;
+        case 'x':
+          value.push_back(static_cast<char>(parseHex(2)));
+          break;
+        case 'u':
+          appendUtf8(&value, parseCodePoint());
+          break;
+        default:
+          fail("bad escape");
+      }
+    }
+  }
+
+  uint32_t parseHex(size_t digits) {
+    if (pos_ + digits > text_.size()) {
+      fail("bad escape");
+    }
+    uint32_t value = 0;
+    for (size_t i = 0; i < digits; ++i) {
+      const char c = text_[pos_++];
+      if (std::isxdigit(static_cast<unsigned char>(c)) == 0) {
+        fail("bad escape");
+      }
+      value = value * 16 + static_cast<uint32_t>(std::isdigit(static_cast<unsigned char>(c)) != 0
+                                                     ? c - '0'
+                                                     : std::tolower(static_cast<unsigned char>(c)) - 'a' + 10);
+    }
+    return value;
+  }
+
+  // \uXXXX, joined with a following low surrogate escape where there is one.
+  uint32_t parseCodePoint() {
+    const uint32_t high = parseHex(4);
+    if (high >= 0xd800 && high < 0xdc00 && text_.compare(pos_, 2, "\\u") == 0) {
+      const size_t saved = pos_;
+      pos_ += 2;
+      const uint32_t low = parseHex(4);
+      if (low >= 0xdc00 && low < 0xe000) {
+        return 0x10000 + ((high - 0xd800) << 10) + (low - 0xdc00);
+      }
+      pos_ = saved;
+    }
+    return high;
+  }
+
+  static void appendUtf8(std::string* out, uint32_t code_point) {
+    if (code_point < 0x80) {
+      out->push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+      out->push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else if (code_point < 0x10000) {
+      out->push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else {
+      out->push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    }
+  }
+
+  const std::string& text_;
+  size_t pos_{0};
+};
+
+}  // namespace
+
+static std::string join(const std::vector<std::string>& values) {
+  std::string joined;
+  for (const auto& value : values) {
+    joined += (joined.empty() ? "" : ", ") + value;
+  }
+  return joined;
+}
+
+static bool revisionMatches(const std::string& pattern, const std::string& revision) {
+  static const std::string kRegexPrefix = "#RE:";
+  if (pattern.compare(0, kRegexPrefix.size(), kRegexPrefix) != 0) {
+    return pattern == revision;
+  }
+  try {
+    return std::regex_search(revision, std::regex(pattern.substr(kRegexPrefix.size()), std::regex::extended));
+  } catch (const std::regex_error&) {
+    throw std::runtime_error("sw-description: bad regular expression " + pattern + " in hardware-compatibility");
+  }
+}
+
+// Throws std::runtime_error if the image is not meant for this device.
+//
+// Like SWUpdate, this takes software.<board> where it exists and software
+// otherwise. Board sections are the groups under software that have their
+// own hardware-compatibility.
+static void checkCompatibility(const ConfigNode& root, const SwuRequirements& requirements) {
+  const ConfigNode* software = root.find("software");
+  if (software == nullptr || software->kind != ConfigNode::Kind::kGroup) {
+    throw std::runtime_error("sw-description has no software group");
+  }
+  std::vector<std::string> boards;
+  bool generic = false;
+  for (size_t i = 0; i < software->children.size(); ++i) {
+    const ConfigNode& child = software->children[i];
+    if (child.kind == ConfigNode::Kind::kGroup && child.find("hardware-compatibility") != nullptr) {
+      boards.push_back(software->names[i]);
+    } else if (child.kind != ConfigNode::Kind::kScalar) {
+      generic = true;
+    }
+  }
+
+  const ConfigNode* section = software;
+  if (!requirements.board.empty()) {
+    const ConfigNode* own = software->find(requirements.board);
+    if (own != nullptr && own->kind == ConfigNode::Kind::kGroup) {
+      section = own;
+    } else if (!boards.empty() && !generic) {
+      throw std::runtime_error("sw-description is for " + join(boards) + ", not " + requirements.board);
+    }
+  }
+
+  const ConfigNode* compatibility = section->find("hardware-compatibility");
+  if (compatibility == nullptr && section != software) {
+    compatibility = software->find("hardware-compatibility");
+  }
+  if (requirements.revision.empty() || compatibility == nullptr) {
+    return;
+  }
+  std::vector<std::string> revisions;
+  for (const auto& revision : compatibility->children) {
+    if (revisionMatches(revision.scalar, requirements.revision)) {
+      return;
+    }
+    revisions.push_back(revision.scalar);
+  }
+  throw std::runtime_error("hardware revision " + requirements.revision +
+                           " is not in the hardware-compatibility of sw-description (" + join(revisions) + ")");
+}
+
+// Collects the sha256 of every file sw-description lists, in any section.
+static void collectDigests(const ConfigNode& node, std::multimap<std::string, std::string>* digests) {
+  const ConfigNode* filename = node.find("filename");
+  const ConfigNode* sha256 = node.find("sha256");
+  if (node.kind == ConfigNode::Kind::kGroup && filename != nullptr && sha256 != nullptr) {
+    std::string value = sha256->scalar;
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    digests->emplace(filename->scalar, value);
+  }
+  for (const auto& child : node.children) {
+    collectDigests(child, digests);
+  }
+}
+
+SwuParser::SwuParser(SwuRequirements requirements)
+    : requirements_{std::move(requirements)}, need_{kCpioHeaderSize}, digest_{EVP_sha256()} {}
+
+bool SwuParser::update(const char* data, size_t len) {
+  while (len > 0) {
+    size_t n = 0;
+    switch (state_) {
+      case State::kFailed:
+        return false;
+      case State::kTrailer:
+        // Whatever follows the trailer, e.g. padding to a block size.
+        position_ += len;
+        return true;
+      case State::kHeader:
+      case State::kName:
+        n = std::min(len, need_ - header_.size());
+        header_.append(data, n);
+        break;
+      case State::kData:
+        n = static_cast<size_t>(std::min<uint64_t>(len, left_));
+        if (entries_.empty()) {
+          description_.append(data, n);
+        }
+        digest_.update(data, n);
+        if (crc_format_) {
+          for (size_t i = 0; i < n; ++i) {
+            sum_ += static_cast<unsigned char>(data[i]);
+          }
+        }
+        left_ -= n;
+        break;
+      case State::kPadding:
+        n = std::min(len, need_);
+        need_ -= n;
+        break;
+    }
+    data += n;
+    len -= n;
+    position_ += n;
+
+    bool ok = true;
+    if (state_ == State::kHeader && header_.size() == need_) {
+      ok = parseHeader();
+    } else if (state_ == State::kName && header_.size() == need_) {
+      ok = startEntry();
+    } else if (state_ == State::kData && left_ == 0) {
+      ok = finishEntry();
+    } else if (state_ == State::kPadding && need_ == 0) {
+      state_ = State::kHeader;
+      need_ = kCpioHeaderSize;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return state_ != State::kFailed;
+}
+
+bool SwuParser::finish() {
+  if (state_ == State::kFailed) {
+    return false;
+  }
+  if (state_ != State::kTrailer) {
+    return fail("archive ends after " + std::to_string(position_) + " bytes, before " +
+                (validated_ ? "its trailer" : "sw-description is complete"));
+  }
+  return true;
+}
+
+bool SwuParser::parseHeader() {
+  const uint64_t start = position_ - kCpioHeaderSize;
+  if (header_.compare(0, 6, "070701") != 0 && header_.compare(0, 6, "070702") != 0) {
+    return fail(start == 0 ? "not a newc or crc CPIO archive" : "bad CPIO header at offset " + std::to_string(start));
+  }
+  crc_format_ = header_[5] == '2';
+  uint32_t fields[kCpioFields];
+  for (size_t i = 0; i < kCpioFields; ++i) {
+    fields[i] = 0;
+    for (size_t j = 6 + 8 * i; j < 6 + 8 * (i + 1); ++j) {
+      const unsigned char c = static_cast<unsigned char>(header_[j]);
+      if (std::isxdigit(c) == 0) {
+        return fail("bad CPIO header at offset " + std::to_string(start));
+      }
+      fields[i] = fields[i] * 16 + static_cast<uint32_t>(std::isdigit(c) != 0 ? c - '0' : std::tolower(c) - 'a' + 10);
+    }
+  }
+  name_size_ = fields[kCpioNameSize];
+  if (name_size_ == 0 || name_size_ > kMaxNameSize) {
+    return fail("bad CPIO header at offset " + std::to_string(start));
+  }
+  entry_ = SwuEntry();
+  entry_.size = fields[kCpioFileSize];
+  expected_sum_ = fields[kCpioCheck];
+  header_.clear();
+  need_ = static_cast<size_t>(name_size_ + padding(kCpioHeaderSize + name_size_));
+  state_ = State::kName;
+  return true;
+}
+
+bool SwuParser::startEntry() {
+  if (header_[name_size_ - 1] != '\0') {
+    return fail("bad CPIO file name at offset " + std::to_string(position_ - header_.size()));
+  }
+  entry_.name = header_.c_str();
+  entry_.offset = position_;
+  header_.clear();
+  if (entry_.name == "TRAILER!!!") {
+    if (entries_.empty()) {
+      return fail("archive has no sw-description");
+    }
+    state_ = State::kTrailer;
+    return true;
+  }
+  if (entries_.empty() && entry_.name != "sw-description") {
+    return fail("archive starts with " + entry_.name + " instead of sw-description");
+  }
+  if (entries_.empty() && entry_.size > kMaxDescriptionSize) {
+    return fail("sw-description is larger than " + std::to_string(kMaxDescriptionSize) + " bytes");
+  }
+  left_ = entry_.size;
+  sum_ = 0;
+  state_ = State::kData;
+  return left_ != 0 || finishEntry();
+}
+
+bool SwuParser::finishEntry() {
+  entry_.sha256 = digest_.hexDigest();
+  digest_.reset();
+  if (crc_format_ && sum_ != expected_sum_) {
+    return fail(entry_.name + " does not match its CPIO checksum");
+  }
+  if (entries_.empty()) {
+    if (!checkDescription()) {
+      return false;
+    }
+  } else {
+    const auto digests = expected_.equal_range(entry_.name);
+    for (auto it = digests.first; it != digests.second; ++it) {
+      entry_.expected_sha256 = it->second;
+      if (it->second == entry_.sha256) {
+        break;
+      }
+    }
+    if (entry_.expected_sha256 != entry_.sha256 && !entry_.expected_sha256.empty()) {
+      return fail(entry_.name + " does not match its sha256 in sw-description: expected " + entry_.expected_sha256 +
+                  ", got " + entry_.sha256);
+    }
+  }
+  entries_.push_back(entry_);
+  if (on_entry_) {
+    on_entry_(entries_.back());
+  }
+  need_ = static_cast<size_t>(padding(entry_.size));
+  state_ = need_ == 0 ? State::kHeader : State::kPadding;
+  if (state_ == State::kHeader) {
+    need_ = kCpioHeaderSize;
+  }
+  return true;
+}
+
+bool SwuParser::checkDescription() {
+  try {
+    const ConfigNode root = ConfigParser(description_).parse();
+    checkCompatibility(root, requirements_);
+    collectDigests(root, &expected_);
+  } catch (const std::runtime_error& e) {
+    return fail(e.what());
+  }
+  std::string().swap(description_);
+  validated_ = true;
+  return true;
+}
+
+bool SwuParser::fail(const std::string& error) {
+  error_ = error;
+  state_ = State::kFailed;
+  return false;
+}
+
+SwuStage::SwuStage(RingBuffer& stream, size_t reader, SwuRequirements requirements, const std::atomic<bool>& cancel,
+                   std::function<void(const std::string&)> on_error)
+    : stream_{stream},
+      reader_{reader},
+      cancel_{cancel},
+      on_error_{std::move(on_error)},
+      parser_{std::move(requirements)} {}
+
+SwuStage::~SwuStage() { wait(); }
+
+void SwuStage::start() { thread_ = std::thread(&SwuStage::run, this); }
+
+bool SwuStage::wait() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  return ok_;
+}
+
+void SwuStage::run() {
+  Backoff backoff;
+  while (!cancel_) {
+    const char* data = nullptr;
+    const size_t len = stream_.peek(&data, reader_);
+    if (len == 0) {
+      if (stream_.drained(reader_)) {
+        ok_ = parser_.finish();
+        break;
+      }
+      backoff.pause();
+      continue;
+    }
+    backoff.reset();
+    {
+      StageTimer timer(latency_);
+      ok_ = parser_.update(data, len);
+    }
+    if (parser_.validated() && !validated_) {
+      validated_.store(true, std::memory_order_release);
+    }
+    if (!ok_) {
+      break;
+    }
+    stream_.consume(len, reader_);
+  }
+  if (!ok_ && on_error_) {
+    on_error_(parser_.error());
+  }
+}
@@ -0,0 +1,153 @@
+#ifndef SWUPDATE_POC_SWU_STAGE_H_
+#define SWUPDATE_POC_SWU_STAGE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "digest.h"
+#include "metrics.h"
+#include "ring_buffer.h"
+
+// What sw-description is checked against.
+struct SwuRequirements {
+  // SWUpdate's board name, i.e. the device's hardware ID; empty for any.
+  std::string board;
+  // Hardware revision, looked up in hardware-compatibility; empty to skip
+  // that check.
+  std::string revision;
+};
+
+// One file of a .swu archive.
+struct SwuEntry {
+  std::string name;
+  // Where the file's data starts in the archive, and its size.
+  uint64_t offset{0};
+  uint64_t size{0};
+  // Hex sha256 of the data, and the one sw-description lists for the file,
+  // if any.
+  std::string sha256;
+  std::string expected_sha256;
+};
+
+// Incremental parser of a .swu: a newc or crc CPIO archive starting with
+// sw-description.
+//
+// The archive can be fed in pieces of any size as it arrives. sw-description
+// is parsed as soon as it is complete, in libconfig or JSON syntax, and
+// checked against the requirements the way SWUpdate will check it: if the
+// software group has board sections, this board needs one, unless there is
+// also a part for any board; and the hardware revision must be in the
+// hardware-compatibility list that applies, where entries starting with
+// "#RE:" are extended regular expressions. An image for other hardware is so
+// rejected in its first kilobytes. Every entry is hashed as it streams past
+// and checked against the sha256 sw-description lists for its file name, so a
+// corrupt image fails at the first bad entry. Only the CPIO header being read
+// and sw-description itself are buffered.
+class SwuParser {
+ public:
+  explicit SwuParser(SwuRequirements requirements);
+
+  // Called with every entry once its data is through.
+  void setEntryCallback(std::function<void(const SwuEntry&)> on_entry) { on_entry_ = std::move(on_entry); }
+
+  // Parses the next len bytes of the archive. Returns false, now and from
+  // then on, once the archive turned out malformed, incompatible or corrupt;
+  // error() says why.
+  bool update(const char* data, size_t len);
+  // Checks that the archive did not end before its trailer.
+  bool finish();
+
+  // True once sw-description has been read and found compatible.
+  bool validated() const { return validated_; }
+  // The entries seen so far, sw-description first.
+  const std::vector<SwuEntry>& entries() const { return entries_; }
+  const std::string& error() const { return error_; }
+
+ private:
+  enum class State { kHeader, kName, kData, kPadding, kTrailer, kFailed };
+
+  bool parseHeader();
+  bool startEntry();
+  bool finishEntry();
+  bool checkDescription();
+  bool fail(const std::string& error);
+
+  const SwuRequirements requirements_;
+  std::function<void(const SwuEntry&)> on_entry_;
+  State state_{State::kHeader};
+  // Archive offset of the next byte fed.
+  uint64_t position_{0};
+  // The header or name being read.
+  std::string header_;
+  size_t need_{0};
+  uint64_t name_size_{0};
+  // Of the entry being read.
+  SwuEntry entry_;
+  uint64_t left_{0};
+  bool crc_format_{false};
+  uint32_t expected_sum_{0};
+  uint32_t sum_{0};
+  EvpDigest digest_;
+  std::string description_;
+  bool validated_{false};
+  // sha256 digests sw-description lists, by file name. Sections for
+  // different boards may list different files under one name.
+  std::multimap<std::string, std::string> expected_;
+  std::vector<SwuEntry> entries_;
+  std::string error_;
+};
+
+// Pipeline stage running a SwuParser over the install stream on its own
+// thread.
+//
+// It is one more reader of the ring SWUpdate is fed from, so it parses the
+// very bytes SWUpdate gets. The install side holds the stream back until
+// validated() is set, so nothing reaches SWUpdate before sw-description has
+// passed.
+class SwuStage {
+ public:
+  // Reads reader of stream. on_error gets a description of a malformed,
+  // incompatible or corrupt archive; the stage then stops, as it does once
+  // cancel is set.
+  SwuStage(RingBuffer& stream, size_t reader, SwuRequirements requirements, const std::atomic<bool>& cancel,
+           std::function<void(const std::string&)> on_error);
+  ~SwuStage();
+  SwuStage(const SwuStage&) = delete;
+  SwuStage& operator=(const SwuStage&) = delete;
+
+  // Both must be set before start(). Entries are reported on the stage's
+  // thread.
+  void setEntryCallback(std::function<void(const SwuEntry&)> on_entry) {
+    parser_.setEntryCallback(std::move(on_entry));
+  }
+  void setLatencyHistogram(LatencyHistogram* latency) { latency_ = latency; }
+
+  void start();
+  // Waits for the end of the stream. Returns false if the archive was
+  // rejected; error() then says why.
+  bool wait();
+  const std::atomic<bool>& validated() const { return validated_; }
+  const std::vector<SwuEntry>& entries() const { return parser_.entries(); }
+  const std::string& error() const { return parser_.error(); }
+
+ private:
+  void run();
+
+  RingBuffer& stream_;
+  const size_t reader_;
+  const std::atomic<bool>& cancel_;
+  std::function<void(const std::string&)> on_error_;
+  SwuParser parser_;
+  LatencyHistogram* latency_{nullptr};
+  std::atomic<bool> validated_{false};
+  bool ok_{true};
+  std::thread thread_;
+};
+
+#endif  // SWUPDATE_POC_SWU_STAGE_H_
@@ -1,6 +1,11 @@
 #ifndef SWUPDATE_POC_H_
 #define SWUPDATE_POC_H_
 
-// TODO: Flesh out.
+// Runs the tool with the given command line, see main.cc for the options.
+// Returns EXIT_SUCCESS once SWUpdate installed, for every target given, an
+// image that matched every digest of that target. Builds that embed the tool,
+// such as the end-to-end benchmark, compile main.cc with __NO_MAIN__ and call
+// this instead. It runs one campaign per process.
+int swupdate_poc_main(int argc, char** argv);
 
 #endif  // SWUPDATE_POC_H_
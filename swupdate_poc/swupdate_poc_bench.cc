@@ -0,0 +1,101 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "digest.h"
+#include "hash_stage.h"
+#include "ring_buffer.h"
+
+// Micro-benchmarks for the download -> SWUpdate streaming pipeline. The curl
+// write callback and the readimage consumer are simulated by two threads
+// around the real stream ring, so the numbers isolate the pipeline from the
+// network and from SWUpdate.
+
+static constexpr size_t kRingSize = 4 * 1024 * 1024;
+// curl hands over at most CURL_MAX_WRITE_SIZE bytes per callback.
+static constexpr size_t kChunkSize = 16 * 1024;
+
+static double megabytesPerSecond(size_t bytes, std::chrono::steady_clock::duration elapsed) {
+  return static_cast<double>(bytes) / (1024.0 * 1024.0) /
+         std::chrono::duration_cast<std::chrono::duration<double>>(elapsed).count();
+}
+
+static void drain(RingBuffer& ring, size_t reader) {
+  Backoff backoff;
+  while (!ring.drained(reader)) {
+    const char* data = nullptr;
+    size_t len = ring.peek(&data, reader);
+    if (len == 0) {
+      backoff.pause();
+      continue;
+    }
+    backoff.reset();
+    ring.consume(len, reader);
+  }
+}
+
+static void produce(RingBuffer& ring, const std::vector<char>& chunk, size_t total, EvpDigest* inline_digest) {
+  Backoff backoff;
+  for (size_t sent = 0; sent < total; sent += chunk.size()) {
+    if (inline_digest != nullptr) {
+      inline_digest->update(chunk.data(), chunk.size());
+    }
+    size_t written = 0;
+    while (written < chunk.size()) {
+      size_t n = ring.write(chunk.data() + written, chunk.size() - written);
+      if (n == 0) {
+        backoff.pause();
+        continue;
+      }
+      backoff.reset();
+      written += n;
+    }
+  }
+  ring.close();
+}
+
+// Hashing inside the producer, as DownloadHandler used to do.
+static double benchInlineHash(const std::vector<char>& chunk, size_t total) {
+  RingBuffer ring(kRingSize);
+  EvpDigest digest(EVP_sha256());
+  auto start = std::chrono::steady_clock::now();
+  std::thread consumer(drain, std::ref(ring), 0);
+  produce(ring, chunk, total, &digest);
+  consumer.join();
+  digest.hexDigest();
+  return megabytesPerSecond(total, std::chrono::steady_clock::now() - start);
+}
+
+// Hashing as a second reader of the ring, as the HashStage does.
+static double benchPipelinedHash(const std::vector<char>& chunk, size_t total) {
+  RingBuffer ring(kRingSize, 2);
+  auto hash_stage = makeHashStage(ring, 1, {Sha256Algorithm::kName});
+  auto start = std::chrono::steady_clock::now();
+  hash_stage->start();
+  std::thread consumer(drain, std::ref(ring), 0);
+  produce(ring, chunk, total, nullptr);
+  consumer.join();
+  hash_stage->wait();
+  return megabytesPerSecond(total, std::chrono::steady_clock::now() - start);
+}
+
+int main(int argc, char** argv) {
+  size_t size_mb = 256;
+  if (argc > 1) {
+    size_mb = std::strtoul(argv[1], nullptr, 10);
+  }
+  const size_t total = size_mb * 1024 * 1024;
+  std::vector<char> chunk(kChunkSize);
+  for (size_t i = 0; i < chunk.size(); ++i) {
+    chunk[i] = static_cast<char>(i * 31);
+  }
+
+  std::printf("stream: %zu MiB in %zu KiB chunks, SHA acceleration: %s, cores: %u\n", size_mb, kChunkSize / 1024,
+              shaAcceleration(), std::thread::hardware_concurrency());
+  std::printf("sha256 inline in callback: %8.1f MB/s\n", benchInlineHash(chunk, total));
+  std::printf("sha256 pipelined stage:    %8.1f MB/s\n", benchPipelinedHash(chunk, total));
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+#include "json/json.h"
+
+#include "chunk_store.h"
+#include "digest.h"
+
+// Writes the chunk index of an image for delta updates, and prints the
+// chunkIndex entry to add to the target's custom.swupdate metadata.
+//
+//   swupdate-poc-chunk-index --image image.swu --output image.swu.chunks --url https://.../image.swu.chunks
+
+namespace bpo = boost::program_options;
+
+int main(int argc, char** argv) {
+  std::string image;
+  std::string output;
+  std::string url;
+  size_t avg_kb = 0;
+
+  bpo::options_description description("swupdate-poc-chunk-index options");
+  // clang-format off
+  description.add_options()
+      ("help,h", "print usage")
+      ("image", bpo::value<std::string>(&image)->required(), "image to index")
+      ("output", bpo::value<std::string>(&output)->required(), "where to write the index")
+      ("url", bpo::value<std::string>(&url)->default_value(""), "URL the index will be published at")
+      ("avg-chunk", bpo::value<size_t>(&avg_kb)->default_value(64), "average chunk size in KiB, a power of two");
+  // clang-format on
+
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::parse_command_line(argc, argv, description), vm);
+    if (vm.count("help") != 0) {
+      std::cout << description;
+      return EXIT_SUCCESS;
+    }
+    bpo::notify(vm);
+  } catch (const bpo::error& e) {
+    std::cerr << e.what() << std::endl << description;
+    return EXIT_FAILURE;
+  }
+
+  ChunkIndex index;
+  index.params.avg_size = avg_kb * 1024;
+  index.params.min_size = index.params.avg_size / 4;
+  index.params.max_size = index.params.avg_size * 4;
+  try {
+    if (!chunkFile(image, index.params, &index.chunks)) {
+      std::cerr << "Could not read " << image << std::endl;
+      return EXIT_FAILURE;
+    }
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  for (const auto& chunk : index.chunks) {
+    index.length += chunk.length;
+  }
+
+  Json::StreamWriterBuilder writer;
+  writer["indentation"] = "";
+  const std::string text = Json::writeString(writer, chunkIndexToJson(index));
+  if (!(std::ofstream(output, std::ios::binary) << text)) {
+    std::cerr << "Could not write " << output << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  EvpDigest digest(EVP_sha256());
+  digest.update(text.data(), text.size());
+  Json::Value entry;
+  entry["chunkIndex"]["url"] = url;
+  entry["chunkIndex"]["sha256"] = digest.hexDigest();
+  std::cout << index.chunks.size() << " chunks" << std::endl << entry << std::endl;
+  return EXIT_SUCCESS;
+}
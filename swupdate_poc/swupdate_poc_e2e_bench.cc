@@ -0,0 +1,771 @@
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include "json/json.h"
+
+extern "C" {
+#include "network_ipc.h"
+}
+
+#include "chunk_store.h"
+#include "digest.h"
+#include "local_http_server.h"
+#include "mock_swupdate_ipc.h"
+#include "swupdate_poc.h"
+
+// End-to-end benchmark of the whole tool: the real download, ring, hash stage
+// and SWUpdate IPC client, with a local HTTP server in place of the storage
+// backend and MockSwupdateIpc in place of the SWUpdate daemon. Everything runs
+// in this process, so the numbers cover the pipeline and loopback only.
+//
+//   swupdate-poc-e2e-bench [--size MiB] [--latency ms] [--rate MiB/s] [--delta %] [--compress FORMAT]
+//                          [--metadata-targets N] [--board NAME] [--abort-at MiB] [--pause-at MiB --pause-for ms]
+//                          [--two-phase] [--mirrors N [--mirror-latency ms]] [--cut-at MiB]
+//                          [--stall-at MiB [--stall-for ms]] [--campaign N [--campaign-size MiB]]
+//                          [-- swupdate-poc options]
+//
+// Given the tool's --max-rate, it reports how closely the download keeps to
+// the cap. With --mirrors, it reports how much each server served. With
+// --campaign, the tool updates several targets at once, each served by a
+// server of its own; its throughput is that of all images together.
+
+namespace bpo = boost::program_options;
+
+using Clock = std::chrono::steady_clock;
+
+static void appendCpioHeader(std::string* archive, const std::string& name, size_t size) {
+  char header[111];
+  std::snprintf(header, sizeof(header), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X", 0U,
+                name == "TRAILER!!!" ? 0U : 0100644U, 0U, 0U, 1U, 0U, static_cast<unsigned int>(size), 0U, 0U, 0U,
+                0U, static_cast<unsigned int>(name.size() + 1), 0U);
+  archive->append(header, 110);
+  archive->append(name);
+  archive->push_back('\0');
+  archive->append((4 - archive->size() % 4) % 4, '\0');
+}
+
+static void appendCpioEntry(std::string* archive, const std::string& name, const std::string& data) {
+  appendCpioHeader(archive, name, data.size());
+  archive->append(data);
+  archive->append((4 - archive->size() % 4) % 4, '\0');
+}
+
+// Incompressible filler, so later stages cannot get away with less work than
+// on a real image. Deterministic, so it can be hashed before it is stored;
+// state carries on between calls as long as len stays a multiple of 8. For
+// compression runs, half the bits are cleared: the result compresses to a
+// little over half, like a typical rootfs.
+static void fillPayload(char* data, size_t len, uint64_t* state, bool compressible) {
+  const uint64_t mask = compressible ? 0x0f0f0f0f0f0f0f0fULL : ~0ULL;
+  uint64_t x = *state;
+  for (size_t i = 0; i < len; i += sizeof(x)) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    const uint64_t value = x & mask;
+    std::memcpy(data + i, &value, std::min(sizeof(value), len - i));
+  }
+  *state = x;
+}
+
+static constexpr uint64_t kPayloadSeed = 0x9e3779b97f4a7c15ULL;
+
+// A valid newc .swu of about the given size: a sw-description and one raw
+// image, for any board or only for board. The payload is generated in place;
+// a second copy would show up in the peak RSS the benchmark reports. Images
+// from different seeds differ, even if they are of the same size.
+static std::string syntheticSwu(size_t size, bool compressible, const std::string& board,
+                                uint64_t seed = kPayloadSeed) {
+  const size_t payload_size = size > 4096 ? size - 4096 : size;
+  EvpDigest payload_digest(EVP_sha256());
+  std::vector<char> chunk(1024 * 1024);
+  uint64_t state = seed;
+  for (size_t done = 0; done < payload_size; done += chunk.size()) {
+    const size_t len = std::min(chunk.size(), payload_size - done);
+    fillPayload(chunk.data(), len, &state, compressible);
+    payload_digest.update(chunk.data(), len);
+  }
+  const std::string images =
+      "  images: ({\n"
+      "    filename = \"rootfs.img\";\n"
+      "    type = \"raw\";\n"
+      "    device = \"/dev/null\";\n"
+      "    sha256 = \"" +
+      payload_digest.hexDigest() +
+      "\";\n"
+      "  });\n";
+  const std::string description =
+      "software = {\n"
+      "  version = \"0.0.0\";\n" +
+      (board.empty() ? images : "  " + board + " = {\n  hardware-compatibility = [\"1.0\"];\n" + images + "  };\n") +
+      "}\n";
+
+  std::string archive;
+  archive.reserve(payload_size + 4096);
+  appendCpioEntry(&archive, "sw-description", description);
+  appendCpioHeader(&archive, "rootfs.img", payload_size);
+  const size_t offset = archive.size();
+  archive.resize(offset + payload_size);
+  state = seed;
+  fillPayload(&archive[offset], payload_size, &state, compressible);
+  archive.append((4 - archive.size() % 4) % 4, '\0');
+  appendCpioEntry(&archive, "TRAILER!!!", "");
+  return archive;
+}
+
+static std::string gzipCompress(const char* data, size_t len, bool bgzf_header) {
+  z_stream z{};
+  deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, bgzf_header ? -MAX_WBITS : 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&z, len), '\0');
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  z.avail_in = static_cast<uInt>(len);
+  z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  z.avail_out = static_cast<uInt>(out.size());
+  deflate(&z, Z_FINISH);
+  out.resize(z.total_out);
+  deflateEnd(&z);
+  if (!bgzf_header) {
+    return out;
+  }
+  // A BGZF member: gzip with the member size in a "BC" extra field.
+  auto le = [](uint32_t value, int bytes) {
+    std::string field;
+    for (int i = 0; i < bytes; ++i) {
+      field.push_back(static_cast<char>(value >> (8 * i)));
+    }
+    return field;
+  };
+  const uint32_t crc = static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(len)));
+  return std::string("\x1f\x8b\x08\x04\0\0\0\0\0\xff", 10) + le(6, 2) + "BC" + le(2, 2) +
+         le(static_cast<uint32_t>(18 + 8 + out.size() - 1), 2) + out + le(crc, 4) + le(static_cast<uint32_t>(len), 4);
+}
+
+// The image as served with --compress: "gzip" and "zstd" are one stream,
+// "bgzf" and "pzstd" independent frames that can be decoded in parallel.
+// Returns the custom.swupdate.compression value.
+static std::string compressImage(std::string* image, const std::string& format) {
+  const size_t kFrame = format == "bgzf" ? 64 * 1000 : 4 * 1024 * 1024;
+  std::string compressed;
+  if (format == "gzip") {
+    compressed = gzipCompress(image->data(), image->size(), false);
+  } else if (format == "bgzf") {
+    for (size_t offset = 0; offset < image->size(); offset += kFrame) {
+      compressed += gzipCompress(image->data() + offset, std::min(kFrame, image->size() - offset), true);
+    }
+#ifdef HAVE_ZSTD
+  } else if (format == "zstd" || format == "pzstd") {
+    const size_t frame_size = format == "zstd" ? image->size() : kFrame;
+    std::string frame;
+    for (size_t offset = 0; offset < image->size(); offset += frame_size) {
+      const size_t len = std::min(frame_size, image->size() - offset);
+      frame.resize(ZSTD_compressBound(len));
+      frame.resize(ZSTD_compress(&frame[0], frame.size(), image->data() + offset, len, 3));
+      if (format == "pzstd") {
+        const uint32_t header[3] = {0x184D2A50, 4, static_cast<uint32_t>(frame.size())};
+        compressed.append(reinterpret_cast<const char*>(header), sizeof(header));
+      }
+      compressed += frame;
+    }
+#endif
+  } else {
+    throw std::runtime_error("Unknown --compress format " + format);
+  }
+  *image = std::move(compressed);
+  return format == "bgzf" ? "gzip" : format == "pzstd" ? "zstd" : format;
+}
+
+// An earlier version of image for delta runs: the same but for percent of
+// its 1 MiB blocks, spread evenly over it.
+static void writeSeed(const std::string& path, const std::string& image, unsigned int percent) {
+  const size_t kBlock = 1024 * 1024;
+  std::ofstream seed(path, std::ios::binary);
+  std::vector<char> block(kBlock);
+  for (size_t i = 0; i * kBlock < image.size(); ++i) {
+    const size_t len = std::min(kBlock, image.size() - i * kBlock);
+    std::memcpy(block.data(), image.data() + i * kBlock, len);
+    if ((i + 1) * percent / 100 != i * percent / 100) {
+      for (size_t j = 0; j < len; ++j) {
+        block[j] = static_cast<char>(~block[j]);
+      }
+    }
+    seed.write(block.data(), static_cast<std::streamsize>(len));
+  }
+}
+
+// The name and hardware ID of the target in generated targets metadata.
+static const char kMetadataTargetName[] = "e2e-bench.swu";
+static const char kMetadataHardwareId[] = "e2e-bench";
+
+// The target metadata for image as served, from uri if it is not empty.
+// swupdate holds the extra custom.swupdate entries, e.g. "chunkIndex" for
+// delta runs.
+static Json::Value targetJson(const std::string& image, const Json::Value& swupdate, const std::string& uri) {
+  EvpDigest digest(EVP_sha256());
+  digest.update(image.data(), image.size());
+  Json::Value target;
+  target["hashes"]["sha256"] = digest.hexDigest();
+  target["length"] = static_cast<Json::UInt64>(image.size());
+  target["custom"]["targetFormat"] = "BINARY";
+  if (!uri.empty()) {
+    target["custom"]["uri"] = uri;
+  }
+  if (!swupdate.isNull()) {
+    target["custom"]["swupdate"] = swupdate;
+  }
+  return target;
+}
+
+// Writes the target, on its own or, with metadata_targets, as the last of
+// that many entries of Uptane targets metadata, the others for other devices.
+// The targets of a campaign are listed for this device as well, before it.
+static void writeTarget(const std::string& path, Json::Value target, unsigned int metadata_targets,
+                        const std::vector<std::pair<std::string, Json::Value>>& campaign) {
+  std::ofstream file(path);
+  if (metadata_targets == 0) {
+    file << target;
+    return;
+  }
+  target["custom"]["hardwareIds"].append(kMetadataHardwareId);
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  file << R"({"signatures":[],"signed":{"_type":"Targets","version":1,"targets":{)";
+  Json::Value other = target;
+  for (unsigned int i = 1; i < metadata_targets; ++i) {
+    other["custom"]["hardwareIds"][0] = "device-" + std::to_string(i % 64);
+    file << "\"other-" << i << ".swu\":" << Json::writeString(builder, other) << ",";
+  }
+  for (auto entry : campaign) {
+    entry.second["custom"]["hardwareIds"].append(kMetadataHardwareId);
+    file << "\"" << entry.first << "\":" << Json::writeString(builder, entry.second) << ",";
+  }
+  file << "\"" << kMetadataTargetName << "\":" << Json::writeString(builder, target) << "}}}";
+}
+
+static double milliseconds(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(d).count();
+}
+
+static long peakRssKb() {
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// User plus system CPU time of the whole process, server and mock included.
+static double cpuSeconds() {
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+         static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Time each slice of the image took from being sent by the server to reaching
+// the IPC socket. A slice sent more than once, e.g. past the end of a segment
+// and again by the connection that owns it, counts with its last send before
+// it arrived.
+static std::vector<double> chunkLatencies(std::vector<std::pair<uint64_t, Clock::time_point>> sends,
+                                          const std::vector<std::pair<uint64_t, Clock::time_point>>& receives) {
+  std::sort(sends.begin(), sends.end());
+  std::vector<double> latencies;
+  for (size_t i = 0; i < sends.size();) {
+    const uint64_t end = sends[i].first;
+    auto received = std::lower_bound(receives.begin(), receives.end(), end,
+                                     [](const std::pair<uint64_t, Clock::time_point>& r, uint64_t offset) {
+                                       return r.first < offset;
+                                     });
+    bool found = false;
+    Clock::time_point sent;
+    for (; i < sends.size() && sends[i].first == end; ++i) {
+      if (received != receives.end() && sends[i].second <= received->second) {
+        sent = sends[i].second;
+        found = true;
+      }
+    }
+    if (found) {
+      latencies.push_back(milliseconds(received->second - sent));
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+static double percentile(const std::vector<double>& sorted, double q) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * static_cast<double>(sorted.size())))];
+}
+
+// Rates in MiB/s at which the server sent the image: over the whole run,
+// and the lowest and highest over whole seconds. The first second is left
+// out of those, as the socket buffers fill up at once then. Over loopback,
+// a Range request of --connections can go into the socket buffers whole, so
+// their seconds spread wider than what the tool actually reads.
+struct RateSpread {
+  double overall{0};
+  double lowest{0};
+  double highest{0};
+};
+
+static RateSpread rateSpread(const std::vector<std::pair<uint64_t, Clock::time_point>>& served,
+                             Clock::time_point start, Clock::time_point finish) {
+  RateSpread spread;
+  if (served.empty()) {
+    return spread;
+  }
+  const double mib = 1024.0 * 1024.0;
+  spread.overall = static_cast<double>(served.back().first) / mib / (milliseconds(finish - start) / 1000.0);
+  size_t window_start = 0;
+  bool first = true;
+  for (size_t i = 1; i < served.size(); ++i) {
+    if (served[i].second - served[window_start].second < std::chrono::seconds(1)) {
+      continue;
+    }
+    const double rate = static_cast<double>(served[i].first - served[window_start].first) / mib /
+                        (milliseconds(served[i].second - served[window_start].second) / 1000.0);
+    window_start = i;
+    if (first) {
+      first = false;
+      continue;
+    }
+    spread.lowest = spread.lowest == 0 ? rate : std::min(spread.lowest, rate);
+    spread.highest = std::max(spread.highest, rate);
+  }
+  return spread;
+}
+
+// The value of the tool's --max-rate, 0 if it is not given.
+static double maxRateOption(const std::vector<std::string>& tool_args) {
+  for (size_t i = 0; i < tool_args.size(); ++i) {
+    if (tool_args[i] == "--max-rate" && i + 1 < tool_args.size()) {
+      return std::atof(tool_args[i + 1].c_str());
+    }
+    if (tool_args[i].compare(0, 11, "--max-rate=") == 0) {
+      return std::atof(tool_args[i].c_str() + 11);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  size_t size_mb = 0;
+  unsigned int latency_ms = 0;
+  uint64_t rate_mb = 0;
+  unsigned int delta_percent = 0;
+  std::string compress;
+  unsigned int metadata_targets = 0;
+  std::string board;
+  uint64_t abort_at_mb = 0;
+  uint64_t pause_at_mb = 0;
+  unsigned int pause_ms = 0;
+  unsigned int mirror_count = 0;
+  unsigned int mirror_latency_ms = 0;
+  uint64_t cut_at_mb = 0;
+  uint64_t stall_at_mb = 0;
+  unsigned int stall_ms = 0;
+  unsigned int campaign_targets = 0;
+  size_t campaign_size_mb = 0;
+
+  bpo::options_description description("swupdate-poc-e2e-bench options");
+  // clang-format off
+  description.add_options()
+      ("help,h", "print usage")
+      ("size", bpo::value<size_t>(&size_mb)->default_value(256), "image size in MiB")
+      ("latency", bpo::value<unsigned int>(&latency_ms)->default_value(0), "server delay per request in ms")
+      ("rate", bpo::value<uint64_t>(&rate_mb)->default_value(0), "server rate per connection in MiB/s, 0 for none")
+      ("delta", bpo::value<unsigned int>(&delta_percent)->default_value(0),
+       "delta update from a seed differing in this percentage of the image, 0 for a full download")
+      ("compress", bpo::value<std::string>(&compress),
+       "serve the image compressed: gzip, bgzf, zstd or pzstd (the last two if built with zstd)")
+      ("metadata-targets", bpo::value<unsigned int>(&metadata_targets)->default_value(0),
+       "hand the tool targets metadata listing this many targets, the image's last, instead of a single target")
+      ("board", bpo::value<std::string>(&board),
+       "make the image for this board only, e.g. to see one for other hardware rejected with -- --hardware-id")
+      ("abort-at", bpo::value<uint64_t>(&abort_at_mb)->default_value(0),
+       "send the tool SIGTERM once this many MiB are served, and measure how fast it stops; 0 for never")
+      ("pause-at", bpo::value<uint64_t>(&pause_at_mb)->default_value(0),
+       "pause the tool with SIGUSR1 once this many MiB are served, and resume it --pause-for ms later")
+      ("pause-for", bpo::value<unsigned int>(&pause_ms)->default_value(1000), "ms to pause for with --pause-at")
+      ("two-phase",
+       "run the tool with --prefetch first, then measure the --install-staged run on its own")
+      ("mirrors", bpo::value<unsigned int>(&mirror_count)->default_value(0),
+       "serve the image from this many more servers, handed to the tool with --mirror")
+      ("mirror-latency", bpo::value<unsigned int>(&mirror_latency_ms)->default_value(0),
+       "delay per request of the --mirrors in ms")
+      ("cut-at", bpo::value<uint64_t>(&cut_at_mb)->default_value(0),
+       "close every response of the first server once it reaches this many MiB, 0 for never")
+      ("stall-at", bpo::value<uint64_t>(&stall_at_mb)->default_value(0),
+       "stop every response of the first server for --stall-for ms once it reaches this many MiB, 0 for never")
+      ("stall-for", bpo::value<unsigned int>(&stall_ms)->default_value(3000), "ms to stall for with --stall-at")
+      ("campaign", bpo::value<unsigned int>(&campaign_targets)->default_value(0),
+       "update this many targets at once: the image of --size and others of --campaign-size, 0 or 1 for one")
+      ("campaign-size", bpo::value<size_t>(&campaign_size_mb)->default_value(32),
+       "size in MiB of the other images of a --campaign");
+  // clang-format on
+
+  bpo::variables_map vm;
+  std::vector<std::string> tool_args;
+  try {
+    bpo::parsed_options parsed = bpo::command_line_parser(argc, argv).options(description).allow_unregistered().run();
+    tool_args = bpo::collect_unrecognized(parsed.options, bpo::include_positional);
+    bpo::store(parsed, vm);
+    bpo::notify(vm);
+  } catch (const bpo::error& e) {
+    std::cerr << e.what() << std::endl << description;
+    return EXIT_FAILURE;
+  }
+  if (vm.count("help") != 0) {
+    std::cout << description << "Other options are passed on to swupdate-poc." << std::endl;
+    return EXIT_SUCCESS;
+  }
+  const bool two_phase = vm.count("two-phase") != 0;
+  const bool campaign = campaign_targets > 1;
+  if (campaign && (delta_percent > 0 || !compress.empty() || mirror_count > 0 || metadata_targets > 0)) {
+    std::cerr << "--campaign takes full, uncompressed downloads from one server per image" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // The tool takes these signals on a thread of its own. Every thread the
+  // benchmark starts has to block them as well, or one of those would get
+  // them and die.
+  if (abort_at_mb > 0 || pause_at_mb > 0) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (int signal : {SIGUSR1, SIGUSR2, SIGINT, SIGTERM}) {
+      sigaddset(&signals, signal);
+    }
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  }
+
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  boost::filesystem::create_directories(dir);
+  // Point the IPC library at a private control socket, so a SWUpdate daemon
+  // running on this machine is neither used nor disturbed.
+  setenv("RUNTIME_DIRECTORY", dir.c_str(), 1);
+  setenv("TMPDIR", dir.c_str(), 1);
+
+  std::string image = syntheticSwu(size_mb * 1024 * 1024, !compress.empty(), board);
+  // The other images of a campaign, and the sizes SWUpdate gets of them all.
+  std::vector<std::string> campaign_images;
+  std::vector<uint64_t> install_sizes{image.size()};
+  for (unsigned int i = 1; campaign && i < campaign_targets; ++i) {
+    campaign_images.push_back(syntheticSwu(campaign_size_mb * 1024 * 1024, false, board, kPayloadSeed + i));
+    install_sizes.push_back(campaign_images.back().size());
+  }
+  size_t install_size = 0;
+  for (const uint64_t size : install_sizes) {
+    install_size += size;
+  }
+  const std::string target_path = (dir / "target.json").string();
+  Json::Value swupdate;
+  if (!compress.empty()) {
+    EvpDigest raw_digest(EVP_sha256());
+    raw_digest.update(image.data(), image.size());
+    swupdate["rawHashes"]["sha256"] = raw_digest.hexDigest();
+    try {
+      swupdate["compression"] = compressImage(&image, compress);
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // A delta run publishes the image's chunk index on a second server and
+  // hands the tool a seed to take the unchanged chunks from.
+  std::unique_ptr<LocalHttpServer> index_server;
+  if (delta_percent > 0) {
+    ChunkIndex index;
+    index.length = image.size();
+    index.chunks = chunkBuffer(image.data(), image.size(), index.params);
+    const std::string text = Json::writeString(Json::StreamWriterBuilder(), chunkIndexToJson(index));
+    EvpDigest digest(EVP_sha256());
+    digest.update(text.data(), text.size());
+    index_server = std::unique_ptr<LocalHttpServer>(new LocalHttpServer(text));
+    swupdate["chunkIndex"]["url"] = index_server->url();
+    swupdate["chunkIndex"]["sha256"] = digest.hexDigest();
+    const std::string seed_path = (dir / "seed.swu").string();
+    writeSeed(seed_path, image, std::min(delta_percent, 100U));
+    tool_args.insert(tool_args.begin(), {"--seed", seed_path});
+  }
+
+  std::mutex samples_mutex;
+  std::vector<std::pair<uint64_t, Clock::time_point>> sends;
+  std::vector<std::pair<uint64_t, Clock::time_point>> receives;
+  // Bytes the server had sent, over time.
+  std::vector<std::pair<uint64_t, Clock::time_point>> served;
+  // Where the server and SWUpdate were when a signal went out, and when.
+  struct SignalSample {
+    Clock::time_point sent;
+    uint64_t served{0};
+    uint64_t installed{0};
+  };
+  SignalSample abort_sample;
+  SignalSample pause_sample;
+  SignalSample resume_sample;
+  bool abort_sent = false;
+  bool pause_sent = false;
+  std::thread resumer;
+  std::unique_ptr<MockSwupdateIpc> daemon;
+  LocalHttpServer server(image);
+  server.setLatency(std::chrono::milliseconds(latency_ms));
+  server.setRate(rate_mb * 1024 * 1024);
+  server.setCutAt(cut_at_mb * 1024 * 1024);
+  server.setStallAt(stall_at_mb * 1024 * 1024, std::chrono::milliseconds(stall_ms));
+  std::vector<std::unique_ptr<LocalHttpServer>> mirrors;
+  for (unsigned int i = 0; i < mirror_count; ++i) {
+    mirrors.emplace_back(new LocalHttpServer(image));
+    mirrors.back()->setLatency(std::chrono::milliseconds(mirror_latency_ms));
+    mirrors.back()->setRate(rate_mb * 1024 * 1024);
+  }
+  // A campaign's images each come from a server of their own, named in the
+  // metadata rather than with --url.
+  std::vector<std::unique_ptr<LocalHttpServer>> campaign_servers;
+  std::vector<std::pair<std::string, Json::Value>> campaign_targets_json;
+  std::vector<std::string> campaign_args;
+  for (size_t i = 0; i < campaign_images.size(); ++i) {
+    campaign_servers.emplace_back(new LocalHttpServer(campaign_images[i]));
+    campaign_servers.back()->setLatency(std::chrono::milliseconds(latency_ms));
+    campaign_servers.back()->setRate(rate_mb * 1024 * 1024);
+    const std::string name = "e2e-bench-" + std::to_string(i + 1) + ".swu";
+    campaign_targets_json.emplace_back(name,
+                                       targetJson(campaign_images[i], Json::Value(), campaign_servers.back()->url()));
+    campaign_args.insert(campaign_args.end(), {"--target-name", name});
+  }
+  tool_args.insert(tool_args.begin(), campaign_args.begin(), campaign_args.end());
+  writeTarget(target_path, targetJson(image, swupdate, campaign ? server.url() : std::string()),
+              campaign ? 1 : metadata_targets, campaign_targets_json);
+  if (metadata_targets > 0 || campaign) {
+    tool_args.insert(tool_args.begin(), {"--target-name", kMetadataTargetName, "--hardware-id", kMetadataHardwareId});
+  }
+  if (campaign && std::find(tool_args.begin(), tool_args.end(), "--cache-dir") == tool_args.end()) {
+    tool_args.insert(tool_args.begin(), {"--cache-dir", (dir / "cache").string()});
+  }
+  // Image data sent by all servers together.
+  auto bytesServed = [&] {
+    uint64_t total = server.bytesSent();
+    for (const auto& other : mirrors) {
+      total += other->bytesSent();
+    }
+    for (const auto& other : campaign_servers) {
+      total += other->bytesSent();
+    }
+    return total;
+  };
+  auto requestsServed = [&] {
+    unsigned int total = server.requests();
+    for (const auto& other : mirrors) {
+      total += other->requests();
+    }
+    for (const auto& other : campaign_servers) {
+      total += other->requests();
+    }
+    return total;
+  };
+  auto sample = [&](SignalSample* signal_sample) {
+    signal_sample->sent = Clock::now();
+    signal_sample->served = bytesServed();
+    signal_sample->installed = daemon->received();
+  };
+  auto observer = [&](uint64_t end_offset) {
+    auto now = Clock::now();
+    std::lock_guard<std::mutex> guard(samples_mutex);
+    sends.emplace_back(end_offset, now);
+    served.emplace_back(bytesServed(), now);
+    if (abort_at_mb > 0 && end_offset >= abort_at_mb * 1024 * 1024 && !abort_sent) {
+      abort_sent = true;
+      sample(&abort_sample);
+      kill(getpid(), SIGTERM);
+    }
+    if (pause_at_mb > 0 && end_offset >= pause_at_mb * 1024 * 1024 && !pause_sent) {
+      pause_sent = true;
+      sample(&pause_sample);
+      kill(getpid(), SIGUSR1);
+      resumer = std::thread([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(pause_ms));
+        sample(&resume_sample);
+        kill(getpid(), SIGUSR2);
+      });
+    }
+  };
+  server.setSendObserver(observer);
+  for (const auto& mirror : mirrors) {
+    mirror->setSendObserver(observer);
+  }
+  for (const auto& other : campaign_servers) {
+    other->setSendObserver(observer);
+  }
+  int rc = EXIT_FAILURE;
+  {
+    daemon = std::unique_ptr<MockSwupdateIpc>(new MockSwupdateIpc(get_ctrl_socket(), install_sizes));
+    daemon->setReceiveObserver([&](uint64_t received) {
+      auto now = Clock::now();
+      std::lock_guard<std::mutex> guard(samples_mutex);
+      receives.emplace_back(received, now);
+    });
+
+    // The tool's own stage histograms, unless the caller wants them elsewhere.
+    const bool own_metrics = std::find(tool_args.begin(), tool_args.end(), "--metrics-file") == tool_args.end();
+    const std::string metrics_path = (dir / "metrics.json").string();
+    std::vector<std::string> args{"swupdate-poc", "--target", target_path};
+    if (!campaign) {
+      args.insert(args.end(), {"--url", server.url()});
+    }
+    if (own_metrics) {
+      args.insert(args.end(), {"--metrics-file", metrics_path});
+    }
+    for (const auto& mirror : mirrors) {
+      args.insert(args.end(), {"--mirror", mirror->url()});
+    }
+    args.insert(args.end(), tool_args.begin(), tool_args.end());
+    auto runTool = [](std::vector<std::string> run_args) {
+      std::vector<char*> tool_argv;
+      for (auto& arg : run_args) {
+        tool_argv.push_back(&arg[0]);
+      }
+      tool_argv.push_back(nullptr);
+      return swupdate_poc_main(static_cast<int>(run_args.size()), tool_argv.data());
+    };
+
+    // A two-phase run stages the image with a prefetch first, and measures
+    // only the install from the staged copy.
+    uint64_t prefetch_served = 0;
+    unsigned int prefetch_requests = 0;
+    if (two_phase) {
+      if (std::find(tool_args.begin(), tool_args.end(), "--staging-file") == tool_args.end() &&
+          std::find(tool_args.begin(), tool_args.end(), "--cache-dir") == tool_args.end()) {
+        args.insert(args.end(), {"--staging-file", (dir / "staged.swu").string()});
+      }
+      std::vector<std::string> prefetch_args = args;
+      prefetch_args.emplace_back("--prefetch");
+      const auto prefetch_start = Clock::now();
+      const int prefetched = runTool(prefetch_args);
+      prefetch_served = bytesServed();
+      prefetch_requests = requestsServed();
+      std::printf("prefetch:          %8.1f ms, %s, %.1f MiB served in %u requests\n",
+                  milliseconds(Clock::now() - prefetch_start), prefetched == EXIT_SUCCESS ? "success" : "FAILED",
+                  static_cast<double>(prefetch_served) / (1024.0 * 1024.0), prefetch_requests);
+      std::lock_guard<std::mutex> guard(samples_mutex);
+      sends.clear();
+      receives.clear();
+      served.clear();
+      args.emplace_back("--install-staged");
+    }
+
+    const long baseline_rss = peakRssKb();
+    const double baseline_cpu = cpuSeconds();
+    const auto start = Clock::now();
+    rc = runTool(args);
+    const auto finish = Clock::now();
+    const long peak_rss = peakRssKb();
+    const double cpu = cpuSeconds() - baseline_cpu;
+    if (resumer.joinable()) {
+      resumer.join();
+    }
+
+    std::lock_guard<std::mutex> guard(samples_mutex);
+    // Server and IPC offsets only line up when one image is served as installed.
+    const std::vector<double> latencies =
+        compress.empty() && !campaign ? chunkLatencies(sends, receives) : std::vector<double>();
+    std::string passed;
+    for (const auto& arg : tool_args) {
+      passed += " " + arg;
+    }
+    std::printf("image: %zu MiB, latency %u ms, rate %s, swupdate-poc%s\n", size_mb, latency_ms,
+                rate_mb != 0 ? (std::to_string(rate_mb) + " MiB/s").c_str() : "unlimited", passed.c_str());
+    if (campaign) {
+      std::printf("campaign:          %u images, %zu MiB and %zu x %zu MiB, %u installed\n", campaign_targets, size_mb,
+                  campaign_images.size(), campaign_size_mb, daemon->installs());
+    }
+    std::printf("served:            %8.1f MiB of image data in %u requests%s\n",
+                static_cast<double>(bytesServed() - prefetch_served) / (1024.0 * 1024.0),
+                requestsServed() - prefetch_requests, two_phase ? " during the install" : "");
+    if (!mirrors.empty()) {
+      std::printf("  by --url:        %8.1f MiB in %u requests, latency %u ms\n",
+                  static_cast<double>(server.bytesSent()) / (1024.0 * 1024.0), server.requests(), latency_ms);
+    }
+    for (size_t i = 0; i < mirrors.size(); ++i) {
+      std::printf("  by mirror %zu:     %8.1f MiB in %u requests, latency %u ms\n", i + 1,
+                  static_cast<double>(mirrors[i]->bytesSent()) / (1024.0 * 1024.0), mirrors[i]->requests(),
+                  mirror_latency_ms);
+    }
+    std::printf("result:            %s, %llu of %zu bytes into IPC\n", rc == EXIT_SUCCESS ? "success" : "FAILED",
+                static_cast<unsigned long long>(daemon->received()), install_size);
+    std::printf("throughput:        %8.1f MB/s (installed image)\n",
+                static_cast<double>(install_size) / (1024.0 * 1024.0) / (milliseconds(finish - start) / 1000.0));
+    if (abort_sent) {
+      // Sends are recorded as they complete, so the last one shows when the
+      // network went quiet.
+      const Clock::time_point last_send = sends.empty() ? abort_sample.sent : sends.back().second;
+      std::printf("abort:             %8.1f ms to exit after SIGTERM at %.1f MiB, network quiet after %.1f ms\n",
+                  milliseconds(finish - abort_sample.sent),
+                  static_cast<double>(abort_sample.served) / (1024.0 * 1024.0),
+                  std::max(0.0, milliseconds(last_send - abort_sample.sent)));
+      std::printf("after abort:       %8.1f MiB served, %llu bytes into IPC\n",
+                  static_cast<double>(bytesServed() - abort_sample.served) / (1024.0 * 1024.0),
+                  static_cast<unsigned long long>(daemon->received() - abort_sample.installed));
+    }
+    if (resume_sample.sent != Clock::time_point{}) {
+      std::printf("pause:             %8.1f MiB served, %llu bytes into IPC during the %u ms pause\n",
+                  static_cast<double>(resume_sample.served - pause_sample.served) / (1024.0 * 1024.0),
+                  static_cast<unsigned long long>(resume_sample.installed - pause_sample.installed), pause_ms);
+    }
+    const double max_rate = maxRateOption(tool_args);
+    if (max_rate > 0 && !two_phase && delta_percent == 0) {
+      const RateSpread spread = rateSpread(served, start, finish);
+      std::printf("rate cap:          %8.1f MiB/s, held to %.2f MiB/s (%+.1f%%)", max_rate, spread.overall,
+                  (spread.overall / max_rate - 1) * 100);
+      if (spread.highest > 0) {
+        std::printf(", %.1f-%.1f MiB/s over 1 s windows", spread.lowest, spread.highest);
+      }
+      std::printf("\n");
+    }
+    std::printf("TTFB into IPC:     %8.1f ms\n", receives.empty() ? 0.0 : milliseconds(receives.front().second - start));
+    std::printf("chunk latency p50: %8.2f ms\n", percentile(latencies, 0.50));
+    std::printf("chunk latency p99: %8.2f ms (server send to IPC, %zu chunks)\n", percentile(latencies, 0.99),
+                latencies.size());
+    std::printf("CPU time:          %8.2f s (%.1f ms per MiB, including server and mock)\n", cpu,
+                cpu * 1000.0 / (static_cast<double>(install_size) / (1024.0 * 1024.0)));
+    std::printf("peak RSS:          %8.1f MiB (%.1f MiB over the in-memory test image)\n", peak_rss / 1024.0,
+                (peak_rss - baseline_rss) / 1024.0);
+    Json::Value metrics;
+    std::ifstream metrics_file(metrics_path);
+    std::string errors;
+    if (own_metrics && Json::parseFromStream(Json::CharReaderBuilder(), metrics_file, &metrics, &errors)) {
+      for (const auto& name : metrics["stages"].getMemberNames()) {
+        const Json::Value& stage = metrics["stages"][name];
+        if (stage["count"].asUInt64() != 0) {
+          std::printf("%-18s p50 %8.3f ms, p99 %8.3f ms, total %8.1f ms (%llu)\n", (name + ":").c_str(),
+                      stage["p50_seconds"].asDouble() * 1000.0, stage["p99_seconds"].asDouble() * 1000.0,
+                      stage["sum_seconds"].asDouble() * 1000.0,
+                      static_cast<unsigned long long>(stage["count"].asUInt64()));
+        }
+      }
+    }
+  }
+  daemon.reset();
+
+  boost::filesystem::remove_all(dir);
+  return rc;
+}
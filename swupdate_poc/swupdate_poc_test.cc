@@ -1,6 +1,1404 @@
 #include <gtest/gtest.h>
 
-#if 0
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_verifier.h"
+#include "chunk_store.h"
+#include "connection_cache.h"
+#include "decompress_stage.h"
+#include "download_checkpoint.h"
+#include "flow_control.h"
+#include "hash_stage.h"
+#include "http/httpclient.h"
+#include "json/json.h"
+#include "image_cache.h"
+#include "local_http_server.h"
+#include "metrics.h"
+#include "mirror_download.h"
+#include "parallel_download.h"
+#include "progress_reporter.h"
+#include "rate_limiter.h"
+#include "ring_buffer.h"
+#include "slab_pool.h"
+#include "splice_transfer.h"
+#include "staging_writer.h"
+#include "swu_stage.h"
+#include "targets_index.h"
+#include "update_scheduler.h"
+
+/* Bytes come out of the ring in the order they went in, including across the
+ * wrap-around point. */
+TEST(RingBuffer, PreservesOrderAcrossWrap) {
+  RingBuffer ring(1000);
+  EXPECT_EQ(ring.capacity(), 1024);
+
+  std::vector<char> input(3000);
+  std::iota(input.begin(), input.end(), 0);
+  std::vector<char> output;
+
+  std::thread producer([&ring, &input]() {
+    size_t written = 0;
+    while (written < input.size()) {
+      written += ring.write(input.data() + written, std::min<size_t>(300, input.size() - written));
+    }
+    ring.close();
+  });
+
+  while (!ring.drained()) {
+    const char* data = nullptr;
+    size_t len = ring.peek(&data);
+    output.insert(output.end(), data, data + len);
+    ring.consume(len);
+  }
+  producer.join();
+
+  EXPECT_EQ(input, output);
+}
+
+/* The producer can never overwrite bytes the consumer has not released. */
+TEST(RingBuffer, WriteStopsWhenFull) {
+  RingBuffer ring(16);
+  std::vector<char> chunk(10, 'a');
+  EXPECT_EQ(ring.write(chunk.data(), chunk.size()), 10);
+  EXPECT_EQ(ring.write(chunk.data(), chunk.size()), 6);
+  EXPECT_EQ(ring.freeSpace(), 0);
+
+  const char* data = nullptr;
+  EXPECT_EQ(ring.peek(&data), 16);
+  ring.consume(4);
+  EXPECT_EQ(ring.write(chunk.data(), chunk.size()), 4);
+  EXPECT_FALSE(ring.drained());
+}
+
+/* The hashing stage digests the whole stream as a second reader, while the
+ * first reader still sees every byte. */
+TEST(HashStage, DigestsStreamAlongsideInstallReader) {
+  RingBuffer ring(4, 2);
+  auto hash_stage = makeHashStage(ring, 1, {"sha256"});
+  hash_stage->start();
+
+  const std::string input = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  std::string output;
+  size_t written = 0;
+  while (!ring.drained(0)) {
+    if (written < input.size()) {
+      written += ring.write(input.data() + written, input.size() - written);
+      if (written == input.size()) {
+        ring.close();
+      }
+    }
+    const char* data = nullptr;
+    size_t len = ring.peek(&data, 0);
+    output.append(data, len);
+    ring.consume(len, 0);
+  }
+
+  EXPECT_EQ(output, input);
+  EXPECT_EQ(hash_stage->wait().at("sha256"), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+/* All listed algorithms are computed in one pass, and every mismatching
+ * expectation is reported rather than just the first. */
+TEST(MultiDigest, ReportsAllMismatches) {
+  MultiDigest<EvpAlgorithmDigest, Sha256Algorithm, Sha512Algorithm> digest;
+  digest.update("ab", 2);
+  digest.update("c", 1);
+  DigestResults results = digest.finish();
+  EXPECT_EQ(results.at("sha256"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  EXPECT_EQ(results.at("sha512"),
+            "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+            "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f");
+
+  std::vector<ExpectedDigest> expected{
+      {"hashes", "sha256", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+      {"custom.swupdate.rawHashes", "sha256", "00"},
+      {"hashes", "sha512", "00"},
+  };
+  auto mismatches = digestMismatches(expected, results);
+  ASSERT_EQ(mismatches.size(), 2);
+  EXPECT_EQ(mismatches[0].find("custom.swupdate.rawHashes.sha256"), 0);
+  EXPECT_EQ(mismatches[1].find("hashes.sha512"), 0);
+}
+
+/* The first block that does not match the manifest stops verification, even
+ * when it arrives split over several chunks; a short last block is checked
+ * too. */
+TEST(BlockVerifier, StopsAtFirstCorruptBlock) {
+  const std::vector<std::string> manifest{
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",  // "abc"
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",  // "abc"
+      "ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb",  // "a"
+  };
+  BlockVerifier good("sha256", 3, manifest, 7);
+  EXPECT_TRUE(good.update("ab", 2));
+  EXPECT_TRUE(good.update("cabca", 5));
+
+  BlockVerifier bad("sha256", 3, manifest, 7);
+  EXPECT_TRUE(bad.update("abc", 3));
+  EXPECT_FALSE(bad.update("abd", 3));
+  EXPECT_EQ(bad.failedBlock(), 1);
+
+  EXPECT_THROW(BlockVerifier("sha256", 3, manifest, 10), std::runtime_error);
+}
+
+static void feed(RingBuffer& ring, const std::string& input) {
+  size_t written = 0;
+  while (written < input.size()) {
+    written += ring.write(input.data() + written, input.size() - written);
+    const char* data = nullptr;
+    ring.consume(ring.peek(&data, 0), 0);
+  }
+  ring.close();
+  while (!ring.drained(0)) {
+    const char* data = nullptr;
+    ring.consume(ring.peek(&data, 0), 0);
+  }
+}
+
+/* A stage resumed from a checkpoint skips the prefix it covers and ends up
+ * with the same digests as one that hashed the whole stream. */
+TEST(HashStage, ResumesFromCheckpoint) {
+  const std::string input(100, 'x');
+  HashCheckpoint checkpoint;
+  {
+    RingBuffer ring(16, 2);
+    auto hash_stage = makeHashStage(ring, 1, {"sha256", "sha512"}, true);
+    hash_stage->setCheckpointInterval(32);
+    hash_stage->start();
+    feed(ring, input.substr(0, 70));  // interrupted after 70 bytes
+    hash_stage->wait();
+    ASSERT_TRUE(hash_stage->takeCheckpoint(&checkpoint));
+    EXPECT_EQ(checkpoint.offset, 64);
+  }
+
+  RingBuffer ring(16, 2);
+  auto hash_stage = makeHashStage(ring, 1, {"sha256", "sha512"}, true);
+  ASSERT_TRUE(hash_stage->resumeFrom(checkpoint));
+  hash_stage->start();
+  feed(ring, input);
+  const DigestResults& results = hash_stage->wait();
+
+  MultiDigest<EvpAlgorithmDigest, Sha256Algorithm, Sha512Algorithm> reference;
+  reference.update(input.data(), input.size());
+  EXPECT_EQ(results, reference.finish());
+}
+
+/* Checkpoints survive a save/load round trip and replace each other. */
+TEST(DownloadCheckpoint, SaveAndLoad) {
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  boost::filesystem::create_directories(dir);
+  const std::string path = (dir / "checkpoint.json").string();
+
+  DownloadCheckpoint checkpoint;
+  checkpoint.target_name = "image.swu";
+  checkpoint.target_length = 131284480;
+  checkpoint.target_digest = "sha256:55573dd4";
+  checkpoint.hash.offset = 16777216;
+  checkpoint.hash.states["sha256"] = "00ff";
+  ASSERT_TRUE(saveCheckpoint(path, checkpoint));
+  checkpoint.hash.offset *= 2;
+  ASSERT_TRUE(saveCheckpoint(path, checkpoint));
+
+  DownloadCheckpoint loaded;
+  ASSERT_TRUE(loadCheckpoint(path, &loaded));
+  EXPECT_EQ(loaded.target_name, checkpoint.target_name);
+  EXPECT_EQ(loaded.target_length, checkpoint.target_length);
+  EXPECT_EQ(loaded.target_digest, checkpoint.target_digest);
+  EXPECT_EQ(loaded.hash.offset, 33554432);
+  EXPECT_EQ(loaded.hash.states, checkpoint.hash.states);
+
+  removeCheckpoint(path);
+  EXPECT_FALSE(loadCheckpoint(path, &loaded));
+  boost::filesystem::remove_all(dir);
+}
+
+/* Segments fetched over several connections reach the sink in stream order,
+ * also when resuming mid-image and when the last segment is short. */
+TEST(ParallelDownloader, DeliversSegmentsInOrder) {
+  std::string image(1000 * 1000 + 123, '\0');
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>((i * 7 + i / 251) & 0xff);
+  }
+  LocalHttpServer server(image);
+  server.setLatency(std::chrono::milliseconds(20));
+
+  ParallelDownloader downloader([] { return std::make_shared<HttpClient>(); }, server.url(), 4, 64 * 1024);
+  std::string received;
+  ASSERT_TRUE(downloader.download(1000, image.size(), [&received](const char* data, size_t len) {
+    received.append(data, len);
+    return true;
+  }));
+  EXPECT_TRUE(received == image.substr(1000));
+  EXPECT_EQ(server.requests(), 16);
+}
+
+/* A sink refusing data stops the download with an error. */
+TEST(ParallelDownloader, SinkStopsDownload) {
+  LocalHttpServer server(std::string(512 * 1024, 'x'));
+  ParallelDownloader downloader([] { return std::make_shared<HttpClient>(); }, server.url(), 2, 64 * 1024);
+  size_t calls = 0;
+  EXPECT_FALSE(downloader.download(0, 512 * 1024, [&calls](const char*, size_t) { return ++calls < 3; }));
+  EXPECT_EQ(calls, 3);
+  EXPECT_FALSE(downloader.error().empty());
+}
+
+/* Downloads one after another, as of the spans of a delta update, run on the
+ * same connections, also after one was stopped. */
+TEST(ParallelDownloader, KeepsConnectionsAcrossDownloads) {
+  std::string image(300 * 1000, '\0');
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>((i * 13 + i / 97) & 0xff);
+  }
+  LocalHttpServer server(image);
+  std::atomic<int> clients{0};
+  ParallelDownloader downloader(
+      [&clients] {
+        ++clients;
+        return std::make_shared<HttpClient>();
+      },
+      server.url(), 3, 16 * 1024);
+  size_t calls = 0;
+  EXPECT_FALSE(downloader.download(0, 100 * 1000, [&calls](const char*, size_t) { return ++calls < 2; }));
+  for (uint64_t from = 0; from < image.size(); from += 60 * 1000) {
+    const uint64_t to = std::min<uint64_t>(from + 50 * 1000, image.size());
+    std::string received;
+    ASSERT_TRUE(downloader.download(from, to, [&received](const char* data, size_t len) {
+      received.append(data, len);
+      return true;
+    }));
+    EXPECT_TRUE(received == image.substr(from, to - from));
+  }
+  EXPECT_EQ(clients, 3);
+}
+
+static size_t appendToString(char* data, size_t size, size_t nmemb, void* userp) {
+  static_cast<std::string*>(userp)->append(data, size * nmemb);
+  return size * nmemb;
+}
+
+/* Transfers through a connection cache share connections, parallel segments
+ * included, and a cache made later, as by the next run, resumes the TLS
+ * session the first one saved to disk. */
+TEST(ConnectionCache, ReusesConnectionsAndResumesTlsSessions) {
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  boost::filesystem::create_directories(dir);
+  const std::string session_file = (dir / "tls-sessions.json").string();
+  std::string image(256 * 1024, '\0');
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>((i * 13 + i / 509) & 0xff);
+  }
+  LocalHttpServer server(image);
+  server.setKeepAlive(true);
+  server.enableTls();
+  auto client = [&server](const std::shared_ptr<ConnectionCache>& cache) {
+    auto http = std::make_shared<CachedHttpClient>(cache);
+    http->setCerts(server.certificate(), CryptoSource::kFile, "", CryptoSource::kFile, "", CryptoSource::kFile);
+    return http;
+  };
+  auto fetch = [&](const std::shared_ptr<ConnectionCache>& cache, curl_off_t from) {
+    std::string body;
+    HttpResponse response = client(cache)->download(server.url(), appendToString, nullptr, &body, from);
+    EXPECT_TRUE(response.isOk()) << response.error_message;
+    return body;
+  };
+
+  auto cache = ConnectionCache::create(session_file);
+  EXPECT_TRUE(fetch(cache, 0) == image);
+  EXPECT_TRUE(fetch(cache, 1000) == image.substr(1000));
+  EXPECT_EQ(client(cache)->get(server.url(), 1024).curl_code, CURLE_WRITE_ERROR);  // over maxsize
+  EXPECT_EQ(server.connections(), 1);
+  EXPECT_EQ(cache->reusedConnections(), 2);
+  ParallelDownloader downloader([&] { return client(cache); }, server.url(), 2, 16 * 1024);
+  std::string received;
+  ASSERT_TRUE(downloader.download(0, image.size(), [&received](const char* data, size_t len) {
+    received.append(data, len);
+    return true;
+  }));
+  EXPECT_TRUE(received == image);
+  EXPECT_LE(server.connections(), 3);  // 16 segments
+  EXPECT_EQ(cache->connections(), server.connections());
+  EXPECT_EQ(server.resumedSessions(), cache->resumedSessions());
+  ASSERT_TRUE(cache->saveSessions());
+  struct stat st {};
+  ASSERT_EQ(stat(session_file.c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0600);  // session secrets
+  cache.reset();
+
+  const unsigned int resumed = server.resumedSessions();
+  cache = ConnectionCache::create(session_file);
+  EXPECT_TRUE(fetch(cache, 0) == image);
+  EXPECT_EQ(server.resumedSessions(), resumed + 1);
+  EXPECT_EQ(cache->resumedSessions(), 1);
+  // Without the file, the first handshake is a full one.
+  EXPECT_TRUE(fetch(ConnectionCache::create(), 0) == image);
+  EXPECT_EQ(server.resumedSessions(), resumed + 1);
+  boost::filesystem::remove_all(dir);
+}
+
+/* The bucket lets a burst through at once, then has transfers wait for what
+ * they are short of, and the schedule picks the window open at a time of
+ * day, wrapping past midnight. */
+TEST(RateLimiter, RefillsAtRateAndFollowsSchedule) {
+  RateLimiter limiter(1024 * 1024, 64 * 1024);
+  EXPECT_EQ(limiter.acquire(64 * 1024), RateLimiter::Clock::duration::zero());
+  const auto wait = limiter.acquire(16 * 1024);
+  EXPECT_GT(wait, std::chrono::milliseconds(14));  // 16 KiB at 1 MiB/s
+  EXPECT_LE(wait, std::chrono::milliseconds(16));
+  std::this_thread::sleep_for(wait);
+  EXPECT_EQ(limiter.acquire(16 * 1024), RateLimiter::Clock::duration::zero());
+  limiter.refund(64 * 1024);
+  EXPECT_EQ(limiter.acquire(256 * 1024), RateLimiter::Clock::duration::zero());  // a full bucket passes anything
+  EXPECT_NE(limiter.acquire(1), RateLimiter::Clock::duration::zero());
+
+  std::vector<RateLimiter::Window> schedule;
+  EXPECT_FALSE(RateLimiter::parseSchedule("", &schedule));
+  EXPECT_FALSE(RateLimiter::parseSchedule("08:00-18:00", &schedule));
+  EXPECT_FALSE(RateLimiter::parseSchedule("08:00-25:00=1", &schedule));
+  EXPECT_FALSE(RateLimiter::parseSchedule("08:00-18:00=1,x", &schedule));
+  ASSERT_TRUE(RateLimiter::parseSchedule("08:00-18:00=2, 22:30-06:00=0.5,00:00-24:00=0", &schedule));
+  ASSERT_EQ(schedule.size(), 3);
+  RateLimiter scheduled(3 * 1024 * 1024, 64 * 1024, schedule);
+  EXPECT_EQ(scheduled.rateAt(8 * 60), 2 * 1024 * 1024);
+  EXPECT_EQ(scheduled.rateAt(18 * 60 - 1), 2 * 1024 * 1024);
+  EXPECT_EQ(scheduled.rateAt(23 * 60), 512 * 1024);
+  EXPECT_EQ(scheduled.rateAt(5 * 60 + 59), 512 * 1024);
+  EXPECT_EQ(scheduled.rateAt(20 * 60), 0);
+  EXPECT_EQ(RateLimiter(3 * 1024 * 1024, 1, {schedule[0]}).rateAt(20 * 60), 3 * 1024 * 1024);
+}
+
+/* One limiter holds a single download and the connections of a parallel one
+ * together to its rate, pausing the transfers rather than failing them. */
+TEST(RateLimiter, ShapesSingleAndParallelDownloads) {
+  constexpr uint64_t kRate = 4 * 1024 * 1024;
+  constexpr uint64_t kBurst = 256 * 1024;
+  std::string image(2 * 1024 * 1024, '\0');
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>((i * 7 + i / 1021) & 0xff);
+  }
+  LocalHttpServer server(image);
+  server.setKeepAlive(true);
+  auto cache = ConnectionCache::create();
+  auto limiter = std::make_shared<RateLimiter>(kRate, kBurst);
+  auto client = [&cache, &limiter] {
+    auto http = std::make_shared<CachedHttpClient>(cache);
+    http->setRateLimiter(limiter);
+    return http;
+  };
+  // What goes beyond the first burst takes its time at the rate.
+  const double expected = static_cast<double>(image.size() - kBurst) / kRate;
+  auto seconds = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  std::string body;
+  auto start = std::chrono::steady_clock::now();
+  HttpResponse response = client()->download(server.url(), appendToString, nullptr, &body, 0);
+  double elapsed = seconds(start);
+  EXPECT_TRUE(response.isOk()) << response.error_message;
+  EXPECT_TRUE(body == image);
+  EXPECT_GT(elapsed, expected * 0.9);
+  EXPECT_LT(elapsed, expected * 1.15);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(kBurst * 1000 / kRate));  // refill
+  ParallelDownloader downloader(client, server.url(), 4, 128 * 1024);
+  std::string received;
+  start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(downloader.download(0, image.size(), [&received](const char* data, size_t len) {
+    received.append(data, len);
+    return true;
+  }));
+  elapsed = seconds(start);
+  EXPECT_TRUE(received == image);
+  EXPECT_GT(elapsed, expected * 0.9);
+  EXPECT_LT(elapsed, expected * 1.15);
+  EXPECT_LE(server.connections(), 5);  // connections still reused
+}
+
+static std::string mirrorImage(size_t size) {
+  std::string image(size, '\0');
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>((i * 11 + i / 733) & 0xff);
+  }
+  return image;
+}
+
+// What MirrorDownload hands its callbacks, digested as it streams.
+struct MirrorSink {
+  EvpDigest digest{EVP_sha256()};
+  std::string received;
+  int handle_changes{0};
+
+  static size_t write(char* data, size_t size, size_t nmemb, void* userp) {
+    auto* sink = static_cast<MirrorSink*>(userp);
+    sink->digest.update(data, size * nmemb);
+    sink->received.append(data, size * nmemb);
+    return size * nmemb;
+  }
+};
+
+/* Mirrors come back fastest first, followed by those that do not answer or
+ * take more than twice as long as the fastest, which are not waited for. */
+TEST(MirrorDownload, ProbesMirrorsFastestFirst) {
+  const std::string image = mirrorImage(64 * 1024);
+  LocalHttpServer slow(image);
+  LocalHttpServer fast(image);
+  LocalHttpServer close(image);
+  fast.setLatency(std::chrono::milliseconds(100));
+  close.setLatency(std::chrono::milliseconds(140));
+  slow.setLatency(std::chrono::milliseconds(600));
+  const std::string dead = "http://127.0.0.1:1/image.swu";
+  auto cache = ConnectionCache::create();
+  const auto start = std::chrono::steady_clock::now();
+  const std::vector<Mirror> mirrors = probeMirrors([&cache] { return std::make_shared<CachedHttpClient>(cache); },
+                                                   {dead, slow.url(), close.url(), fast.url()},
+                                                   std::chrono::milliseconds(2000));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(400));
+  ASSERT_EQ(mirrors.size(), 4);
+  EXPECT_EQ(mirrors[0].url, fast.url());
+  EXPECT_EQ(mirrors[1].url, close.url());
+  EXPECT_EQ(mirrors[2].url, dead);
+  EXPECT_EQ(mirrors[3].url, slow.url());
+  EXPECT_GE(mirrors[0].first_byte, std::chrono::milliseconds(100));
+  EXPECT_GE(mirrors[1].first_byte, std::chrono::milliseconds(140));
+  EXPECT_LT(mirrors[2].first_byte.count(), 0);
+  EXPECT_LT(mirrors[3].first_byte.count(), 0);
+  // A probe fetches a single byte.
+  EXPECT_LT(fast.bytesSent(), 1024);
+}
+
+/* A mirror failing mid-stream is left for the next one, which carries on
+ * with a Range request where it stopped, so the stream and its digest just
+ * continue. Once every mirror failed, so does the download. */
+TEST(MirrorDownload, FailsOverMidStream) {
+  const std::string image = mirrorImage(1024 * 1024 + 17);
+  LocalHttpServer failing(image);
+  LocalHttpServer good(image);
+  failing.setCutAt(300 * 1024);
+  auto http = std::make_shared<CachedHttpClient>(ConnectionCache::create());
+
+  MirrorSink sink;
+  MirrorDownload download(http, {failing.url(), good.url()}, MirrorSink::write, nullptr, &sink);
+  download.setHandleCallback([&sink](const CurlHandler& easy) { sink.handle_changes += easy ? 1 : 0; });
+  ASSERT_TRUE(download.download(1000, image.size())) << download.error();
+  EXPECT_TRUE(sink.received == image.substr(1000));
+  EvpDigest reference(EVP_sha256());
+  reference.update(image.data() + 1000, image.size() - 1000);
+  EXPECT_EQ(sink.digest.hexDigest(), reference.hexDigest());
+  EXPECT_EQ(download.failovers(), 1);
+  EXPECT_EQ(download.hedges(), 0);
+  EXPECT_EQ(download.url(), good.url());
+  EXPECT_EQ(sink.handle_changes, 2);
+  EXPECT_EQ(good.requests(), 1);
+  EXPECT_LT(good.bytesSent(), image.size() - 300 * 1024 + 256 * 1024);
+
+  good.setCutAt(300 * 1024);
+  MirrorSink failed;
+  MirrorDownload broken(http, {failing.url(), good.url()}, MirrorSink::write, nullptr, &failed);
+  EXPECT_FALSE(broken.download(0, image.size()));
+  EXPECT_NE(broken.error().find("every mirror failed"), std::string::npos) << broken.error();
+  EXPECT_TRUE(failed.received == image.substr(0, 300 * 1024));
+}
+
+/* A mirror that is slow to answer, or stops sending, gets a hedged request
+ * to the next one, and whichever delivers first carries the download. */
+TEST(MirrorDownload, HedgesSlowAndStalledMirrors) {
+  const std::string image = mirrorImage(512 * 1024);
+  LocalHttpServer slow(image);
+  LocalHttpServer stalling(image);
+  LocalHttpServer good(image);
+  slow.setLatency(std::chrono::milliseconds(3000));
+  stalling.setStallAt(100 * 1024, std::chrono::milliseconds(3000));
+  auto http = std::make_shared<CachedHttpClient>(ConnectionCache::create());
+
+  for (LocalHttpServer* first : {&slow, &stalling}) {
+    MirrorSink sink;
+    MirrorDownload download(http, {first->url(), good.url()}, MirrorSink::write, nullptr, &sink);
+    download.setHedgeAfter(std::chrono::milliseconds(200));
+    const auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(download.download(0, image.size())) << download.error();
+    // Not waiting for the losing transfer to notice either.
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(800));
+    EXPECT_TRUE(sink.received == image);
+    EXPECT_EQ(download.hedges(), 1);
+    EXPECT_EQ(download.failovers(), 0);
+    EXPECT_EQ(download.url(), good.url());
+  }
+
+  // Without hedging it just waits.
+  MirrorSink sink;
+  MirrorDownload patient(http, {stalling.url(), good.url()}, MirrorSink::write, nullptr, &sink);
+  patient.setHedgeAfter(std::chrono::milliseconds(0));
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(patient.download(0, image.size())) << patient.error();
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(3000));
+  EXPECT_TRUE(sink.received == image);
+  EXPECT_EQ(patient.hedges(), 0);
+  EXPECT_EQ(patient.url(), stalling.url());
+}
+
+/* A transfer paused for the rate limiter is not stalled: a capped download
+ * stays on its mirror however long it waits for the bucket. */
+TEST(MirrorDownload, DoesNotHedgeThrottledTransfers) {
+  constexpr uint64_t kRate = 64 * 1024;
+  constexpr uint64_t kBurst = 128 * 1024;
+  // The burst, then two pauses of half a second for a quarter of it each.
+  const std::string image = mirrorImage(kBurst + kBurst / 2);
+  LocalHttpServer capped(image);
+  LocalHttpServer other(image);
+  auto http = std::make_shared<CachedHttpClient>(ConnectionCache::create());
+  http->setRateLimiter(std::make_shared<RateLimiter>(kRate, kBurst));
+
+  MirrorSink sink;
+  MirrorDownload download(http, {capped.url(), other.url()}, MirrorSink::write, nullptr, &sink);
+  download.setHedgeAfter(std::chrono::milliseconds(200));
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(download.download(0, image.size())) << download.error();
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(800));
+  EXPECT_TRUE(sink.received == image);
+  EXPECT_EQ(download.hedges(), 0);
+  EXPECT_EQ(download.url(), capped.url());
+  EXPECT_EQ(other.requests(), 0);
+}
+
+/* Segments a mirror fails to serve are fetched from the next one. */
+TEST(ParallelDownloader, RetriesSegmentsOnNextMirror) {
+  const std::string image = mirrorImage(1024 * 1024);
+  LocalHttpServer failing(image);
+  LocalHttpServer good(image);
+  failing.setCutAt(400 * 1024);
+  ParallelDownloader downloader([] { return std::make_shared<HttpClient>(); }, "unused", 4, 64 * 1024);
+  downloader.setMirrors({failing.url(), good.url()});
+  std::string received;
+  ASSERT_TRUE(downloader.download(0, image.size(), [&received](const char* data, size_t len) {
+    received.append(data, len);
+    return true;
+  })) << downloader.error();
+  EXPECT_TRUE(received == image);
+  EXPECT_GT(good.requests(), 0);
+}
+
+/* The zero-copy path delivers the image over HTTP to the install socket and
+ * its copy to the hash stage, and leaves anything but a plain response of the
+ * expected length to curl. */
+TEST(SpliceTransfer, SplicesHttpBodyAndFeedsHashStage) {
+  std::string image(3 * 1000 * 1000 + 7, '\0');
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>((i * 13 + i / 509) & 0xff);
+  }
+  LocalHttpServer server(image);
+  EXPECT_EQ(openSpliceSource("https://127.0.0.1/image.swu", 0, image.size()), -1);
+  EXPECT_EQ(openSpliceSource(server.url(), 0, image.size() + 1), -1);
+
+  const uint64_t from = 100;
+  int source = openSpliceSource(server.url(), from, image.size());
+  ASSERT_GE(source, 0);
+  int sockets[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+  std::string installed;
+  std::thread installer([&installed, &sockets]() {
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(sockets[1], buf, sizeof(buf))) > 0) {
+      installed.append(buf, static_cast<size_t>(n));
+    }
+  });
+
+  RingBuffer ring(64 * 1024, 2);
+  auto hash_stage = makeHashStage(ring, 1, {"sha256"});
+  hash_stage->start();
+  std::atomic<bool> failed{false};
+  EXPECT_TRUE(spliceTransfer(source, sockets[0], image.size() - from, ring, 0, failed));
+  close(source);
+  close(sockets[0]);
+  ring.close();
+  installer.join();
+  close(sockets[1]);
+
+  EXPECT_TRUE(installed == image.substr(from));
+  EvpDigest reference(EVP_sha256());
+  reference.update(image.data() + from, image.size() - from);
+  EXPECT_EQ(hash_stage->wait().at("sha256"), reference.hexDigest());
+}
+
+/* The staging writer lands every byte at its offset, has synced what was
+ * written before a syncThen() callback runs, and keeps an unaligned prefix
+ * when reopened to resume. */
+TEST(StagingWriter, WritesBehindAndResumes) {
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  boost::filesystem::create_directories(dir);
+  const std::string path = (dir / "image.swu").string();
+  std::string image(3 * 1000 * 1000 + 11, '\0');
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>((i * 29 + i / 1021) & 0xff);
+  }
+  auto readBack = [&path]() {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  };
+
+  const size_t interrupted = 1234567;
+  {
+    StagingWriter writer(path, 0, image.size());
+    for (size_t pos = 0; pos < interrupted; pos += 4099) {
+      writer.write(image.data() + pos, std::min<size_t>(4099, interrupted - pos));
+    }
+    std::promise<std::string> synced;
+    writer.syncThen([&synced, &readBack](bool ok) { synced.set_value(ok ? readBack() : ""); });
+    std::string on_disk = synced.get_future().get();
+    ASSERT_GE(on_disk.size(), interrupted);
+    EXPECT_TRUE(on_disk.compare(0, interrupted, image, 0, interrupted) == 0);
+    EXPECT_TRUE(writer.finish());
+  }
+  EXPECT_TRUE(readBack() == image.substr(0, interrupted));
+
+  StagingWriter writer(path, interrupted, image.size());
+  writer.write(image.data() + interrupted, image.size() - interrupted);
+  EXPECT_TRUE(writer.finish());
+  EXPECT_TRUE(readBack() == image);
+  boost::filesystem::remove_all(dir);
+}
+
+/* The image cache serves what was inserted from a mapping, and evicts the
+ * least recently used images to stay within its size limit. */
+TEST(ImageCache, EvictsLeastRecentlyUsed) {
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  ImageCache cache((dir / "cache").string(), 2500);
+  auto stage = [&cache](const std::string& key, char fill) {
+    std::ofstream(cache.stagingPath(key), std::ios::binary) << std::string(1000, fill);
+    return cache.insert(key, cache.stagingPath(key));
+  };
+  const std::string a = ImageCache::key("sha256:aaaa");
+  EXPECT_EQ(a, "sha256-aaaa");
+  ASSERT_TRUE(stage(a, 'a'));
+  ASSERT_TRUE(stage("sha256-bbbb", 'b'));
+  EXPECT_TRUE(cache.lookup("sha256-cccc").empty());
+
+  // Make b the older one, then use a: inserting c has to evict b.
+  boost::filesystem::last_write_time(dir / "cache" / a, std::time(nullptr) - 20);
+  boost::filesystem::last_write_time(dir / "cache" / "sha256-bbbb", std::time(nullptr) - 10);
+  const std::string path = cache.lookup(a);
+  ASSERT_FALSE(path.empty());
+  ASSERT_TRUE(stage("sha256-cccc", 'c'));
+  EXPECT_TRUE(cache.lookup("sha256-bbbb").empty());
+  EXPECT_FALSE(cache.lookup("sha256-cccc").empty());
+
+  MappedImage image(path);
+  EXPECT_EQ(std::string(image.data(), image.size()), std::string(1000, 'a'));
+  EXPECT_EQ(digestBuffer(image.data(), image.size(), {"sha256"}).at("sha256"),
+            "41edece42d63e8d9bf515a9ba6932e1c20cbc9f5a5d134645adb5db1b9737ea3");
+  boost::filesystem::remove_all(dir);
+}
+
+/* A delta update reads the chunks an edited image shares with its seed from
+ * the seed and only downloads the ones around the edits, in stream order. */
+TEST(ChunkStore, PlansDownloadOfChangedChunksOnly) {
+  std::string seed(4 * 1024 * 1024, '\0');
+  uint64_t x = 88172645463325252ULL;
+  for (auto& c : seed) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    c = static_cast<char>(x);
+  }
+  std::string image = seed;
+  image.insert(1024 * 1024, std::string(100, 'i'));
+  image[3 * 1024 * 1024] ^= 1;
+
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  boost::filesystem::create_directories(dir);
+  const std::string seed_path = (dir / "seed").string();
+  std::ofstream(seed_path, std::ios::binary) << seed;
+
+  ChunkIndex index;
+  index.length = image.size();
+  index.chunks = chunkBuffer(image.data(), image.size(), index.params);
+  const ChunkIndex parsed = parseChunkIndex(Json::writeString(Json::StreamWriterBuilder(), chunkIndexToJson(index)));
+  ASSERT_EQ(parsed.chunks.size(), index.chunks.size());
+  EXPECT_EQ(parsed.chunks.back().offset, index.chunks.back().offset);
+
+  ChunkStore store(parsed.params);
+  ASSERT_TRUE(store.addSeed(seed_path));
+  for (uint64_t from : {uint64_t{0}, uint64_t{2 * 1024 * 1024 + 5}}) {
+    std::string rebuilt;
+    uint64_t downloaded = 0;
+    std::vector<char> chunk(parsed.params.max_size);
+    for (const auto& span : planDelta(parsed, store, from, 0)) {
+      EXPECT_EQ(span.offset, from + rebuilt.size());
+      if (span.local != nullptr) {
+        ASSERT_TRUE(store.read(*span.local, chunk.data()));
+        rebuilt.append(chunk.data() + (span.offset - span.local->offset), span.length);
+      } else {
+        rebuilt.append(image, span.offset, span.length);
+        downloaded += span.length;
+      }
+    }
+    EXPECT_TRUE(rebuilt == image.substr(from));
+    // Two edits, each costing a chunk or two of the 64 KiB average.
+    EXPECT_GT(downloaded, 0);
+    EXPECT_LT(downloaded, 1024 * 1024);
+  }
+  boost::filesystem::remove_all(dir);
+}
+
+/* An index entry longer than the chunker's max_size is rejected, as the
+ * buffers local chunks are read into are sized on max_size. */
+TEST(ChunkStore, RejectsOversizeIndexEntry) {
+  const std::string image(2 * ChunkerParams{}.max_size, 'x');
+  ChunkIndex index;
+  index.length = image.size();
+  EvpDigest digest(EVP_sha256());
+  digest.update(image.data(), image.size());
+  index.chunks.push_back(ChunkRef{0, image.size(), digest.hexDigest()});
+  const std::string text = Json::writeString(Json::StreamWriterBuilder(), chunkIndexToJson(index));
+  EXPECT_THROW(parseChunkIndex(text), std::runtime_error);
+
+  index.chunks = chunkBuffer(image.data(), image.size(), index.params);
+  EXPECT_NO_THROW(parseChunkIndex(Json::writeString(Json::StreamWriterBuilder(), chunkIndexToJson(index))));
+}
+
+// One gzip member. With bgzf, the header carries the BGZF "BC" field with
+// the member's size, which lets it be decoded on its own.
+static std::string gzipMember(const std::string& data, bool bgzf) {
+  z_stream z{};
+  deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  std::string deflated(deflateBound(&z, data.size()), '\0');
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  z.avail_in = static_cast<uInt>(data.size());
+  z.next_out = reinterpret_cast<Bytef*>(&deflated[0]);
+  z.avail_out = static_cast<uInt>(deflated.size());
+  deflate(&z, Z_FINISH);
+  deflated.resize(z.total_out);
+  deflateEnd(&z);
+
+  auto le = [](uint32_t value, int bytes) {
+    std::string out;
+    for (int i = 0; i < bytes; ++i) {
+      out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+    return out;
+  };
+  std::string member("\x1f\x8b\x08", 3);
+  member += bgzf ? '\x04' : '\0';
+  member += le(0, 4) + std::string("\0\xff", 2);
+  if (bgzf) {
+    member += le(6, 2) + "BC" + le(2, 2) + le(static_cast<uint32_t>(18 + 8 + deflated.size() - 1), 2);
+  }
+  const auto crc = crc32(0, reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size()));
+  return member + deflated + le(static_cast<uint32_t>(crc), 4) + le(static_cast<uint32_t>(data.size()), 4);
+}
+
+// Runs a DecompressStage over compressed, fed in odd-sized pieces, and returns
+// what it decoded. *error gets whatever it reported.
+static std::string decompress(const std::string& compressed, Compression compression, unsigned int threads,
+                              std::string* error, size_t memory_budget = 64 * 1024 * 1024) {
+  RingBuffer in(64 * 1024);
+  RingBuffer out(64 * 1024);
+  std::atomic<bool> cancel{false};
+  DecompressStage stage(in, 0, out, compression, threads, memory_budget, cancel, [&](const std::string& e) {
+    *error = e;
+    cancel = true;
+  });
+  stage.start();
+  std::thread producer([&]() {
+    size_t written = 0;
+    while (written < compressed.size() && !cancel) {
+      written += in.write(compressed.data() + written, std::min<size_t>(compressed.size() - written, 7777));
+    }
+    in.close();
+  });
+  std::string result;
+  const char* data = nullptr;
+  while (!out.drained()) {
+    size_t len = out.peek(&data);
+    result.append(data, len);
+    out.consume(len);
+  }
+  producer.join();
+  stage.wait();
+  return result;
+}
+
+static std::string compressibleData(size_t size) {
+  std::string data;
+  while (data.size() < size) {
+    data += "block " + std::to_string(data.size() / 97) + " of the decompressed image\n";
+  }
+  data.resize(size);
+  return data;
+}
+
+/* The pool hands out cache-line aligned slabs up to its size, waits for one
+ * to come back when it runs out, takes a slab back when its owner lets go of
+ * it, and stops handing out slabs once closed. */
+TEST(SlabPool, BoundsSlabsInFlight) {
+  SlabPool pool(1000, 3);
+  EXPECT_EQ(pool.slabSize(), 1024);
+  std::vector<SlabPool::Slab> slabs;
+  for (int i = 0; i < 3; ++i) {
+    slabs.push_back(pool.tryAcquire());
+    ASSERT_TRUE(slabs.back());
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(slabs.back().data()) % SlabPool::kAlignment, 0);
+  }
+  EXPECT_FALSE(pool.tryAcquire());
+  EXPECT_EQ(pool.available(), 0);
+
+  std::memset(slabs[1].data(), 'x', slabs[1].capacity());
+  char* released = slabs[1].data();
+  std::thread releaser([&slabs]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    slabs[1].reset();
+  });
+  SlabPool::Slab slab = pool.acquire();  // waits for the releaser
+  releaser.join();
+  ASSERT_TRUE(slab);
+  EXPECT_EQ(slab.data(), released);
+
+  SlabPool::Slab moved = std::move(slab);
+  EXPECT_FALSE(slab);
+  moved.reset();
+  slabs.clear();
+  EXPECT_EQ(pool.available(), 3);
+  pool.close();
+  EXPECT_FALSE(pool.acquire());  // closed: does not wait, even with slabs free
+}
+
+/* BGZF members are decoded in parallel and put back in order, a plain gzip
+ * member after them is decoded by the streaming decoder, and corrupt input is
+ * reported instead of being passed on. */
+TEST(DecompressStage, DecodesFramedAndStreamingGzip) {
+  const std::string image = compressibleData(3 * 1000 * 1000 + 11);
+  std::string compressed;
+  const size_t kMember = 60 * 1000;
+  size_t offset = 0;
+  for (; offset < 2 * 1000 * 1000; offset += kMember) {
+    compressed += gzipMember(image.substr(offset, kMember), true);
+  }
+  compressed += gzipMember(image.substr(offset), false);
+
+  for (unsigned int threads : {1U, 4U}) {
+    std::string error;
+    EXPECT_TRUE(decompress(compressed, Compression::kGzip, threads, &error) == image);
+    EXPECT_EQ(error, "");
+  }
+  // Budgets for one frame in flight, and for none.
+  for (size_t budget : {size_t{128 * 1024}, size_t{0}}) {
+    std::string error;
+    EXPECT_TRUE(decompress(compressed, Compression::kGzip, 4, &error, budget) == image);
+    EXPECT_EQ(error, "");
+  }
+
+  std::string corrupt = compressed;
+  corrupt[corrupt.size() / 2] ^= 0x55;
+  std::string error;
+  decompress(corrupt, Compression::kGzip, 4, &error);
+  EXPECT_NE(error, "");
+  error.clear();
+  decompress(compressed.substr(0, compressed.size() - 100), Compression::kGzip, 4, &error);
+  EXPECT_NE(error.find("Truncated"), std::string::npos);
+}
+
+#ifdef HAVE_ZSTD
+/* pzstd-style frames, each announced by a skippable frame holding its size,
+ * decode in parallel to the same stream as a plain multi-frame file. */
+TEST(DecompressStage, DecodesPzstdFrames) {
+  const std::string image = compressibleData(2 * 1000 * 1000 + 3);
+  std::string framed;
+  std::string plain;
+  for (size_t offset = 0; offset < image.size(); offset += 300 * 1000) {
+    const std::string part = image.substr(offset, 300 * 1000);
+    std::string frame(ZSTD_compressBound(part.size()), '\0');
+    frame.resize(ZSTD_compress(&frame[0], frame.size(), part.data(), part.size(), 3));
+    const uint32_t header[3] = {0x184D2A50, 4, static_cast<uint32_t>(frame.size())};
+    framed.append(reinterpret_cast<const char*>(header), sizeof(header));
+    framed += frame;
+    plain += frame;
+  }
+  std::string error;
+  EXPECT_TRUE(decompress(framed, Compression::kZstd, 3, &error) == image);
+  EXPECT_TRUE(decompress(plain, Compression::kZstd, 3, &error) == image);
+  EXPECT_EQ(error, "");
+}
+#endif
+
+/* Latencies land in power-of-two buckets, quantiles report the bucket bound
+ * capped at the maximum, and both exports carry every stage. */
+TEST(PipelineMetrics, RecordsAndExportsStageLatencies) {
+  PipelineMetrics metrics;
+  LatencyHistogram& hash = metrics.stage(Stage::kHash);
+  for (int i = 0; i < 99; ++i) {
+    hash.record(std::chrono::microseconds(3));  // 3000 ns, below 2^12
+  }
+  hash.record(std::chrono::milliseconds(5));
+  metrics.addDownloaded(1000);
+
+  const auto snapshot = hash.snapshot();
+  EXPECT_EQ(snapshot.count, 100);
+  EXPECT_EQ(snapshot.counts[12], 99);
+  EXPECT_EQ(snapshot.sum_ns, 99 * 3000 + 5000000);
+  EXPECT_EQ(snapshot.max_ns, 5000000);
+  EXPECT_EQ(snapshot.quantileNs(0.5), 4096);
+  EXPECT_EQ(snapshot.quantileNs(0.999), 5000000);
+  EXPECT_EQ(metrics.stage(Stage::kIpcWrite).snapshot().count, 0);
+
+  const std::string prometheus = metrics.prometheus();
+  EXPECT_NE(prometheus.find("swupdate_poc_stage_seconds_bucket{stage=\"hash\",le=\"4.096e-06\"} 99\n"),
+            std::string::npos);
+  EXPECT_NE(prometheus.find("swupdate_poc_stage_seconds_count{stage=\"hash\"} 100\n"), std::string::npos);
+  EXPECT_NE(prometheus.find("swupdate_poc_stage_seconds_count{stage=\"ipc_write\"} 0\n"), std::string::npos);
+  EXPECT_NE(prometheus.find("swupdate_poc_bytes_total{direction=\"downloaded\"} 1000\n"), std::string::npos);
+
+  Json::Value json;
+  std::istringstream text(metrics.json());
+  text >> json;
+  EXPECT_EQ(json["stages"]["hash"]["count"].asUInt64(), 100);
+  EXPECT_DOUBLE_EQ(json["stages"]["hash"]["max_seconds"].asDouble(), 0.005);
+  EXPECT_EQ(json["stages"].size(), static_cast<size_t>(Stage::kCount));
+  EXPECT_EQ(json["bytes"]["downloaded"].asUInt64(), 1000);
+}
+
+/* The throughput average follows a change of pace within a few time
+ * constants, and the ETA follows the average. */
+TEST(ProgressReporter, SmoothsThroughputAndEstimatesEta) {
+  ThroughputEstimator estimator(std::chrono::seconds(1));
+  const auto start = std::chrono::steady_clock::now();
+  EXPECT_LT(estimator.etaSeconds(0, 1000), 0);
+  uint64_t done = 0;
+  for (int i = 0; i <= 10; ++i) {  // 1000 B/s
+    estimator.sample(done, start + std::chrono::milliseconds(100 * i));
+    done += 100;
+  }
+  EXPECT_NEAR(estimator.bytesPerSecond(), 1000, 1);
+  done -= 100;
+  EXPECT_NEAR(estimator.etaSeconds(done, done + 5000), 5, 0.01);
+  for (int i = 1; i <= 50; ++i) {  // 4000 B/s for 5 s
+    estimator.sample(done + 400 * i, start + std::chrono::milliseconds(1000 + 100 * i));
+  }
+  EXPECT_NEAR(estimator.bytesPerSecond(), 4000, 3000 * 0.01);
+  EXPECT_EQ(estimator.etaSeconds(10, 10), 0);
+}
+
+/* Updates are rate limited, carry the final count once stopped, and queued
+ * messages arrive in order on the reporter thread. */
+TEST(ProgressReporter, PublishesFromItsOwnThread) {
+  std::atomic<uintmax_t> done{0};
+  std::vector<ProgressUpdate> updates;
+  std::vector<std::string> messages;
+  std::thread::id reporter_thread;
+  {
+    ProgressReporter reporter(
+        done, 1000, std::chrono::milliseconds(20), [&](const ProgressUpdate& update) { updates.push_back(update); },
+        [&](const std::string& message) {
+          if (messages.empty()) {
+            reporter_thread = std::this_thread::get_id();
+          }
+          messages.push_back(message);
+        });
+    for (int i = 0; i < 10; ++i) {
+      reporter.post(std::to_string(i));
+    }
+    for (int i = 0; i < 50; ++i) {
+      done += 10;
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    done = 1000;
+    reporter.stop();
+    reporter.post("after");
+  }
+  ASSERT_FALSE(updates.empty());
+  EXPECT_LT(updates.size(), 10);  // about 100 ms at one update per 20 ms
+  EXPECT_EQ(updates.back().done, 1000);
+  EXPECT_EQ(updates.back().percent, 100);
+  EXPECT_EQ(updates.back().eta_seconds, 0);
+  ASSERT_EQ(messages.size(), 11);
+  EXPECT_EQ(messages[9], "9");
+  EXPECT_EQ(messages[10], "after");
+  EXPECT_NE(reporter_thread, std::this_thread::get_id());
+}
+
+/* The scan picks names, hardware IDs and the byte range of each entry out of
+ * targets metadata, the index finds them again, and goes stale with the
+ * metadata. */
+TEST(TargetsIndex, ScansAndIndexesTargetsMetadata) {
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  boost::filesystem::create_directories(dir);
+  const std::string metadata = (dir / "targets.json").string();
+  const std::string index = (dir / "targets.idx").string();
+  {
+    std::ofstream file(metadata, std::ios::binary);
+    file << R"({"signatures": [{"keyid": "k", "sig": "s{[\""}],)"
+         << R"( "signed": {"_type": "Targets", "version": 3, "targets": {)"
+         << R"("other": {"length": 1, "custom": {"hardwareIds": ["a"]}},)";
+    for (int i = 0; i < 100; ++i) {
+      file << "\"filler-" << i << R"(": {"length": )" << i << R"(, "hashes": {"sha256": "00"}, "custom": null},)";
+    }
+    file << R"( "image-é😀.swu" : { "custom": {"nested": {"hardwareIds": ["x"]},)"
+         << R"( "hardwareIds": ["verdin-imx8mm", "apalis"]}, "length": 42, "hashes": {"sha256": "ab"} } } } })";
+  }
+  const std::string name = "image-\xc3\xa9\xf0\x9f\x98\x80.swu";
+
+  std::vector<TargetEntry> entries;
+  scanTargets(metadata, [&entries](TargetEntry&& entry) {
+    entries.push_back(std::move(entry));
+    return true;
+  });
+  ASSERT_EQ(entries.size(), 102);
+  EXPECT_EQ(entries[0].name, "other");
+  EXPECT_EQ(entries[1].hardware_ids.size(), 0);
+  EXPECT_EQ(entries[101].name, name);
+  EXPECT_EQ(entries[101].hardware_ids, (std::vector<std::string>{"verdin-imx8mm", "apalis"}));
+
+  // The byte range holds the whole entry and nothing else.
+  std::ifstream file(metadata, std::ios::binary);
+  std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  Json::Value target;
+  std::istringstream(text.substr(entries[101].offset, entries[101].length)) >> target;
+  EXPECT_EQ(target["length"].asInt(), 42);
+
+  int seen = 0;
+  scanTargets(metadata, [&seen](TargetEntry&&) { return ++seen < 2; });
+  EXPECT_EQ(seen, 2);
+
+  EXPECT_EQ(TargetsIndex::open(index, metadata), nullptr);
+  TargetEntry entry;
+  ASSERT_TRUE(findTarget(metadata, index, name, &entry));
+  EXPECT_EQ(entry.offset, entries[101].offset);
+  auto opened = TargetsIndex::open(index, metadata);
+  ASSERT_NE(opened, nullptr);
+  for (const auto& scanned : entries) {
+    ASSERT_TRUE(opened->lookup(scanned.name, &entry));
+    EXPECT_EQ(entry.name, scanned.name);
+    EXPECT_EQ(entry.hardware_ids, scanned.hardware_ids);
+    EXPECT_EQ(entry.offset, scanned.offset);
+    EXPECT_EQ(entry.length, scanned.length);
+  }
+  EXPECT_FALSE(opened->lookup("missing", &entry));
+  EXPECT_FALSE(findTarget(metadata, "", "missing", &entry));
+
+  std::ofstream(metadata, std::ios::app) << "\n";
+  EXPECT_EQ(TargetsIndex::open(index, metadata), nullptr);
+  std::ofstream(metadata, std::ios::app) << "{";
+  EXPECT_THROW(findTarget(metadata, index, name, &entry), std::runtime_error);
+  boost::filesystem::remove_all(dir);
+}
+
+// Appends a newc CPIO entry, or a crc one with its byte sum, and returns the
+// offset of its data.
+static uint64_t appendCpioEntry(std::string* archive, const std::string& name, const std::string& data,
+                                bool crc = false) {
+  uint32_t sum = 0;
+  for (const char c : data) {
+    sum += static_cast<unsigned char>(c);
+  }
+  char header[111];
+  std::snprintf(header, sizeof(header), "07070%c%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+                crc ? '2' : '1', 0U, 0100644U, 0U, 0U, 1U, 0U, static_cast<unsigned int>(data.size()), 0U, 0U, 0U,
+                0U, static_cast<unsigned int>(name.size() + 1), crc ? sum : 0U);
+  archive->append(header, 110);
+  archive->append(name);
+  archive->push_back('\0');
+  archive->append((4 - archive->size() % 4) % 4, '\0');
+  const uint64_t offset = archive->size();
+  archive->append(data);
+  archive->append((4 - archive->size() % 4) % 4, '\0');
+  return offset;
+}
+
+static std::string sha256Hex(const std::string& data) {
+  EvpDigest digest(EVP_sha256());
+  digest.update(data.data(), data.size());
+  return digest.hexDigest();
+}
+
+/* Entries are tracked and hashed as the archive streams past in pieces of
+ * any size, and the stage validates sw-description on the install ring. */
+TEST(SwuParser, TracksAndHashesEntries) {
+  const std::string rootfs = "rootfs contents";
+  const std::string description = "# board sections\n"
+                                  "software = {\n"
+                                  "  version = \"1.0.0\";\n"
+                                  "  board-a = {\n"
+                                  "    hardware-compatibility: [ \"1.0\", \"#RE:^2\\\\.[0-9]+$\" ];\n"
+                                  "    images: ( { filename = \"rootfs.img\"; type = \"raw\"; /* inline */\n"
+                                  "                sha256 = \"" + sha256Hex(rootfs) + "\"; } );\n"
+                                  "  };\n"
+                                  "};\n";
+  std::string archive;
+  appendCpioEntry(&archive, "sw-description", description, true);
+  const uint64_t rootfs_offset = appendCpioEntry(&archive, "rootfs.img", rootfs, true);
+  appendCpioEntry(&archive, "notes.txt", "", true);
+  appendCpioEntry(&archive, "TRAILER!!!", "", true);
+  archive.append(512 - archive.size() % 512, '\0');
+
+  SwuParser parser({"board-a", "2.13"});
+  int reported = 0;
+  parser.setEntryCallback([&reported](const SwuEntry&) { ++reported; });
+  for (size_t i = 0; i < archive.size(); i += 7) {
+    ASSERT_TRUE(parser.update(archive.data() + i, std::min<size_t>(7, archive.size() - i))) << parser.error();
+  }
+  ASSERT_TRUE(parser.finish());
+  EXPECT_TRUE(parser.validated());
+  ASSERT_EQ(parser.entries().size(), 3);
+  EXPECT_EQ(reported, 3);
+  const SwuEntry& entry = parser.entries()[1];
+  EXPECT_EQ(entry.name, "rootfs.img");
+  EXPECT_EQ(entry.offset, rootfs_offset);
+  EXPECT_EQ(entry.size, rootfs.size());
+  EXPECT_EQ(entry.sha256, sha256Hex(rootfs));
+  EXPECT_EQ(entry.expected_sha256, entry.sha256);
+  EXPECT_EQ(parser.entries()[2].size, 0);
+  EXPECT_TRUE(parser.entries()[2].expected_sha256.empty());
+
+  RingBuffer ring(64, 2);
+  std::atomic<bool> cancel{false};
+  bool failed = false;
+  SwuStage stage(ring, 1, {"board-a", ""}, cancel, [&failed](const std::string&) { failed = true; });
+  stage.start();
+  feed(ring, archive);
+  EXPECT_TRUE(stage.wait());
+  EXPECT_FALSE(failed);
+  EXPECT_TRUE(stage.validated());
+  EXPECT_EQ(stage.entries().size(), 3);
+}
+
+/* An image for other hardware fails as soon as sw-description is through,
+ * before any payload; a corrupt or malformed one fails at the first bad
+ * entry or header. */
+TEST(SwuParser, RejectsIncompatibleImagesEarly) {
+  const std::string rootfs(4096, 'r');
+  const std::string description = "software = { board-a = { hardware-compatibility = [\"1.0\"];"
+                                  " images = ({ filename = \"rootfs.img\"; sha256 = \"" + sha256Hex(rootfs) +
+                                  "\"; }); }; };";
+  std::string archive;
+  appendCpioEntry(&archive, "sw-description", description);
+  const size_t description_end = archive.size();
+  appendCpioEntry(&archive, "rootfs.img", rootfs);
+  appendCpioEntry(&archive, "TRAILER!!!", "");
+
+  SwuParser other_board({"board-b", ""});
+  EXPECT_FALSE(other_board.update(archive.data(), description_end));
+  EXPECT_NE(other_board.error().find("board-a, not board-b"), std::string::npos) << other_board.error();
+  EXPECT_FALSE(other_board.validated());
+
+  SwuParser other_revision({"board-a", "1.1"});
+  EXPECT_FALSE(other_revision.update(archive.data(), description_end));
+  EXPECT_NE(other_revision.error().find("hardware revision 1.1"), std::string::npos);
+
+  SwuParser any_board({"", "1.0"});
+  EXPECT_TRUE(any_board.update(archive.data(), archive.size()));
+  EXPECT_TRUE(any_board.finish());
+
+  // A part for any board, here in JSON syntax, is installed on other boards.
+  std::string generic;
+  appendCpioEntry(&generic, "sw-description",
+                  R"({"software": {"board-a": {"hardware-compatibility": ["1.0"]},)"
+                  R"( "images": [{"filename": "rootfs.img", "sha256": ")" + sha256Hex(rootfs) + R"("}]}})");
+  appendCpioEntry(&generic, "rootfs.img", rootfs);
+  appendCpioEntry(&generic, "TRAILER!!!", "");
+  SwuParser generic_board({"board-b", ""});
+  EXPECT_TRUE(generic_board.update(generic.data(), generic.size())) << generic_board.error();
+  EXPECT_TRUE(generic_board.finish());
+
+  std::string corrupt = archive;
+  corrupt[description_end + 200] ^= 1;
+  SwuParser corrupt_parser({"board-a", ""});
+  EXPECT_FALSE(corrupt_parser.update(corrupt.data(), corrupt.size()));
+  EXPECT_TRUE(corrupt_parser.validated());
+  EXPECT_NE(corrupt_parser.error().find("rootfs.img does not match"), std::string::npos);
+
+  SwuParser truncated({"board-a", ""});
+  EXPECT_TRUE(truncated.update(archive.data(), archive.size() - 200));
+  EXPECT_FALSE(truncated.finish());
+
+  SwuParser not_cpio({"", ""});
+  const std::string text(200, 'x');
+  EXPECT_FALSE(not_cpio.update(text.data(), text.size()));
+
+  std::string reordered;
+  appendCpioEntry(&reordered, "rootfs.img", rootfs);
+  SwuParser reordered_parser({"", ""});
+  EXPECT_FALSE(reordered_parser.update(reordered.data(), reordered.size()));
+  EXPECT_NE(reordered_parser.error().find("instead of sw-description"), std::string::npos);
+}
+
+/* Fetches run side by side, largest first, and alongside the streaming
+ * install; installs never overlap and follow in the order fetches finished,
+ * so the campaign takes about as long as its longest target. */
+TEST(UpdateScheduler, FetchesConcurrentlyAndInstallsOneAtATime) {
+  std::mutex mutex;
+  std::vector<std::string> events;
+  std::atomic<int> fetching{0};
+  std::atomic<int> most_fetching{0};
+  std::atomic<int> installing{0};
+  std::atomic<bool> overlapped{false};
+  auto record = [&](const std::string& event) {
+    std::lock_guard<std::mutex> guard(mutex);
+    events.push_back(event);
+  };
+  auto fetch = [&](const std::string& name, int ms) {
+    return [&, name, ms] {
+      record("fetch " + name);
+      int now = ++fetching;
+      for (int most = most_fetching; now > most && !most_fetching.compare_exchange_weak(most, now);) {
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+      --fetching;
+      return true;
+    };
+  };
+  auto install = [&](const std::string& name, int ms) {
+    return [&, name, ms] {
+      record("install " + name);
+      if (++installing != 1) {
+        overlapped = true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+      --installing;
+      return true;
+    };
+  };
+
+  UpdateScheduler scheduler(2);
+  scheduler.add({"rootfs", 400, nullptr, install("rootfs", 400)});
+  scheduler.add({"small", 100, fetch("small", 150), install("small", 20)});
+  scheduler.add({"medium", 200, fetch("medium", 200), install("medium", 20)});
+  scheduler.add({"large", 300, fetch("large", 300), install("large", 20)});
+  const auto start = std::chrono::steady_clock::now();
+  const auto outcomes = scheduler.run();
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  EXPECT_EQ(outcomes, std::vector<UpdateScheduler::Outcome>(4, UpdateScheduler::Outcome::kDone));
+  EXPECT_FALSE(overlapped);
+  EXPECT_EQ(most_fetching, 2);
+  // Run one after another, they would take 1.11 s.
+  EXPECT_LT(elapsed, std::chrono::milliseconds(800));
+  const std::vector<std::string> fetches{"fetch large", "fetch medium", "fetch small"};
+  std::vector<std::string> fetched;
+  std::copy_if(events.begin(), events.end(), std::back_inserter(fetched),
+               [](const std::string& event) { return event.compare(0, 6, "fetch ") == 0; });
+  EXPECT_EQ(fetched, fetches);
+  std::vector<std::string> installed;
+  std::copy_if(events.begin(), events.end(), std::back_inserter(installed),
+               [](const std::string& event) { return event.compare(0, 8, "install ") == 0; });
+  EXPECT_EQ(installed,
+            (std::vector<std::string>{"install rootfs", "install medium", "install large", "install small"}));
+}
+
+/* A failed fetch or install stops what has not started yet: nothing more is
+ * installed, and no further fetch begins. */
+TEST(UpdateScheduler, StopsAfterAFailure) {
+  using Outcome = UpdateScheduler::Outcome;
+  std::atomic<int> installs{0};
+  auto install = [&installs] {
+    ++installs;
+    return true;
+  };
+  auto fetched = [] { return true; };
+
+  UpdateScheduler failing_fetch(1);
+  failing_fetch.add({"broken", 300, [] { return false; }, install});
+  failing_fetch.add({"later", 200, fetched, install});
+  EXPECT_EQ(failing_fetch.run(), (std::vector<Outcome>{Outcome::kFailed, Outcome::kSkipped}));
+  EXPECT_EQ(installs, 0);
+
+  UpdateScheduler failing_install(2);
+  failing_install.add({"rootfs", 300, nullptr, [] {
+                         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                         return false;
+                       }});
+  failing_install.add({"firmware", 200, fetched, install});
+  failing_install.add({"prefetch only", 100, fetched, nullptr});
+  EXPECT_EQ(failing_install.run(), (std::vector<Outcome>{Outcome::kFailed, Outcome::kSkipped, Outcome::kDone}));
+  EXPECT_EQ(installs, 0);
+}
+
+/* A step that throws fails its job like one returning false, on a fetcher
+ * thread as well as on the installing one, and the error is kept. */
+TEST(UpdateScheduler, FailsJobsThatThrow) {
+  using Outcome = UpdateScheduler::Outcome;
+  auto fetched = [] { return true; };
+  auto installed = [] { return true; };
+
+  UpdateScheduler throwing_fetch(2);
+  throwing_fetch.add({"rootfs", 300, fetched, installed});
+  throwing_fetch.add({"malformed", 200, []() -> bool { throw std::runtime_error("Unsupported hash algorithm"); },
+                      installed});
+  const auto fetch_outcomes = throwing_fetch.run();
+  EXPECT_EQ(fetch_outcomes[1], Outcome::kFailed);
+  EXPECT_NE(fetch_outcomes[0], Outcome::kFailed);
+  EXPECT_EQ(throwing_fetch.error(1), "Unsupported hash algorithm");
+  EXPECT_EQ(throwing_fetch.error(0), "");
+
+  UpdateScheduler throwing_install(1);
+  throwing_install.add({"rootfs", 300, nullptr, []() -> bool { throw std::runtime_error("Bad block manifest"); }});
+  throwing_install.add({"firmware", 200, fetched, installed});
+  EXPECT_EQ(throwing_install.run(), (std::vector<Outcome>{Outcome::kFailed, Outcome::kSkipped}));
+  EXPECT_EQ(throwing_install.error(0), "Bad block manifest");
+}
+
+/* Signals to the process pause, resume and abort the update through the token,
+ * and reach the signal thread although other threads are running. */
+TEST(SignalFlowControl, PausesResumesAndAbortsOnSignals) {
+  api::FlowControlToken token;
+  SignalFlowControl signals(token);
+  std::atomic<bool> stop{false};
+  std::thread bystander([&stop] {
+    while (!stop) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  auto waitFor = [](const std::function<bool()>& condition) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!condition() && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return condition();
+  };
+
+  ASSERT_EQ(kill(getpid(), SIGUSR1), 0);
+  EXPECT_TRUE(waitFor([&token] { return !token.canContinue(false); }));
+  EXPECT_FALSE(token.hasAborted());
+
+  ASSERT_EQ(kill(getpid(), SIGUSR2), 0);
+  EXPECT_TRUE(waitFor([&token] { return token.canContinue(false); }));
+
+  // A paused update wakes up aborted.
+  ASSERT_EQ(kill(getpid(), SIGUSR1), 0);
+  EXPECT_TRUE(waitFor([&token] { return !token.canContinue(false); }));
+  auto waiter = std::async(std::launch::async, [&token] { return token.canContinue(); });
+  ASSERT_EQ(kill(getpid(), SIGTERM), 0);
+  ASSERT_EQ(waiter.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  EXPECT_FALSE(waiter.get());
+  EXPECT_TRUE(token.hasAborted());
+
+  stop = true;
+  bystander.join();
+}
+
 #ifndef __NO_MAIN__
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
@@ -8,4 +1406,3 @@ int main(int argc, char** argv) {
   return RUN_ALL_TESTS();
 }
 #endif
-#endif
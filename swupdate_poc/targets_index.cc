@@ -0,0 +1,568 @@
+#include "targets_index.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "logging/logging.h"
+
+namespace {
+
+// Buffered reader that knows the file offset of the next byte.
+class MetadataReader {
+ public:
+  explicit MetadataReader(const std::string& path) : fd_{open(path.c_str(), O_RDONLY | O_CLOEXEC)} {
+    if (fd_ < 0) {
+      throw std::runtime_error("Could not open " + path);
+    }
+  }
+  ~MetadataReader() { close(fd_); }
+  MetadataReader(const MetadataReader&) = delete;
+  MetadataReader& operator=(const MetadataReader&) = delete;
+
+  // The next byte, or -1 at the end of the file.
+  int peek() {
+    if (pos_ == end_ && !fill()) {
+      return -1;
+    }
+    return static_cast<unsigned char>(buffer_[pos_]);
+  }
+  int get() {
+    const int c = peek();
+    if (c >= 0) {
+      ++pos_;
+    }
+    return c;
+  }
+  uint64_t offset() const { return base_ + pos_; }
+
+ private:
+  static constexpr size_t kReadSize = 64 * 1024;
+
+  bool fill() {
+    base_ += end_;
+    pos_ = end_ = 0;
+    ssize_t n;
+    do {
+      n = read(fd_, buffer_, sizeof(buffer_));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      throw std::runtime_error(std::string("Could not read targets metadata: ") + std::strerror(errno));
+    }
+    end_ = static_cast<size_t>(n);
+    return n > 0;
+  }
+
+  const int fd_;
+  char buffer_[kReadSize];
+  uint64_t base_{0};
+  size_t pos_{0};
+  size_t end_{0};
+};
+
+// Recursive descent over the few levels of the document that matter, with
+// everything else skipped without being decoded.
+class TargetsScanner {
+ public:
+  TargetsScanner(const std::string& path, const std::function<bool(TargetEntry&&)>& on_target)
+      : path_{path}, reader_{path}, on_target_{on_target} {}
+
+  void run() {
+    skipSpace();
+    readObject([this](const std::string& key) {
+      if (key == "signed" && reader_.peek() == '{') {
+        readObject([this](const std::string& signed_key) {
+          if (signed_key == "targets" && reader_.peek() == '{') {
+            readTargets();
+          } else {
+            skipValue();
+          }
+        });
+      } else {
+        skipValue();
+      }
+    });
+    if (stopped_) {
+      return;
+    }
+    skipSpace();
+    if (reader_.peek() >= 0) {
+      fail("trailing data");
+    }
+    if (!found_targets_) {
+      throw std::runtime_error(path_ + " is not Uptane targets metadata: no signed.targets");
+    }
+  }
+
+ private:
+  [[noreturn]] void fail(const std::string& what) {
+    throw std::runtime_error("Malformed targets metadata " + path_ + ": " + what + " at offset " +
+                             std::to_string(reader_.offset()));
+  }
+
+  void skipSpace() {
+    int c = reader_.peek();
+    while (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      reader_.get();
+      c = reader_.peek();
+    }
+  }
+
+  void expect(char expected) {
+    if (reader_.get() != expected) {
+      fail(std::string("expected '") + expected + "'");
+    }
+  }
+
+  unsigned int readHex4() {
+    unsigned int value = 0;
+    for (int i = 0; i < 4; ++i) {
+      const int c = reader_.get();
+      value <<= 4;
+      if (c >= '0' && c <= '9') {
+        value |= static_cast<unsigned int>(c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        value |= static_cast<unsigned int>(c - 'a' + 10);
+      } else if (c >= 'A' && c <= 'F') {
+        value |= static_cast<unsigned int>(c - 'A' + 10);
+      } else {
+        fail("bad \\u escape");
+      }
+    }
+    return value;
+  }
+
+  // The code point of a \u escape whose "\u" has been read, joining
+  // surrogate pairs.
+  unsigned int readCodePoint() {
+    const unsigned int high = readHex4();
+    if (high < 0xD800 || high > 0xDFFF) {
+      return high;
+    }
+    if (high > 0xDBFF || reader_.get() != '\\' || reader_.get() != 'u') {
+      fail("unpaired surrogate");
+    }
+    const unsigned int low = readHex4();
+    if (low < 0xDC00 || low > 0xDFFF) {
+      fail("unpaired surrogate");
+    }
+    return 0x10000 + ((high - 0xD800) << 10) + (low - 0xDC00);
+  }
+
+  static void appendUtf8(std::string* out, unsigned int code_point) {
+    if (code_point < 0x80) {
+      out->push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+      out->push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else if (code_point < 0x10000) {
+      out->push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else {
+      out->push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    }
+  }
+
+  std::string readString() {
+    expect('"');
+    std::string value;
+    for (;;) {
+      int c = reader_.get();
+      if (c < 0) {
+        fail("unterminated string");
+      }
+      if (c == '"') {
+        return value;
+      }
+      if (c < 0x20) {
+        fail("control character in string");
+      }
+      if (c != '\\') {
+        value.push_back(static_cast<char>(c));
+        continue;
+      }
+      c = reader_.get();
+      switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+          value.push_back(static_cast<char>(c));
+          break;
+        case 'b':
+          value.push_back('\b');
+          break;
+        case 'f':
+          value.push_back('\f');
+          break;
+        case 'n':
+          value.push_back('\n');
+          break;
+        case 'r':
+          value.push_back('\r');
+          break;
+        case 't':
+          value.push_back('\t');
+          break;
+        case 'u':
+          appendUtf8(&value, readCodePoint());
+          break;
+        default:
+          fail("bad escape");
+      }
+    }
+  }
+
+  void skipString() {
+    expect('"');
+    for (;;) {
+      const int c = reader_.get();
+      if (c < 0) {
+        fail("unterminated string");
+      }
+      if (c == '"') {
+        return;
+      }
+      if (c == '\\' && reader_.get() < 0) {
+        fail("unterminated string");
+      }
+    }
+  }
+
+  // Skips one value of any kind, nested ones included, without recursing.
+  void skipValue() {
+    int depth = 0;
+    do {
+      skipSpace();
+      const int c = reader_.peek();
+      if (c == '"') {
+        skipString();
+      } else if (c == '{' || c == '[') {
+        reader_.get();
+        ++depth;
+      } else if (c == '}' || c == ']') {
+        if (depth == 0) {
+          fail("expected a value");
+        }
+        reader_.get();
+        --depth;
+      } else if ((c == ',' || c == ':') && depth > 0) {
+        reader_.get();
+      } else {
+        // A number or a literal.
+        bool scalar = false;
+        for (int s = reader_.peek(); s == '-' || s == '+' || s == '.' || (s >= '0' && s <= '9') ||
+                                     (s >= 'a' && s <= 'z') || (s >= 'A' && s <= 'Z');
+             s = reader_.peek()) {
+          reader_.get();
+          scalar = true;
+        }
+        if (!scalar) {
+          fail("expected a value");
+        }
+      }
+    } while (depth > 0);
+  }
+
+  // Calls on_member(key) with the reader at each member's value, which
+  // on_member must consume.
+  template <class Fn>
+  void readObject(Fn&& on_member) {
+    expect('{');
+    skipSpace();
+    if (reader_.peek() == '}') {
+      reader_.get();
+      return;
+    }
+    for (;;) {
+      skipSpace();
+      const std::string key = readString();
+      skipSpace();
+      expect(':');
+      skipSpace();
+      on_member(key);
+      if (stopped_) {
+        return;
+      }
+      skipSpace();
+      const int c = reader_.get();
+      if (c == '}') {
+        return;
+      }
+      if (c != ',') {
+        fail("expected ',' or '}'");
+      }
+    }
+  }
+
+  template <class Fn>
+  void readArray(Fn&& on_element) {
+    expect('[');
+    skipSpace();
+    if (reader_.peek() == ']') {
+      reader_.get();
+      return;
+    }
+    for (;;) {
+      skipSpace();
+      on_element();
+      skipSpace();
+      const int c = reader_.get();
+      if (c == ']') {
+        return;
+      }
+      if (c != ',') {
+        fail("expected ',' or ']'");
+      }
+    }
+  }
+
+  void readTargets() {
+    found_targets_ = true;
+    readObject([this](const std::string& name) {
+      if (reader_.peek() != '{') {
+        fail("target " + name + " is not an object");
+      }
+      TargetEntry entry;
+      entry.name = name;
+      entry.offset = reader_.offset();
+      readObject([this, &entry](const std::string& key) {
+        if (key == "custom" && reader_.peek() == '{') {
+          readCustom(&entry);
+        } else {
+          skipValue();
+        }
+      });
+      entry.length = reader_.offset() - entry.offset;
+      if (!on_target_(std::move(entry))) {
+        stopped_ = true;
+      }
+    });
+  }
+
+  void readCustom(TargetEntry* entry) {
+    readObject([this, entry](const std::string& key) {
+      if (key != "hardwareIds" || reader_.peek() != '[') {
+        skipValue();
+        return;
+      }
+      readArray([this, entry]() {
+        if (reader_.peek() == '"') {
+          entry->hardware_ids.push_back(readString());
+        } else {
+          skipValue();
+        }
+      });
+    });
+  }
+
+  const std::string& path_;
+  MetadataReader reader_;
+  const std::function<bool(TargetEntry&&)>& on_target_;
+  bool found_targets_{false};
+  bool stopped_{false};
+};
+
+// The index file: a header, a power-of-two table of buckets probed linearly,
+// then one record per target holding its name and hardware IDs, each
+// followed by a NUL.
+struct IndexHeader {
+  char magic[8];
+  uint64_t metadata_size;
+  int64_t metadata_mtime_sec;
+  int64_t metadata_mtime_nsec;
+  uint64_t metadata_inode;
+  uint64_t buckets;
+};
+
+struct IndexBucket {
+  uint64_t hash;  // 0 for an empty bucket
+  uint64_t offset;
+  uint64_t length;
+  uint64_t record_offset;
+  uint64_t record_length;
+};
+
+constexpr char kIndexMagic[8] = {'S', 'W', 'P', 'T', 'I', 'D', 'X', '1'};
+
+// FNV-1a, never 0.
+uint64_t nameHash(const std::string& name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : name) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+bool describeMetadata(const std::string& metadata_path, IndexHeader* header) {
+  struct stat st {};
+  if (stat(metadata_path.c_str(), &st) != 0) {
+    return false;
+  }
+  std::memcpy(header->magic, kIndexMagic, sizeof(kIndexMagic));
+  header->metadata_size = static_cast<uint64_t>(st.st_size);
+  header->metadata_mtime_sec = static_cast<int64_t>(st.st_mtim.tv_sec);
+  header->metadata_mtime_nsec = static_cast<int64_t>(st.st_mtim.tv_nsec);
+  header->metadata_inode = static_cast<uint64_t>(st.st_ino);
+  return true;
+}
+
+bool readAt(int fd, void* data, size_t len, uint64_t offset) {
+  return pread(fd, data, len, static_cast<off_t>(offset)) == static_cast<ssize_t>(len);
+}
+
+}  // namespace
+
+void scanTargets(const std::string& metadata_path, const std::function<bool(TargetEntry&&)>& on_target) {
+  TargetsScanner(metadata_path, on_target).run();
+}
+
+TargetsIndex::~TargetsIndex() { close(fd_); }
+
+std::unique_ptr<TargetsIndex> TargetsIndex::open(const std::string& index_path, const std::string& metadata_path) {
+  IndexHeader expected{};
+  if (!describeMetadata(metadata_path, &expected)) {
+    return nullptr;
+  }
+  const int fd = ::open(index_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  IndexHeader header{};
+  if (!readAt(fd, &header, sizeof(header), 0) || std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+      header.metadata_size != expected.metadata_size || header.metadata_mtime_sec != expected.metadata_mtime_sec ||
+      header.metadata_mtime_nsec != expected.metadata_mtime_nsec ||
+      header.metadata_inode != expected.metadata_inode || header.buckets == 0 ||
+      (header.buckets & (header.buckets - 1)) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  return std::unique_ptr<TargetsIndex>(new TargetsIndex(fd, header.buckets));
+}
+
+bool TargetsIndex::write(const std::string& index_path, const std::string& metadata_path,
+                         const std::vector<TargetEntry>& entries) {
+  IndexHeader header{};
+  if (!describeMetadata(metadata_path, &header)) {
+    return false;
+  }
+  // At most half full, so that a lookup probes about one bucket.
+  header.buckets = 16;
+  while (header.buckets < 2 * entries.size()) {
+    header.buckets <<= 1;
+  }
+  std::vector<IndexBucket> table(header.buckets);
+  std::string records;
+  const uint64_t records_start = sizeof(header) + header.buckets * sizeof(IndexBucket);
+  for (const auto& entry : entries) {
+    const uint64_t hash = nameHash(entry.name);
+    uint64_t slot = hash & (header.buckets - 1);
+    while (table[slot].hash != 0) {
+      slot = (slot + 1) & (header.buckets - 1);
+    }
+    IndexBucket& bucket = table[slot];
+    bucket.hash = hash;
+    bucket.offset = entry.offset;
+    bucket.length = entry.length;
+    bucket.record_offset = records_start + records.size();
+    records.append(entry.name).push_back('\0');
+    for (const auto& hardware_id : entry.hardware_ids) {
+      records.append(hardware_id).push_back('\0');
+    }
+    bucket.record_length = records_start + records.size() - bucket.record_offset;
+  }
+
+  // Readers must never see a half-written index.
+  const std::string tmp = index_path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(table.data()),
+               static_cast<std::streamsize>(table.size() * sizeof(IndexBucket)));
+    file.write(records.data(), static_cast<std::streamsize>(records.size()));
+    if (!file) {
+      return false;
+    }
+  }
+  return std::rename(tmp.c_str(), index_path.c_str()) == 0;
+}
+
+bool TargetsIndex::lookup(const std::string& name, TargetEntry* entry) const {
+  const uint64_t hash = nameHash(name);
+  for (uint64_t probe = 0; probe < buckets_; ++probe) {
+    const uint64_t slot = (hash + probe) & (buckets_ - 1);
+    IndexBucket bucket{};
+    if (!readAt(fd_, &bucket, sizeof(bucket), sizeof(IndexHeader) + slot * sizeof(IndexBucket)) ||
+        bucket.hash == 0) {
+      return false;
+    }
+    if (bucket.hash != hash) {
+      continue;
+    }
+    std::string record(bucket.record_length, '\0');
+    if (!readAt(fd_, &record[0], record.size(), bucket.record_offset)) {
+      return false;
+    }
+    size_t end = record.find('\0');
+    if (record.compare(0, end, name) != 0) {
+      continue;
+    }
+    entry->name = name;
+    entry->hardware_ids.clear();
+    for (size_t start = end + 1; start < record.size(); start = end + 1) {
+      end = record.find('\0', start);
+      entry->hardware_ids.push_back(record.substr(start, end - start));
+    }
+    entry->offset = bucket.offset;
+    entry->length = bucket.length;
+    return true;
+  }
+  return false;
+}
+
+bool findTarget(const std::string& metadata_path, const std::string& index_path, const std::string& name,
+                TargetEntry* entry) {
+  bool found = false;
+  if (index_path.empty()) {
+    scanTargets(metadata_path, [&](TargetEntry&& scanned) {
+      if (scanned.name != name) {
+        return true;
+      }
+      *entry = std::move(scanned);
+      found = true;
+      return false;
+    });
+    return found;
+  }
+
+  auto index = TargetsIndex::open(index_path, metadata_path);
+  if (index) {
+    return index->lookup(name, entry);
+  }
+  std::vector<TargetEntry> entries;
+  scanTargets(metadata_path, [&entries](TargetEntry&& scanned) {
+    entries.push_back(std::move(scanned));
+    return true;
+  });
+  if (!TargetsIndex::write(index_path, metadata_path, entries)) {
+    LOG_WARNING << "Could not write targets index " << index_path;
+  }
+  // The first of duplicate names wins, as with the index.
+  for (auto& scanned : entries) {
+    if (scanned.name == name) {
+      *entry = std::move(scanned);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,67 @@
+#ifndef SWUPDATE_POC_TARGETS_INDEX_H_
+#define SWUPDATE_POC_TARGETS_INDEX_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Where one target's entry sits in Uptane targets metadata, and whom it is for.
+struct TargetEntry {
+  std::string name;
+  std::vector<std::string> hardware_ids;
+  // Byte range of the entry's JSON object in the metadata file.
+  uint64_t offset{0};
+  uint64_t length{0};
+};
+
+// Streams through Uptane targets metadata ({"signed": {"targets": {...}}})
+// and hands on_target every entry of signed.targets, in document order, until
+// it returns false. Only the entry names and their custom.hardwareIds are
+// decoded; everything else is skipped in a single buffered pass, so memory
+// stays flat however many targets the metadata lists. Skipped values are only
+// checked for balanced brackets and strings: the entry that gets used is
+// parsed in full later on. Throws std::runtime_error if the file cannot be
+// read or is not targets metadata.
+void scanTargets(const std::string& metadata_path, const std::function<bool(TargetEntry&&)>& on_target);
+
+// On-disk hash table from target name to TargetEntry, for one metadata file.
+//
+// Lookups read a header, a bucket or two and the matching name, so they cost
+// the same however large the metadata grows. The index records the size,
+// modification time and inode of the metadata it was built from, and is
+// ignored once they change. It is a cache of this device's metadata, written
+// in native byte order.
+class TargetsIndex {
+ public:
+  ~TargetsIndex();
+  TargetsIndex(const TargetsIndex&) = delete;
+  TargetsIndex& operator=(const TargetsIndex&) = delete;
+
+  // Returns nullptr if there is no index at index_path or it was built from
+  // something other than the metadata now at metadata_path.
+  static std::unique_ptr<TargetsIndex> open(const std::string& index_path, const std::string& metadata_path);
+  // Replaces the index at index_path atomically with one of entries, which
+  // must have been scanned from the metadata at metadata_path.
+  static bool write(const std::string& index_path, const std::string& metadata_path,
+                    const std::vector<TargetEntry>& entries);
+
+  // Returns false if the metadata has no target of that name.
+  bool lookup(const std::string& name, TargetEntry* entry) const;
+
+ private:
+  TargetsIndex(int fd, uint64_t buckets) : fd_{fd}, buckets_{buckets} {}
+
+  const int fd_;
+  const uint64_t buckets_;
+};
+
+// Finds the target called name in the metadata at metadata_path. With an
+// index_path the index there is used, or rebuilt first if it is missing or
+// stale; without, the metadata is scanned up to the target. Returns false if
+// there is no such target. Throws std::runtime_error like scanTargets().
+bool findTarget(const std::string& metadata_path, const std::string& index_path, const std::string& name,
+                TargetEntry* entry);
+
+#endif  // SWUPDATE_POC_TARGETS_INDEX_H_
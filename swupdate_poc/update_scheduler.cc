@@ -0,0 +1,103 @@
+#include "update_scheduler.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+// Runs one step of a job. An exception it throws fails the step, with the
+// exception's message as the error.
+static bool runStep(const std::function<bool()>& step, std::string* error) {
+  try {
+    return step();
+  } catch (const std::exception& e) {
+    *error = e.what();
+    return false;
+  }
+}
+
+UpdateScheduler::UpdateScheduler(unsigned int fetchers) : fetchers_{std::max(fetchers, 1U)} {}
+
+void UpdateScheduler::add(Job job) {
+  if (!job.fetch && !job.install) {
+    throw std::invalid_argument("Update of " + job.name + " has nothing to do");
+  }
+  jobs_.push_back(std::move(job));
+}
+
+std::vector<UpdateScheduler::Outcome> UpdateScheduler::run() {
+  std::vector<Outcome> outcomes(jobs_.size(), Outcome::kSkipped);
+  errors_.assign(jobs_.size(), std::string());
+  std::mutex mutex;
+  std::condition_variable cv;
+  // Jobs to install, in order; the streaming ones go first.
+  std::deque<size_t> installs;
+  std::vector<size_t> fetches;
+  for (size_t i = 0; i < jobs_.size(); ++i) {
+    if (jobs_[i].fetch) {
+      fetches.push_back(i);
+    } else {
+      installs.push_back(i);
+    }
+  }
+  std::stable_sort(fetches.begin(), fetches.end(),
+                   [this](size_t a, size_t b) { return jobs_[a].size > jobs_[b].size; });
+  size_t next_fetch = 0;
+  unsigned int running = 0;
+  bool failed = false;
+
+  auto fetcher = [&] {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!failed && next_fetch < fetches.size()) {
+      const size_t job = fetches[next_fetch++];
+      ++running;
+      lock.unlock();
+      std::string error;
+      const bool ok = runStep(jobs_[job].fetch, &error);
+      lock.lock();
+      --running;
+      if (!ok) {
+        outcomes[job] = Outcome::kFailed;
+        errors_[job] = std::move(error);
+        failed = true;
+      } else if (jobs_[job].install) {
+        installs.push_back(job);
+      } else {
+        outcomes[job] = Outcome::kDone;
+      }
+      cv.notify_all();
+    }
+    cv.notify_all();
+  };
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < std::min<size_t>(fetchers_, fetches.size()); ++i) {
+    threads.emplace_back(fetcher);
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    cv.wait(lock, [&] { return !installs.empty() || (running == 0 && (failed || next_fetch == fetches.size())); });
+    if (installs.empty()) {
+      break;
+    }
+    const size_t job = installs.front();
+    installs.pop_front();
+    if (failed) {
+      continue;
+    }
+    lock.unlock();
+    std::string error;
+    const bool ok = runStep(jobs_[job].install, &error);
+    lock.lock();
+    outcomes[job] = ok ? Outcome::kDone : Outcome::kFailed;
+    errors_[job] = std::move(error);
+    failed = failed || !ok;
+  }
+  lock.unlock();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return outcomes;
+}
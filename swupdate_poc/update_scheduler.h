@@ -0,0 +1,61 @@
+#ifndef SWUPDATE_POC_UPDATE_SCHEDULER_H_
+#define SWUPDATE_POC_UPDATE_SCHEDULER_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Runs the updates of several targets, e.g. the images of a primary and of
+// its secondaries, so that the whole campaign takes about as long as its
+// largest image rather than as long as all of them together.
+//
+// A target is updated in up to two steps. Its fetch downloads, verifies and
+// stages the image; fetches run on up to fetchers threads at once, largest
+// target first. Its install hands the image to SWUpdate, which installs one
+// image at a time, so installs run one after another on the thread calling
+// run(), in the order the fetches finished. A target without a fetch
+// downloads while it installs, streaming into SWUpdate, and is installed
+// before any fetched target, while those are still being fetched. A target
+// without an install is only fetched.
+//
+// A step that throws a std::exception fails like one returning false.
+//
+// Once a step fails, no further fetch starts and nothing more is installed;
+// fetches already running finish, so their images are staged for next time.
+class UpdateScheduler {
+ public:
+  struct Job {
+    std::string name;
+    // Bytes the fetch downloads.
+    uint64_t size{0};
+    // Either may be empty, not both. Each returns false if it failed.
+    std::function<bool()> fetch;
+    std::function<bool()> install;
+  };
+
+  enum class Outcome {
+    kDone,
+    kFailed,
+    // Not run, or fetched but not installed, as another step failed.
+    kSkipped,
+  };
+
+  explicit UpdateScheduler(unsigned int fetchers);
+  UpdateScheduler(const UpdateScheduler&) = delete;
+  UpdateScheduler& operator=(const UpdateScheduler&) = delete;
+
+  void add(Job job);
+  // Runs every job. Returns their outcomes in the order they were added.
+  std::vector<Outcome> run();
+  // After run(): what the failed step of a job threw; empty if it threw
+  // nothing.
+  const std::string& error(size_t job) const { return errors_.at(job); }
+
+ private:
+  const unsigned int fetchers_;
+  std::vector<Job> jobs_;
+  std::vector<std::string> errors_;
+};
+
+#endif  // SWUPDATE_POC_UPDATE_SCHEDULER_H_
@@ -3,7 +3,7 @@
 #include <fstream>
 #include <string>
 #include <pthread.h>
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <curl/curl.h>
 #include "json/json.h"
 #include "libaktualizr/packagemanagerinterface.h"
@@ -32,7 +32,7 @@ int verbose = 1;
 static pthread_mutex_t mymutex;
 static pthread_cond_t cv_end = PTHREAD_COND_INITIALIZER;
 
-SHA256_CTX sha256;
+EVP_MD_CTX* sha256;
 
 size_t write_callback(void* ptr, size_t, size_t nmemb, void* userdata) {
     size_t totalSize = size * nmemb;
@@ -63,9 +63,9 @@ size_t read_incrementally(CURL* curl, DownloadState& state, char* buffer, size_t
     return copy_size;
 }
 
-std::string hash_to_string(unsigned char hash[SHA256_DIGEST_LENGTH]) {
+std::string hash_to_string(const unsigned char* hash, unsigned int len) {
     std::stringstream ss;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    for (unsigned int i = 0; i < len; ++i) {
         ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(hash[i]);
     }
     return ss.str();
@@ -98,7 +98,7 @@ int readimage(char **pbuf, int *size)
         *pbuf = buf;
     }
     //updateFile.gcount()
-    SHA256_Update(&sha256, buf, bytes_read);
+    EVP_DigestUpdate(sha256, buf, bytes_read);
 
     // SHA256_CTX temp_ctx = sha256;
     // unsigned char temp_hash[SHA256_DIGEST_LENGTH];
@@ -131,9 +131,10 @@ int end(RECOVERY_STATUS status)
 		std::printf("Executing post-update actions.\n");
 		ipc_message msg;
         // final check
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256_Final(hash, &sha256)
-		if (hash_to_string(hash) != jsonDataOut["custom"]["swupdate"]["rawHashes"]["sha256"].asString()) {
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hash_len = 0;
+        EVP_DigestFinal_ex(sha256, hash, &hash_len);
+		if (hash_to_string(hash, hash_len) != jsonDataOut["custom"]["swupdate"]["rawHashes"]["sha256"].asString()) {
             std::fprintf(stderr, "Running post-update failed!\n");
 			end_status = EXIT_FAILURE; // sending exit_failure cancels the rest
 		}
@@ -167,7 +168,8 @@ int swupdate_test_func(const std::string& url) {
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state);
 
-    SHA256_Init(&sha256)
+    sha256 = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(sha256, EVP_sha256(), nullptr);
 
     swupdate_prepare_req(&req);
 
@@ -176,6 +178,7 @@ int swupdate_test_func(const std::string& url) {
         std::cout << "swupdate start error" << std::endl;
         pthread_mutex_unlock(&mymutex);
         // updateFile.close();
+        EVP_MD_CTX_free(sha256);
         curl_easy_cleanup(curl);
         curl_global_cleanup();
         return -1;
@@ -186,6 +189,7 @@ int swupdate_test_func(const std::string& url) {
 	pthread_mutex_unlock(&mymutex);
 
     // updateFile.close();
+    EVP_MD_CTX_free(sha256);
     curl_easy_cleanup(curl);
     curl_global_cleanup();
 
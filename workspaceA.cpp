@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <cstring>
 #include <pthread.h>
 #include "json/json.h"
 #include "libaktualizr/packagemanagerfactory.h"
@@ -26,13 +28,23 @@ extern "C" {
 #include <condition_variable>
 #include <queue>
 
+#include "swupdate_poc/slab_pool.h"
+
+// Chunks on their way to SWUpdate live in slabs of a fixed pool, so the
+// downloader waits for SWUpdate instead of growing the queue without bound.
+static const size_t kChunkSize = 64 * 1024;
+static const size_t kMemoryBudget = 4 * 1024 * 1024;
+SlabPool chunk_pool(kChunkSize, kMemoryBudget / kChunkSize);
+
 std::mutex buffer_mutex;
 std::condition_variable buffer_cv;
-std::queue<std::vector<char>> data_queue; // A queue to hold chunks of data
+std::queue<SlabPool::Slab> data_queue; // A queue to hold chunks of data
 
 // Flags to control the flow
 bool pause_download = false;
 bool stop_download = false;
+// Set with stop_download: whether the whole image was downloaded.
+bool download_ok = false;
 
 struct DownloadMetaStruct {
  public:
@@ -125,6 +137,22 @@ static size_t DownloadHandler(char* contents, size_t size, size_t nmemb, void* u
         }
 
         dst->hasher().update(reinterpret_cast<const unsigned char*>(contents), downloaded);
+
+        // Hand the data to readimage, waiting for slabs to come back once the
+        // budget is used up.
+        for (size_t queued = 0; queued < downloaded;) {
+            SlabPool::Slab slab = chunk_pool.acquire();
+            if (!slab) {
+                return 0; // SWUpdate is gone, abort download
+            }
+            size_t n = std::min(downloaded - queued, slab.capacity());
+            std::memcpy(slab.data(), contents + queued, n);
+            slab.setSize(n);
+            queued += n;
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            data_queue.push(std::move(slab));
+            buffer_cv.notify_all();
+        }
         dst->downloaded_length += downloaded;
         // std::cout << "Downloaded: " << dst->downloaded_length << "/" << expected << std::endl;
     } catch (const std::exception& e) {
@@ -136,7 +164,12 @@ static size_t DownloadHandler(char* contents, size_t size, size_t nmemb, void* u
 }
 
 
+// The chunk handed out last stays in in_flight until SWUpdate asks for the
+// next one: it has written the previous one to the install socket by then.
 int readimage(char** pbuf, int* size) {
+    static SlabPool::Slab in_flight;
+    in_flight.reset();
+
     std::unique_lock<std::mutex> lock(buffer_mutex);
 
     // Wait until there is data in the buffer or download is stopped
@@ -144,15 +177,18 @@ int readimage(char** pbuf, int* size) {
         buffer_cv.wait(lock);
     }
 
-    if (stop_download) {
-        return -1;
+    // The download has ended and everything it queued has been handed out:
+    // the end of the image, or an error if the download was cut short.
+    if (data_queue.empty()) {
+        *size = download_ok ? 0 : -1;
+        return *size;
     }
 
-    // Get the data from the queue
-    auto& buffer = data_queue.front();
-    *pbuf = const_cast<char*>(buffer.data());
-    *size = static_cast<int>(buffer.size());
+    // Take the chunk off the queue without releasing its buffer
+    in_flight = std::move(data_queue.front());
     data_queue.pop();
+    *pbuf = in_flight.data();
+    *size = static_cast<int>(in_flight.size());
 
     return *size;
 }
@@ -167,6 +203,9 @@ int printstatus(ipc_message *msg) {
 }
 
 int end(RECOVERY_STATUS status) {
+  // Nothing reads the queue any more; do not let the download wait for it.
+  chunk_pool.close();
+
   ds->fhandle.flush();
   if (!ds->fhandle) {
       std::cerr << "Error flushing file." << std::endl;
@@ -228,6 +267,7 @@ int swupdate_test_func() {
 
   {
       std::unique_lock<std::mutex> lock(buffer_mutex);
+      download_ok = response.isOk() && ds->downloaded_length == ds->target.length();
       stop_download = true;
       buffer_cv.notify_all(); // Notify to break out of waiting in readimage
   }